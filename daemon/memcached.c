@@ -362,6 +362,9 @@ static void settings_init(void) {
     settings.extensions.logger = get_stderr_logger();
     settings.num_ports = 1;
     settings.tcp_nodelay = getenv("MEMCACHED_DISABLE_TCP_NODELAY") == NULL;
+    settings.numa = false;
+    settings.reuseport = false;
+    settings.dispatch_policy = dispatch_round_robin;
 }
 
 /*
@@ -425,20 +428,50 @@ static uint64_t get_listen_disabled_num(void) {
     return ret;
 }
 
-static void disable_listen(void) {
+/*
+ * Stop (or start) accepting connections on a list of listening sockets.
+ * The sockets must belong to the calling thread.
+ */
+static void update_listen_conns(conn *list, bool enable) {
     conn *next;
+    for (next = list; next; next = next->next) {
+        update_event(next, enable ? EV_READ | EV_PERSIST : 0);
+        if (listen(next->sfd, enable ? settings.backlog : 1) != 0) {
+            log_socket_error(EXTENSION_LOG_WARNING, NULL,
+                             "listen() failed: %s");
+        }
+    }
+}
+
+/*
+ * Stop accepting connections (we're out of file descriptors). The
+ * workers with their own listening sockets only disable their own, the
+ * others do the same once they fail to accept a connection.
+ */
+static void disable_listen(conn *c) {
     cb_mutex_enter(&listen_state.mutex);
     listen_state.disabled = true;
     listen_state.count = 10;
     ++listen_state.num_disable;
     cb_mutex_exit(&listen_state.mutex);
 
-    for (next = listen_conn; next; next = next->next) {
-        update_event(next, 0);
-        if (listen(next->sfd, 1) != 0) {
-            log_socket_error(EXTENSION_LOG_WARNING, NULL,
-                             "listen() failed: %s");
-        }
+    if (c->thread != NULL) {
+        c->thread->listen_disabled = true;
+        update_listen_conns(c->thread->listen_conn, false);
+    } else {
+        update_listen_conns(listen_conn, false);
+    }
+}
+
+/*
+ * Called by the workers when they are notified, to start accepting
+ * connections on their own listening sockets again once the dispatcher
+ * enabled listening.
+ */
+void resume_listen(LIBEVENT_THREAD *me) {
+    if (me->listen_disabled && !is_listen_disabled()) {
+        me->listen_disabled = false;
+        update_listen_conns(me->listen_conn, true);
     }
 }
 
@@ -731,6 +764,16 @@ static const char *protocol_text(enum protocol protocol) {
     }
 }
 
+static const char *dispatch_policy_text(enum dispatch_policy policy) {
+    switch (policy) {
+    case dispatch_round_robin: return "round_robin";
+    case dispatch_least_conns: return "least_conns";
+    case dispatch_least_busy: return "least_busy";
+    default:
+        return "illegal";
+    }
+}
+
 static void add_connection_stats(ADD_STAT add_stats, conn *d, conn *c) {
     append_stat("conn", add_stats, d, "%p", c);
     if (c->sfd == INVALID_SOCKET) {
@@ -876,6 +919,7 @@ conn *conn_new(const SOCKET sfd, const int parent_port,
     c->parent_port = parent_port;
     c->state = init_state;
     c->rlbytes = 0;
+    c->rsegment = c->nrsegments = 0;
     c->cmd = -1;
     c->rbytes = c->wbytes = 0;
     c->wcurr = c->wbuf;
@@ -889,6 +933,7 @@ conn *conn_new(const SOCKET sfd, const int parent_port,
     c->msgcurr = 0;
     c->msgused = 0;
     c->next = NULL;
+    c->prev = NULL;
     c->list_state = 0;
 
     c->write_and_go = init_state;
@@ -912,6 +957,7 @@ conn *conn_new(const SOCKET sfd, const int parent_port,
     STATS_UNLOCK();
 
     c->aiostat = ENGINE_SUCCESS;
+    c->io_status = ENGINE_SUCCESS;
     c->ewouldblock = false;
     c->refcount = 1;
 
@@ -966,11 +1012,14 @@ void conn_close(conn *c) {
 
     assert(c->thread);
     /* remove from pending-io list */
-    if (settings.verbose > 1 && list_contains(c->thread->pending_io, c)) {
+    LOCK_THREAD(c->thread);
+    if (settings.verbose > 1 && pending_io_contains(c)) {
         settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
                                         "Current connection was in the pending-io list.. Nuking it\n");
     }
-    c->thread->pending_io = list_remove(c->thread->pending_io, c);
+    pending_io_remove(c);
+    UNLOCK_THREAD(c->thread);
+    thread_count_conn(c->thread, -1);
 
     conn_cleanup(c);
 
@@ -1564,7 +1613,7 @@ static void complete_update_bin(conn *c) {
     assert(c != NULL);
     it = c->item;
     memset(&info, 0, sizeof(info));
-    info.info.nvalue = 1;
+    info.info.nvalue = IOV_MAX;
     if (!settings.engine.v1->get_item_info(settings.engine.v0, c, it,
                                            (void*)&info)) {
         settings.engine.v1->release(settings.engine.v0, c, it);
@@ -2019,6 +2068,50 @@ static void bin_read_chunk(conn *c,
     conn_set_state(c, conn_nread);
 }
 
+/*
+ * Read the value of a set / append etc into the item. Large values may be
+ * split over multiple segments of the item, and the segments are read one
+ * by one (see read_next_value_segment).
+ */
+static void bin_read_value(conn *c, const item_info *info) {
+    c->ritem = info->value[0].iov_base;
+    c->rlbytes = (uint32_t)info->value[0].iov_len;
+    c->rsegment = 1;
+    c->nrsegments = (uint16_t)info->nvalue;
+    conn_set_state(c, conn_nread);
+    c->substate = bin_read_set_value;
+}
+
+/*
+ * Prepare to read the next segment of a value split over multiple
+ * segments. Returns false if we've read all of them.
+ */
+static bool read_next_value_segment(conn *c) {
+    item_info_holder info;
+
+    if (c->rsegment >= c->nrsegments) {
+        return false;
+    }
+
+    memset(&info, 0, sizeof(info));
+    info.info.nvalue = IOV_MAX;
+    if (!settings.engine.v1->get_item_info(settings.engine.v0, c, c->item,
+                                           (void*)&info)) {
+        return false;
+    }
+
+    while (c->rsegment < info.info.nvalue) {
+        struct iovec *iov = &info.info.value[c->rsegment++];
+        if (iov->iov_len > 0) {
+            c->ritem = iov->iov_base;
+            c->rlbytes = (uint32_t)iov->iov_len;
+            return true;
+        }
+    }
+
+    return false;
+}
+
 static void bin_read_key(conn *c, enum bin_substates next_substate, int extra) {
     bin_read_chunk(c, next_substate, c->keylen + extra);
 }
@@ -4369,7 +4462,7 @@ static void process_bin_update(conn *c) {
 
     assert(c != NULL);
     memset(&info, 0, sizeof(info));
-    info.info.nvalue = 1;
+    info.info.nvalue = IOV_MAX;
     key = binary_get_key(c);
     nkey = c->binary_header.request.keylen;
 
@@ -4421,7 +4514,7 @@ static void process_bin_update(conn *c) {
                                                                         c, it,
                                                                         (void*)&info)) {
             settings.engine.v1->release(settings.engine.v0, c, it);
-            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL, 0);
+            write_bin_packet(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL, vlen);
             return;
         }
     }
@@ -4453,10 +4546,7 @@ static void process_bin_update(conn *c) {
         }
 
         c->item = it;
-        c->ritem = info.info.value[0].iov_base;
-        c->rlbytes = vlen;
-        conn_set_state(c, conn_nread);
-        c->substate = bin_read_set_value;
+        bin_read_value(c, &info.info);
         break;
     case ENGINE_EWOULDBLOCK:
         c->ewouldblock = true;
@@ -4496,7 +4586,7 @@ static void process_bin_append_prepend(conn *c) {
     item *it;
     item_info_holder info;
     memset(&info, 0, sizeof(info));
-    info.info.nvalue = 1;
+    info.info.nvalue = IOV_MAX;
 
     assert(c != NULL);
 
@@ -4546,10 +4636,7 @@ static void process_bin_append_prepend(conn *c) {
         }
 
         c->item = it;
-        c->ritem = info.info.value[0].iov_base;
-        c->rlbytes = vlen;
-        conn_set_state(c, conn_nread);
-        c->substate = bin_read_set_value;
+        bin_read_value(c, &info.info);
         break;
     case ENGINE_EWOULDBLOCK:
         c->ewouldblock = true;
@@ -4604,7 +4691,7 @@ static void process_bin_delete(conn *c) {
     item_info_holder info;
     memset(&info, 0, sizeof(info));
 
-    info.info.nvalue = 1;
+    info.info.nvalue = IOV_MAX;
 
     assert(c != NULL);
 
@@ -4671,7 +4758,9 @@ static void complete_nread(conn *c) {
         }
         break;
     case bin_read_set_value:
-        complete_update_bin(c);
+        if (!read_next_value_segment(c)) {
+            complete_update_bin(c);
+        }
         break;
     case bin_reading_get_key:
         process_bin_get(c);
@@ -4857,6 +4946,8 @@ static void server_stats(ADD_STAT add_stats, conn *c, bool aggregate) {
     APPEND_STAT("conn_yields", "%" PRIu64, (uint64_t)thread_stats.conn_yields);
     STATS_UNLOCK();
 
+    thread_load_stats(add_stats, c);
+
     APPEND_STAT("tcp_nodelay", "%s", settings.tcp_nodelay ? "enable" : "disable");
 
     /*
@@ -4962,6 +5053,9 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
     }
 
     APPEND_STAT("tcp_nodelay", "%s", settings.tcp_nodelay ? "enable" : "disable");
+    APPEND_STAT("reuseport", "%s", settings.reuseport ? "yes" : "no");
+    APPEND_STAT("dispatch_policy", "%s",
+                dispatch_policy_text(settings.dispatch_policy));
 }
 
 /*
@@ -5323,7 +5417,7 @@ bool conn_listening(conn *c)
         if (is_emfile(error)) {
             settings.extensions.logger->log(EXTENSION_LOG_WARNING, c,
                                             "Too many open connections\n");
-            disable_listen();
+            disable_listen(c);
         } else if (!is_blocking(error)) {
             log_socket_error(EXTENSION_LOG_WARNING, c,
                              "Failed to accept new client: %s");
@@ -5360,8 +5454,25 @@ bool conn_listening(conn *c)
         return false;
     }
 
-    dispatch_conn_new(sfd, c->parent_port, conn_new_cmd, EV_READ | EV_PERSIST,
-                      DATA_BUFFER_SIZE);
+    if (c->thread == NULL) {
+        dispatch_conn_new(sfd, c->parent_port, conn_new_cmd,
+                          EV_READ | EV_PERSIST, DATA_BUFFER_SIZE);
+    } else {
+        /* One of the worker's own listening sockets; serve the client
+         * from this thread instead of handing it over */
+        conn *client = conn_new(sfd, c->parent_port, conn_new_cmd,
+                                EV_READ | EV_PERSIST, DATA_BUFFER_SIZE,
+                                c->thread->base, NULL);
+        if (client == NULL) {
+            STATS_LOCK();
+            --port_instance->curr_conns;
+            STATS_UNLOCK();
+            safe_close(sfd);
+        } else {
+            client->thread = c->thread;
+            thread_count_conn(c->thread, 1);
+        }
+    }
 
     return false;
 }
@@ -5717,6 +5828,18 @@ bool conn_mwrite(conn *c) {
     return true;
 }
 
+/*
+ * Get the number of references to a connection (the engine threads may
+ * release theirs while the worker runs it)
+ */
+static int conn_refcount(conn *c) {
+    int refcount;
+    LOCK_THREAD(c->thread);
+    refcount = c->refcount;
+    UNLOCK_THREAD(c->thread);
+    return refcount;
+}
+
 bool conn_pending_close(conn *c) {
     assert(c->sfd == INVALID_SOCKET);
     settings.extensions.logger->log(EXTENSION_LOG_DEBUG, c,
@@ -5728,7 +5851,7 @@ bool conn_pending_close(conn *c) {
      */
     perform_callbacks(ON_DISCONNECT, NULL, c);
 
-    if (c->refcount > 1) {
+    if (conn_refcount(c) > 1) {
         return false;
     }
 
@@ -5761,7 +5884,7 @@ bool conn_closing(conn *c) {
     safe_close(c->sfd);
     c->sfd = INVALID_SOCKET;
 
-    if (c->refcount > 1 || c->ewouldblock) {
+    if (conn_refcount(c) > 1 || c->ewouldblock) {
         conn_set_state(c, conn_pending_close);
     } else {
         conn_set_state(c, conn_immediate_close);
@@ -5798,6 +5921,7 @@ bool conn_refresh_cbsasl(conn *c) {
 void event_handler(const int fd, const short which, void *arg) {
     conn *c = arg;
     LIBEVENT_THREAD *thr;
+    hrtime_t start = gethrtime();
 
     assert(c != NULL);
 
@@ -5815,7 +5939,8 @@ void event_handler(const int fd, const short which, void *arg) {
          * object was scheduled to run in the dispatcher before the
          * callback for the worker thread is executed.
          */
-        c->thread->pending_io = list_remove(c->thread->pending_io, c);
+        pending_io_claim(c);
+        UNLOCK_THREAD(thr);
     }
 
     c->which = which;
@@ -5839,7 +5964,7 @@ void event_handler(const int fd, const short which, void *arg) {
     } while (c->state(c));
 
     if (thr) {
-        UNLOCK_THREAD(thr);
+        thread_add_busy_time(thr, start);
     }
 }
 
@@ -5857,15 +5982,8 @@ static void dispatch_event_handler(int fd, short which, void *arg) {
         }
         cb_mutex_exit(&listen_state.mutex);
         if (enable) {
-            conn *next;
-            for (next = listen_conn; next; next = next->next) {
-                update_event(next, EV_READ | EV_PERSIST);
-                if (listen(next->sfd, settings.backlog) != 0) {
-                    settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                                    "listen() failed",
-                                                    strerror(errno));
-                }
-            }
+            update_listen_conns(listen_conn, true);
+            notify_listen_threads();
         }
     }
 }
@@ -5928,6 +6046,118 @@ static SOCKET new_socket(struct addrinfo *ai) {
     return sfd;
 }
 
+/*
+ * Set the options of a new listening socket. Returns false if the socket
+ * can't be used.
+ */
+static bool server_socket_options(SOCKET sfd, const struct addrinfo *ai) {
+    struct linger ling = {0, 0};
+    int flags = 1;
+    int error;
+
+#ifdef IPV6_V6ONLY
+    if (ai->ai_family == AF_INET6) {
+        error = setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &flags, sizeof(flags));
+        if (error != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "setsockopt(IPV6_V6ONLY): %s",
+                                            strerror(errno));
+            return false;
+        }
+    }
+#endif
+
+    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+#ifdef SO_REUSEPORT
+    if (settings.reuseport) {
+        error = setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags));
+        if (error != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "setsockopt(SO_REUSEPORT): %s",
+                                            strerror(errno));
+            return false;
+        }
+    }
+#endif
+
+    error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
+    if (error != 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "setsockopt(SO_KEEPALIVE): %s",
+                                        strerror(errno));
+    }
+
+    error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
+    if (error != 0) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "setsockopt(SO_LINGER): %s",
+                                        strerror(errno));
+    }
+
+    if (settings.tcp_nodelay) {
+        error = setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
+        if (error != 0) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                            "setsockopt(TCP_NODELAY): %s",
+                                            strerror(errno));
+        }
+    }
+
+    return true;
+}
+
+static void count_listen_conn(int port) {
+    struct listening_port *port_instance;
+    STATS_LOCK();
+    ++stats.curr_conns;
+    ++stats.daemon_conns;
+    port_instance = get_listening_port_instance(port);
+    assert(port_instance);
+    ++port_instance->curr_conns;
+    STATS_UNLOCK();
+}
+
+/*
+ * Give each worker thread its own listening socket bound to the same
+ * address as sfd (with SO_REUSEPORT set), so the kernel spreads the new
+ * connections over the workers and they accept them without involving
+ * the dispatcher. The first worker gets sfd.
+ */
+static bool server_socket_reuseport(SOCKET sfd, struct addrinfo *ai,
+                                    int port) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    int ii;
+
+    if (getsockname(sfd, (struct sockaddr*)&addr, &addrlen) != 0) {
+        log_socket_error(EXTENSION_LOG_WARNING, NULL, "getsockname(): %s");
+        safe_close(sfd);
+        return false;
+    }
+
+    for (ii = 0; ii < settings.num_threads; ++ii) {
+        if (ii > 0) {
+            /* Bind to the address of the first socket, so we'll get the
+             * same port if the kernel picked it for us */
+            if ((sfd = new_socket(ai)) == INVALID_SOCKET) {
+                return false;
+            }
+            if (!server_socket_options(sfd, ai) ||
+                bind(sfd, (struct sockaddr*)&addr, addrlen) == SOCKET_ERROR ||
+                listen(sfd, settings.backlog) == SOCKET_ERROR) {
+                log_socket_error(EXTENSION_LOG_WARNING, NULL,
+                                 "Failed to create worker listening socket: %s");
+                safe_close(sfd);
+                return false;
+            }
+        }
+        dispatch_listen_conn(ii, sfd, port);
+        count_listen_conn(port);
+    }
+
+    return true;
+}
+
 /**
  * Create a socket and bind it to a specific port number
  * @param interface the interface to bind to
@@ -5940,14 +6170,12 @@ static int server_socket(const char *interface,
                          int port,
                          FILE *portnumber_file) {
     int sfd;
-    struct linger ling = {0, 0};
     struct addrinfo *ai;
     struct addrinfo *next;
     struct addrinfo hints;
     char port_buf[NI_MAXSERV];
     int error;
     int success = 0;
-    int flags =1;
 
     memset(&hints, 0, sizeof(hints));
     hints.ai_flags = AI_PASSIVE;
@@ -5977,7 +6205,6 @@ static int server_socket(const char *interface,
     }
 
     for (next= ai; next; next= next->ai_next) {
-        struct listening_port *port_instance;
         conn *listen_conn_add;
         if ((sfd = new_socket(next)) == INVALID_SOCKET) {
             /* getaddrinfo can return "junk" addresses,
@@ -5986,41 +6213,9 @@ static int server_socket(const char *interface,
             continue;
         }
 
-#ifdef IPV6_V6ONLY
-        if (next->ai_family == AF_INET6) {
-            error = setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &flags, sizeof(flags));
-            if (error != 0) {
-                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                                "setsockopt(IPV6_V6ONLY): %s",
-                                                strerror(errno));
-                safe_close(sfd);
-                continue;
-            }
-        }
-#endif
-
-        setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
-        error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
-        if (error != 0) {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                            "setsockopt(SO_KEEPALIVE): %s",
-                                            strerror(errno));
-        }
-
-        error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
-        if (error != 0) {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                            "setsockopt(SO_LINGER): %s",
-                                            strerror(errno));
-        }
-
-        if (settings.tcp_nodelay) {
-            error = setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
-            if (error != 0) {
-                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                                                "setsockopt(TCP_NODELAY): %s",
-                                                strerror(errno));
-            }
+        if (!server_socket_options(sfd, next)) {
+            safe_close(sfd);
+            continue;
         }
 
         if (bind(sfd, next->ai_addr, next->ai_addrlen) == SOCKET_ERROR) {
@@ -6068,6 +6263,14 @@ static int server_socket(const char *interface,
             }
         }
 
+        if (settings.reuseport) {
+            if (!server_socket_reuseport(sfd, next, port)) {
+                freeaddrinfo(ai);
+                return 1;
+            }
+            continue;
+        }
+
         if (!(listen_conn_add = conn_new(sfd, port, conn_listening,
                                          EV_READ | EV_PERSIST, 1,
                                          main_base, NULL))) {
@@ -6077,13 +6280,7 @@ static int server_socket(const char *interface,
         }
         listen_conn_add->next = listen_conn;
         listen_conn = listen_conn_add;
-        STATS_LOCK();
-        ++stats.curr_conns;
-        ++stats.daemon_conns;
-        port_instance = get_listening_port_instance(port);
-        assert(port_instance);
-        ++port_instance->curr_conns;
-        STATS_UNLOCK();
+        count_listen_conn(port);
     }
 
     freeaddrinfo(ai);
@@ -6214,6 +6411,7 @@ static void clock_handler(const int fd, const short which, void *arg) {
     evtimer_add(&clockevent, &t);
 
     set_current_time();
+    threads_update_load();
 }
 
 static void usage(void) {
@@ -6252,7 +6450,18 @@ static void usage(void) {
     printf("              the memory page size could reduce the number of TLB misses\n");
     printf("              and improve the performance. In order to get large pages\n");
     printf("              from the OS, memcached will allocate the total item-cache\n");
-    printf("              in one large chunk.\n");
+    printf("              in one large chunk (on Linux with hugetlb pages, or\n");
+    printf("              transparent huge pages if none are reserved).\n");
+    printf("-N            Pin the worker threads to the NUMA nodes and allocate\n");
+    printf("              the item memory used by each worker from its node\n");
+    printf("              (implies preallocating the item memory).\n");
+    printf("-W            Let each worker thread accept the TCP connections on its\n");
+    printf("              own listening socket (SO_REUSEPORT) instead of having\n");
+    printf("              a single thread accept them and hand them over.\n");
+    printf("-j <policy>   How new connections are assigned to the worker threads:\n");
+    printf("              round_robin (default), least_conns (the worker with the\n");
+    printf("              fewest connections) or least_busy (the worker that spent\n");
+    printf("              the least time handling events in the last second).\n");
     printf("-D <char>     Use <char> as the delimiter between key prefixes and IDs.\n");
     printf("              This is used for per-prefix stats reporting. The default is\n");
     printf("              \":\" (colon). If this option is specified, stats collection\n");
@@ -6489,7 +6698,13 @@ static int get_socket_fd(const void *cookie) {
 
 static ENGINE_ERROR_CODE reserve_cookie(const void *cookie) {
     conn *c = (conn *)cookie;
+    LIBEVENT_THREAD *thr = c->thread;
+
+    assert(thr);
+    /* release_cookie may run in an engine thread at the same time */
+    LOCK_THREAD(thr);
     ++c->refcount;
+    UNLOCK_THREAD(thr);
     return ENGINE_SUCCESS;
 }
 
@@ -7254,6 +7469,9 @@ int main (int argc, char **argv) {
           "t:"  /* threads */
           "D:"  /* prefix delimiter? */
           "L"   /* Large memory pages */
+          "N"   /* NUMA aware */
+          "W"   /* Per worker listening sockets */
+          "j:"  /* Dispatch policy */
           "R:"  /* max requests per event */
           "C"   /* Disable use of CAS */
           "b:"  /* backlog queue limit */
@@ -7394,6 +7612,37 @@ int main (int argc, char **argv) {
         case 'L' :
             if (enable_large_pages() == 0) {
                 old_opts += sprintf(old_opts, "preallocate=true;");
+#ifdef __linux__
+                /* The engine maps the item memory with huge pages */
+                old_opts += sprintf(old_opts, "large_pages=true;");
+#endif
+            }
+            break;
+        case 'N' :
+            settings.numa = true;
+            old_opts += sprintf(old_opts, "numa=true;");
+            break;
+        case 'W' :
+#ifdef SO_REUSEPORT
+            settings.reuseport = true;
+#else
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "warning: -W invalid, SO_REUSEPORT not supported on this platform.  proceeding without.\n");
+#endif
+            break;
+        case 'j':
+            if (strcmp(optarg, "round_robin") == 0) {
+                settings.dispatch_policy = dispatch_round_robin;
+            } else if (strcmp(optarg, "least_conns") == 0) {
+                settings.dispatch_policy = dispatch_least_conns;
+            } else if (strcmp(optarg, "least_busy") == 0) {
+                settings.dispatch_policy = dispatch_least_busy;
+            } else {
+                settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "Invalid value for dispatch policy: %s\n"
+                        " -- should be one of round_robin, least_conns or least_busy\n",
+                        optarg);
+                exit(EX_USAGE);
             }
             break;
         case 'C' :
@@ -7633,6 +7882,31 @@ int main (int argc, char **argv) {
 
     cbsasl_server_init();
 
+    /* Load the storage engine */
+    if (!load_engine(engine,get_server_api,settings.extensions.logger,&engine_handle)) {
+        /* Error already reported */
+        exit(EXIT_FAILURE);
+    }
+
+#ifndef WIN32
+    /* daemonize if requested. The engine is loaded first (it may be
+     * specified with a relative path), but the event base, the memory
+     * lock and the threads the engine starts when it's initialized
+     * wouldn't survive the fork, so they're set up afterwards */
+    /* if we want to ensure our ability to dump core, don't chdir to / */
+    if (do_daemonize) {
+        if (sigignore(SIGHUP) == -1) {
+            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Failed to ignore SIGHUP: ", strerror(errno));
+        }
+        if (daemonize(maxcore, settings.verbose) == -1) {
+             settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "failed to daemon() in order to daemonize\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+#endif
+
     /* lock paged memory if needed */
     if (lock_memory) {
 #ifdef HAVE_MLOCKALL
@@ -7651,12 +7925,6 @@ int main (int argc, char **argv) {
     /* initialize main thread libevent instance */
     main_base = event_base_new();
 
-    /* Load the storage engine */
-    if (!load_engine(engine,get_server_api,settings.extensions.logger,&engine_handle)) {
-        /* Error already reported */
-        exit(EXIT_FAILURE);
-    }
-
     if (!init_engine(engine_handle,engine_config,settings.extensions.logger)) {
         return false;
     }
@@ -7676,20 +7944,6 @@ int main (int argc, char **argv) {
     default_independent_stats = new_independent_stats();
 
 #ifndef WIN32
-    /* daemonize if requested */
-    /* if we want to ensure our ability to dump core, don't chdir to / */
-    if (do_daemonize) {
-        if (sigignore(SIGHUP) == -1) {
-            settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                    "Failed to ignore SIGHUP: ", strerror(errno));
-        }
-        if (daemonize(maxcore, settings.verbose) == -1) {
-             settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
-                    "failed to daemon() in order to daemonize\n");
-            exit(EXIT_FAILURE);
-        }
-    }
-
     /*
      * ignore SIGPIPE signals; we can use errno == EPIPE if we
      * need that information
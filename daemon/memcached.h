@@ -102,6 +102,13 @@ enum protocol {
     negotiating_prot /* Discovering the protocol */
 };
 
+/** How new connections are assigned to the worker threads */
+enum dispatch_policy {
+    dispatch_round_robin,
+    dispatch_least_conns, /* the worker with the fewest connections */
+    dispatch_least_busy   /* the worker least busy in the last second */
+};
+
 /** Stats stored per slab (and per thread). */
 struct slab_stats {
     uint64_t  cmd_set;
@@ -198,6 +205,9 @@ struct settings {
     } extensions;
     int num_ports;
     bool tcp_nodelay;
+    bool numa;              /* pin the workers to the NUMA nodes */
+    bool reuseport;         /* each worker accepts on its own sockets */
+    enum dispatch_policy dispatch_policy; /* how connections are assigned */
 };
 
 struct engine_event_handler {
@@ -219,18 +229,36 @@ typedef struct {
     cb_thread_t thread_id;      /* unique ID of this thread */
     struct event_base *base;    /* libevent handle this thread uses */
     struct event notify_event;  /* listen event for notify pipe */
-    SOCKET notify[2];           /* notification pipes */
+    SOCKET notify[2];           /* notification pipes (or eventfd) */
+    volatile uint32_t notify_pending; /* a wakeup is pending (workers only) */
     struct conn_queue *new_conn_queue; /* queue of new connections to handle */
     cache_t *suffix_cache;      /* suffix cache */
-    cb_mutex_t mutex;      /* Mutex to lock protect access to the pending_io */
+    cb_mutex_t mutex;      /* Mutex to protect the pending_io handoff */
     bool is_locked;
     struct conn *pending_io;    /* List of connection with pending async io ops */
+    struct conn *pending_io_tail; /* The last connection in pending_io */
     int index;                  /* index of this thread in the threads array */
     enum thread_type type;      /* Type of IO this thread processes */
+    int numa_node;              /* NUMA node of the thread (-1 if not pinned) */
+    struct conn *listen_conn;   /* the thread's own listening sockets */
+    bool listen_disabled;       /* accepting is disabled (out of fds) */
+    volatile int curr_conns;    /* connections assigned to the thread */
+    volatile uint64_t busy_time; /* time spent handling events (ns) */
+    uint64_t last_busy_time;    /* busy_time at the last load update */
+    volatile uint32_t busy_ratio; /* event loop utilisation in permille */
 
     rel_time_t last_checked;
 } LIBEVENT_THREAD;
 
+/*
+ * The thread lock only protects the handoff between the engine threads
+ * and the worker: the pending_io list, the list_state, io_status and
+ * refcount of its connections. The worker must NOT hold it while running
+ * the state machine of a connection, so notify_io_complete never has to
+ * wait for a request to be executed. The rest of the connection belongs
+ * to the worker, and aiostat is only set from io_status by the worker
+ * when it takes the connection off the pending_io list.
+ */
 #define LOCK_THREAD(t)                          \
     cb_mutex_enter(&t->mutex);                  \
     assert(t->is_locked == false);              \
@@ -277,6 +305,12 @@ struct conn {
 
     char   *ritem;  /** when we read in an item's value, it goes here */
     uint32_t rlbytes;
+    /**
+     * Large values may be split over multiple segments of the item.
+     * rsegment is the next segment to read into (of nrsegments)
+     */
+    uint16_t rsegment;
+    uint16_t nrsegments;
 
     /* data for the nread state */
 
@@ -343,9 +377,11 @@ struct conn {
 
     int list_state; /* bitmask of list state data for this connection */
     conn   *next;     /* Used for generating a list of conn structures */
+    conn   *prev;     /* The previous connection in the pending_io list */
     LIBEVENT_THREAD *thread; /* Pointer to the thread object serving this connection */
 
     ENGINE_ERROR_CODE aiostat;
+    ENGINE_ERROR_CODE io_status; /* status from notify_io_complete */
     bool ewouldblock;
     TAP_ITERATOR tap_iterator;
     int parent_port; /* Listening port that creates this connection instance */
@@ -355,9 +391,8 @@ struct conn {
 };
 
 /* States for the connection list_state */
-#define LIST_STATE_PROCESSING 1
-#define LIST_STATE_REQ_PENDING_IO 2
-#define LIST_STATE_REQ_PENDING_CLOSE 4
+#define LIST_STATE_PENDING_IO 1 /* the connection is in the pending_io list */
+#define LIST_STATE_IO_STATUS 2 /* io_status is set and not handed over yet */
 
 /*
  * Functions
@@ -397,6 +432,12 @@ int  dispatch_event_add(int thread, conn *c);
 void dispatch_conn_new(SOCKET sfd, int parent_port,
                        STATE_FUNC init_state, int event_flags,
                        int read_buffer_size);
+void dispatch_listen_conn(int thread, SOCKET sfd, int parent_port);
+void notify_listen_threads(void);
+void resume_listen(LIBEVENT_THREAD *me);
+void thread_count_conn(LIBEVENT_THREAD *me, int delta);
+void thread_add_busy_time(LIBEVENT_THREAD *me, hrtime_t start);
+void threads_update_load(void);
 
 /* Lock wrappers for cache functions that are called from main loop. */
 void accept_new_conns(const bool do_accept);
@@ -410,6 +451,7 @@ void threadlocal_stats_clear(struct thread_stats *stats);
 void threadlocal_stats_reset(struct thread_stats *thread_stats);
 void threadlocal_stats_aggregate(struct thread_stats *thread_stats, struct thread_stats *stats);
 void slab_stats_aggregate(struct thread_stats *stats, struct slab_stats *out);
+void thread_load_stats(ADD_STAT add_stats, conn *c);
 
 /* Stat processing functions */
 void append_stat(const char *name, ADD_STAT add_stats, conn *c,
@@ -421,14 +463,15 @@ const char *state_text(STATE_FUNC state);
 void safe_close(SOCKET sfd);
 
 
-/* Number of times this connection is in the given pending list */
-int number_of_pending(conn *c, conn *pending);
-bool has_cycle(conn *c);
-bool list_contains(conn *h, conn *n);
-conn *list_remove(conn *h, conn *n);
-size_t list_to_array(conn **dest, size_t max_items, conn **l);
-void enlist_conn(conn *c, conn **list);
-void finalize_list(conn **list, size_t items);
+/*
+ * The pending_io list of a thread (all of these must be called with the
+ * thread locked, and run in constant time)
+ */
+bool pending_io_contains(conn *c);
+void pending_io_add(conn *c);
+void pending_io_remove(conn *c);
+void pending_io_claim(conn *c);
+conn *pending_io_pop(LIBEVENT_THREAD *thr);
 bool set_socket_nonblocking(SOCKET sfd);
 
 void conn_close(conn *c);
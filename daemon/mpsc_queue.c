@@ -0,0 +1,98 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+#include <stddef.h>
+
+#if defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+#include <atomic.h>
+#endif
+
+#include "mpsc_queue.h"
+
+/*
+ * Atomically replace the head of the queue, with a full memory barrier
+ * so the contents of the new node are visible before it's linked in.
+ */
+#ifdef WIN32
+static struct mpsc_node *mpsc_exchange(struct mpsc_node * volatile *dest,
+                                       struct mpsc_node *node) {
+    return InterlockedExchangePointer((PVOID volatile*)dest, node);
+}
+#define mpsc_load(src) (*(src))
+#elif defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+static struct mpsc_node *mpsc_exchange(struct mpsc_node * volatile *dest,
+                                       struct mpsc_node *node) {
+    struct mpsc_node *ret;
+    membar_producer();
+    ret = atomic_swap_ptr((volatile void*)dest, node);
+    membar_consumer();
+    return ret;
+}
+static struct mpsc_node *mpsc_load(struct mpsc_node * volatile *src) {
+    struct mpsc_node *ret = *src;
+    membar_consumer();
+    return ret;
+}
+#elif defined(__ATOMIC_ACQUIRE)
+#define mpsc_exchange(dest, node) __atomic_exchange_n(dest, node, __ATOMIC_SEQ_CST)
+#define mpsc_load(src) __atomic_load_n(src, __ATOMIC_ACQUIRE)
+#else
+static struct mpsc_node *mpsc_exchange(struct mpsc_node * volatile *dest,
+                                       struct mpsc_node *node) {
+    /* __sync_lock_test_and_set is only an acquire barrier */
+    __sync_synchronize();
+    return __sync_lock_test_and_set(dest, node);
+}
+static struct mpsc_node *mpsc_load(struct mpsc_node * volatile *src) {
+    struct mpsc_node *ret = *src;
+    __sync_synchronize();
+    return ret;
+}
+#endif
+
+void mpsc_queue_init(mpsc_queue_t *queue) {
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+}
+
+void mpsc_queue_push(mpsc_queue_t *queue, struct mpsc_node *node) {
+    struct mpsc_node *prev;
+    node->next = NULL;
+    prev = mpsc_exchange(&queue->head, node);
+    /* The consumer can't get past prev until we link the node in */
+    prev->next = node;
+}
+
+struct mpsc_node *mpsc_queue_pop(mpsc_queue_t *queue) {
+    struct mpsc_node *tail = queue->tail;
+    struct mpsc_node *next = mpsc_load(&tail->next);
+
+    if (tail == &queue->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        queue->tail = next;
+        tail = next;
+        next = mpsc_load(&next->next);
+    }
+
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+
+    if (tail != mpsc_load(&queue->head)) {
+        /* A producer is in the middle of pushing a node after tail */
+        return NULL;
+    }
+
+    /* tail is the last node. Push the stub so we may hand out tail */
+    mpsc_queue_push(queue, &queue->stub);
+    next = mpsc_load(&tail->next);
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,51 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+/*
+ * An intrusive lock-free multi-producer / single-consumer queue (the
+ * algorithm by Dmitry Vyukov). Any number of threads may push nodes onto
+ * the queue at the same time, but only a single thread may pop them.
+ *
+ * Pushing is a single atomic exchange, and popping doesn't need any
+ * atomic operations at all (unless the queue becomes empty). A push in
+ * progress may hide the nodes pushed after it from the consumer for a
+ * short while, so the producers should wake up the consumer after they
+ * pushed their node (it'll see the node once it runs).
+ */
+
+struct mpsc_node {
+    struct mpsc_node * volatile next;
+};
+
+typedef struct {
+    /** The node pushed most recently (updated by the producers) */
+    struct mpsc_node * volatile head;
+    /** The next node to pop (only used by the consumer) */
+    struct mpsc_node *tail;
+    struct mpsc_node stub;
+} mpsc_queue_t;
+
+/**
+ * Initialize an empty queue
+ * @param queue the queue to initialize
+ */
+void mpsc_queue_init(mpsc_queue_t *queue);
+
+/**
+ * Push a node onto the queue. This may be called by any thread.
+ * @param queue the queue to add the node to
+ * @param node the node to add (owned by the queue until popped)
+ */
+void mpsc_queue_push(mpsc_queue_t *queue, struct mpsc_node *node);
+
+/**
+ * Pop the oldest node from the queue. This may only be called by the
+ * consumer thread.
+ * @param queue the queue to get the node from
+ * @return the node, or NULL if the queue is empty (or the next node
+ *         isn't completely pushed yet)
+ */
+struct mpsc_node *mpsc_queue_pop(mpsc_queue_t *queue);
+
+#endif
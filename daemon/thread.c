@@ -14,15 +14,57 @@
 #include <signal.h>
 #include <fcntl.h>
 #include <platform/platform.h>
+#include "utilities/numa.h"
+#include "mpsc_queue.h"
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#define HAVE_EVENTFD 1
+#endif
+
+#if defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+#include <atomic.h>
+#endif
+
+/*
+ * Set (or clear) the pending wakeup flag of a worker, returns the old
+ * value. Both are full memory barriers.
+ */
+#ifdef WIN32
+#define notify_flag_swap(flag, value) \
+    (uint32_t)InterlockedExchange((LONG volatile*)(flag), (LONG)(value))
+#elif defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+#define notify_flag_swap(flag, value) \
+    (membar_enter(), atomic_swap_32((flag), (value)))
+#else
+#define notify_flag_swap(flag, value) \
+    (__sync_synchronize(), __sync_lock_test_and_set((flag), (value)))
+#endif
+
+/* Atomically add delta to a connection counter */
+#ifdef WIN32
+#define conn_counter_add(counter, delta) \
+    InterlockedExchangeAdd((LONG volatile*)(counter), (LONG)(delta))
+#elif defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+#define conn_counter_add(counter, delta) \
+    atomic_add_int((volatile uint_t*)(counter), (delta))
+#else
+#define conn_counter_add(counter, delta) \
+    __sync_add_and_fetch((counter), (delta))
+#endif
 
 #define ITEMS_PER_ALLOC 64
+#define NUMA_MAX_WORKER_NODES 64
 
+#ifndef HAVE_EVENTFD
 static char devnull[8192];
+#endif
 extern volatile sig_atomic_t memcached_shutdown;
 
 /* An item in the connection queue. */
 typedef struct conn_queue_item CQ_ITEM;
 struct conn_queue_item {
+    struct mpsc_node  node;             /* must be first */
     SOCKET            sfd;
     int               parent_port;
     STATE_FUNC        init_state;
@@ -31,13 +73,13 @@ struct conn_queue_item {
     CQ_ITEM          *next;
 };
 
-/* A connection queue. */
+/*
+ * A connection queue. Any thread may push connections onto the queue of
+ * a worker without taking any locks, and only the worker pops them.
+ */
 typedef struct conn_queue CQ;
 struct conn_queue {
-    CQ_ITEM *head;
-    CQ_ITEM *tail;
-    cb_mutex_t lock;
-    cb_cond_t  cond;
+    mpsc_queue_t queue;
 };
 
 /* Connection lock around accepting new connections */
@@ -70,46 +112,23 @@ static void thread_libevent_process(int fd, short which, void *arg);
  * Initializes a connection queue.
  */
 static void cq_init(CQ *cq) {
-    cb_mutex_initialize(&cq->lock);
-    cb_cond_initialize(&cq->cond);
-    cq->head = NULL;
-    cq->tail = NULL;
+    mpsc_queue_init(&cq->queue);
 }
 
 /*
  * Looks for an item on a connection queue, but doesn't block if there isn't
- * one.
+ * one. Only the thread owning the queue may call this.
  * Returns the item, or NULL if no item is available
  */
 static CQ_ITEM *cq_pop(CQ *cq) {
-    CQ_ITEM *item;
-
-    cb_mutex_enter(&cq->lock);
-    item = cq->head;
-    if (NULL != item) {
-        cq->head = item->next;
-        if (NULL == cq->head)
-            cq->tail = NULL;
-    }
-    cb_mutex_exit(&cq->lock);
-
-    return item;
+    return (CQ_ITEM*)mpsc_queue_pop(&cq->queue);
 }
 
 /*
  * Adds an item to a connection queue.
  */
 static void cq_push(CQ *cq, CQ_ITEM *item) {
-    item->next = NULL;
-
-    cb_mutex_enter(&cq->lock);
-    if (NULL == cq->tail)
-        cq->head = item;
-    else
-        cq->tail->next = item;
-    cq->tail = item;
-    cb_cond_signal(&cq->cond);
-    cb_mutex_exit(&cq->lock);
+    mpsc_queue_push(&cq->queue, &item->node);
 }
 
 /*
@@ -203,6 +222,26 @@ bool create_notification_pipe(LIBEVENT_THREAD *me)
     return true;
 }
 
+/*
+ * The workers are woken up with an eventfd where available. A socketpair
+ * is used elsewhere, and by the dispatcher (which counts the wakeups).
+ */
+static bool create_notification_event(LIBEVENT_THREAD *me)
+{
+#ifdef HAVE_EVENTFD
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd == -1) {
+        log_system_error(EXTENSION_LOG_WARNING, NULL,
+                         "Can't create notify eventfd: %s");
+        return false;
+    }
+    me->notify[0] = me->notify[1] = fd;
+    return true;
+#else
+    return create_notification_pipe(me);
+#endif
+}
+
 static void setup_dispatcher(struct event_base *main_base,
                              void (*dispatcher_callback)(int, short, void *))
 {
@@ -276,6 +315,11 @@ static void worker_libevent(void *arg) {
     /* Any per-thread setup can happen here; thread_init() will block until
      * all threads have finished initializing.
      */
+    if (me->numa_node != -1 && !numa_pin_thread(me->numa_node)) {
+        settings.extensions.logger->log(EXTENSION_LOG_WARNING, NULL,
+                                        "Failed to pin thread %d to NUMA node %d",
+                                        me->index, me->numa_node);
+    }
 
     cb_mutex_enter(&init_lock);
     init_count++;
@@ -285,16 +329,6 @@ static void worker_libevent(void *arg) {
     event_base_loop(me->base, 0);
 }
 
-int number_of_pending(conn *c, conn *list) {
-    int rv = 0;
-    for (; list; list = list->next) {
-        if (list == c) {
-            rv ++;
-        }
-    }
-    return rv;
-}
-
 /*
  * Processes an incoming "handle a new connection" item. This is called when
  * input arrives on the libevent wakeup pipe.
@@ -302,14 +336,34 @@ int number_of_pending(conn *c, conn *list) {
 static void thread_libevent_process(int fd, short which, void *arg) {
     LIBEVENT_THREAD *me = arg;
     CQ_ITEM *item;
-    conn* pending;
+    conn *c;
+    conn *last;
+    bool more;
+    hrtime_t start = gethrtime();
 
     assert(me->type == GENERAL);
 
+#ifdef HAVE_EVENTFD
+    {
+        uint64_t count;
+        if (read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+            log_system_error(EXTENSION_LOG_WARNING, NULL,
+                             "Can't read from libevent eventfd: %s");
+        }
+    }
+#else
     if (recv(fd, devnull, sizeof(devnull), 0) == -1) {
         log_socket_error(EXTENSION_LOG_WARNING, NULL,
                          "Can't read from libevent pipe: %s");
     }
+#endif
+
+    /*
+     * Clear the flag before looking at the queues: whoever adds work
+     * from now on has to wake us up again, while everything added
+     * before is picked up below.
+     */
+    notify_flag_swap(&me->notify_pending, 0);
 
     if (memcached_shutdown) {
          event_base_loopbreak(me->base);
@@ -327,21 +381,38 @@ static void thread_libevent_process(int fd, short which, void *arg) {
                                                 item->sfd);
             }
             closesocket(item->sfd);
+            if (item->init_state != conn_listening) {
+                thread_count_conn(me, -1);
+            }
         } else {
             assert(c->thread == NULL);
             c->thread = me;
+            if (item->init_state == conn_listening) {
+                c->next = me->listen_conn;
+                me->listen_conn = c;
+            }
         }
         cqi_free(item);
     }
 
+    if (me->listen_disabled) {
+        resume_listen(me);
+    }
+
+    /*
+     * The lock is released while a connection runs, so the engine may
+     * add connections (or add the same one again) meanwhile. Only run
+     * the ones that were pending when we started, and leave the rest
+     * for the next wakeup so this can't go on forever.
+     */
     LOCK_THREAD(me);
-    pending = me->pending_io;
-    me->pending_io = NULL;
-    while (pending != NULL) {
-        conn *c = pending;
+    last = me->pending_io_tail;
+    while (last != NULL && (c = pending_io_pop(me)) != NULL) {
         assert(me == c->thread);
-        pending = pending->next;
-        c->next = NULL;
+        if (c == last) {
+            last = NULL;
+        }
+        UNLOCK_THREAD(me);
 
         if (c->sfd != INVALID_SOCKET && !c->registered_in_libevent) {
             /* The socket may have been shut down while we're looping */
@@ -361,93 +432,87 @@ static void thread_libevent_process(int fd, short which, void *arg) {
                                                 c->sfd, state_text(c->state));
             }
         } while (c->state(c));
+        LOCK_THREAD(me);
     }
+    more = me->pending_io != NULL;
     UNLOCK_THREAD(me);
-}
 
-extern volatile rel_time_t current_time;
+    if (more) {
+        notify_thread(me);
+    }
 
-bool has_cycle(conn *c) {
-    conn *slowNode, *fastNode1, *fastNode2;
+    thread_add_busy_time(me, start);
+}
 
-    if (!c) {
-        return false;
-    }
+extern volatile rel_time_t current_time;
 
-    slowNode = fastNode1 = fastNode2 = c;
-    while (slowNode && (fastNode1 = fastNode2->next) && (fastNode2 = fastNode1->next)) {
-        if (slowNode == fastNode1 || slowNode == fastNode2) {
-            return true;
-        }
-        slowNode = slowNode->next;
-    }
-    return false;
+/*
+ * The pending_io list is an intrusive doubly linked list (through the
+ * next and prev pointers of the connections), and LIST_STATE_PENDING_IO
+ * tells if a connection is in it. This keeps all of the operations
+ * constant time, even with thousands of connections waiting for the
+ * engine to complete their I/O.
+ */
+bool pending_io_contains(conn *c) {
+    assert(c->thread->is_locked);
+    return (c->list_state & LIST_STATE_PENDING_IO) != 0;
 }
 
-bool list_contains(conn *haystack, conn *needle) {
-    for (; haystack; haystack = haystack -> next) {
-        if (needle == haystack) {
-            return true;
-        }
+void pending_io_add(conn *c) {
+    LIBEVENT_THREAD *thr = c->thread;
+    assert(thr->is_locked);
+    assert(!pending_io_contains(c));
+    assert(c->next == NULL && c->prev == NULL);
+
+    c->prev = thr->pending_io_tail;
+    if (thr->pending_io_tail == NULL) {
+        thr->pending_io = c;
+    } else {
+        thr->pending_io_tail->next = c;
     }
-    return false;
+    thr->pending_io_tail = c;
+    c->list_state |= LIST_STATE_PENDING_IO;
 }
 
-conn* list_remove(conn *haystack, conn *needle) {
-    if (!haystack) {
-        return NULL;
+void pending_io_remove(conn *c) {
+    LIBEVENT_THREAD *thr = c->thread;
+    if (!pending_io_contains(c)) {
+        return;
     }
 
-    if (haystack == needle) {
-        conn *rv = needle->next;
-        needle->next = NULL;
-        return rv;
+    if (c->prev == NULL) {
+        thr->pending_io = c->next;
+    } else {
+        c->prev->next = c->next;
     }
-
-    haystack->next = list_remove(haystack->next, needle);
-
-    return haystack;
-}
-
-size_t list_to_array(conn **dest, size_t max_items, conn **l) {
-    size_t n_items = 0;
-    for (; *l && n_items < max_items - 1; ++n_items) {
-        dest[n_items] = *l;
-        *l = dest[n_items]->next;
-        dest[n_items]->next = NULL;
-        dest[n_items]->list_state |= LIST_STATE_PROCESSING;
+    if (c->next == NULL) {
+        thr->pending_io_tail = c->prev;
+    } else {
+        c->next->prev = c->prev;
     }
-    return n_items;
+    c->next = c->prev = NULL;
+    c->list_state &= ~LIST_STATE_PENDING_IO;
 }
 
-void enlist_conn(conn *c, conn **list) {
-    LIBEVENT_THREAD *thr = c->thread;
-    assert(list == &thr->pending_io);
-    if ((c->list_state & LIST_STATE_PROCESSING) == 0) {
-        assert(!list_contains(thr->pending_io, c));
-        assert(c->next == NULL);
-        c->next = *list;
-        *list = c;
-        assert(list_contains(*list, c));
-        assert(!has_cycle(*list));
-    } else {
-        c->list_state |= LIST_STATE_REQ_PENDING_IO;
+/*
+ * Take a connection off the pending_io list before the worker runs it,
+ * and hand over the status of the I/O the engine completed (if any)
+ */
+void pending_io_claim(conn *c) {
+    pending_io_remove(c);
+    if (c->list_state & LIST_STATE_IO_STATUS) {
+        c->aiostat = c->io_status;
+        c->list_state &= ~LIST_STATE_IO_STATUS;
     }
 }
 
-void finalize_list(conn **list, size_t items) {
-    size_t i;
-    for (i = 0; i < items; i++) {
-        if (list[i] != NULL) {
-            list[i]->list_state &= ~LIST_STATE_PROCESSING;
-            if (list[i]->sfd != INVALID_SOCKET) {
-                if (list[i]->list_state & LIST_STATE_REQ_PENDING_IO) {
-                    enlist_conn(list[i], &list[i]->thread->pending_io);
-                }
-            }
-            list[i]->list_state = 0;
-        }
+conn *pending_io_pop(LIBEVENT_THREAD *thr) {
+    conn *c = thr->pending_io;
+    assert(thr->is_locked);
+    if (c != NULL) {
+        pending_io_claim(c);
     }
+    return c;
 }
 
 void notify_io_complete(const void *cookie, ENGINE_ERROR_CODE status)
@@ -465,7 +530,10 @@ void notify_io_complete(const void *cookie, ENGINE_ERROR_CODE status)
                                     conn->sfd, status);
 
     LOCK_THREAD(thr);
-    conn->aiostat = status;
+    /* The worker may be running the connection, so it picks up the
+     * status when it takes the connection off the pending_io list */
+    conn->io_status = status;
+    conn->list_state |= LIST_STATE_IO_STATUS;
     notify = add_conn_to_pending_io_list(conn);
     UNLOCK_THREAD(thr);
 
@@ -478,6 +546,97 @@ void notify_io_complete(const void *cookie, ENGINE_ERROR_CODE status)
 /* Which thread we assigned a connection to most recently. */
 static int last_thread = -1;
 
+/* The number of NUMA nodes with workers pinned to them (0 if not pinned) */
+static int numa_nodes;
+/* Which thread of the node we assigned a connection to most recently. */
+static unsigned int numa_last_thread[NUMA_MAX_WORKER_NODES];
+
+/*
+ * Get the home node of a connection. All of the connections from a client
+ * go to the same node, so the items it uses are stored in the memory
+ * local to the workers serving it. Returns -1 if we don't know the peer
+ * (like for UDP).
+ */
+static int numa_home_node(SOCKET sfd) {
+    struct sockaddr_storage peer;
+    socklen_t len = sizeof(peer);
+    const unsigned char *addr;
+    size_t naddr;
+    uint32_t hash = 2166136261U;
+
+    if (getpeername(sfd, (struct sockaddr*)&peer, &len) != 0) {
+        return -1;
+    }
+
+    if (peer.ss_family == AF_INET) {
+        struct sockaddr_in *in = (struct sockaddr_in*)&peer;
+        addr = (const unsigned char*)&in->sin_addr;
+        naddr = sizeof(in->sin_addr);
+    } else if (peer.ss_family == AF_INET6) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6*)&peer;
+        addr = (const unsigned char*)&in6->sin6_addr;
+        naddr = sizeof(in6->sin6_addr);
+    } else {
+        return -1;
+    }
+
+    /* FNV-1a of the address (but not the port) */
+    while (naddr-- > 0) {
+        hash = (hash ^ *addr++) * 16777619U;
+    }
+    return (int)(hash % numa_nodes);
+}
+
+/*
+ * Compare the load of two workers for the dispatch policy. Returns a
+ * negative value if a is less loaded than b.
+ */
+static int thread_load_cmp(LIBEVENT_THREAD *a, LIBEVENT_THREAD *b) {
+    if (settings.dispatch_policy == dispatch_least_busy) {
+        /* The busy ratio is only updated once a second, so don't let
+         * small differences decide (use the connections instead) */
+        int diff = (int)a->busy_ratio - (int)b->busy_ratio;
+        if (diff < -50 || diff > 50) {
+            return diff;
+        }
+    }
+    return a->curr_conns - b->curr_conns;
+}
+
+/*
+ * Select the worker to serve a new connection from the given NUMA node
+ * (-1 for any node).
+ */
+static int select_thread(int node) {
+    int tid = (last_thread + 1) % settings.num_threads;
+    int best = -1;
+    int ii;
+
+    if (settings.dispatch_policy == dispatch_round_robin) {
+        if (node != -1) {
+            /* Round robin among the workers of the node (thread i is on
+             * node i % numa_nodes) */
+            int count = (settings.num_threads - node + numa_nodes - 1) / numa_nodes;
+            tid = node + numa_nodes * (int)(numa_last_thread[node]++ % count);
+        }
+        return tid;
+    }
+
+    /* Start looking after the last one we picked so the ties are
+     * spread over the workers */
+    for (ii = 0; ii < settings.num_threads; ++ii) {
+        tid = (last_thread + 1 + ii) % settings.num_threads;
+        if (node != -1 && tid % numa_nodes != node) {
+            continue;
+        }
+        if (best == -1 || thread_load_cmp(threads + tid, threads + best) < 0) {
+            best = tid;
+        }
+    }
+
+    return best;
+}
+
 /*
  * Dispatches a new connection to another thread. This is only ever called
  * from the main thread, or because of an incoming connection.
@@ -486,11 +645,14 @@ void dispatch_conn_new(SOCKET sfd, int parent_port,
                        STATE_FUNC init_state, int event_flags,
                        int read_buffer_size) {
     CQ_ITEM *item = cqi_new();
-    int tid = (last_thread + 1) % settings.num_threads;
-
+    int node = numa_nodes > 0 ? numa_home_node(sfd) : -1;
+    int tid = select_thread(node);
     LIBEVENT_THREAD *thread = threads + tid;
 
     last_thread = tid;
+    /* Count the connection right away, so the ones accepted before the
+     * worker gets to them are taken into account */
+    thread_count_conn(thread, 1);
 
     item->sfd = sfd;
     item->parent_port = parent_port;
@@ -504,6 +666,79 @@ void dispatch_conn_new(SOCKET sfd, int parent_port,
     notify_thread(thread);
 }
 
+/*
+ * Hands a listening socket to a worker thread (see settings.reuseport).
+ * The worker accepts the new connections on it and serves them itself.
+ */
+void dispatch_listen_conn(int tid, SOCKET sfd, int parent_port) {
+    CQ_ITEM *item = cqi_new();
+    LIBEVENT_THREAD *thread = threads + tid;
+
+    item->sfd = sfd;
+    item->parent_port = parent_port;
+    item->init_state = conn_listening;
+    item->event_flags = EV_READ | EV_PERSIST;
+    item->read_buffer_size = 1;
+
+    cq_push(thread->new_conn_queue, item);
+    notify_thread(thread);
+}
+
+/*
+ * Wakes up the workers with their own listening sockets so they may
+ * start accepting connections again.
+ */
+void notify_listen_threads(void) {
+    int ii;
+    if (settings.reuseport) {
+        for (ii = 0; ii < settings.num_threads; ++ii) {
+            notify_thread(&threads[ii]);
+        }
+    }
+}
+
+/*
+ * Update the number of connections assigned to a worker
+ */
+void thread_count_conn(LIBEVENT_THREAD *me, int delta) {
+    conn_counter_add(&me->curr_conns, delta);
+}
+
+/*
+ * Add the time spent handling an event (since start) to the busy time of
+ * the worker. Only the worker itself may call this.
+ */
+void thread_add_busy_time(LIBEVENT_THREAD *me, hrtime_t start) {
+    me->busy_time += gethrtime() - start;
+}
+
+/*
+ * Update the event loop utilisation of the workers. This is called by
+ * the clock handler in the dispatcher once a second.
+ */
+void threads_update_load(void) {
+    static hrtime_t last_update;
+    hrtime_t now = gethrtime();
+    hrtime_t elapsed = now - last_update;
+    int ii;
+
+    if (threads == NULL) {
+        return;
+    }
+
+    for (ii = 0; ii < settings.num_threads; ++ii) {
+        LIBEVENT_THREAD *me = threads + ii;
+        uint64_t busy = me->busy_time;
+        uint64_t ratio = 0;
+        if (last_update != 0 && elapsed > 0) {
+            ratio = (busy - me->last_busy_time) * 1000 / elapsed;
+        }
+        me->busy_ratio = ratio > 1000 ? 1000 : (uint32_t)ratio;
+        me->last_busy_time = busy;
+    }
+    last_update = now;
+}
+
 /*
  * Returns true if this is the thread that listens for new TCP connections.
  */
@@ -517,6 +752,24 @@ void notify_dispatcher(void) {
 
 /******************************* GLOBAL STATS ******************************/
 
+/*
+ * Add the number of connections and the event loop utilisation of each
+ * of the worker threads to the stats.
+ */
+void thread_load_stats(ADD_STAT add_stats, conn *c) {
+    char key[80];
+    int ii;
+
+    for (ii = 0; ii < settings.num_threads; ++ii) {
+        snprintf(key, sizeof(key), "thread_%d_curr_connections", ii);
+        append_stat(key, add_stats, c, "%d", threads[ii].curr_conns);
+        snprintf(key, sizeof(key), "thread_%d_busy_ratio", ii);
+        append_stat(key, add_stats, c, "%u.%03u",
+                    threads[ii].busy_ratio / 1000,
+                    threads[ii].busy_ratio % 1000);
+    }
+}
+
 void threadlocal_stats_clear(struct thread_stats *stats) {
     stats->cmd_get = 0;
     stats->get_misses = 0;
@@ -637,14 +890,29 @@ void thread_init(int nthr, struct event_base *main_base,
     setup_dispatcher(main_base, dispatcher_callback);
 
     for (i = 0; i < nthreads; i++) {
-        if (!create_notification_pipe(&threads[i])) {
+        if (!create_notification_event(&threads[i])) {
             exit(1);
         }
         threads[i].index = i;
+        threads[i].numa_node = -1;
 
         setup_thread(&threads[i]);
     }
 
+    if (settings.numa) {
+        /* Spread the workers over the nodes (the tap thread isn't pinned) */
+        numa_nodes = numa_node_count();
+        if (numa_nodes > nthr) {
+            numa_nodes = nthr;
+        }
+        if (numa_nodes > NUMA_MAX_WORKER_NODES) {
+            numa_nodes = NUMA_MAX_WORKER_NODES;
+        }
+        for (i = 0; i < nthr; i++) {
+            threads[i].numa_node = i % numa_nodes;
+        }
+    }
+
     /* Create threads after we've done all the libevent setup. */
     for (i = 0; i < nthreads; i++) {
         create_worker(worker_libevent, &threads[i], &thread_ids[i]);
@@ -670,7 +938,9 @@ void threads_shutdown(void)
         CQ_ITEM *it;
 
         safe_close(threads[ii].notify[0]);
-        safe_close(threads[ii].notify[1]);
+        if (threads[ii].notify[1] != threads[ii].notify[0]) {
+            safe_close(threads[ii].notify[1]);
+        }
         cache_destroy(threads[ii].suffix_cache);
         event_base_free(threads[ii].base);
 
@@ -684,20 +954,47 @@ void threads_shutdown(void)
     free(threads);
 }
 
+/*
+ * Wake up a thread. The wakeups of the workers are coalesced: only the
+ * first notification after the worker started processing its queues
+ * is sent, the others are picked up by the same run.
+ */
 void notify_thread(LIBEVENT_THREAD *thread) {
+    if (thread->type == DISPATCHER) {
+        if (send(thread->notify[1], "", 1, 0) != 1) {
+            log_socket_error(EXTENSION_LOG_WARNING, NULL,
+                             "Failed to notify thread: %s");
+        }
+        return;
+    }
+
+    if (notify_flag_swap(&thread->notify_pending, 1) != 0) {
+        return;
+    }
+
+#ifdef HAVE_EVENTFD
+    {
+        uint64_t count = 1;
+        if (write(thread->notify[1], &count, sizeof(count)) != sizeof(count)) {
+            log_system_error(EXTENSION_LOG_WARNING, NULL,
+                             "Failed to notify thread: %s");
+        }
+    }
+#else
     if (send(thread->notify[1], "", 1, 0) != 1) {
         log_socket_error(EXTENSION_LOG_WARNING, NULL,
                          "Failed to notify thread: %s");
     }
+#endif
 }
 
 int add_conn_to_pending_io_list(conn *c) {
     int notify = 0;
-    if (number_of_pending(c, c->thread->pending_io) == 0) {
+    if (!pending_io_contains(c)) {
         if (c->thread->pending_io == NULL) {
             notify = 1;
         }
-        enlist_conn(c, &c->thread->pending_io);
+        pending_io_add(c);
     }
 
     return notify;
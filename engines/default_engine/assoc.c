@@ -10,20 +10,240 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <inttypes.h>
 #include <platform/platform.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "default_engine.h"
 
 #define hashsize(n) ((uint32_t)1<<(n))
 #define hashmask(n) (hashsize(n)-1)
 
+/* The mask for the slots in use in the tags of a group */
+#define ASSOC_GROUP_MASK ((1U << ASSOC_GROUP_SLOTS) - 1)
+
+/* Expand the grouped table when the groups hold this many items on average */
+#define ASSOC_GROUP_LOAD 4
+
+/*
+ * The number of buckets moved while holding an item lock during expansion
+ * adapts to the load: it is halved when we had to wait longer than
+ * ASSOC_EXPAND_CONTENDED ns for the lock, and doubled (up to
+ * ASSOC_EXPAND_MAX_BATCH) when we didn't.
+ */
+#define ASSOC_EXPAND_MAX_BATCH 128
+#define ASSOC_EXPAND_CONTENDED 10000
+
+/* The largest table assoc_presize will create */
+#define ASSOC_MAX_PRESIZE 30
+
+/*
+ * During expansion the buckets in the old table are moved one item lock
+ * stripe at a time (so that a batch of buckets can be moved with a single
+ * lock round trip). This maps a bucket in the old table to its position
+ * in that order.
+ */
+static unsigned int expand_position(struct default_engine *engine,
+                                    unsigned int bucket) {
+    unsigned int lockpower = engine->items.item_lock_hashpower;
+    return ((bucket & hashmask(lockpower)) << (engine->assoc.hashpower - 1 - lockpower)) |
+        (bucket >> lockpower);
+}
+
+/*
+ * Returns true (and the bucket in the old table) if the item with the
+ * given hash value is still in the old table. The caller must hold the
+ * item lock for the hash value.
+ */
+static bool in_old_table(struct default_engine *engine, uint32_t hash,
+                         unsigned int *bucket) {
+    if (!engine->assoc.expanding) {
+        return false;
+    }
+    *bucket = hash & hashmask(engine->assoc.hashpower - 1);
+    return expand_position(engine, *bucket) >= engine->assoc.expand_position;
+}
+
+static assoc_group *assoc_group_alloc(uint32_t ngroups) {
+    size_t size = ngroups * sizeof(assoc_group);
+    void *ret;
+#ifdef WIN32
+    ret = _aligned_malloc(size, 64);
+#else
+    if (posix_memalign(&ret, 64, size) != 0) {
+        ret = NULL;
+    }
+#endif
+    if (ret != NULL) {
+        memset(ret, 0, size);
+    }
+    return ret;
+}
+
+static void assoc_group_free(assoc_group *groups) {
+#ifdef WIN32
+    _aligned_free(groups);
+#else
+    free(groups);
+#endif
+}
+
+/*
+ * The tag is taken from the high bits of the hash value (mixed with the low
+ * bits, because with large tables all of the items in a bucket share the
+ * low bits). 0 is used to mark an empty slot.
+ */
+static uint8_t assoc_tag(uint32_t hash) {
+    uint8_t tag = (uint8_t)((hash * 2654435761U) >> 24);
+    return tag != 0 ? tag : 1;
+}
+
+/* Returns a bitmask of the slots in the group with the given tag */
+static unsigned int group_match(const assoc_group *group, uint8_t tag) {
+#ifdef __SSE2__
+    __m128i tags = _mm_loadl_epi64((const __m128i*)group->tags);
+    __m128i match = _mm_cmpeq_epi8(tags, _mm_set1_epi8((char)tag));
+    return (unsigned int)_mm_movemask_epi8(match) & ASSOC_GROUP_MASK;
+#else
+    unsigned int ret = 0;
+    int ii;
+    for (ii = 0; ii < ASSOC_GROUP_SLOTS; ++ii) {
+        if (group->tags[ii] == tag) {
+            ret |= 1U << ii;
+        }
+    }
+    return ret;
+#endif
+}
+
+static assoc_group *group_for(struct default_engine *engine, uint32_t hash) {
+    unsigned int oldbucket;
+
+    if (in_old_table(engine, hash, &oldbucket)) {
+        return &engine->assoc.old_groups[oldbucket];
+    }
+    return &engine->assoc.primary_groups[hash & hashmask(engine->assoc.hashpower)];
+}
+
+static hash_item *group_find(struct default_engine *engine,
+                             assoc_group *group, uint32_t hash,
+                             const char *key, const size_t nkey,
+                             int *depth) {
+    unsigned int match = group_match(group, assoc_tag(hash));
+    hash_item *it;
+    int ii;
+
+    for (ii = 0; match != 0; ++ii, match >>= 1) {
+        if (match & 1) {
+            it = group->items[ii];
+            ++*depth;
+            if ((nkey == it->nkey) && (memcmp(key, item_get_key(it), nkey) == 0)) {
+                return it;
+            }
+        }
+    }
+
+    for (it = group->overflow; it != NULL; it = item_get_h_next(engine, it)) {
+        ++*depth;
+        if ((nkey == it->nkey) && (memcmp(key, item_get_key(it), nkey) == 0)) {
+            return it;
+        }
+    }
+
+    return NULL;
+}
+
+static void group_insert(struct default_engine *engine, assoc_group *group,
+                         uint32_t hash, hash_item *it) {
+    unsigned int empty = group_match(group, 0);
+    int ii;
+
+    for (ii = 0; empty != 0; ++ii, empty >>= 1) {
+        if (empty & 1) {
+            group->tags[ii] = assoc_tag(hash);
+            group->items[ii] = it;
+            return;
+        }
+    }
+
+    item_set_h_next(engine, it, group->overflow);
+    group->overflow = it;
+}
+
+static bool group_delete(struct default_engine *engine, assoc_group *group,
+                         uint32_t hash, const char *key, const size_t nkey) {
+    unsigned int match = group_match(group, assoc_tag(hash));
+    hash_item *it, *prev = NULL;
+    int ii;
+
+    for (ii = 0; match != 0; ++ii, match >>= 1) {
+        hash_item *it = group->items[ii];
+        if ((match & 1) && (nkey == it->nkey) &&
+            (memcmp(key, item_get_key(it), nkey) == 0)) {
+            group->tags[ii] = 0;
+            group->items[ii] = NULL;
+
+            /* Keep the overflow chain short */
+            if ((it = group->overflow) != NULL) {
+                group->overflow = item_get_h_next(engine, it);
+                item_set_h_next(engine, it, NULL);
+                group->tags[ii] = assoc_tag(engine->server.core->hash(item_get_key(it), it->nkey, 0));
+                group->items[ii] = it;
+            }
+            return true;
+        }
+    }
+
+    it = group->overflow;
+    while (it && ((nkey != it->nkey) || memcmp(key, item_get_key(it), nkey))) {
+        prev = it;
+        it = item_get_h_next(engine, it);
+    }
+
+    if (it) {
+        hash_item *nxt = item_get_h_next(engine, it);
+        item_set_h_next(engine, it, NULL);
+        if (prev) {
+            item_set_h_next(engine, prev, nxt);
+        } else {
+            group->overflow = nxt;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+void assoc_presize(struct default_engine *engine, size_t nitems) {
+    while (engine->assoc.hashpower < ASSOC_MAX_PRESIZE) {
+        /* The number of items where assoc_insert starts the expansion */
+        uint64_t limit = hashsize(engine->assoc.hashpower);
+        if (engine->config.hash_groups) {
+            limit *= ASSOC_GROUP_LOAD;
+        } else {
+            limit = (limit * 3) / 2;
+        }
+        if (limit >= nitems) {
+            break;
+        }
+        engine->assoc.hashpower++;
+    }
+}
+
 ENGINE_ERROR_CODE assoc_init(struct default_engine *engine) {
+    engine->assoc.grouped = engine->config.hash_groups;
+    if (engine->assoc.grouped) {
+        engine->assoc.primary_groups = assoc_group_alloc(hashsize(engine->assoc.hashpower));
+        return (engine->assoc.primary_groups != NULL) ? ENGINE_SUCCESS : ENGINE_ENOMEM;
+    }
     engine->assoc.primary_hashtable = calloc(hashsize(engine->assoc.hashpower), sizeof(void *));
     return (engine->assoc.primary_hashtable != NULL) ? ENGINE_SUCCESS : ENGINE_ENOMEM;
 }
 
 void assoc_destroy(struct default_engine *engine) {
-    while (engine->assoc.expanding) {
+    while (engine->assoc.maintenance) {
 #ifdef WIN32
         Sleep(1);
 #else
@@ -31,6 +251,7 @@ void assoc_destroy(struct default_engine *engine) {
 #endif
     }
     free(engine->assoc.primary_hashtable);
+    assoc_group_free(engine->assoc.primary_groups);
 }
 
 hash_item *assoc_find(struct default_engine *engine, uint32_t hash, const char *key, const size_t nkey) {
@@ -39,9 +260,13 @@ hash_item *assoc_find(struct default_engine *engine, uint32_t hash, const char *
     hash_item *ret = NULL;
     int depth = 0;
 
-    if (engine->assoc.expanding &&
-        (oldbucket = (hash & hashmask(engine->assoc.hashpower - 1))) >= engine->assoc.expand_bucket)
-    {
+    if (engine->assoc.grouped) {
+        ret = group_find(engine, group_for(engine, hash), hash, key, nkey, &depth);
+        MEMCACHED_ASSOC_FIND(key, nkey, depth);
+        return ret;
+    }
+
+    if (in_old_table(engine, hash, &oldbucket)) {
         it = engine->assoc.old_hashtable[oldbucket];
     } else {
         it = engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)];
@@ -52,67 +277,45 @@ hash_item *assoc_find(struct default_engine *engine, uint32_t hash, const char *
             ret = it;
             break;
         }
-        it = it->h_next;
+        it = item_get_h_next(engine, it);
         ++depth;
     }
     MEMCACHED_ASSOC_FIND(key, nkey, depth);
     return ret;
 }
 
-/* returns the address of the item pointer before the key.  if *item == 0,
-   the item wasn't found */
+/* returns the address of the bucket holding the key */
 
-static hash_item** _hashitem_before(struct default_engine *engine,
-                                    uint32_t hash,
-                                    const char *key,
-                                    const size_t nkey) {
-    hash_item **pos;
+static hash_item** _hashitem_bucket(struct default_engine *engine,
+                                    uint32_t hash) {
     unsigned int oldbucket;
 
-    if (engine->assoc.expanding &&
-        (oldbucket = (hash & hashmask(engine->assoc.hashpower - 1))) >= engine->assoc.expand_bucket)
-    {
-        pos = &engine->assoc.old_hashtable[oldbucket];
-    } else {
-        pos = &engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)];
-    }
-
-    while (*pos && ((nkey != (*pos)->nkey) || memcmp(key, item_get_key(*pos), nkey))) {
-        pos = &(*pos)->h_next;
+    if (in_old_table(engine, hash, &oldbucket)) {
+        return &engine->assoc.old_hashtable[oldbucket];
     }
-    return pos;
+    return &engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)];
 }
 
 static void assoc_maintenance_thread(void *arg);
 
-/* grows the hashtable to the next power of 2. */
+/*
+ * Start a thread to grow the hashtable to the next power of 2. The caller
+ * holds one of the item locks so we can't swap the tables here (that
+ * requires all of the item locks).
+ */
 static void assoc_expand(struct default_engine *engine) {
-    engine->assoc.old_hashtable = engine->assoc.primary_hashtable;
-
-    engine->assoc.primary_hashtable = calloc(hashsize(engine->assoc.hashpower + 1), sizeof(void *));
-    if (engine->assoc.primary_hashtable) {
-        int ret = 0;
+    if (ATOMIC_CAS_32(&engine->assoc.maintenance, 0, 1)) {
+        int ret;
         cb_thread_t tid;
 
-        engine->assoc.hashpower++;
-        engine->assoc.expanding = true;
-        engine->assoc.expand_bucket = 0;
-
-        /* start a thread to do the expansion */
         if ((ret = cb_create_thread(&tid, assoc_maintenance_thread, engine, 1)) != 0)
         {
             EXTENSION_LOGGER_DESCRIPTOR *logger;
             logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
             logger->log(EXTENSION_LOG_WARNING, NULL,
                         "Can't create thread: %s\n", strerror(ret));
-            engine->assoc.hashpower--;
-            engine->assoc.expanding = false;
-            free(engine->assoc.primary_hashtable);
-            engine->assoc.primary_hashtable =engine->assoc.old_hashtable;
+            engine->assoc.maintenance = 0;
         }
-    } else {
-        engine->assoc.primary_hashtable = engine->assoc.old_hashtable;
-        /* Bad news, but we can keep running. */
     }
 }
 
@@ -122,18 +325,26 @@ int assoc_insert(struct default_engine *engine, uint32_t hash, hash_item *it) {
 
     assert(assoc_find(engine, hash, item_get_key(it), it->nkey) == 0);  /* shouldn't have duplicately named things defined */
 
-    if (engine->assoc.expanding &&
-        (oldbucket = (hash & hashmask(engine->assoc.hashpower - 1))) >= engine->assoc.expand_bucket)
-    {
-        it->h_next = engine->assoc.old_hashtable[oldbucket];
+    if (engine->assoc.grouped) {
+        group_insert(engine, group_for(engine, hash), hash, it);
+        if (ATOMIC_ADD_32(&engine->assoc.hash_items, 1) > hashsize(engine->assoc.hashpower) * ASSOC_GROUP_LOAD &&
+            !engine->assoc.expanding) {
+            assoc_expand(engine);
+        }
+        MEMCACHED_ASSOC_INSERT(item_get_key(it), it->nkey, engine->assoc.hash_items);
+        return 1;
+    }
+
+    if (in_old_table(engine, hash, &oldbucket)) {
+        item_set_h_next(engine, it, engine->assoc.old_hashtable[oldbucket]);
         engine->assoc.old_hashtable[oldbucket] = it;
     } else {
-        it->h_next = engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)];
+        item_set_h_next(engine, it, engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)]);
         engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)] = it;
     }
 
-    engine->assoc.hash_items++;
-    if (! engine->assoc.expanding && engine->assoc.hash_items > (hashsize(engine->assoc.hashpower) * 3) / 2) {
+    if (ATOMIC_ADD_32(&engine->assoc.hash_items, 1) > (hashsize(engine->assoc.hashpower) * 3) / 2 &&
+        !engine->assoc.expanding) {
         assoc_expand(engine);
     }
 
@@ -142,67 +353,216 @@ int assoc_insert(struct default_engine *engine, uint32_t hash, hash_item *it) {
 }
 
 void assoc_delete(struct default_engine *engine, uint32_t hash, const char *key, const size_t nkey) {
-    hash_item **before = _hashitem_before(engine, hash, key, nkey);
+    hash_item **bucket;
+    hash_item *it, *prev = NULL;
 
-    if (*before) {
+    if (engine->assoc.grouped) {
+        if (group_delete(engine, group_for(engine, hash), hash, key, nkey)) {
+            ATOMIC_ADD_32(&engine->assoc.hash_items, -1);
+            MEMCACHED_ASSOC_DELETE(key, nkey, engine->assoc.hash_items);
+            return;
+        }
+        /* The callers don't delete things they can't find */
+        assert(false);
+        return;
+    }
+
+    bucket = _hashitem_bucket(engine, hash);
+    it = *bucket;
+    while (it && ((nkey != it->nkey) || memcmp(key, item_get_key(it), nkey))) {
+        prev = it;
+        it = item_get_h_next(engine, it);
+    }
+
+    if (it) {
         hash_item *nxt;
-        engine->assoc.hash_items--;
+        ATOMIC_ADD_32(&engine->assoc.hash_items, -1);
         /* The DTrace probe cannot be triggered as the last instruction
          * due to possible tail-optimization by the compiler
          */
         MEMCACHED_ASSOC_DELETE(key, nkey, engine->assoc.hash_items);
-        nxt = (*before)->h_next;
-        (*before)->h_next = 0;   /* probably pointless, but whatever. */
-        *before = nxt;
+        nxt = item_get_h_next(engine, it);
+        item_set_h_next(engine, it, NULL);   /* probably pointless, but whatever. */
+        if (prev) {
+            item_set_h_next(engine, prev, nxt);
+        } else {
+            *bucket = nxt;
+        }
         return;
     }
     /* Note:  we never actually get here.  the callers don't delete things
        they can't find. */
-    assert(*before != 0);
+    assert(it != 0);
 }
 
 
 
-#define DEFAULT_HASH_BULK_MOVE 1
-int hash_bulk_move = DEFAULT_HASH_BULK_MOVE;
+/* Move all of the items in a group in the old table to the new table */
+static void group_expand_bucket(struct default_engine *engine,
+                                unsigned int bucket) {
+    assoc_group *group = &engine->assoc.old_groups[bucket];
+    hash_item *it, *next;
+    int ii;
+
+    for (ii = 0; ii < ASSOC_GROUP_SLOTS; ++ii) {
+        if (group->tags[ii] != 0) {
+            uint32_t hash;
+            it = group->items[ii];
+            hash = engine->server.core->hash(item_get_key(it), it->nkey, 0);
+            group_insert(engine,
+                         &engine->assoc.primary_groups[hash & hashmask(engine->assoc.hashpower)],
+                         hash, it);
+        }
+    }
+
+    for (it = group->overflow; NULL != it; it = next) {
+        uint32_t hash;
+        next = item_get_h_next(engine, it);
+        item_set_h_next(engine, it, NULL);
+        hash = engine->server.core->hash(item_get_key(it), it->nkey, 0);
+        group_insert(engine,
+                     &engine->assoc.primary_groups[hash & hashmask(engine->assoc.hashpower)],
+                     hash, it);
+    }
+
+    memset(group, 0, sizeof(*group));
+}
+
+/* Move all of the items in a bucket in the old table to the new table */
+static void assoc_expand_bucket(struct default_engine *engine,
+                                unsigned int bucket) {
+    hash_item *it, *next;
+
+    if (engine->assoc.grouped) {
+        group_expand_bucket(engine, bucket);
+        return;
+    }
+
+    for (it = engine->assoc.old_hashtable[bucket]; NULL != it; it = next) {
+        unsigned int nbucket;
+        next = item_get_h_next(engine, it);
+
+        nbucket = engine->server.core->hash(item_get_key(it), it->nkey, 0)
+            & hashmask(engine->assoc.hashpower);
+        item_set_h_next(engine, it, engine->assoc.primary_hashtable[nbucket]);
+        engine->assoc.primary_hashtable[nbucket] = it;
+    }
+
+    engine->assoc.old_hashtable[bucket] = NULL;
+}
 
 static void assoc_maintenance_thread(void *arg) {
     struct default_engine *engine = arg;
-    bool done = false;
-    do {
-        int ii;
-        cb_mutex_enter(&engine->cache_lock);
-
-        for (ii = 0; ii < hash_bulk_move && engine->assoc.expanding; ++ii) {
-            hash_item *it, *next;
-            int bucket;
-
-            for (it = engine->assoc.old_hashtable[engine->assoc.expand_bucket];
-                 NULL != it; it = next) {
-                next = it->h_next;
-
-                bucket = engine->server.core->hash(item_get_key(it), it->nkey, 0)
-                    & hashmask(engine->assoc.hashpower);
-                it->h_next = engine->assoc.primary_hashtable[bucket];
-                engine->assoc.primary_hashtable[bucket] = it;
+    unsigned int hashpower = engine->assoc.hashpower;
+    unsigned int lockpower = engine->items.item_lock_hashpower;
+    unsigned int stripe;
+    unsigned int batch = 1;
+    hash_item **table = NULL;
+    assoc_group *groups = NULL;
+
+    if (engine->assoc.grouped) {
+        groups = assoc_group_alloc(hashsize(hashpower + 1));
+    } else {
+        table = calloc(hashsize(hashpower + 1), sizeof(void *));
+    }
+
+    if (table == NULL && groups == NULL) {
+        /* Bad news, but we can keep running. */
+        engine->assoc.maintenance = 0;
+        return;
+    }
+
+    /* Swap the tables while all of the item locks are held */
+    item_lock_all(engine);
+    engine->assoc.old_hashtable = engine->assoc.primary_hashtable;
+    engine->assoc.primary_hashtable = table;
+    engine->assoc.old_groups = engine->assoc.primary_groups;
+    engine->assoc.primary_groups = groups;
+    engine->assoc.hashpower++;
+    engine->assoc.expand_position = 0;
+    engine->assoc.expanding = true;
+    item_unlock_all(engine);
+
+    /*
+     * All of the items in a bucket in the old table use the same item lock
+     * (the number of item locks never exceeds the number of buckets), so
+     * we only need to hold that lock while moving the chain. The buckets
+     * using the same lock are moved in batches, and readers keep using the
+     * old table for the buckets not moved yet.
+     */
+    for (stripe = 0; stripe < hashsize(lockpower); ++stripe) {
+        unsigned int idx = 0;
+        while (idx < hashsize(hashpower - lockpower)) {
+            hrtime_t start = gethrtime();
+            hrtime_t waited;
+            unsigned int ii;
+
+            item_lock(engine, stripe);
+            waited = gethrtime() - start;
+            for (ii = 0; ii < batch && idx < hashsize(hashpower - lockpower); ++ii, ++idx) {
+                assoc_expand_bucket(engine, (idx << lockpower) | stripe);
             }
+            engine->assoc.expand_position = (stripe << (hashpower - lockpower)) + idx;
+            item_unlock(engine, stripe);
 
-            engine->assoc.old_hashtable[engine->assoc.expand_bucket] = NULL;
-            engine->assoc.expand_bucket++;
-            if (engine->assoc.expand_bucket == hashsize(engine->assoc.hashpower - 1)) {
-                engine->assoc.expanding = false;
-                free(engine->assoc.old_hashtable);
-                if (engine->config.verbose > 1) {
-                    EXTENSION_LOGGER_DESCRIPTOR *logger;
-                    logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
-                    logger->log(EXTENSION_LOG_INFO, NULL,
-                                "Hash table expansion done\n");
-                }
+            if (waited > ASSOC_EXPAND_CONTENDED) {
+                batch = batch > 1 ? batch / 2 : 1;
+            } else if (batch < ASSOC_EXPAND_MAX_BATCH) {
+                batch *= 2;
             }
         }
-        if (!engine->assoc.expanding) {
-            done = true;
-        }
-        cb_mutex_exit(&engine->cache_lock);
-    } while (!done);
+    }
+
+    item_lock_all(engine);
+    engine->assoc.expanding = false;
+    free(engine->assoc.old_hashtable);
+    engine->assoc.old_hashtable = NULL;
+    assoc_group_free(engine->assoc.old_groups);
+    engine->assoc.old_groups = NULL;
+    item_unlock_all(engine);
+
+    if (engine->config.verbose > 1) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_INFO, NULL,
+                    "Hash table expansion done\n");
+    }
+
+    engine->assoc.maintenance = 0;
+}
+
+void assoc_stats(struct default_engine *engine, ADD_STAT add_stats,
+                 const void *cookie) {
+    char val[128];
+    int len;
+    unsigned int hashpower;
+    bool expanding;
+    size_t bucket_size;
+
+    /* The table can't be swapped while we hold one of the item locks */
+    item_lock(engine, 0);
+    hashpower = engine->assoc.hashpower;
+    expanding = engine->assoc.expanding;
+    item_unlock(engine, 0);
+
+    if (engine->assoc.grouped) {
+        bucket_size = sizeof(assoc_group);
+    } else {
+        bucket_size = sizeof(void*);
+    }
+
+    len = sprintf(val, "%u", hashpower);
+    add_stats("hash_power_level", 16, val, len, cookie);
+    len = sprintf(val, "%"PRIu64, (uint64_t)hashsize(hashpower) * bucket_size);
+    add_stats("hash_bytes", 10, val, len, cookie);
+    if (expanding) {
+        add_stats("hash_is_expanding", 17, "1", 1, cookie);
+    } else {
+        add_stats("hash_is_expanding", 17, "0", 1, cookie);
+    }
+    if (engine->assoc.grouped) {
+        add_stats("hash_table", 10, "grouped", 7, cookie);
+    } else {
+        add_stats("hash_table", 10, "chained", 7, cookie);
+    }
 }
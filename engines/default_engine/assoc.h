@@ -1,10 +1,36 @@
 #ifndef ASSOC_H
 #define ASSOC_H
 
+/*
+ * Number of items stored directly in a group of the grouped hash table,
+ * sized so that a group fills a 64 byte cache line on 64 bit platforms.
+ */
+#define ASSOC_GROUP_SLOTS 6
+
+/*
+ * A bucket in the grouped hash table. Lookups compare a one byte tag from
+ * the hash value of all the items in the group at once, and only look at
+ * the items with a matching tag. Items which don't fit in the group are
+ * chained through h_next from the overflow pointer.
+ */
+typedef struct {
+   /* The tag for each slot (0 means the slot is empty) */
+   uint8_t tags[8];
+   hash_item *overflow;
+   hash_item *items[ASSOC_GROUP_SLOTS];
+} assoc_group;
+
 struct assoc {
    /* how many powers of 2's worth of buckets we use */
    unsigned int hashpower;
 
+   /* Flag: Use the grouped hash table (the *_groups tables) */
+   bool grouped;
+
+   /* The grouped version of primary_hashtable and old_hashtable */
+   assoc_group *primary_groups;
+   assoc_group *old_groups;
+
 
    /* Main hash table. This is where we look except during expansion. */
    hash_item** primary_hashtable;
@@ -16,19 +42,29 @@ struct assoc {
    hash_item** old_hashtable;
 
    /* Number of items in the hash table. */
-   unsigned int hash_items;
+   uint32_t hash_items;
 
-   /* Flag: Are we in the middle of expanding now? */
+   /*
+    * Flag: Are we in the middle of expanding now? The flag (and the table
+    * pointers above) may only be changed while holding all of the item
+    * locks.
+    */
    bool expanding;
 
+   /* Flag: Is the maintenance thread running (set with CAS) */
+   uint32_t maintenance;
+
    /*
-    * During expansion we migrate values with bucket granularity; this is how
-    * far we've gotten so far. Ranges from 0 .. hashsize(hashpower - 1) - 1.
+    * During expansion we migrate values with bucket granularity, one item
+    * lock stripe after the other; this is how far we've gotten so far (see
+    * expand_position() in assoc.c). Ranges from 0 .. hashsize(hashpower - 1).
+    * A bucket is only moved while holding its item lock.
     */
-   unsigned int expand_bucket;
+   unsigned int expand_position;
 };
 
 /* associative array */
+void assoc_presize(struct default_engine *engine, size_t nitems);
 ENGINE_ERROR_CODE assoc_init(struct default_engine *engine);
 void assoc_destroy(struct default_engine *engine);
 hash_item *assoc_find(struct default_engine *engine, uint32_t hash,
@@ -37,6 +73,8 @@ int assoc_insert(struct default_engine *engine, uint32_t hash,
                  hash_item *item);
 void assoc_delete(struct default_engine *engine, uint32_t hash,
                   const char *key, const size_t nkey);
+void assoc_stats(struct default_engine *engine, ADD_STAT add_stats,
+                 const void *cookie);
 int start_assoc_maintenance_thread(struct default_engine *engine);
 void stop_assoc_maintenance_thread(struct default_engine *engine);
 
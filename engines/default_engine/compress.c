@@ -0,0 +1,204 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Value compression
+ *
+ * A greedy LZ77 compressor producing the LZ4 block format. Each sequence
+ * is a token (the length of the literal run in the upper 4 bits and the
+ * match length - 4 in the lower 4 bits, 15 meaning that more length bytes
+ * follows), the literals, and a match given by a 2 byte offset (little
+ * endian) back into the data already decoded. The last sequence holds
+ * literals only, and the last 5 bytes of the data are always literals.
+ */
+#include "config.h"
+#include <stdint.h>
+#include <string.h>
+
+#include "compress.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+/* The number of bytes at the end which is always stored as literals */
+#define LZ_LAST_LITERALS 5
+/* Don't start a match within the last 12 bytes */
+#define LZ_MATCH_LIMIT 12
+
+static uint32_t lz_read32(const uint8_t *ptr) {
+    uint32_t ret;
+    memcpy(&ret, ptr, sizeof(ret));
+    return ret;
+}
+
+static uint32_t lz_hash(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Write the extra bytes of a length (after the 15 in the token) */
+static uint8_t *lz_write_length(uint8_t *op, size_t length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+/*
+ * Write a sequence of nlit literals followed by a match of mlen bytes at
+ * offset back (mlen 0 for the last sequence). Returns NULL if it doesn't
+ * fit before end.
+ */
+static uint8_t *lz_write_sequence(uint8_t *op, const uint8_t *end,
+                                  const uint8_t *literals, size_t nlit,
+                                  size_t offset, size_t mlen) {
+    uint8_t *token = op++;
+    size_t space = 1 + nlit + nlit / 255 + 1 + (mlen > 0 ? 3 + mlen / 255 : 0);
+
+    if (space > (size_t)(end - token)) {
+        return NULL;
+    }
+
+    if (nlit >= 15) {
+        *token = 15 << 4;
+        op = lz_write_length(op, nlit - 15);
+    } else {
+        *token = (uint8_t)(nlit << 4);
+    }
+    memcpy(op, literals, nlit);
+    op += nlit;
+
+    if (mlen > 0) {
+        *op++ = (uint8_t)(offset & 0xff);
+        *op++ = (uint8_t)(offset >> 8);
+        mlen -= LZ_MIN_MATCH;
+        if (mlen >= 15) {
+            *token |= 15;
+            op = lz_write_length(op, mlen - 15);
+        } else {
+            *token |= (uint8_t)mlen;
+        }
+    }
+
+    return op;
+}
+
+size_t lz_compress(const void *src, size_t nsrc, void *dst, size_t ndst) {
+    const uint8_t *in = src;
+    uint8_t *op = dst;
+    const uint8_t *end = op + ndst;
+    uint32_t table[1 << LZ_HASH_BITS];
+    size_t anchor = 0;
+    size_t ip = 0;
+
+    memset(table, 0, sizeof(table));
+
+    if (nsrc > LZ_MATCH_LIMIT) {
+        size_t limit = nsrc - LZ_MATCH_LIMIT;
+        while (ip < limit) {
+            uint32_t sequence = lz_read32(in + ip);
+            uint32_t h = lz_hash(sequence);
+            size_t ref = table[h];
+            table[h] = (uint32_t)ip + 1;
+
+            if (ref != 0 && ip - (ref - 1) <= LZ_MAX_OFFSET &&
+                lz_read32(in + ref - 1) == sequence) {
+                size_t mlen = LZ_MIN_MATCH;
+                --ref;
+                while (ip + mlen < nsrc - LZ_LAST_LITERALS &&
+                       in[ref + mlen] == in[ip + mlen]) {
+                    ++mlen;
+                }
+
+                op = lz_write_sequence(op, end, in + anchor, ip - anchor,
+                                       ip - ref, mlen);
+                if (op == NULL) {
+                    return 0;
+                }
+                ip += mlen;
+                anchor = ip;
+            } else {
+                ++ip;
+            }
+        }
+    }
+
+    op = lz_write_sequence(op, end, in + anchor, nsrc - anchor, 0, 0);
+    if (op == NULL) {
+        return 0;
+    }
+
+    return (size_t)(op - (uint8_t*)dst);
+}
+
+/* Read the extra bytes of a length. Returns false on bad input */
+static bool lz_read_length(const uint8_t *in, size_t nsrc, size_t *ip,
+                           size_t *length) {
+    uint8_t b;
+    do {
+        if (*ip >= nsrc) {
+            return false;
+        }
+        b = in[(*ip)++];
+        *length += b;
+    } while (b == 255);
+    return true;
+}
+
+bool lz_decompress(const void *src, size_t nsrc, void *dst, size_t ndst) {
+    const uint8_t *in = src;
+    uint8_t *out = dst;
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (ip < nsrc) {
+        uint8_t token = in[ip++];
+        size_t nlit = token >> 4;
+        size_t mlen = token & 15;
+        size_t offset;
+
+        if (nlit == 15 && !lz_read_length(in, nsrc, &ip, &nlit)) {
+            return false;
+        }
+        if (nlit > nsrc - ip || nlit > ndst - op) {
+            return false;
+        }
+        memcpy(out + op, in + ip, nlit);
+        ip += nlit;
+        op += nlit;
+
+        if (ip == nsrc) {
+            /* The last sequence */
+            break;
+        }
+
+        if (nsrc - ip < 2) {
+            return false;
+        }
+        offset = in[ip] | ((size_t)in[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) {
+            return false;
+        }
+
+        if (mlen == 15 && !lz_read_length(in, nsrc, &ip, &mlen)) {
+            return false;
+        }
+        mlen += LZ_MIN_MATCH;
+        if (mlen > ndst - op) {
+            return false;
+        }
+
+        if (offset >= mlen) {
+            memcpy(out + op, out + op - offset, mlen);
+            op += mlen;
+        } else {
+            /* The match overlaps the data we're writing */
+            while (mlen-- > 0) {
+                out[op] = out[op - offset];
+                ++op;
+            }
+        }
+    }
+
+    return op == ndst;
+}
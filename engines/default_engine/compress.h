@@ -0,0 +1,30 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* value compression */
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Compress a block of data with a fast LZ77 compressor (using the LZ4
+ * block format: literal runs and matches within the last 64k)
+ * @param src the data to compress
+ * @param nsrc the number of bytes to compress
+ * @param dst where to store the compressed data
+ * @param ndst the size of dst
+ * @return the size of the compressed data, or 0 if it doesn't fit in dst
+ */
+size_t lz_compress(const void *src, size_t nsrc, void *dst, size_t ndst);
+
+/**
+ * Decompress a block of data compressed with lz_compress
+ * @param src the compressed data
+ * @param nsrc the size of the compressed data
+ * @param dst where to store the data
+ * @param ndst the size of the data
+ * @return true if the data was decompressed to exactly ndst bytes
+ */
+bool lz_decompress(const void *src, size_t nsrc, void *dst, size_t ndst);
+
+#endif
@@ -262,10 +262,11 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
    }
 
    cb_mutex_initialize(&engine->slabs.lock);
-   cb_mutex_initialize(&engine->cache_lock);
    cb_mutex_initialize(&engine->stats.lock);
    cb_mutex_initialize(&engine->scrubber.lock);
    cb_mutex_initialize(&engine->tap_connections.lock);
+   cb_mutex_initialize(&engine->slabs.rebalance.lock);
+   cb_cond_initialize(&engine->slabs.rebalance.cond);
 
    engine->engine.interface.interface = 1;
    engine->engine.get_info = default_get_info;
@@ -305,12 +306,28 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
    engine->config.use_cas = true;
    engine->config.verbose = 0;
    engine->config.oldest_live = 0;
+   engine->config.oldest_cas = 0;
    engine->config.evict_to_free = true;
    engine->config.maxbytes = 64 * 1024 * 1024;
    engine->config.preallocate = false;
    engine->config.factor = 1.25;
    engine->config.chunk_size = 48;
    engine->config.item_size_max= 1024 * 1024;
+   engine->config.large_item_max = 0;
+   engine->config.compression_threshold = 0;
+   engine->config.item_locks = 1024;
+   engine->config.lru_maintainer = true;
+   engine->config.hot_lru_pct = 20;
+   engine->config.warm_lru_pct = 40;
+   engine->config.slab_reassign = false;
+   engine->config.slab_automove = false;
+   engine->config.hash_groups = false;
+   engine->config.hash_items = 0;
+   engine->config.compact_items = false;
+   engine->config.numa = false;
+   engine->config.numa_nodes = 0;
+   engine->config.large_pages = false;
+   engine->config.lock_memory = false;
    engine->tap_connections.size = 10;
    engine->tap_connections.clients = calloc(engine->tap_connections.size,
                                             sizeof(void*));
@@ -350,6 +367,19 @@ static ENGINE_ERROR_CODE default_initialize(ENGINE_HANDLE* handle,
        se->info.engine_info.features[se->info.engine_info.num_features++].feature = ENGINE_FEATURE_CAS;
    }
 
+   se->stats.vbuckets = calloc(NUM_VBUCKETS, sizeof(struct vbucket_stats));
+   if (se->stats.vbuckets == NULL) {
+      return ENGINE_ENOMEM;
+   }
+
+   /* The number of item locks depends on the size of the hash table */
+   assoc_presize(se, se->config.hash_items);
+
+   ret = item_init(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
    ret = assoc_init(se);
    if (ret != ENGINE_SUCCESS) {
       return ret;
@@ -361,6 +391,20 @@ static ENGINE_ERROR_CODE default_initialize(ENGINE_HANDLE* handle,
       return ret;
    }
 
+   if (se->config.lru_maintainer) {
+      ret = item_start_lru_maintainer(se);
+      if (ret != ENGINE_SUCCESS) {
+         return ret;
+      }
+   }
+
+   if (se->config.slab_reassign) {
+      ret = slabs_start_rebalancer(se);
+      if (ret != ENGINE_SUCCESS) {
+         return ret;
+      }
+   }
+
    se->server.callback->register_callback(handle, ON_DISCONNECT,
                                           default_handle_disconnect, handle);
 
@@ -372,20 +416,32 @@ static void default_destroy(ENGINE_HANDLE* handle, const bool force) {
     (void)force;
 
     if (se->initialized) {
+        /* Stop the background threads using the cache */
+        item_stop_lru_maintainer(se);
+        slabs_stop_rebalancer(se);
+        item_stop_scrub(se);
+
         /* Destroy the association table */
         assoc_destroy(se);
 
+        /* Release the item locks */
+        item_destroy(se);
+
         /* Destory the slabs cache */
         slabs_destroy(se);
 
         free(se->config.uuid);
+        free(se->config.memory_file);
+        free(se->config.eviction_policy);
+        free(se->stats.vbuckets);
 
         /* Clean up the mutexes */
-        cb_mutex_destroy(&se->cache_lock);
         cb_mutex_destroy(&se->stats.lock);
         cb_mutex_destroy(&se->slabs.lock);
         cb_mutex_destroy(&se->scrubber.lock);
         cb_mutex_destroy(&se->tap_connections.lock);
+        cb_mutex_destroy(&se->slabs.rebalance.lock);
+        cb_cond_destroy(&se->slabs.rebalance.cond);
         se->initialized = false;
         free((void*)se->tap_connections.clients);
         free(se);
@@ -401,14 +457,8 @@ static ENGINE_ERROR_CODE default_item_allocate(ENGINE_HANDLE* handle,
                                                const int flags,
                                                const rel_time_t exptime) {
    hash_item *it;
-   unsigned int id;
    struct default_engine* engine = get_handle(handle);
-   size_t ntotal = sizeof(hash_item) + nkey + nbytes;
-   if (engine->config.use_cas) {
-      ntotal += sizeof(uint64_t);
-   }
-   id = slabs_clsid(engine, ntotal);
-   if (id == 0) {
+   if (!item_size_ok(engine, nkey, nbytes)) {
       return ENGINE_E2BIG;
    }
 
@@ -466,11 +516,23 @@ static ENGINE_ERROR_CODE default_get(ENGINE_HANDLE* handle,
    VBUCKET_GUARD(engine, vbucket);
 
    *item = item_get(engine, key, nkey);
-   if (*item != NULL) {
-      return ENGINE_SUCCESS;
-   } else {
+   if (*item == NULL) {
+      ATOMIC_INCR_64(&engine->stats.get_misses);
       return ENGINE_KEY_ENOENT;
    }
+   ATOMIC_INCR_64(&engine->stats.get_hits);
+
+   if ((((hash_item*)*item)->iflag & ITEM_COMPRESSED) != 0) {
+      /* The clients can't handle compressed values */
+      hash_item *it = *item;
+      *item = item_decompress(engine, it);
+      item_release(engine, it);
+      if (*item == NULL) {
+         return ENGINE_ENOMEM;
+      }
+   }
+
+   return ENGINE_SUCCESS;
 }
 
 static void stats_vbucket(struct default_engine *e,
@@ -488,6 +550,78 @@ static void stats_vbucket(struct default_engine *e,
     }
 }
 
+/* The vbuckets copied from the stats at a time (keeps the lock hold short) */
+#define VBUCKET_DETAILS_BATCH 1024
+
+/*
+ * Report the items and bytes stored in each vbucket, and its high seqno.
+ * Only vbuckets in use (or still holding items) are reported, unless a
+ * single vbucket is requested ("vbucket-details <vbid>").
+ */
+static ENGINE_ERROR_CODE stats_vbucket_details(struct default_engine *e,
+                                               const char *stat_key,
+                                               int nkey,
+                                               ADD_STAT add_stat,
+                                               const void *cookie) {
+    struct vbucket_stats batch[VBUCKET_DETAILS_BATCH];
+    int first = 0;
+    int last = NUM_VBUCKETS;
+    int i;
+
+    if (nkey > 15) {
+        char buffer[16];
+        char *end;
+        long vbid;
+        if (stat_key[15] != ' ' || nkey - 16 >= (int)sizeof(buffer)) {
+            return ENGINE_EINVAL;
+        }
+        memcpy(buffer, stat_key + 16, nkey - 16);
+        buffer[nkey - 16] = '\0';
+        vbid = strtol(buffer, &end, 10);
+        if (end == buffer || *end != '\0' || vbid < 0 || vbid >= NUM_VBUCKETS) {
+            return ENGINE_EINVAL;
+        }
+        first = (int)vbid;
+        last = first + 1;
+    }
+
+    for (; first < last; first += VBUCKET_DETAILS_BATCH) {
+        int count = last - first;
+        if (count > VBUCKET_DETAILS_BATCH) {
+            count = VBUCKET_DETAILS_BATCH;
+        }
+
+        memcpy(batch, e->stats.vbuckets + first, count * sizeof(batch[0]));
+
+        for (i = 0; i < count; i++) {
+            vbucket_state_t state = get_vbucket_state(e, first + i);
+            const char *state_name = vbucket_state_name(state);
+            char key[64];
+            char val[32];
+            int klen, vlen;
+
+            if (last - first > 1 && batch[i].curr_items == 0 &&
+                (state == vbucket_state_dead || !is_valid_vbucket_state_t(state))) {
+                continue;
+            }
+
+            klen = snprintf(key, sizeof(key), "vb_%d:state", first + i);
+            add_stat(key, klen, state_name, strlen(state_name), cookie);
+            klen = snprintf(key, sizeof(key), "vb_%d:curr_items", first + i);
+            vlen = snprintf(val, sizeof(val), "%"PRIu64, batch[i].curr_items);
+            add_stat(key, klen, val, vlen, cookie);
+            klen = snprintf(key, sizeof(key), "vb_%d:bytes", first + i);
+            vlen = snprintf(val, sizeof(val), "%"PRIu64, batch[i].bytes);
+            add_stat(key, klen, val, vlen, cookie);
+            klen = snprintf(key, sizeof(key), "vb_%d:high_seqno", first + i);
+            vlen = snprintf(val, sizeof(val), "%"PRIu64, batch[i].high_seqno);
+            add_stat(key, klen, val, vlen, cookie);
+        }
+    }
+
+    return ENGINE_SUCCESS;
+}
+
 static ENGINE_ERROR_CODE default_get_stats(ENGINE_HANDLE* handle,
                                            const void* cookie,
                                            const char* stat_key,
@@ -500,27 +634,66 @@ static ENGINE_ERROR_CODE default_get_stats(ENGINE_HANDLE* handle,
    if (stat_key == NULL) {
       char val[128];
       int len;
+      itemcounts_t counts;
+
+      item_counts(engine, NULL, &counts);
 
       cb_mutex_enter(&engine->stats.lock);
       len = sprintf(val, "%"PRIu64, (uint64_t)engine->stats.evictions);
       add_stat("evictions", 9, val, len, cookie);
-      len = sprintf(val, "%"PRIu64, (uint64_t)engine->stats.curr_items);
+      len = sprintf(val, "%"PRIu64, counts.curr_items);
       add_stat("curr_items", 10, val, len, cookie);
-      len = sprintf(val, "%"PRIu64, (uint64_t)engine->stats.total_items);
+      len = sprintf(val, "%"PRIu64, counts.total_items);
       add_stat("total_items", 11, val, len, cookie);
-      len = sprintf(val, "%"PRIu64, (uint64_t)engine->stats.curr_bytes);
+      len = sprintf(val, "%"PRIu64, counts.curr_bytes);
       add_stat("bytes", 5, val, len, cookie);
       len = sprintf(val, "%"PRIu64, engine->stats.reclaimed);
       add_stat("reclaimed", 9, val, len, cookie);
       len = sprintf(val, "%"PRIu64, (uint64_t)engine->config.maxbytes);
       add_stat("engine_maxbytes", 15, val, len, cookie);
+      len = sprintf(val, "%.4f", engine->stats.get_hits == 0 ? 0.0 :
+                    (double)engine->stats.get_hits /
+                    (double)(engine->stats.get_hits + engine->stats.get_misses));
+      add_stat("hit_rate", 8, val, len, cookie);
+      len = sprintf(val, "%"PRIu64, engine->stats.admission_rejects);
+      add_stat("admission_rejects", 17, val, len, cookie);
+      if (engine->config.compression_threshold != 0) {
+         len = sprintf(val, "%"PRIu64, engine->stats.compressed_items);
+         add_stat("compressed_items", 16, val, len, cookie);
+         len = sprintf(val, "%.2f", engine->stats.compress_bytes_out == 0 ? 0.0 :
+                       (double)engine->stats.compress_bytes_in /
+                       (double)engine->stats.compress_bytes_out);
+         add_stat("compression_ratio", 17, val, len, cookie);
+         len = sprintf(val, "%"PRIu64, engine->stats.compress_time / 1000);
+         add_stat("compression_time_us", 19, val, len, cookie);
+         len = sprintf(val, "%"PRIu64, engine->stats.decompress_time / 1000);
+         add_stat("decompression_time_us", 21, val, len, cookie);
+      }
       cb_mutex_exit(&engine->stats.lock);
+
+      cb_mutex_enter(&engine->items.maintainer.lock);
+      len = sprintf(val, "%"PRIu64, engine->items.maintainer.juggles);
+      add_stat("lru_maintainer_juggles", 22, val, len, cookie);
+      cb_mutex_exit(&engine->items.maintainer.lock);
+
+      cb_mutex_enter(&engine->items.expiry.lock);
+      len = sprintf(val, "%"PRIu64, engine->items.expiry.entries);
+      add_stat("expiry_wheel_entries", 20, val, len, cookie);
+      len = sprintf(val, "%"PRIu64, engine->items.expiry.dropped);
+      add_stat("expiry_wheel_dropped", 20, val, len, cookie);
+      len = sprintf(val, "%"PRIu64, engine->items.expiry.reclaimed);
+      add_stat("expiry_wheel_reclaimed", 22, val, len, cookie);
+      cb_mutex_exit(&engine->items.expiry.lock);
+
+      assoc_stats(engine, add_stat, cookie);
    } else if (strncmp(stat_key, "slabs", 5) == 0) {
       slabs_stats(engine, add_stat, cookie);
    } else if (strncmp(stat_key, "items", 5) == 0) {
       item_stats(engine, add_stat, cookie);
    } else if (strncmp(stat_key, "sizes", 5) == 0) {
       item_stats_sizes(engine, add_stat, cookie);
+   } else if (nkey >= 15 && strncmp(stat_key, "vbucket-details", 15) == 0) {
+      ret = stats_vbucket_details(engine, stat_key, nkey, add_stat, cookie);
    } else if (strncmp(stat_key, "vbucket", 7) == 0) {
       stats_vbucket(engine, add_stat, cookie);
    } else if (strncmp(stat_key, "uuid", 4) == 0) {
@@ -569,6 +742,7 @@ static ENGINE_ERROR_CODE default_store(ENGINE_HANDLE* handle,
                                        uint16_t vbucket) {
     struct default_engine *engine = get_handle(handle);
     VBUCKET_GUARD(engine, vbucket);
+    get_real_item(item)->vbucket = vbucket;
     return store_item(engine, get_real_item(item), cas, operation,
                       cookie);
 }
@@ -590,7 +764,7 @@ static ENGINE_ERROR_CODE default_arithmetic(ENGINE_HANDLE* handle,
 
    return arithmetic(engine, cookie, key, nkey, increment,
                      create, delta, initial, engine->server.core->realtime(exptime), cas,
-                     result);
+                     result, vbucket);
 }
 
 static ENGINE_ERROR_CODE default_flush(ENGINE_HANDLE* handle,
@@ -607,7 +781,14 @@ static void default_reset_stats(ENGINE_HANDLE* handle, const void *cookie) {
    cb_mutex_enter(&engine->stats.lock);
    engine->stats.evictions = 0;
    engine->stats.reclaimed = 0;
-   engine->stats.total_items = 0;
+   engine->stats.compressed_items = 0;
+   engine->stats.compress_bytes_in = 0;
+   engine->stats.compress_bytes_out = 0;
+   engine->stats.compress_time = 0;
+   engine->stats.decompress_time = 0;
+   engine->stats.get_hits = 0;
+   engine->stats.get_misses = 0;
+   engine->stats.admission_rejects = 0;
    cb_mutex_exit(&engine->stats.lock);
 }
 
@@ -618,7 +799,7 @@ static ENGINE_ERROR_CODE initalize_configuration(struct default_engine *se,
    se->config.vb0 = true;
 
    if (cfg_str != NULL) {
-       struct config_item items[13];
+       struct config_item items[30];
        int ii = 0;
 
        memset(&items, 0, sizeof(items));
@@ -662,6 +843,91 @@ static ENGINE_ERROR_CODE initalize_configuration(struct default_engine *se,
        items[ii].value.dt_size = &se->config.item_size_max;
        ++ii;
 
+       items[ii].key = "large_item_max";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.large_item_max;
+       ++ii;
+
+       items[ii].key = "compression_threshold";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.compression_threshold;
+       ++ii;
+
+       items[ii].key = "item_locks";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.item_locks;
+       ++ii;
+
+       items[ii].key = "lru_maintainer";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.lru_maintainer;
+       ++ii;
+
+       items[ii].key = "hot_lru_pct";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.hot_lru_pct;
+       ++ii;
+
+       items[ii].key = "warm_lru_pct";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.warm_lru_pct;
+       ++ii;
+
+       items[ii].key = "slab_reassign";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.slab_reassign;
+       ++ii;
+
+       items[ii].key = "slab_automove";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.slab_automove;
+       ++ii;
+
+       items[ii].key = "hash_groups";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.hash_groups;
+       ++ii;
+
+       items[ii].key = "hash_items";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.hash_items;
+       ++ii;
+
+       items[ii].key = "memory_file";
+       items[ii].datatype = DT_STRING;
+       items[ii].value.dt_string = &se->config.memory_file;
+       ++ii;
+
+       items[ii].key = "eviction_policy";
+       items[ii].datatype = DT_STRING;
+       items[ii].value.dt_string = &se->config.eviction_policy;
+       ++ii;
+
+       items[ii].key = "compact_items";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.compact_items;
+       ++ii;
+
+       items[ii].key = "numa";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.numa;
+       ++ii;
+
+       items[ii].key = "numa_nodes";
+       items[ii].datatype = DT_SIZE;
+       items[ii].value.dt_size = &se->config.numa_nodes;
+       ++ii;
+
+       items[ii].key = "large_pages";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.large_pages;
+       ++ii;
+
+       items[ii].key = "lock_memory";
+       items[ii].datatype = DT_BOOL;
+       items[ii].value.dt_bool = &se->config.lock_memory;
+       ++ii;
+
        items[ii].key = "ignore_vbucket";
        items[ii].datatype = DT_BOOL;
        items[ii].value.dt_bool = &se->config.ignore_vbucket;
@@ -683,10 +949,14 @@ static ENGINE_ERROR_CODE initalize_configuration(struct default_engine *se,
 
        items[ii].key = NULL;
        ++ii;
-       assert(ii == 13);
+       assert(ii == 30);
        ret = se->server.core->parse_config(cfg_str, items, stderr);
    }
 
+   if (se->config.hot_lru_pct + se->config.warm_lru_pct > 100) {
+       return ENGINE_EINVAL;
+   }
+
    if (se->config.vb0) {
        set_vbucket_state(se, 0, vbucket_state_active);
    }
@@ -759,6 +1029,47 @@ static bool scrub_cmd(struct default_engine *e,
                     res, 0, cookie);
 }
 
+static bool slabs_reassign_cmd(struct default_engine *e,
+                               const void *cookie,
+                               protocol_binary_request_slabs_reassign *req,
+                               ADD_RESPONSE response) {
+    protocol_binary_response_status res = PROTOCOL_BINARY_RESPONSE_EINVAL;
+    const char *msg = NULL;
+    uint32_t src, dst;
+
+    if (req->message.header.request.extlen != sizeof(req->message.body) ||
+        req->message.header.request.keylen != 0) {
+        msg = "Incorrect packet format";
+    } else {
+        memcpy(&src, &req->message.body.src, sizeof(src));
+        memcpy(&dst, &req->message.body.dst, sizeof(dst));
+
+        switch (slabs_reassign(e, ntohl(src), ntohl(dst))) {
+        case REASSIGN_OK:
+            res = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+            break;
+        case REASSIGN_RUNNING:
+            res = PROTOCOL_BINARY_RESPONSE_EBUSY;
+            break;
+        case REASSIGN_DISABLED:
+            msg = "Slab reassignment is disabled";
+            break;
+        case REASSIGN_BADCLASS:
+            msg = "Invalid slab class";
+            break;
+        case REASSIGN_NOSPARE:
+            msg = "No spare pages in the source class";
+            break;
+        case REASSIGN_SRC_DST_SAME:
+            msg = "Source and destination class are the same";
+            break;
+        }
+    }
+
+    return response(NULL, 0, NULL, 0, msg, msg ? strlen(msg) : 0,
+                    PROTOCOL_BINARY_RAW_BYTES, res, 0, cookie);
+}
+
 static bool touch(struct default_engine *e, const void *cookie,
                   protocol_binary_request_header *request,
                   ADD_RESPONSE response) {
@@ -790,9 +1101,37 @@ static bool touch(struct default_engine *e, const void *cookie,
         }
     } else {
         bool ret;
+        if (request->request.opcode != PROTOCOL_BINARY_CMD_TOUCH &&
+            (item->iflag & ITEM_COMPRESSED) != 0) {
+            hash_item *raw = item_decompress(e, item);
+            item_release(e, item);
+            if (raw == NULL) {
+                return response(NULL, 0, NULL, 0, NULL, 0,
+                                PROTOCOL_BINARY_RAW_BYTES,
+                                PROTOCOL_BINARY_RESPONSE_ENOMEM, 0, cookie);
+            }
+            item = raw;
+        }
+
         if (request->request.opcode == PROTOCOL_BINARY_CMD_TOUCH) {
             ret = response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
                            PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, cookie);
+        } else if ((item->iflag & ITEM_CHUNKED) != 0) {
+            /* The response callback needs the value in a single buffer */
+            char *value = malloc(item->nbytes);
+            if (value == NULL) {
+                ret = response(NULL, 0, NULL, 0, NULL, 0,
+                               PROTOCOL_BINARY_RAW_BYTES,
+                               PROTOCOL_BINARY_RESPONSE_ENOMEM, 0, cookie);
+            } else {
+                item_read_data(e, item, value);
+                ret = response(NULL, 0, &item->flags, sizeof(item->flags),
+                               value, item->nbytes,
+                               PROTOCOL_BINARY_RAW_BYTES,
+                               PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                               item_get_cas(item), cookie);
+                free(value);
+            }
         } else {
             ret = response(NULL, 0, &item->flags, sizeof(item->flags),
                            item_get_data(item), item->nbytes,
@@ -831,6 +1170,9 @@ static ENGINE_ERROR_CODE default_unknown_command(ENGINE_HANDLE* handle,
     case PROTOCOL_BINARY_CMD_GATQ:
         sent = touch(e, cookie, request, response);
         break;
+    case PROTOCOL_BINARY_CMD_SLABS_REASSIGN:
+        sent = slabs_reassign_cmd(e, cookie, (void*)request, response);
+        break;
     default:
         sent = response(NULL, 0, NULL, 0, NULL, 0, PROTOCOL_BINARY_RAW_BYTES,
                         PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND, 0, cookie);
@@ -845,10 +1187,22 @@ static ENGINE_ERROR_CODE default_unknown_command(ENGINE_HANDLE* handle,
 }
 
 
+/* The CAS (and the rest of the item) follows the header */
+static char *item_get_body(const hash_item* item)
+{
+    if (item->iflag & ITEM_COMPACT) {
+        return (char*)item + ITEM_COMPACT_HEADER_SIZE;
+    }
+    return (char*)(item + 1);
+}
+
 uint64_t item_get_cas(const hash_item* item)
 {
     if (item->iflag & ITEM_WITH_CAS) {
-        return *(uint64_t*)(item + 1);
+        /* The CAS of a compact item isn't aligned */
+        uint64_t ret;
+        memcpy(&ret, item_get_body(item), sizeof(ret));
+        return ret;
     }
     return 0;
 }
@@ -858,16 +1212,19 @@ void item_set_cas(ENGINE_HANDLE *handle, const void *cookie,
 {
     hash_item* it = get_real_item(item);
     if (it->iflag & ITEM_WITH_CAS) {
-        *(uint64_t*)(it + 1) = val;
+        memcpy(item_get_body(it), &val, sizeof(val));
     }
 }
 
 const void* item_get_key(const hash_item* item)
 {
-    char *ret = (void*)(item + 1);
+    char *ret = item_get_body(item);
     if (item->iflag & ITEM_WITH_CAS) {
         ret += sizeof(uint64_t);
     }
+    if (item->iflag & ITEM_CHUNKED) {
+        ret += sizeof(hash_item*);
+    }
 
     return ret;
 }
@@ -886,7 +1243,9 @@ static bool get_item_info(ENGINE_HANDLE *handle, const void *cookie,
                           const item* item, item_info *item_info)
 {
     hash_item* it = (hash_item*)item;
-    if (item_info->nvalue < 1) {
+    int nvalue = item_get_iov(get_handle(handle), it, item_info->value,
+                              item_info->nvalue);
+    if (nvalue < 0) {
         return false;
     }
     item_info->cas = item_get_cas(it);
@@ -895,10 +1254,8 @@ static bool get_item_info(ENGINE_HANDLE *handle, const void *cookie,
     item_info->flags = it->flags;
     item_info->clsid = it->slabs_clsid;
     item_info->nkey = it->nkey;
-    item_info->nvalue = 1;
+    item_info->nvalue = nvalue;
     item_info->key = item_get_key(it);
-    item_info->value[0].iov_base = item_get_data(it);
-    item_info->value[0].iov_len = it->nbytes;
     return true;
 }
 
@@ -947,7 +1304,7 @@ static ENGINE_ERROR_CODE default_tap_notify(ENGINE_HANDLE* handle,
                 return ret;
             }
         }
-        memcpy(item_get_data(it), data, ndata);
+        item_write_data(engine, it, 0, data, ndata);
         engine->server.cookie->store_engine_specific(cookie, NULL);
         item_set_cas(handle, cookie, it, cas);
         ret = default_store(handle, cookie, it, &cas, OPERATION_SET, vbucket);
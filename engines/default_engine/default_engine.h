@@ -11,6 +11,7 @@
 #include "config.h"
 
 #include <stdbool.h>
+#include <stddef.h>
 
 #include <memcached/engine.h>
 #include <memcached/util.h>
@@ -32,36 +33,195 @@
 /* Forward decl */
 struct default_engine;
 
+/*
+ * Atomic primitives used by the cache layer for the fields that are
+ * updated without holding a single lock (refcounts, counters etc).
+ */
+#ifdef WIN32
+static __inline uint16_t ATOMIC_INCR_16(volatile uint16_t *dest) {
+    return (uint16_t)InterlockedIncrement16((SHORT volatile*)dest);
+}
+
+static __inline uint16_t ATOMIC_DECR_16(volatile uint16_t *dest) {
+    return (uint16_t)InterlockedDecrement16((SHORT volatile*)dest);
+}
+
+static __inline bool ATOMIC_CAS_16(volatile uint16_t *dest,
+                                   uint16_t prev, uint16_t next) {
+    SHORT old = InterlockedCompareExchange16((SHORT volatile*)dest,
+                                             (SHORT)next, (SHORT)prev);
+    return old == (SHORT)prev;
+}
+
+static __inline uint32_t ATOMIC_ADD_32(volatile uint32_t *dest, int32_t value) {
+    LONG old = InterlockedExchangeAdd((LONG volatile*)dest, (LONG)value);
+    return (uint32_t)(old + value);
+}
+
+static __inline bool ATOMIC_CAS_32(volatile uint32_t *dest,
+                                   uint32_t prev, uint32_t next) {
+    LONG old = InterlockedCompareExchange((LONG volatile*)dest,
+                                          (LONG)next, (LONG)prev);
+    return old == (LONG)prev;
+}
+
+static __inline uint64_t ATOMIC_INCR_64(volatile uint64_t *dest) {
+    return (uint64_t)InterlockedIncrement64((LONGLONG volatile*)dest);
+}
+
+static __inline uint64_t ATOMIC_ADD_64(volatile uint64_t *dest, int64_t value) {
+    LONGLONG old = InterlockedExchangeAdd64((LONGLONG volatile*)dest,
+                                            (LONGLONG)value);
+    return (uint64_t)(old + value);
+}
+
+static __inline void ATOMIC_OR_8(volatile uint8_t *dest, uint8_t value) {
+    _InterlockedOr8((char volatile*)dest, (char)value);
+}
+
+static __inline void ATOMIC_AND_8(volatile uint8_t *dest, uint8_t value) {
+    _InterlockedAnd8((char volatile*)dest, (char)value);
+}
+#elif defined(HAVE_ATOMIC_H) && defined(__SUNPRO_C)
+#include <atomic.h>
+static inline uint16_t ATOMIC_INCR_16(volatile uint16_t *dest) {
+    return atomic_inc_16_nv(dest);
+}
+
+static inline uint16_t ATOMIC_DECR_16(volatile uint16_t *dest) {
+    return atomic_dec_16_nv(dest);
+}
+
+static inline bool ATOMIC_CAS_16(volatile uint16_t *dest,
+                                 uint16_t prev, uint16_t next) {
+    return atomic_cas_16(dest, prev, next) == prev;
+}
+
+static inline uint32_t ATOMIC_ADD_32(volatile uint32_t *dest, int32_t value) {
+    return atomic_add_32_nv(dest, value);
+}
+
+static inline bool ATOMIC_CAS_32(volatile uint32_t *dest,
+                                 uint32_t prev, uint32_t next) {
+    return atomic_cas_32(dest, prev, next) == prev;
+}
+
+static inline uint64_t ATOMIC_INCR_64(volatile uint64_t *dest) {
+    return atomic_inc_64_nv(dest);
+}
+
+static inline uint64_t ATOMIC_ADD_64(volatile uint64_t *dest, int64_t value) {
+    return atomic_add_64_nv(dest, value);
+}
+
+static inline bool ATOMIC_CAS_64(volatile uint64_t *dest,
+                                 uint64_t prev, uint64_t next) {
+    return atomic_cas_64(dest, prev, next) == prev;
+}
+
+static inline void ATOMIC_OR_8(volatile uint8_t *dest, uint8_t value) {
+    atomic_or_8(dest, value);
+}
+
+static inline void ATOMIC_AND_8(volatile uint8_t *dest, uint8_t value) {
+    atomic_and_8(dest, value);
+}
+#else
+#define ATOMIC_INCR_16(dest) __sync_add_and_fetch(dest, 1)
+#define ATOMIC_DECR_16(dest) __sync_sub_and_fetch(dest, 1)
+#define ATOMIC_CAS_16(dest, prev, next) \
+            __sync_bool_compare_and_swap(dest, prev, next)
+#define ATOMIC_ADD_32(dest, value) __sync_add_and_fetch(dest, value)
+#define ATOMIC_CAS_32(dest, prev, next) \
+            __sync_bool_compare_and_swap(dest, prev, next)
+#define ATOMIC_INCR_64(dest) __sync_add_and_fetch(dest, 1)
+#define ATOMIC_ADD_64(dest, value) __sync_add_and_fetch(dest, value)
+#define ATOMIC_CAS_64(dest, prev, next) \
+            __sync_bool_compare_and_swap(dest, prev, next)
+#define ATOMIC_OR_8(dest, value) (void)__sync_fetch_and_or(dest, value)
+#define ATOMIC_AND_8(dest, value) (void)__sync_fetch_and_and(dest, value)
+#endif
+
 #include "trace.h"
+#include "sketch.h"
 #include "items.h"
 #include "assoc.h"
 #include "slabs.h"
+#include "compress.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-   /* Flags */
+/*
+ * Flags (hash_item.iflag). The byte is full: the core server never reads
+ * the flags of our items, so there are no bits reserved for it any more.
+ * A new per-item bit which is only set and cleared with atomic operations
+ * may go in the free bits of hash_item.lru.
+ */
 #define ITEM_WITH_CAS 1
 
-#define ITEM_LINKED (1<<8)
+#define ITEM_LINKED 2
 
 /* temp */
-#define ITEM_SLABBED (2<<8)
+#define ITEM_SLABBED 4
+
+/* The item holds a native counter (see do_add_delta in items.c) */
+#define ITEM_COUNTER 8
+
+/*
+ * The value is too big for a single slab chunk. The item is a header
+ * (allocated from the largest slab class) holding the first part of the
+ * value, followed by a chain of data chunks (see items.c)
+ */
+#define ITEM_CHUNKED 16
+
+/* A data chunk holding a part of the value of a chunked item */
+#define ITEM_CHUNK 32
+
+/*
+ * The value is compressed: the length of the raw value (uint32_t)
+ * followed by the compressed data (see item_compress in items.c)
+ */
+#define ITEM_COMPRESSED 64
+
+/*
+ * The item uses the compact header: the links are references into the
+ * slab memory (see hash_item in items.h)
+ */
+#define ITEM_COMPACT 128
 
 struct config {
    bool use_cas;
    size_t verbose;
    rel_time_t oldest_live;
+   uint64_t oldest_cas;
    bool evict_to_free;
    size_t maxbytes;
    bool preallocate;
    float factor;
    size_t chunk_size;
    size_t item_size_max;
+   size_t large_item_max;
+   size_t compression_threshold;
    bool ignore_vbucket;
    bool vb0;
    char *uuid;
+   size_t item_locks;
+   bool lru_maintainer;
+   size_t hot_lru_pct;
+   size_t warm_lru_pct;
+   bool slab_reassign;
+   bool slab_automove;
+   bool hash_groups;
+   size_t hash_items;
+   char *memory_file;
+   char *eviction_policy;
+   bool compact_items;
+   bool numa;
+   size_t numa_nodes;
+   bool large_pages;
+   bool lock_memory;
 };
 
 MEMCACHED_PUBLIC_API
@@ -72,18 +232,51 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
 /**
  * Statistic information collected by the default engine
  */
+/* The items stored in a vbucket (updated with atomic operations) */
+struct vbucket_stats {
+   uint64_t curr_items;
+   uint64_t bytes;
+   /* Bumped by every mutation of an item in the vbucket */
+   uint64_t high_seqno;
+};
+
 struct engine_stats {
    cb_mutex_t lock;
+   /*
+    * The counters updated for single items (the evictions, reclaims,
+    * compression and lookups) are updated with atomic operations, so the
+    * item paths don't take the lock
+    */
    uint64_t evictions;
    uint64_t reclaimed;
-   uint64_t curr_bytes;
-   uint64_t curr_items;
-   uint64_t total_items;
+   /*
+    * The number of items (and bytes) in the cache is kept per slab class
+    * (see itemcounts_t) so linking and unlinking items doesn't need the
+    * stats lock.
+    */
+   /* The items stored compressed, and the size of their values */
+   uint64_t compressed_items;
+   uint64_t compress_bytes_in;
+   uint64_t compress_bytes_out;
+   /* The time spent compressing and decompressing values (in ns) */
+   uint64_t compress_time;
+   uint64_t decompress_time;
+   /* The lookups */
+   uint64_t get_hits;
+   uint64_t get_misses;
+   /* New items evicted by the eviction policy in favour of older ones */
+   uint64_t admission_rejects;
+   /* Indexed by the vbucket id (NUM_VBUCKETS entries) */
+   struct vbucket_stats *vbuckets;
 };
 
 struct engine_scrubber {
    cb_mutex_t lock;
    bool running;
+   /* Walk the LRUs again when the current run completes */
+   bool restart;
+   /* Stop the current run (the engine is being destroyed) */
+   volatile bool stop;
    uint64_t visited;
    uint64_t cleaned;
    time_t started;
@@ -97,7 +290,7 @@ struct tap_connections {
 };
 
 struct vbucket_info {
-    int state : 2;
+    unsigned int state : 3;
 };
 
 #define NUM_VBUCKETS 65536
@@ -121,12 +314,6 @@ struct default_engine {
    struct slabs slabs;
    struct items items;
 
-   /**
-    * The cache layer (item_* and assoc_*) is currently protected by
-    * this single mutex
-    */
-   cb_mutex_t cache_lock;
-
    struct config config;
    struct engine_stats stats;
    struct engine_scrubber scrubber;
@@ -141,6 +328,84 @@ struct default_engine {
    char vbucket_infos[NUM_VBUCKETS];
 };
 
+/* The size of the item headers allocated by the engine (without the CAS) */
+#define ITEM_HEADER_SIZE(engine) ((engine)->config.compact_items ? \
+                                  ITEM_COMPACT_HEADER_SIZE : sizeof(hash_item))
+
+/*
+ * The LRU and hash chain links of a compact item are references (see
+ * items.h). Cursors are identified just like item_is_cursor() in items.c
+ * does, and their slot in the cursor table (+ 1) is stored in the flags.
+ */
+static __inline uint32_t item_ref(const struct default_engine *engine,
+                                  const hash_item *it) {
+    if (it == NULL) {
+        return 0;
+    }
+    if (it->nkey == 0 && it->nbytes == 0) {
+        return ITEM_REF_CURSOR + it->flags - 1;
+    }
+    return (uint32_t)(((const char*)it - (const char*)engine->slabs.mem_base) /
+                      CHUNK_ALIGN_BYTES) + 1;
+}
+
+static __inline hash_item *item_deref(const struct default_engine *engine,
+                                      uint32_t ref) {
+    if (ref == 0) {
+        return NULL;
+    }
+    if (ref >= ITEM_REF_CURSOR) {
+        return engine->items.cursors[ref - ITEM_REF_CURSOR];
+    }
+    return (hash_item*)((char*)engine->slabs.mem_base +
+                        (size_t)(ref - 1) * CHUNK_ALIGN_BYTES);
+}
+
+static __inline hash_item *item_get_next(const struct default_engine *engine,
+                                         const hash_item *it) {
+    return engine->config.compact_items ?
+        item_deref(engine, it->ref.next) : it->next;
+}
+
+static __inline hash_item *item_get_prev(const struct default_engine *engine,
+                                         const hash_item *it) {
+    return engine->config.compact_items ?
+        item_deref(engine, it->ref.prev) : it->prev;
+}
+
+static __inline hash_item *item_get_h_next(const struct default_engine *engine,
+                                           const hash_item *it) {
+    return engine->config.compact_items ?
+        item_deref(engine, it->ref.h_next) : it->h_next;
+}
+
+static __inline void item_set_next(const struct default_engine *engine,
+                                   hash_item *it, hash_item *next) {
+    if (engine->config.compact_items) {
+        it->ref.next = item_ref(engine, next);
+    } else {
+        it->next = next;
+    }
+}
+
+static __inline void item_set_prev(const struct default_engine *engine,
+                                   hash_item *it, hash_item *prev) {
+    if (engine->config.compact_items) {
+        it->ref.prev = item_ref(engine, prev);
+    } else {
+        it->prev = prev;
+    }
+}
+
+static __inline void item_set_h_next(const struct default_engine *engine,
+                                     hash_item *it, hash_item *h_next) {
+    if (engine->config.compact_items) {
+        it->ref.h_next = item_ref(engine, h_next);
+    } else {
+        it->h_next = h_next;
+    }
+}
+
 char* item_get_data(const hash_item* item);
 const void* item_get_key(const hash_item* item);
 void item_set_cas(ENGINE_HANDLE *handle, const void *cookie,
@@ -20,38 +20,191 @@ static hash_item *do_item_alloc(struct default_engine *engine,
                                 const int nbytes,
                                 const void *cookie);
 static hash_item *do_item_get(struct default_engine *engine,
-                              const char *key, const size_t nkey);
-static int do_item_link(struct default_engine *engine, hash_item *it);
-static void do_item_unlink(struct default_engine *engine, hash_item *it);
+                              const char *key, const size_t nkey,
+                              uint32_t hv);
+static int do_item_link(struct default_engine *engine, hash_item *it,
+                        uint32_t hv);
+static void do_item_unlink(struct default_engine *engine, hash_item *it,
+                           uint32_t hv);
 static void do_item_release(struct default_engine *engine, hash_item *it);
 static void do_item_update(struct default_engine *engine, hash_item *it);
 static int do_item_replace(struct default_engine *engine,
-                            hash_item *it, hash_item *new_it);
+                            hash_item *it, hash_item *new_it,
+                            uint32_t hv);
 static void item_free(struct default_engine *engine, hash_item *it);
+static void item_scrub_flushed(struct default_engine *engine);
+static const struct eviction_policy *item_find_policy(const char *name);
 
-/*
- * We only reposition items in the LRU queue if they haven't been repositioned
- * in this many seconds. That saves us from churning on frequently-accessed
- * items.
- */
-#define ITEM_UPDATE_INTERVAL 60
 /*
  * To avoid scanning through the complete cache in some circumstances we'll
  * just give up and return an error after inspecting a fixed number of objects.
  */
 static const int search_items = 50;
 
+/* The maximum number of expiry wheel entries handled in one go */
+#define EXPIRY_BATCH 64
+
+ENGINE_ERROR_CODE item_init(struct default_engine *engine) {
+    unsigned int ii;
+    unsigned int power = 0;
+
+    engine->items.policy = item_find_policy(engine->config.eviction_policy);
+    if (engine->items.policy == NULL) {
+        return ENGINE_EINVAL;
+    }
+    /* Size the sketch for about the number of items we may store */
+    if (engine->items.policy->access != NULL &&
+        !sketch_init(&engine->items.sketch, engine->config.maxbytes / 64)) {
+        return ENGINE_ENOMEM;
+    }
+
+    /*
+     * All of the items in a hash bucket must map to the same item lock, so
+     * we can't have more locks than we've got buckets
+     */
+    while (power < engine->assoc.hashpower &&
+           ((size_t)1 << power) < engine->config.item_locks) {
+        ++power;
+    }
+
+    engine->items.item_locks = calloc((size_t)1 << power, sizeof(cb_mutex_t));
+    if (engine->items.item_locks == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    engine->items.item_lock_hashpower = power;
+
+    for (ii = 0; ii < (1U << power); ++ii) {
+        cb_mutex_initialize(&engine->items.item_locks[ii]);
+    }
+
+    for (ii = 0; ii < POWER_LARGEST; ++ii) {
+        cb_mutex_initialize(&engine->items.lru_locks[ii]);
+    }
+
+    cb_mutex_initialize(&engine->items.maintainer.lock);
+    cb_cond_initialize(&engine->items.maintainer.cond);
+    cb_mutex_initialize(&engine->items.cursor_lock);
+
+    cb_mutex_initialize(&engine->items.expiry.lock);
+    cb_cond_initialize(&engine->items.expiry.cond);
+    engine->items.expiry.time = engine->server.core->get_current_time();
+    /* Don't let the wheel use more than 1/16th of the cache size */
+    engine->items.expiry.max_entries =
+        engine->config.maxbytes / (16 * sizeof(hash_item*));
+
+    return ENGINE_SUCCESS;
+}
+
+void item_destroy(struct default_engine *engine) {
+    unsigned int ii;
+
+    if (engine->items.item_locks == NULL) {
+        return;
+    }
+
+    for (ii = 0; ii < (1U << engine->items.item_lock_hashpower); ++ii) {
+        cb_mutex_destroy(&engine->items.item_locks[ii]);
+    }
+    free(engine->items.item_locks);
+    engine->items.item_locks = NULL;
+
+    for (ii = 0; ii < POWER_LARGEST; ++ii) {
+        cb_mutex_destroy(&engine->items.lru_locks[ii]);
+    }
+
+    cb_mutex_destroy(&engine->items.maintainer.lock);
+    cb_cond_destroy(&engine->items.maintainer.cond);
+    cb_mutex_destroy(&engine->items.cursor_lock);
+
+    for (ii = 0; ii < EXPIRY_LEVELS * EXPIRY_SLOTS; ++ii) {
+        free(engine->items.expiry.slots[ii / EXPIRY_SLOTS][ii % EXPIRY_SLOTS].items);
+    }
+    free(engine->items.expiry.due.items);
+    cb_mutex_destroy(&engine->items.expiry.lock);
+    cb_cond_destroy(&engine->items.expiry.cond);
+
+    sketch_destroy(&engine->items.sketch);
+}
+
+void item_lock(struct default_engine *engine, uint32_t hv) {
+    uint32_t mask = (1U << engine->items.item_lock_hashpower) - 1;
+    cb_mutex_enter(&engine->items.item_locks[hv & mask]);
+}
+
+void item_unlock(struct default_engine *engine, uint32_t hv) {
+    uint32_t mask = (1U << engine->items.item_lock_hashpower) - 1;
+    cb_mutex_exit(&engine->items.item_locks[hv & mask]);
+}
+
+void item_lock_all(struct default_engine *engine) {
+    unsigned int ii;
+    for (ii = 0; ii < (1U << engine->items.item_lock_hashpower); ++ii) {
+        cb_mutex_enter(&engine->items.item_locks[ii]);
+    }
+}
+
+void item_unlock_all(struct default_engine *engine) {
+    unsigned int ii;
+    for (ii = 0; ii < (1U << engine->items.item_lock_hashpower); ++ii) {
+        cb_mutex_exit(&engine->items.item_locks[ii]);
+    }
+}
+
+static uint32_t item_hash(struct default_engine *engine, const hash_item *it) {
+    return engine->server.core->hash(item_get_key(it), it->nkey, 0);
+}
+
 void item_stats_reset(struct default_engine *engine) {
-    cb_mutex_enter(&engine->cache_lock);
-    memset(engine->items.itemstats, 0, sizeof(engine->items.itemstats));
-    cb_mutex_exit(&engine->cache_lock);
+    int ii;
+    for (ii = 0; ii < POWER_LARGEST; ++ii) {
+        cb_mutex_enter(&engine->items.lru_locks[ii]);
+        memset(&engine->items.itemstats[ii], 0, sizeof(itemstats_t));
+        engine->items.counts[ii].total_items = 0;
+        cb_mutex_exit(&engine->items.lru_locks[ii]);
+    }
+}
+
+void item_counts(struct default_engine *engine, itemcounts_t *counts,
+                 itemcounts_t *total) {
+    int ii;
+    memset(total, 0, sizeof(*total));
+    for (ii = 0; ii < POWER_LARGEST; ++ii) {
+        itemcounts_t c;
+        cb_mutex_enter(&engine->items.lru_locks[ii]);
+        c = engine->items.counts[ii];
+        cb_mutex_exit(&engine->items.lru_locks[ii]);
+        if (counts != NULL) {
+            counts[ii] = c;
+        }
+        total->curr_items += c.curr_items;
+        total->curr_bytes += c.curr_bytes;
+        total->total_items += c.total_items;
+    }
 }
 
 
 /* warning: don't use these macros with a function, as it evals its arg twice */
+/*
+ * Counters (items created or updated by incr / decr) store the value as a
+ * native 64 bit integer after room for its longest ASCII representation,
+ * so incr / decr never have to parse the value or allocate a new item
+ * when the number of digits changes. The ASCII digits (nbytes long) are
+ * still rewritten on every update, since the item data is handed out to
+ * the core and the tap / upr streams without holding any of our locks.
+ */
+#define COUNTER_DIGITS 20
+#define COUNTER_NBYTES (COUNTER_DIGITS + sizeof(uint64_t))
+
 static size_t ITEM_ntotal(struct default_engine *engine,
                           const hash_item *item) {
-    size_t ret = sizeof(*item) + item->nkey + item->nbytes;
+    size_t ret = ITEM_HEADER_SIZE(engine) + item->nkey;
+    if ((item->iflag & ITEM_CHUNKED) != 0) {
+        return engine->config.item_size_max;
+    } else if ((item->iflag & ITEM_COUNTER) != 0) {
+        ret += COUNTER_NBYTES;
+    } else {
+        ret += item->nbytes;
+    }
     if (engine->config.use_cas) {
         ret += sizeof(uint64_t);
     }
@@ -59,10 +212,253 @@ static size_t ITEM_ntotal(struct default_engine *engine,
     return ret;
 }
 
-/* Get the next CAS id for a new item. */
+/*
+ * Values too big for the largest slab class are stored as a chain of
+ * chunks. The header item fills a chunk of the largest slab class:
+ *
+ *    hash_item | cas | first data chunk | key | first part of the value
+ *
+ * and the rest of the value is stored in data chunks (hash_items flagged
+ * with ITEM_CHUNK), linked through next and pointing back to the header
+ * with h_next. All data chunks except the last fill a chunk of the
+ * largest class; the last one is allocated from the class that fits the
+ * rest of the value. The data chunks aren't linked in any LRU, and are
+ * freed together with the header.
+ */
+static hash_item *item_get_chunks(const hash_item *it) {
+    hash_item *ret = NULL;
+    if ((it->iflag & ITEM_CHUNKED) != 0) {
+        memcpy(&ret, (const char*)item_get_key(it) - sizeof(ret),
+               sizeof(ret));
+    }
+    return ret;
+}
+
+static void item_set_chunks(hash_item *it, hash_item *chunk) {
+    memcpy((char*)item_get_key(it) - sizeof(chunk), &chunk, sizeof(chunk));
+}
+
+/* The size of the header of an item (everything but the value) */
+static size_t item_header_size(struct default_engine *engine, size_t nkey,
+                               bool chunked) {
+    size_t ret = ITEM_HEADER_SIZE(engine) + nkey;
+    if (engine->config.use_cas) {
+        ret += sizeof(uint64_t);
+    }
+    if (chunked) {
+        ret += sizeof(hash_item*);
+    }
+    return ret;
+}
+
+/* The number of bytes of the value stored in the item itself */
+static size_t item_inline_nbytes(struct default_engine *engine,
+                                 const hash_item *it) {
+    if ((it->iflag & ITEM_CHUNKED) != 0) {
+        return engine->config.item_size_max -
+            item_header_size(engine, it->nkey, true);
+    }
+    return it->nbytes;
+}
+
+/* The memory used by an item, including the data chunks */
+static size_t item_memory(struct default_engine *engine,
+                          const hash_item *it) {
+    size_t ret = ITEM_ntotal(engine, it);
+    const hash_item *chunk;
+    for (chunk = item_get_chunks(it); chunk != NULL; chunk = chunk->next) {
+        ret += sizeof(hash_item) + chunk->nbytes;
+    }
+    return ret;
+}
+
+/*
+ * Account for the items and bytes added to (or removed from) the vbucket
+ * of an item. The counters are updated with atomic operations so we
+ * don't need the stats lock.
+ */
+static void vbucket_stats_update(struct default_engine *engine,
+                                 const hash_item *it, int items,
+                                 int64_t bytes, bool mutation) {
+    struct vbucket_stats *vb = &engine->stats.vbuckets[it->vbucket];
+    if (items != 0) {
+        ATOMIC_ADD_64(&vb->curr_items, items);
+    }
+    if (bytes != 0) {
+        ATOMIC_ADD_64(&vb->bytes, bytes);
+    }
+    if (mutation) {
+        ATOMIC_INCR_64(&vb->high_seqno);
+    }
+}
+
+/*
+ * Account for the bytes added to (or removed from) a linked item. The
+ * caller must hold the LRU lock of the slab class of the item.
+ */
+static void item_counts_update(struct default_engine *engine,
+                               const hash_item *it, int items,
+                               int64_t bytes) {
+    itemcounts_t *counts = &engine->items.counts[it->slabs_clsid];
+    counts->curr_items += items;
+    counts->curr_bytes += bytes;
+    if (items > 0) {
+        counts->total_items += items;
+    }
+}
+
+bool item_size_ok(struct default_engine *engine, size_t nkey,
+                  size_t nbytes) {
+    size_t header;
+    size_t nchunks;
+
+    if (nkey > ITEM_KEY_MAX_LENGTH) {
+        return false;
+    }
+
+    if (slabs_clsid(engine, item_header_size(engine, nkey, false) + nbytes) != 0) {
+        return true;
+    }
+
+    header = item_header_size(engine, nkey, true);
+    if (nbytes > engine->config.large_item_max ||
+        header >= engine->config.item_size_max) {
+        return false;
+    }
+
+    /* Each segment of the value is handed out as an iovec */
+    nbytes -= engine->config.item_size_max - header;
+    nchunks = (nbytes + engine->config.item_size_max - sizeof(hash_item) - 1) /
+        (engine->config.item_size_max - sizeof(hash_item));
+    return nchunks < IOV_MAX;
+}
+
+int item_get_iov(struct default_engine *engine, const hash_item *it,
+                 struct iovec *iov, int niov) {
+    const hash_item *chunk;
+    int ret = 1;
+
+    if (niov < 1) {
+        return -1;
+    }
+
+    iov[0].iov_base = item_get_data(it);
+    iov[0].iov_len = item_inline_nbytes(engine, it);
+    for (chunk = item_get_chunks(it); chunk != NULL; chunk = chunk->next) {
+        if (ret == niov) {
+            return -1;
+        }
+        iov[ret].iov_base = (void*)(chunk + 1);
+        iov[ret].iov_len = chunk->nbytes;
+        ++ret;
+    }
+
+    return ret;
+}
+
+void item_write_data(struct default_engine *engine, hash_item *it,
+                     size_t offset, const void *src, size_t nsrc) {
+    const char *ptr = src;
+    hash_item *chunk = item_get_chunks(it);
+    char *data = item_get_data(it);
+    size_t len = item_inline_nbytes(engine, it);
+
+    while (nsrc > 0) {
+        if (offset < len) {
+            size_t n = len - offset;
+            if (n > nsrc) {
+                n = nsrc;
+            }
+            memcpy(data + offset, ptr, n);
+            ptr += n;
+            nsrc -= n;
+            offset += n;
+        }
+
+        if (nsrc > 0) {
+            assert(chunk != NULL);
+            offset -= len;
+            data = (char*)(chunk + 1);
+            len = chunk->nbytes;
+            chunk = chunk->next;
+        }
+    }
+}
+
+void item_read_data(struct default_engine *engine, const hash_item *it,
+                    void *dst) {
+    char *ptr = dst;
+    const hash_item *chunk;
+
+    memcpy(ptr, item_get_data(it), item_inline_nbytes(engine, it));
+    ptr += item_inline_nbytes(engine, it);
+    for (chunk = item_get_chunks(it); chunk != NULL; chunk = chunk->next) {
+        memcpy(ptr, chunk + 1, chunk->nbytes);
+        ptr += chunk->nbytes;
+    }
+}
+
+/* Copy the value of src into dst (at offset) */
+static void item_copy_value(struct default_engine *engine, hash_item *dst,
+                            size_t offset, const hash_item *src) {
+    const hash_item *chunk;
+
+    item_write_data(engine, dst, offset, item_get_data(src),
+                    item_inline_nbytes(engine, src));
+    offset += item_inline_nbytes(engine, src);
+    for (chunk = item_get_chunks(src); chunk != NULL; chunk = chunk->next) {
+        item_write_data(engine, dst, offset, chunk + 1, chunk->nbytes);
+        offset += chunk->nbytes;
+    }
+}
+
+/*
+ * Get the next CAS id for a new item. The counter is updated with an
+ * atomic increment so we don't need to serialize all of the writers on
+ * a single lock. Every caller gets a unique id which is larger than all
+ * of the ids handed out before it, and since the id is assigned while
+ * holding the item lock the CAS of a given key is strictly increasing.
+ */
+static volatile uint64_t cas_id = 0;
+
 static uint64_t get_cas_id(void) {
-    static uint64_t cas_id = 0;
-    return ++cas_id;
+    return ATOMIC_INCR_64(&cas_id);
+}
+
+/* The last CAS id handed out */
+static uint64_t get_current_cas_id(void) {
+    return ATOMIC_ADD_64(&cas_id, 0);
+}
+
+/*
+ * Has the item been invalidated by flush_all? Items linked before an
+ * immediate flush_all have a CAS value <= oldest_cas, which tells them
+ * apart from the items stored later within the same second.
+ */
+static bool item_is_flushed(struct default_engine *engine,
+                            const hash_item *it,
+                            rel_time_t current_time) {
+    rel_time_t oldest_live = engine->config.oldest_live;
+    uint64_t oldest_cas = engine->config.oldest_cas;
+
+    if (oldest_cas != 0 && (it->iflag & ITEM_WITH_CAS) != 0 &&
+        item_get_cas(it) <= oldest_cas) {
+        return true;
+    }
+
+    return oldest_live != 0 && oldest_live <= current_time &&
+        it->time <= oldest_live;
+}
+
+/* Is the item dead (expired or invalidated by flush_all)? */
+static bool item_is_dead(struct default_engine *engine,
+                         const hash_item *it,
+                         rel_time_t current_time) {
+    if (item_is_flushed(engine, it, current_time)) {
+        return true;
+    }
+
+    return it->exptime != 0 && it->exptime <= current_time;
 }
 
 /* Enable this for reference-count debugging. */
@@ -76,115 +472,792 @@ static uint64_t get_cas_id(void) {
 # define DEBUG_REFCNT(it,op) while(0)
 #endif
 
+/*
+ * Take a reference to the item. Returns false (and the caller should
+ * treat the item as if it wasn't there) if the item already has
+ * ITEM_REF_MAX references, as one more would overflow into the linked bit.
+ */
+static bool item_get_ref(hash_item *it) {
+    unsigned short refcount;
 
-/*@null@*/
-hash_item *do_item_alloc(struct default_engine *engine,
-                         const void *key,
-                         const size_t nkey,
-                         const int flags,
-                         const rel_time_t exptime,
-                         const int nbytes,
-                         const void *cookie) {
+    do {
+        refcount = it->refcount;
+        if ((refcount & ~ITEM_REF_LINKED) == ITEM_REF_MAX) {
+            return false;
+        }
+    } while (!ATOMIC_CAS_16(&it->refcount, refcount, refcount + 1));
+
+    return true;
+}
+
+/*
+ * Unlink an item found while walking one of the LRU lists. The item was
+ * "pinned" (its refcount bumped) while we held the LRU lock, but we need
+ * the item lock before we may unlink it (the lock order is item -> lru),
+ * so someone else may have unlinked it in the meantime. If dead_only is
+ * set we'll only unlink the item if it is still dead and nobody else is
+ * using it. The pin is released.
+ *
+ * Returns true if we unlinked the item.
+ */
+static bool item_unlink_pinned(struct default_engine *engine,
+                               hash_item *it, bool dead_only) {
+    uint32_t hv = item_hash(engine, it);
+    bool ret = false;
+
+    item_lock(engine, hv);
+    if ((it->iflag & ITEM_LINKED) != 0 &&
+        (!dead_only || (ITEM_REFCOUNT(it) == 1 &&
+                        item_is_dead(engine, it,
+                                     engine->server.core->get_current_time())))) {
+        do_item_unlink(engine, it, hv);
+        ret = true;
+    }
+    do_item_release(engine, it);
+    item_unlock(engine, hv);
+
+    return ret;
+}
+
+/* What lru_pull should look for in the tail of the LRU */
+enum lru_pull_mode {
+    /** Expired (or flushed) items nobody is using */
+    LRU_PULL_RECLAIM,
+    /** The least recently used item nobody is using */
+    LRU_PULL_EVICT,
+    /** Items that has been locked "forever" (refcount leak) */
+    LRU_PULL_TAILREPAIR
+};
+
+static bool item_is_cursor(const hash_item *it) {
+    return it->nkey == 0 && it->nbytes == 0;
+}
+
+/*
+ * Items may only leave the hot segment once they're older than the
+ * granularity of flush_all. flush_all only walks the head of the
+ * segments for new items (the rest is handled by the lazy oldest_live
+ * check), and the warm and cold segments aren't sorted by time.
+ */
+static bool item_may_leave_hot(const hash_item *it, rel_time_t current_time) {
+    return it->time + 1 < current_time;
+}
+
+/*
+ * Move the item to the head of another segment of the LRU (and clear
+ * the active bit). The caller must hold the LRU lock for the slab class.
+ */
+static void item_move_q(struct default_engine *engine, hash_item *it,
+                        int segment) {
+    int from = it->lru & ITEM_LRU_SEGMENT_MASK;
+    itemstats_t *stats = &engine->items.itemstats[it->slabs_clsid];
+
+    item_unlink_q(engine, it);
+    ATOMIC_AND_8(&it->lru, ~(ITEM_LRU_SEGMENT_MASK | ITEM_LRU_ACTIVE));
+    ATOMIC_OR_8(&it->lru, segment);
+    item_link_q(engine, it);
+
+    if (from == segment) {
+        stats->moves_within_lru++;
+    } else if (segment == LRU_WARM) {
+        stats->moves_to_warm++;
+    } else if (segment == LRU_COLD) {
+        stats->moves_to_cold++;
+    }
+}
+
+/*
+ * Unlink an item pinned (its refcount bumped) while searching the tail of
+ * the LRU if it still matches the mode, and release the pin. The item may
+ * have been changed while we grabbed the item lock.
+ *
+ * Returns true if the item was unlinked.
+ */
+static bool lru_unlink_pulled(struct default_engine *engine, unsigned int id,
+                              hash_item *it, enum lru_pull_mode mode,
+                              const void *cookie) {
+    rel_time_t current_time = engine->server.core->get_current_time();
+    bool unlinked = false;
+    uint32_t hv;
+
+    hv = item_hash(engine, it);
+    item_lock(engine, hv);
+    if ((it->iflag & ITEM_LINKED) != 0) {
+        switch (mode) {
+        case LRU_PULL_RECLAIM:
+            if (ITEM_REFCOUNT(it) == 1 && item_is_dead(engine, it, current_time)) {
+                unlinked = true;
+                cb_mutex_enter(&engine->items.lru_locks[id]);
+                engine->items.itemstats[id].reclaimed++;
+                cb_mutex_exit(&engine->items.lru_locks[id]);
+                ATOMIC_INCR_64(&engine->stats.reclaimed);
+            }
+            break;
+        case LRU_PULL_EVICT:
+            if (ITEM_REFCOUNT(it) == 1) {
+                unlinked = true;
+                cb_mutex_enter(&engine->items.lru_locks[id]);
+                if (it->exptime == 0 || it->exptime > current_time) {
+                    engine->items.itemstats[id].evicted++;
+                    engine->items.itemstats[id].evicted_time = current_time - it->time;
+                    if (it->exptime != 0) {
+                        engine->items.itemstats[id].evicted_nonzero++;
+                    }
+                    cb_mutex_exit(&engine->items.lru_locks[id]);
+                    ATOMIC_INCR_64(&engine->stats.evictions);
+                    engine->server.stat->evicting(cookie,
+                                                  item_get_key(it),
+                                                  it->nkey);
+                } else {
+                    engine->items.itemstats[id].reclaimed++;
+                    cb_mutex_exit(&engine->items.lru_locks[id]);
+                    ATOMIC_INCR_64(&engine->stats.reclaimed);
+                }
+            }
+            break;
+        case LRU_PULL_TAILREPAIR:
+            unlinked = true;
+            cb_mutex_enter(&engine->items.lru_locks[id]);
+            engine->items.itemstats[id].tailrepairs++;
+            cb_mutex_exit(&engine->items.lru_locks[id]);
+            /* Drop the leaked references (but keep our own) */
+            it->refcount = ITEM_REF_LINKED | 1;
+            break;
+        }
+
+        if (unlinked) {
+            do_item_unlink(engine, it, hv);
+        }
+    }
+    do_item_release(engine, it);
+    item_unlock(engine, hv);
+
+    return unlinked;
+}
+
+/*
+ * Search the tail of a segment of the LRU for an item matching the mode
+ * and pin it. To avoid scanning through the complete cache we'll give
+ * up after inspecting search_items objects. Active items found while
+ * looking for an item to evict get a second chance in the warm segment.
+ *
+ * Returns the pinned item, or NULL if none was found.
+ */
+static hash_item *lru_pin_segment(struct default_engine *engine,
+                                  unsigned int id, int segment,
+                                  enum lru_pull_mode mode) {
+    rel_time_t current_time = engine->server.core->get_current_time();
+    hash_item *search;
+    hash_item *prev;
     hash_item *it = NULL;
     int tries = search_items;
-    hash_item *search;
-    rel_time_t oldest_live;
-    rel_time_t current_time;
-    unsigned int id;
 
-    size_t ntotal = sizeof(hash_item) + nkey + nbytes;
-    if (engine->config.use_cas) {
-        ntotal += sizeof(uint64_t);
+    cb_mutex_enter(&engine->items.lru_locks[id]);
+    for (search = engine->items.tails[id][segment];
+         tries > 0 && search != NULL && it == NULL;
+         tries--, search = prev) {
+        prev = item_get_prev(engine, search);
+        if (item_is_cursor(search)) {
+            /* Ignore cursors */
+            continue;
+        }
+
+        switch (mode) {
+        case LRU_PULL_RECLAIM:
+            if (search->refcount == ITEM_REF_LINKED &&
+                item_is_dead(engine, search, current_time) &&
+                ATOMIC_CAS_16(&search->refcount, ITEM_REF_LINKED,
+                              ITEM_REF_LINKED | 1)) {
+                it = search;
+            }
+            break;
+        case LRU_PULL_EVICT:
+            if (ITEM_REFCOUNT(search) != 0) {
+                break;
+            }
+            if ((search->lru & ITEM_LRU_ACTIVE) != 0 &&
+                !item_is_dead(engine, search, current_time)) {
+                /* Active items too young to leave hot are left alone */
+                if (segment != LRU_HOT ||
+                    item_may_leave_hot(search, current_time)) {
+                    item_move_q(engine, search, LRU_WARM);
+                }
+            } else if (ATOMIC_CAS_16(&search->refcount, ITEM_REF_LINKED,
+                                     ITEM_REF_LINKED | 1)) {
+                it = search;
+            }
+            break;
+        case LRU_PULL_TAILREPAIR:
+            if (ITEM_REFCOUNT(search) != 0 &&
+                search->time + TAIL_REPAIR_TIME < current_time &&
+                item_get_ref(search)) {
+                it = search;
+            }
+            break;
+        }
     }
+    cb_mutex_exit(&engine->items.lru_locks[id]);
 
-    if ((id = slabs_clsid(engine, ntotal)) == 0) {
-        return 0;
+    return it;
+}
+
+/*
+ * Search the tail of a segment of the LRU for an item matching the mode
+ * and unlink it.
+ *
+ * Returns true if an item was unlinked.
+ */
+static bool lru_pull_segment(struct default_engine *engine, unsigned int id,
+                             int segment, enum lru_pull_mode mode,
+                             const void *cookie) {
+    hash_item *it = lru_pin_segment(engine, id, segment, mode);
+
+    if (it == NULL) {
+        return false;
     }
 
-    /* do a quick check if we have any expired items in the tail.. */
-    tries = search_items;
-    oldest_live = engine->config.oldest_live;
-    current_time = engine->server.core->get_current_time();
-
-    for (search = engine->items.tails[id];
-         tries > 0 && search != NULL;
-         tries--, search=search->prev) {
-        if (search->refcount == 0 &&
-            ((search->time < oldest_live) || /* dead by flush */
-             (search->exptime != 0 && search->exptime < current_time))) {
-            it = search;
-            /* I don't want to actually free the object, just steal
-             * the item to avoid to grab the slab mutex twice ;-)
-             */
-            cb_mutex_enter(&engine->stats.lock);
-            engine->stats.reclaimed++;
-            cb_mutex_exit(&engine->stats.lock);
-            engine->items.itemstats[id].reclaimed++;
-            it->refcount = 1;
-            slabs_adjust_mem_requested(engine, it->slabs_clsid, ITEM_ntotal(engine, it), ntotal);
-            do_item_unlink(engine, it);
-            /* Initialize the item block: */
-            it->slabs_clsid = 0;
-            it->refcount = 0;
+    return lru_unlink_pulled(engine, id, it, mode, cookie);
+}
+
+/*
+ * Search the tails of the segments of the LRU (starting with cold) for
+ * an item matching the mode and unlink it.
+ *
+ * Returns true if an item was unlinked.
+ */
+static bool lru_pull(struct default_engine *engine, unsigned int id,
+                     enum lru_pull_mode mode, const void *cookie) {
+    static const int order[LRU_SEGMENTS] = { LRU_COLD, LRU_WARM, LRU_HOT };
+    int ii;
+
+    for (ii = 0; ii < LRU_SEGMENTS; ++ii) {
+        if (lru_pull_segment(engine, id, order[ii], mode, cookie)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool lru_evict(struct default_engine *engine, unsigned int id,
+                      const void *cookie) {
+    return lru_pull(engine, id, LRU_PULL_EVICT, cookie);
+}
+
+static void tinylfu_access(struct default_engine *engine, uint32_t hv) {
+    sketch_increment(&engine->items.sketch, hv);
+}
+
+/*
+ * W-TinyLFU using the hot segment of the LRU as the admission window. The
+ * item leaving the window competes with the victim the LRU picks from the
+ * main (cold and warm) segments, and the one looked up less often
+ * (according to the sketch) is evicted. When the new item loses it is
+ * rejected from the main segments, so a scan through keys nobody asks for
+ * twice doesn't flush out the popular items.
+ */
+static bool tinylfu_evict(struct default_engine *engine, unsigned int id,
+                          const void *cookie) {
+    hash_item *candidate = lru_pin_segment(engine, id, LRU_HOT,
+                                           LRU_PULL_EVICT);
+    hash_item *victim = lru_pin_segment(engine, id, LRU_COLD,
+                                        LRU_PULL_EVICT);
+    bool ret;
+
+    if (victim == NULL) {
+        victim = lru_pin_segment(engine, id, LRU_WARM, LRU_PULL_EVICT);
+    }
+
+    if (candidate == NULL || victim == NULL) {
+        if (victim != NULL) {
+            return lru_unlink_pulled(engine, id, victim, LRU_PULL_EVICT, cookie);
+        } else if (candidate != NULL) {
+            return lru_unlink_pulled(engine, id, candidate, LRU_PULL_EVICT,
+                                     cookie);
+        }
+        return false;
+    }
+
+    if (sketch_frequency(&engine->items.sketch, item_hash(engine, candidate)) >
+        sketch_frequency(&engine->items.sketch, item_hash(engine, victim))) {
+        ret = lru_unlink_pulled(engine, id, victim, LRU_PULL_EVICT, cookie);
+        item_release(engine, candidate);
+    } else {
+        ret = lru_unlink_pulled(engine, id, candidate, LRU_PULL_EVICT, cookie);
+        item_release(engine, victim);
+        if (ret) {
+            ATOMIC_INCR_64(&engine->stats.admission_rejects);
+        }
+    }
+
+    return ret;
+}
+
+static const struct eviction_policy eviction_policies[] = {
+    { "lru", NULL, lru_evict },
+    { "tinylfu", tinylfu_access, tinylfu_evict }
+};
+
+/* Find the eviction policy with the given name (the default is LRU) */
+static const struct eviction_policy *item_find_policy(const char *name) {
+    size_t ii;
+
+    for (ii = 0; ii < sizeof(eviction_policies) / sizeof(eviction_policies[0]); ++ii) {
+        if (strcmp(name == NULL ? "lru" : name, eviction_policies[ii].name) == 0) {
+            return &eviction_policies[ii];
+        }
+    }
+
+    return NULL;
+}
+
+/* Get the last item in the segment which isn't a cursor */
+static hash_item *lru_tail(struct default_engine *engine, unsigned int id,
+                           int segment) {
+    hash_item *it = engine->items.tails[id][segment];
+    while (it != NULL && item_is_cursor(it)) {
+        it = item_get_prev(engine, it);
+    }
+    return it;
+}
+
+/*
+ * Move items between the segments of the LRU for a slab class. The hot
+ * and warm segments are kept within their limits by moving the items in
+ * their tails to the cold segment (or warm if they have been accessed),
+ * and active items in the tail of the cold segment are moved back to
+ * warm. Expired items in the tails are reclaimed first.
+ *
+ * Returns the number of items reclaimed or moved.
+ */
+static int lru_juggle(struct default_engine *engine, unsigned int id,
+                      int limit) {
+    rel_time_t current_time = engine->server.core->get_current_time();
+    unsigned int *sizes = engine->items.sizes[id];
+    int did_work = 0;
+    int ii;
+
+    for (ii = 0; ii < limit; ++ii) {
+        if (!lru_pull(engine, id, LRU_PULL_RECLAIM, NULL)) {
             break;
         }
+        ++did_work;
     }
 
-    if (it == NULL && (it = slabs_alloc(engine, ntotal, id)) == NULL) {
+    cb_mutex_enter(&engine->items.lru_locks[id]);
+    for (ii = 0; ii < limit; ++ii) {
+        unsigned int total = sizes[LRU_HOT] + sizes[LRU_WARM] + sizes[LRU_COLD];
+        hash_item *it;
+        bool moved = false;
+
+        it = lru_tail(engine, id, LRU_HOT);
+        if (it != NULL &&
+            sizes[LRU_HOT] > total * engine->config.hot_lru_pct / 100 &&
+            item_may_leave_hot(it, current_time)) {
+            if ((it->lru & ITEM_LRU_ACTIVE) != 0) {
+                item_move_q(engine, it, LRU_WARM);
+            } else {
+                item_move_q(engine, it, LRU_COLD);
+            }
+            moved = true;
+        }
+
+        it = lru_tail(engine, id, LRU_WARM);
+        if (it != NULL &&
+            sizes[LRU_WARM] > total * engine->config.warm_lru_pct / 100) {
+            if ((it->lru & ITEM_LRU_ACTIVE) != 0) {
+                item_move_q(engine, it, LRU_WARM);
+            } else {
+                item_move_q(engine, it, LRU_COLD);
+            }
+            moved = true;
+        }
+
+        it = lru_tail(engine, id, LRU_COLD);
+        if (it != NULL && (it->lru & ITEM_LRU_ACTIVE) != 0) {
+            item_move_q(engine, it, LRU_WARM);
+            moved = true;
+        }
+
+        if (!moved) {
+            break;
+        }
+        ++did_work;
+    }
+    cb_mutex_exit(&engine->items.lru_locks[id]);
+
+    return did_work;
+}
+
+static bool expiry_slot_push(struct expiry_slot *slot, hash_item *it) {
+    if (slot->count == slot->size) {
+        uint32_t size = slot->size == 0 ? 16 : slot->size * 2;
+        hash_item **items = realloc(slot->items, size * sizeof(hash_item*));
+        if (items == NULL) {
+            return false;
+        }
+        slot->items = items;
+        slot->size = size;
+    }
+    slot->items[slot->count++] = it;
+    return true;
+}
+
+static void expiry_slot_clear(struct expiry_slot *slot) {
+    free(slot->items);
+    slot->items = NULL;
+    slot->count = slot->size = 0;
+}
+
+/*
+ * Find the slot for an entry expiring at exptime. Entries too far into
+ * the future for the wheel are put in the last slot it covers, and they
+ * are moved back up when it is spread over the lower levels.
+ */
+static struct expiry_slot *expiry_find_slot(struct expiry_wheel *wheel,
+                                            rel_time_t exptime) {
+    rel_time_t delta;
+    int level = 0;
+
+    if (exptime <= wheel->time) {
+        return &wheel->due;
+    }
+
+    delta = exptime - wheel->time;
+    while (level < EXPIRY_LEVELS - 1 &&
+           delta >= (rel_time_t)1 << (EXPIRY_SLOT_BITS * (level + 1))) {
+        ++level;
+    }
+    if (level == EXPIRY_LEVELS - 1 &&
+        delta >= (rel_time_t)1 << (EXPIRY_SLOT_BITS * EXPIRY_LEVELS)) {
+        exptime = wheel->time +
+            ((rel_time_t)1 << (EXPIRY_SLOT_BITS * EXPIRY_LEVELS)) - 1;
+    }
+
+    return &wheel->slots[level][(exptime >> (EXPIRY_SLOT_BITS * level)) &
+                                (EXPIRY_SLOTS - 1)];
+}
+
+/*
+ * Add an entry for an item with an expiry time to the wheel. The caller
+ * holds the item lock, so the item can't go away while we read it. The
+ * entry is dropped (and counted) if the wheel is full.
+ */
+static void item_expiry_add(struct default_engine *engine, hash_item *it) {
+#ifndef USE_SYSTEM_MALLOC
+    struct expiry_wheel *wheel = &engine->items.expiry;
+
+    if (it->exptime == 0) {
+        return;
+    }
+
+    cb_mutex_enter(&wheel->lock);
+    if (wheel->entries < wheel->max_entries &&
+        expiry_slot_push(expiry_find_slot(wheel, it->exptime), it)) {
+        ++wheel->entries;
+    } else {
+        ++wheel->dropped;
+    }
+    cb_mutex_exit(&wheel->lock);
+#else
+    /* The entries would refer to memory given back to malloc */
+    (void)engine;
+    (void)it;
+#endif
+}
+
+/*
+ * Move the entries in a slot to where they belong now that the wheel has
+ * advanced. The items may have been freed (and the memory reused) since
+ * the entries were added, in which case we'll read a garbage expiry time.
+ * That's ok; the entry is checked before anything is unlinked.
+ */
+static void expiry_cascade(struct expiry_wheel *wheel,
+                           struct expiry_slot *slot) {
+    struct expiry_slot old = *slot;
+    uint32_t ii;
+
+    slot->items = NULL;
+    slot->count = slot->size = 0;
+    for (ii = 0; ii < old.count; ++ii) {
+        if (!expiry_slot_push(expiry_find_slot(wheel, old.items[ii]->exptime),
+                              old.items[ii])) {
+            --wheel->entries;
+        }
+    }
+    free(old.items);
+}
+
+/* Advance the wheel second by second up to current_time */
+static void expiry_advance(struct expiry_wheel *wheel,
+                           rel_time_t current_time) {
+    while (wheel->time < current_time) {
+        struct expiry_slot *slot;
+        rel_time_t time = ++wheel->time;
+        int level;
+
+        /* Spread the slots in the upper levels we've reached */
+        for (level = EXPIRY_LEVELS - 1; level > 0; --level) {
+            if ((time & (((rel_time_t)1 << (EXPIRY_SLOT_BITS * level)) - 1)) == 0) {
+                expiry_cascade(wheel, &wheel->slots[level][(time >> (EXPIRY_SLOT_BITS * level)) &
+                                                           (EXPIRY_SLOTS - 1)]);
+            }
+        }
+
+        slot = &wheel->slots[0][time & (EXPIRY_SLOTS - 1)];
+        if (slot->count == 0) {
+            continue;
+        }
+        if (wheel->due.count == 0) {
+            struct expiry_slot due = wheel->due;
+            wheel->due = *slot;
+            *slot = due;
+        } else {
+            expiry_cascade(wheel, slot);
+        }
+    }
+}
+
+static void expiry_slot_purge(struct expiry_slot *slot,
+                              const char *start, const char *end,
+                              uint64_t *entries) {
+    uint32_t ii = 0;
+
+    while (ii < slot->count) {
+        const char *ptr = (const char*)slot->items[ii];
+        if (ptr >= start && ptr < end) {
+            slot->items[ii] = slot->items[--slot->count];
+            --*entries;
+        } else {
+            ++ii;
+        }
+    }
+}
+
+void item_expiry_purge(struct default_engine *engine,
+                       const void *start, const void *end) {
+    struct expiry_wheel *wheel = &engine->items.expiry;
+    int ii;
+
+    cb_mutex_enter(&wheel->lock);
+    for (ii = 0; ii < EXPIRY_LEVELS * EXPIRY_SLOTS; ++ii) {
+        expiry_slot_purge(&wheel->slots[ii / EXPIRY_SLOTS][ii % EXPIRY_SLOTS],
+                          start, end, &wheel->entries);
+    }
+    expiry_slot_purge(&wheel->due, start, end, &wheel->entries);
+    /* A batch taken off the wheel before we got here may refer to the
+     * page as well */
+    while (wheel->expiring > 0) {
+        cb_cond_wait(&wheel->cond, &wheel->lock);
+    }
+    cb_mutex_exit(&wheel->lock);
+}
+
+/*
+ * Unlink the item an entry in the wheel refers to if it is expired. Like
+ * in item_evict_chunk we only trust what we read once we've found the
+ * item in the hash table. An item given a later expiry time since the
+ * entry was added (see do_touch_item) is put back in the wheel.
+ */
+static bool item_expire_entry(struct default_engine *engine, hash_item *it,
+                              rel_time_t current_time) {
+    unsigned int id = it->slabs_clsid;
+    uint16_t nkey = it->nkey;
+    const char *key;
+    uint32_t hv;
+    bool ret = false;
+
+    if ((it->iflag & (ITEM_LINKED | ITEM_SLABBED | ITEM_CHUNK)) != ITEM_LINKED ||
+        nkey == 0 || id < POWER_SMALLEST || id >= POWER_LARGEST) {
+        return false;
+    }
+
+    key = item_get_key(it);
+    if (key + nkey > (const char*)it + slabs_chunk_size(engine, id)) {
+        return false;
+    }
+
+    hv = engine->server.core->hash(key, nkey, 0);
+    item_lock(engine, hv);
+    if (assoc_find(engine, hv, key, nkey) == it) {
+        if (item_is_dead(engine, it, current_time)) {
+            do_item_unlink(engine, it, hv);
+            ret = true;
+        } else if (it->exptime > current_time) {
+            item_expiry_add(engine, it);
+        }
+    }
+    item_unlock(engine, hv);
+
+    if (ret) {
+        cb_mutex_enter(&engine->items.lru_locks[id]);
+        engine->items.itemstats[id].reclaimed++;
+        cb_mutex_exit(&engine->items.lru_locks[id]);
+        ATOMIC_INCR_64(&engine->stats.reclaimed);
+    }
+
+    return ret;
+}
+
+/*
+ * Advance the expiry wheel to the current time and unlink the expired
+ * items for (at most) limit of the entries which are due.
+ *
+ * Returns the number of entries looked at.
+ */
+static int item_expire(struct default_engine *engine, int limit) {
+    struct expiry_wheel *wheel = &engine->items.expiry;
+    rel_time_t current_time = engine->server.core->get_current_time();
+    hash_item *batch[EXPIRY_BATCH];
+    int nbatch = 0;
+    int reclaimed = 0;
+    int ii;
+
+    if (limit > EXPIRY_BATCH) {
+        limit = EXPIRY_BATCH;
+    }
+
+    cb_mutex_enter(&wheel->lock);
+    expiry_advance(wheel, current_time);
+    while (nbatch < limit && wheel->due.count > 0) {
+        batch[nbatch++] = wheel->due.items[--wheel->due.count];
+    }
+    if (nbatch == 0) {
+        cb_mutex_exit(&wheel->lock);
+        return 0;
+    }
+    if (wheel->due.count == 0) {
+        expiry_slot_clear(&wheel->due);
+    }
+    wheel->entries -= nbatch;
+    /* Keep the rebalancer from moving the pages of the batch away until
+     * we're done with it (see item_expiry_purge) */
+    wheel->expiring++;
+    cb_mutex_exit(&wheel->lock);
+
+    for (ii = 0; ii < nbatch; ++ii) {
+        if (item_expire_entry(engine, batch[ii], current_time)) {
+            ++reclaimed;
+        }
+    }
+
+    cb_mutex_enter(&wheel->lock);
+    wheel->reclaimed += reclaimed;
+    if (--wheel->expiring == 0) {
+        cb_cond_broadcast(&wheel->cond);
+    }
+    cb_mutex_exit(&wheel->lock);
+
+    return nbatch;
+}
+
+static void lru_maintainer_main(void *arg) {
+    struct default_engine *engine = arg;
+    struct lru_maintainer *maintainer = &engine->items.maintainer;
+
+    cb_mutex_enter(&maintainer->lock);
+    while (maintainer->running) {
+        int did_work = 0;
+        int ii;
+
+        cb_mutex_exit(&maintainer->lock);
+        did_work += item_expire(engine, search_items);
+        for (ii = POWER_SMALLEST; ii < POWER_LARGEST; ++ii) {
+            did_work += lru_juggle(engine, ii, search_items);
+        }
+        cb_mutex_enter(&maintainer->lock);
+
+        if (did_work != 0) {
+            maintainer->juggles += did_work;
+        } else if (maintainer->running) {
+            /* Nothing to do.. back off for a while */
+            cb_cond_timedwait(&maintainer->cond, &maintainer->lock, 100);
+        }
+    }
+    cb_mutex_exit(&maintainer->lock);
+}
+
+ENGINE_ERROR_CODE item_start_lru_maintainer(struct default_engine *engine) {
+    struct lru_maintainer *maintainer = &engine->items.maintainer;
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+
+    cb_mutex_enter(&maintainer->lock);
+    if (!maintainer->running) {
+        maintainer->running = true;
+        if (cb_create_thread(&maintainer->tid, lru_maintainer_main,
+                             engine, 0) != 0) {
+            maintainer->running = false;
+            ret = ENGINE_FAILED;
+        }
+    }
+    cb_mutex_exit(&maintainer->lock);
+
+    return ret;
+}
+
+void item_stop_lru_maintainer(struct default_engine *engine) {
+    struct lru_maintainer *maintainer = &engine->items.maintainer;
+    bool running;
+
+    cb_mutex_enter(&maintainer->lock);
+    running = maintainer->running;
+    maintainer->running = false;
+    cb_cond_signal(&maintainer->cond);
+    cb_mutex_exit(&maintainer->lock);
+
+    if (running) {
+        cb_join_thread(maintainer->tid);
+    }
+}
+
+/*
+ * Allocate memory for an item from the slab class, evicting items from
+ * the class if we're out of memory.
+ */
+static hash_item *item_alloc_memory(struct default_engine *engine,
+                                    size_t ntotal, unsigned int id,
+                                    const void *cookie) {
+    hash_item *it;
+
+    if (!engine->config.lru_maintainer) {
+        /*
+         * Nobody is maintaining the LRU in the background, so do a
+         * quick check if we have any expired items in the tails (or
+         * in the expiry wheel) and move a few items between the segments.
+         */
+        item_expire(engine, 1);
+        lru_juggle(engine, id, 1);
+    }
+
+    if ((it = slabs_alloc(engine, ntotal, id)) == NULL) {
         /*
         ** Could not find an expired item at the tail, and memory allocation
         ** failed. Try to evict some items!
         */
-        tries = search_items;
 
         /* If requested to not push old items out of cache when memory runs out,
          * we're out of luck at this point...
          */
 
-        if (engine->config.evict_to_free == 0) {
-            engine->items.itemstats[id].outofmemory++;
-            return NULL;
-        }
-
-        /*
-         * try to get one off the right LRU
-         * don't necessariuly unlink the tail because it may be locked: refcount>0
-         * search up from tail an item with refcount==0 and unlink it; give up after search_items
-         * tries
-         */
-
-        if (engine->items.tails[id] == 0) {
-            engine->items.itemstats[id].outofmemory++;
-            return NULL;
-        }
-
-        for (search = engine->items.tails[id]; tries > 0 && search != NULL; tries--, search=search->prev) {
-            if (search->refcount == 0) {
-                if (search->exptime == 0 || search->exptime > current_time) {
-                    engine->items.itemstats[id].evicted++;
-                    engine->items.itemstats[id].evicted_time = current_time - search->time;
-                    if (search->exptime != 0) {
-                        engine->items.itemstats[id].evicted_nonzero++;
-                    }
-                    cb_mutex_enter(&engine->stats.lock);
-                    engine->stats.evictions++;
-                    cb_mutex_exit(&engine->stats.lock);
-                    engine->server.stat->evicting(cookie,
-                                                  item_get_key(search),
-                                                  search->nkey);
-                } else {
-                    engine->items.itemstats[id].reclaimed++;
-                    cb_mutex_enter(&engine->stats.lock);
-                    engine->stats.reclaimed++;
-                    cb_mutex_exit(&engine->stats.lock);
-                }
-                do_item_unlink(engine, search);
-                break;
-            }
+        if (engine->config.evict_to_free == 0) {
+            cb_mutex_enter(&engine->items.lru_locks[id]);
+            engine->items.itemstats[id].outofmemory++;
+            cb_mutex_exit(&engine->items.lru_locks[id]);
+            return NULL;
         }
+
+        /*
+         * try to get one off the right LRU
+         * don't necessariuly unlink the tail because it may be locked: refcount>0
+         * search up from tail an item with refcount==0 and unlink it; give up after search_items
+         * tries
+         */
+        engine->items.policy->evict(engine, id, cookie);
         it = slabs_alloc(engine, ntotal, id);
         if (it == 0) {
+            cb_mutex_enter(&engine->items.lru_locks[id]);
             engine->items.itemstats[id].outofmemory++;
+            cb_mutex_exit(&engine->items.lru_locks[id]);
             /* Last ditch effort. There is a very rare bug which causes
              * refcount leaks. We've fixed most of them, but it still happens,
              * and it may happen in the future.
@@ -192,15 +1265,7 @@ hash_item *do_item_alloc(struct default_engine *engine,
              * three hours, so if we find one in the tail which is that old,
              * free it anyway.
              */
-            tries = search_items;
-            for (search = engine->items.tails[id]; tries > 0 && search != NULL; tries--, search=search->prev) {
-                if (search->refcount != 0 && search->time + TAIL_REPAIR_TIME < current_time) {
-                    engine->items.itemstats[id].tailrepairs++;
-                    search->refcount = 0;
-                    do_item_unlink(engine, search);
-                    break;
-                }
-            }
+            lru_pull(engine, id, LRU_PULL_TAILREPAIR, cookie);
             it = slabs_alloc(engine, ntotal, id);
             if (it == 0) {
                 return NULL;
@@ -211,29 +1276,193 @@ hash_item *do_item_alloc(struct default_engine *engine,
     assert(it->slabs_clsid == 0);
 
     it->slabs_clsid = id;
+    return it;
+}
+
+/*
+ * Allocate a data chunk for nbytes of the value of a chunked item, from
+ * the slab class fitting reserve bytes (so later appends may use the
+ * rest of the chunk). The chunk isn't owned by any item yet.
+ */
+static hash_item *item_alloc_chunk(struct default_engine *engine,
+                                   size_t nbytes, size_t reserve,
+                                   const void *cookie) {
+    size_t largest = engine->config.item_size_max;
+    size_t ntotal = sizeof(hash_item) + nbytes;
+    hash_item *chunk;
+
+    if (reserve > largest - sizeof(hash_item)) {
+        reserve = largest - sizeof(hash_item);
+    }
+    if (reserve < nbytes) {
+        reserve = nbytes;
+    }
+
+    chunk = item_alloc_memory(engine, ntotal,
+                              slabs_clsid(engine, sizeof(hash_item) + reserve),
+                              cookie);
+    if (chunk == NULL && sizeof(hash_item) + reserve < largest) {
+        /*
+         * The LRU of the smaller class may not have anything to
+         * evict (the class may be filled with data chunks), but the
+         * largest class holds the chunked items themselves.
+         */
+        chunk = item_alloc_memory(engine, ntotal,
+                                  slabs_clsid(engine, largest), cookie);
+    }
+    if (chunk == NULL) {
+        return NULL;
+    }
+
+    chunk->next = chunk->prev = chunk->h_next = NULL;
+    chunk->time = chunk->exptime = 0;
+    chunk->nbytes = (uint32_t)nbytes;
+    chunk->flags = 0;
+    chunk->nkey = 0;
+    chunk->refcount = 0;
+    chunk->lru = 0;
+    chunk->iflag = ITEM_CHUNK;
+    return chunk;
+}
+
+/* Return a data chunk to the slab allocator */
+static void item_free_chunk(struct default_engine *engine, hash_item *chunk) {
+    unsigned int clsid = chunk->slabs_clsid;
+    chunk->slabs_clsid = 0;
+    chunk->iflag |= ITEM_SLABBED;
+    slabs_free(engine, chunk, sizeof(hash_item) + chunk->nbytes, clsid);
+}
+
+/*
+ * Allocate the data chunks for the part of the value of a chunked item
+ * that doesn't fit in the header.
+ */
+static bool item_alloc_chunks(struct default_engine *engine, hash_item *it,
+                              const void *cookie) {
+    size_t remaining = it->nbytes - item_inline_nbytes(engine, it);
+    hash_item *last = NULL;
+
+    while (remaining > 0) {
+        size_t nbytes = engine->config.item_size_max - sizeof(hash_item);
+        hash_item *chunk;
+
+        if (nbytes > remaining) {
+            nbytes = remaining;
+        }
+
+        if ((chunk = item_alloc_chunk(engine, nbytes, nbytes, cookie)) == NULL) {
+            return false;
+        }
+
+        chunk->h_next = it;
+        if (last == NULL) {
+            item_set_chunks(it, chunk);
+        } else {
+            last->next = chunk;
+        }
+        last = chunk;
+        remaining -= nbytes;
+    }
+
+    return true;
+}
+
+/*
+ * Allocate a new item. This function must _NOT_ be called while holding
+ * an item lock, because we might need to grab the item lock for the
+ * item we're going to evict.
+ */
+/*@null@*/
+hash_item *do_item_alloc(struct default_engine *engine,
+                         const void *key,
+                         const size_t nkey,
+                         const int flags,
+                         const rel_time_t exptime,
+                         const int nbytes,
+                         const void *cookie) {
+    hash_item *it = NULL;
+    unsigned int id;
+    bool chunked = false;
+
+    size_t ntotal = item_header_size(engine, nkey, false) + nbytes;
+    if (nkey > ITEM_KEY_MAX_LENGTH) {
+        return NULL;
+    }
+    if ((id = slabs_clsid(engine, ntotal)) == 0) {
+        if (!item_size_ok(engine, nkey, nbytes)) {
+            return NULL;
+        }
+        ntotal = engine->config.item_size_max;
+        id = slabs_clsid(engine, ntotal);
+        chunked = true;
+    }
 
-    assert(it != engine->items.heads[it->slabs_clsid]);
+    if ((it = item_alloc_memory(engine, ntotal, id, cookie)) == NULL) {
+        return NULL;
+    }
 
-    it->next = it->prev = it->h_next = 0;
+    item_set_next(engine, it, NULL);
+    item_set_prev(engine, it, NULL);
+    item_set_h_next(engine, it, NULL);
+    it->lru = LRU_HOT;
+    it->vbucket = 0;
     it->refcount = 1;     /* the caller will have a reference */
     DEBUG_REFCNT(it, '*');
     it->iflag = engine->config.use_cas ? ITEM_WITH_CAS : 0;
+    if (engine->config.compact_items) {
+        it->iflag |= ITEM_COMPACT;
+    }
+    if (chunked) {
+        it->iflag |= ITEM_CHUNKED;
+        item_set_chunks(it, NULL);
+    }
+    item_set_cas(NULL, NULL, it, 0);
     it->nkey = nkey;
     it->nbytes = nbytes;
     it->flags = flags;
     memcpy((void*)item_get_key(it), key, nkey);
     it->exptime = exptime;
+
+    if (chunked && !item_alloc_chunks(engine, it, cookie)) {
+        it->refcount = 0;
+        item_free(engine, it);
+        return NULL;
+    }
+
     return it;
 }
 
+/* Return the data chunks of a chunked item to the slab allocator */
+static void item_free_chunks(struct default_engine *engine, hash_item *it) {
+    hash_item *chunk = item_get_chunks(it);
+
+    item_set_chunks(it, NULL);
+    while (chunk != NULL) {
+        hash_item *next = chunk->next;
+        item_free_chunk(engine, chunk);
+        chunk = next;
+    }
+}
+
 static void item_free(struct default_engine *engine, hash_item *it) {
     size_t ntotal = ITEM_ntotal(engine, it);
     unsigned int clsid;
+
+    if (it->slabs_clsid == 0) {
+        /* A decompressed copy (see item_decompress) */
+        free(it);
+        return;
+    }
+
     assert((it->iflag & ITEM_LINKED) == 0);
-    assert(it != engine->items.heads[it->slabs_clsid]);
-    assert(it != engine->items.tails[it->slabs_clsid]);
+    assert(it != engine->items.heads[it->slabs_clsid][it->lru & ITEM_LRU_SEGMENT_MASK]);
+    assert(it != engine->items.tails[it->slabs_clsid][it->lru & ITEM_LRU_SEGMENT_MASK]);
     assert(it->refcount == 0);
 
+    if ((it->iflag & ITEM_CHUNKED) != 0) {
+        item_free_chunks(engine, it);
+    }
+
     /* so slab size changer can tell later if item is already free or not */
     clsid = it->slabs_clsid;
     it->slabs_clsid = 0;
@@ -242,124 +1471,175 @@ static void item_free(struct default_engine *engine, hash_item *it) {
     slabs_free(engine, it, ntotal, clsid);
 }
 
+/*
+ * Set or clear the linked bit of the refcount. The caller must hold the
+ * item lock, but the references may be released concurrently.
+ *
+ * Returns the new refcount.
+ */
+static unsigned short item_set_ref_linked(hash_item *it, bool linked) {
+    unsigned short refcount;
+    unsigned short next;
+
+    do {
+        refcount = it->refcount;
+        if (linked) {
+            next = refcount | ITEM_REF_LINKED;
+        } else {
+            next = refcount & ~ITEM_REF_LINKED;
+        }
+    } while (!ATOMIC_CAS_16(&it->refcount, refcount, next));
+
+    return next;
+}
+
+/* The caller must hold the LRU lock for the slab class */
 static void item_link_q(struct default_engine *engine, hash_item *it) { /* item is the new head */
     hash_item **head, **tail;
+    int segment;
     assert(it->slabs_clsid < POWER_LARGEST);
     assert((it->iflag & ITEM_SLABBED) == 0);
 
-    head = &engine->items.heads[it->slabs_clsid];
-    tail = &engine->items.tails[it->slabs_clsid];
+    segment = it->lru & ITEM_LRU_SEGMENT_MASK;
+    head = &engine->items.heads[it->slabs_clsid][segment];
+    tail = &engine->items.tails[it->slabs_clsid][segment];
     assert(it != *head);
     assert((*head && *tail) || (*head == 0 && *tail == 0));
-    it->prev = 0;
-    it->next = *head;
-    if (it->next) it->next->prev = it;
+    item_set_prev(engine, it, NULL);
+    item_set_next(engine, it, *head);
+    if (*head) item_set_prev(engine, *head, it);
     *head = it;
     if (*tail == 0) *tail = it;
-    engine->items.sizes[it->slabs_clsid]++;
+    engine->items.sizes[it->slabs_clsid][segment]++;
     return;
 }
 
+/* The caller must hold the LRU lock for the slab class */
 static void item_unlink_q(struct default_engine *engine, hash_item *it) {
     hash_item **head, **tail;
+    hash_item *next, *prev;
+    int segment;
     assert(it->slabs_clsid < POWER_LARGEST);
-    head = &engine->items.heads[it->slabs_clsid];
-    tail = &engine->items.tails[it->slabs_clsid];
+    segment = it->lru & ITEM_LRU_SEGMENT_MASK;
+    head = &engine->items.heads[it->slabs_clsid][segment];
+    tail = &engine->items.tails[it->slabs_clsid][segment];
 
+    next = item_get_next(engine, it);
+    prev = item_get_prev(engine, it);
     if (*head == it) {
-        assert(it->prev == 0);
-        *head = it->next;
+        assert(prev == 0);
+        *head = next;
     }
     if (*tail == it) {
-        assert(it->next == 0);
-        *tail = it->prev;
+        assert(next == 0);
+        *tail = prev;
     }
-    assert(it->next != it);
-    assert(it->prev != it);
+    assert(next != it);
+    assert(prev != it);
 
-    if (it->next) it->next->prev = it->prev;
-    if (it->prev) it->prev->next = it->next;
-    engine->items.sizes[it->slabs_clsid]--;
+    if (next) item_set_prev(engine, next, prev);
+    if (prev) item_set_next(engine, prev, next);
+    engine->items.sizes[it->slabs_clsid][segment]--;
     return;
 }
 
-int do_item_link(struct default_engine *engine, hash_item *it) {
+int do_item_link(struct default_engine *engine, hash_item *it, uint32_t hv) {
+    size_t nbytes;
     MEMCACHED_ITEM_LINK(item_get_key(it), it->nkey, it->nbytes);
     assert((it->iflag & (ITEM_LINKED|ITEM_SLABBED)) == 0);
-    assert(it->nbytes < (1024 * 1024));  /* 1MB max size */
+    assert(it->nbytes < (1024 * 1024) ||  /* 1MB max size */
+           (it->iflag & ITEM_CHUNKED) != 0);
     it->iflag |= ITEM_LINKED;
+    item_set_ref_linked(it, true);
     it->time = engine->server.core->get_current_time();
-    assoc_insert(engine, engine->server.core->hash(item_get_key(it),
-                                                        it->nkey, 0),
-                 it);
-
-    cb_mutex_enter(&engine->stats.lock);
-    engine->stats.curr_bytes += ITEM_ntotal(engine, it);
-    engine->stats.curr_items += 1;
-    engine->stats.total_items += 1;
-    cb_mutex_exit(&engine->stats.lock);
+    it->lru = LRU_HOT;
 
     /* Allocate a new CAS ID on link. */
     item_set_cas(NULL, NULL, it, get_cas_id());
+    assoc_insert(engine, hv, it);
+
+    nbytes = item_memory(engine, it);
+    vbucket_stats_update(engine, it, 1, nbytes, true);
 
+    cb_mutex_enter(&engine->items.lru_locks[it->slabs_clsid]);
+    item_counts_update(engine, it, 1, nbytes);
     item_link_q(engine, it);
+    cb_mutex_exit(&engine->items.lru_locks[it->slabs_clsid]);
+
+    item_expiry_add(engine, it);
 
     return 1;
 }
 
-void do_item_unlink(struct default_engine *engine, hash_item *it) {
+void do_item_unlink(struct default_engine *engine, hash_item *it,
+                    uint32_t hv) {
     MEMCACHED_ITEM_UNLINK(item_get_key(it), it->nkey, it->nbytes);
     if ((it->iflag & ITEM_LINKED) != 0) {
+        int64_t nbytes = (int64_t)item_memory(engine, it);
         it->iflag &= ~ITEM_LINKED;
-        cb_mutex_enter(&engine->stats.lock);
-        engine->stats.curr_bytes -= ITEM_ntotal(engine, it);
-        engine->stats.curr_items -= 1;
-        cb_mutex_exit(&engine->stats.lock);
-        assoc_delete(engine, engine->server.core->hash(item_get_key(it),
-                                                            it->nkey, 0),
-                     item_get_key(it), it->nkey);
+        vbucket_stats_update(engine, it, -1, -nbytes, false);
+        assoc_delete(engine, hv, item_get_key(it), it->nkey);
+        cb_mutex_enter(&engine->items.lru_locks[it->slabs_clsid]);
+        item_counts_update(engine, it, -1, -nbytes);
         item_unlink_q(engine, it);
-        if (it->refcount == 0) {
+        cb_mutex_exit(&engine->items.lru_locks[it->slabs_clsid]);
+        /*
+         * Nobody may pin the item once it is removed from the LRU, but
+         * the references may be released (without any locks) at any
+         * time. Free the item if nobody is using it, otherwise the last
+         * one to release it will.
+         */
+        if (item_set_ref_linked(it, false) == 0) {
             item_free(engine, it);
         }
     }
 }
 
+/*
+ * Release a reference to an item. This doesn't need any locks; the
+ * refcount tells us if we dropped the last reference to an unlinked item
+ * (see ITEM_REF_LINKED).
+ */
 void do_item_release(struct default_engine *engine, hash_item *it) {
+    unsigned short refcount;
+
     MEMCACHED_ITEM_REMOVE(item_get_key(it), it->nkey, it->nbytes);
-    if (it->refcount != 0) {
-        it->refcount--;
-        DEBUG_REFCNT(it, '-');
-    }
-    if (it->refcount == 0 && (it->iflag & ITEM_LINKED) == 0) {
+    do {
+        refcount = it->refcount;
+        if ((refcount & ~ITEM_REF_LINKED) == 0) {
+            /* The reference was dropped by the tail repair */
+            return;
+        }
+    } while (!ATOMIC_CAS_16(&it->refcount, refcount, refcount - 1));
+    DEBUG_REFCNT(it, '-');
+
+    if (refcount == 1) {
         item_free(engine, it);
     }
 }
 
+/*
+ * Accessing an item only marks it as active (we don't want to grab the LRU
+ * lock and relink the item on every access). The LRU maintainer (or the
+ * eviction code) moves active items to the warm segment of the LRU.
+ */
 void do_item_update(struct default_engine *engine, hash_item *it) {
-    rel_time_t current_time = engine->server.core->get_current_time();
     MEMCACHED_ITEM_UPDATE(item_get_key(it), it->nkey, it->nbytes);
-    if (it->time < current_time - ITEM_UPDATE_INTERVAL) {
-        assert((it->iflag & ITEM_SLABBED) == 0);
-
-        if ((it->iflag & ITEM_LINKED) != 0) {
-            item_unlink_q(engine, it);
-            it->time = current_time;
-            item_link_q(engine, it);
-        }
+    assert((it->iflag & ITEM_SLABBED) == 0);
+    if ((it->lru & ITEM_LRU_ACTIVE) == 0) {
+        ATOMIC_OR_8(&it->lru, ITEM_LRU_ACTIVE);
     }
 }
 
 int do_item_replace(struct default_engine *engine,
-                    hash_item *it, hash_item *new_it) {
+                    hash_item *it, hash_item *new_it, uint32_t hv) {
     MEMCACHED_ITEM_REPLACE(item_get_key(it), it->nkey, it->nbytes,
                            item_get_key(new_it), new_it->nkey, new_it->nbytes);
     assert((it->iflag & ITEM_SLABBED) == 0);
 
-    do_item_unlink(engine, it);
-    return do_item_link(engine, new_it);
+    do_item_unlink(engine, it, hv);
+    return do_item_link(engine, new_it, hv);
 }
-
 /*@null@*/
 static char *do_item_cachedump(const unsigned int slabs_clsid,
                                const unsigned int limit,
@@ -394,7 +1674,7 @@ static char *do_item_cachedump(const unsigned int slabs_clsid,
         memcpy(buffer + bufcurr, temp, len);
         bufcurr += len;
         shown++;
-        it = it->next;
+        it = item_get_next(engine, it);
     }
 
 
@@ -410,37 +1690,50 @@ static char *do_item_cachedump(const unsigned int slabs_clsid,
     return NULL;
 }
 
+/* Does the slab class have any items (or cursors) in its LRU */
+static bool lru_is_empty(struct default_engine *engine, unsigned int id) {
+    return engine->items.tails[id][LRU_HOT] == NULL &&
+        engine->items.tails[id][LRU_WARM] == NULL &&
+        engine->items.tails[id][LRU_COLD] == NULL;
+}
+
 static void do_item_stats(struct default_engine *engine,
                           ADD_STAT add_stats, const void *c) {
     int i;
-    rel_time_t current_time = engine->server.core->get_current_time();
     for (i = 0; i < POWER_LARGEST; i++) {
-        if (engine->items.tails[i] != NULL) {
+        if (!lru_is_empty(engine, i)) {
             const char *prefix = "items";
             int search = search_items;
-            while (search > 0 &&
-                   engine->items.tails[i] != NULL &&
-                   ((engine->config.oldest_live != 0 && /* Item flushd */
-                     engine->config.oldest_live <= current_time &&
-                     engine->items.tails[i]->time <= engine->config.oldest_live) ||
-                    (engine->items.tails[i]->exptime != 0 && /* and not expired */
-                     engine->items.tails[i]->exptime < current_time))) {
+            unsigned int *sizes = engine->items.sizes[i];
+            hash_item *oldest;
+
+            /* Get rid of the expired / flushed items in the tail */
+            while (search > 0 && lru_pull(engine, i, LRU_PULL_RECLAIM, c)) {
                 --search;
-                if (engine->items.tails[i]->refcount == 0) {
-                    do_item_unlink(engine, engine->items.tails[i]);
-                } else {
-                    break;
-                }
             }
-            if (engine->items.tails[i] == NULL) {
+
+            cb_mutex_enter(&engine->items.lru_locks[i]);
+            if (lru_is_empty(engine, i)) {
                 /* We removed all of the items in this slab class */
+                cb_mutex_exit(&engine->items.lru_locks[i]);
                 continue;
             }
 
+            if ((oldest = lru_tail(engine, i, LRU_COLD)) == NULL &&
+                (oldest = lru_tail(engine, i, LRU_WARM)) == NULL) {
+                oldest = lru_tail(engine, i, LRU_HOT);
+            }
+
             add_statistics(c, add_stats, prefix, i, "number", "%u",
-                           engine->items.sizes[i]);
+                           sizes[LRU_HOT] + sizes[LRU_WARM] + sizes[LRU_COLD]);
+            add_statistics(c, add_stats, prefix, i, "number_hot", "%u",
+                           sizes[LRU_HOT]);
+            add_statistics(c, add_stats, prefix, i, "number_warm", "%u",
+                           sizes[LRU_WARM]);
+            add_statistics(c, add_stats, prefix, i, "number_cold", "%u",
+                           sizes[LRU_COLD]);
             add_statistics(c, add_stats, prefix, i, "age", "%u",
-                           engine->items.tails[i]->time);
+                           oldest ? oldest->time : 0);
             add_statistics(c, add_stats, prefix, i, "evicted",
                            "%u", engine->items.itemstats[i].evicted);
             add_statistics(c, add_stats, prefix, i, "evicted_nonzero",
@@ -453,6 +1746,13 @@ static void do_item_stats(struct default_engine *engine,
                            "%u", engine->items.itemstats[i].tailrepairs);;
             add_statistics(c, add_stats, prefix, i, "reclaimed",
                            "%u", engine->items.itemstats[i].reclaimed);;
+            add_statistics(c, add_stats, prefix, i, "moves_to_cold",
+                           "%u", engine->items.itemstats[i].moves_to_cold);
+            add_statistics(c, add_stats, prefix, i, "moves_to_warm",
+                           "%u", engine->items.itemstats[i].moves_to_warm);
+            add_statistics(c, add_stats, prefix, i, "moves_within_lru",
+                           "%u", engine->items.itemstats[i].moves_within_lru);
+            cb_mutex_exit(&engine->items.lru_locks[i]);
         }
     }
 }
@@ -471,14 +1771,19 @@ static void do_item_stats_sizes(struct default_engine *engine,
 
         /* build the histogram */
         for (i = 0; i < POWER_LARGEST; i++) {
-            hash_item *iter = engine->items.heads[i];
-            while (iter) {
-                int ntotal = ITEM_ntotal(engine, iter);
-                int bucket = ntotal / 32;
-                if ((ntotal % 32) != 0) bucket++;
-                if (bucket < num_buckets) histogram[bucket]++;
-                iter = iter->next;
+            int segment;
+            cb_mutex_enter(&engine->items.lru_locks[i]);
+            for (segment = 0; segment < LRU_SEGMENTS; ++segment) {
+                hash_item *iter = engine->items.heads[i][segment];
+                while (iter) {
+                    int ntotal = ITEM_ntotal(engine, iter);
+                    int bucket = ntotal / 32;
+                    if ((ntotal % 32) != 0) bucket++;
+                    if (bucket < num_buckets) histogram[bucket]++;
+                    iter = item_get_next(engine, iter);
+                }
             }
+            cb_mutex_exit(&engine->items.lru_locks[i]);
         }
 
         /* write the buffer */
@@ -499,11 +1804,10 @@ static void do_item_stats_sizes(struct default_engine *engine,
 
 /** wrapper around assoc_find which does the lazy expiration logic */
 hash_item *do_item_get(struct default_engine *engine,
-                       const char *key, const size_t nkey) {
+                       const char *key, const size_t nkey,
+                       uint32_t hv) {
     rel_time_t current_time = engine->server.core->get_current_time();
-    hash_item *it = assoc_find(engine, engine->server.core->hash(key,
-                                                                      nkey, 0),
-                               key, nkey);
+    hash_item *it = assoc_find(engine, hv, key, nkey);
     int was_found = 0;
 
     if (engine->config.verbose > 2) {
@@ -520,10 +1824,8 @@ hash_item *do_item_get(struct default_engine *engine,
         }
     }
 
-    if (it != NULL && engine->config.oldest_live != 0 &&
-        engine->config.oldest_live <= current_time &&
-        it->time <= engine->config.oldest_live) {
-        do_item_unlink(engine, it);           /* MTSAFE - cache_lock held */
+    if (it != NULL && item_is_flushed(engine, it, current_time)) {
+        do_item_unlink(engine, it, hv);       /* MTSAFE - item lock held */
         it = NULL;
     }
 
@@ -535,7 +1837,7 @@ hash_item *do_item_get(struct default_engine *engine,
     }
 
     if (it != NULL && it->exptime != 0 && it->exptime <= current_time) {
-        do_item_unlink(engine, it);           /* MTSAFE - cache_lock held */
+        do_item_unlink(engine, it, hv);       /* MTSAFE - item lock held */
         it = NULL;
     }
 
@@ -546,8 +1848,12 @@ hash_item *do_item_get(struct default_engine *engine,
         was_found--;
     }
 
+    if (it != NULL && !item_get_ref(it)) {
+        /* Too many references to the item */
+        it = NULL;
+    }
+
     if (it != NULL) {
-        it->refcount++;
         DEBUG_REFCNT(it, '+');
         do_item_update(engine, it);
     }
@@ -557,26 +1863,26 @@ hash_item *do_item_get(struct default_engine *engine,
 
 /*
  * Stores an item in the cache according to the semantics of one of the set
- * commands. In threaded mode, this is protected by the cache lock.
+ * commands. This is protected by the item lock. Append and prepend needs to
+ * allocate memory, so they're handled by store_item_concat.
  *
  * Returns the state of storage.
  */
 static ENGINE_ERROR_CODE do_store_item(struct default_engine *engine,
                                        hash_item *it, uint64_t *cas,
                                        ENGINE_STORE_OPERATION operation,
-                                       const void *cookie) {
+                                       const void *cookie,
+                                       uint32_t hv) {
     const char *key = item_get_key(it);
-    hash_item *old_it = do_item_get(engine, key, it->nkey);
+    hash_item *old_it = do_item_get(engine, key, it->nkey, hv);
     ENGINE_ERROR_CODE stored = ENGINE_NOT_STORED;
 
-    hash_item *new_it = NULL;
+    assert(operation != OPERATION_APPEND && operation != OPERATION_PREPEND);
 
     if (old_it != NULL && operation == OPERATION_ADD) {
         /* add only adds a nonexistent item, but promote to head of LRU */
         do_item_update(engine, old_it);
-    } else if (!old_it && (operation == OPERATION_REPLACE
-        || operation == OPERATION_APPEND || operation == OPERATION_PREPEND))
-    {
+    } else if (!old_it && operation == OPERATION_REPLACE) {
         /* replace only replaces an existing value; don't store */
     } else if (operation == OPERATION_CAS) {
         /* validate cas operation */
@@ -588,7 +1894,7 @@ static ENGINE_ERROR_CODE do_store_item(struct default_engine *engine,
             /* cas validates */
             /* it and old_it may belong to different classes. */
             /* I'm updating the stats for the one that's getting pushed out */
-            do_item_replace(engine, old_it, it);
+            do_item_replace(engine, old_it, it, hv);
             stored = ENGINE_SUCCESS;
         } else {
             if (engine->config.verbose > 1) {
@@ -602,75 +1908,338 @@ static ENGINE_ERROR_CODE do_store_item(struct default_engine *engine,
             stored = ENGINE_KEY_EEXISTS;
         }
     } else {
+        if (old_it != NULL) {
+            do_item_replace(engine, old_it, it, hv);
+        } else {
+            do_item_link(engine, it, hv);
+        }
+
+        stored = ENGINE_SUCCESS;
+    }
+
+    if (old_it != NULL) {
+        do_item_release(engine, old_it);         /* release our reference */
+    }
+
+    if (stored == ENGINE_SUCCESS) {
+        *cas = item_get_cas(it);
+    }
+
+    return stored;
+}
+
+/*
+ * Values of at least compression_threshold bytes are stored compressed if
+ * the compressed value fits in a smaller slab class. The value of the
+ * compressed item is the length of the raw value (uint32_t) followed by
+ * the compressed data. Returns a new (unlinked) item holding the
+ * compressed value, or NULL if we should store the item as is.
+ */
+static hash_item *item_compress(struct default_engine *engine,
+                                hash_item *it, const void *cookie) {
+    size_t threshold = engine->config.compression_threshold;
+    size_t header = item_header_size(engine, it->nkey, false);
+    uint32_t nraw = it->nbytes;
+    hash_item *new_it = NULL;
+    hrtime_t start;
+    size_t ncompressed;
+    char *buffer;
+
+    if (threshold == 0 || it->nbytes < threshold ||
+        (it->iflag & (ITEM_CHUNKED | ITEM_COUNTER | ITEM_COMPRESSED)) != 0 ||
+        (buffer = malloc(it->nbytes)) == NULL) {
+        return NULL;
+    }
+
+    start = gethrtime();
+    ncompressed = lz_compress(item_get_data(it), it->nbytes,
+                              buffer, it->nbytes);
+    if (ncompressed != 0 &&
+        slabs_clsid(engine, header + sizeof(nraw) + ncompressed) <
+        slabs_clsid(engine, header + it->nbytes)) {
+        new_it = do_item_alloc(engine, item_get_key(it), it->nkey,
+                               it->flags, it->exptime,
+                               (int)(sizeof(nraw) + ncompressed), cookie);
+    }
+
+    if (new_it != NULL) {
+        new_it->iflag |= ITEM_COMPRESSED;
+        new_it->vbucket = it->vbucket;
+        memcpy(item_get_data(new_it), &nraw, sizeof(nraw));
+        memcpy(item_get_data(new_it) + sizeof(nraw), buffer, ncompressed);
+        item_set_cas(NULL, NULL, new_it, item_get_cas(it));
+    }
+    free(buffer);
+
+    ATOMIC_ADD_64(&engine->stats.compress_time, gethrtime() - start);
+    if (new_it != NULL) {
+        ATOMIC_INCR_64(&engine->stats.compressed_items);
+        ATOMIC_ADD_64(&engine->stats.compress_bytes_in, nraw);
+        ATOMIC_ADD_64(&engine->stats.compress_bytes_out, ncompressed);
+    }
+
+    return new_it;
+}
+
+hash_item *item_decompress(struct default_engine *engine, hash_item *it) {
+    hash_item *new_it;
+    hrtime_t start;
+    uint32_t nraw;
+    bool ok;
+
+    assert((it->iflag & ITEM_COMPRESSED) != 0);
+    memcpy(&nraw, item_get_data(it), sizeof(nraw));
+    new_it = calloc(1, item_header_size(engine, it->nkey, false) + nraw);
+    if (new_it == NULL) {
+        return NULL;
+    }
+
+    new_it->time = it->time;
+    new_it->exptime = it->exptime;
+    new_it->nbytes = nraw;
+    new_it->flags = it->flags;
+    new_it->nkey = it->nkey;
+    new_it->iflag = it->iflag & (ITEM_WITH_CAS | ITEM_COMPACT);
+    new_it->refcount = 1;     /* the caller will have a reference */
+    new_it->vbucket = it->vbucket;
+    memcpy((void*)item_get_key(new_it), item_get_key(it), it->nkey);
+    item_set_cas(NULL, NULL, new_it, item_get_cas(it));
+
+    start = gethrtime();
+    ok = lz_decompress(item_get_data(it) + sizeof(nraw),
+                       it->nbytes - sizeof(nraw),
+                       item_get_data(new_it), nraw);
+    ATOMIC_ADD_64(&engine->stats.decompress_time, gethrtime() - start);
+
+    if (!ok) {
+        free(new_it);
+        return NULL;
+    }
+
+    return new_it;
+}
+
+/* What do_item_append_inplace did */
+enum append_result {
+    /** The value was appended to the item */
+    APPEND_DONE,
+    /** We need a new data chunk for the item (allocated by the caller) */
+    APPEND_NEED_CHUNK,
+    /** The item must be replaced with a copy holding both values */
+    APPEND_COPY
+};
+
+/* The maximum number of segments we'll grow a chunked item to */
+#define APPEND_MAX_SEGMENTS 64
+
+/*
+ * Append the value of it to old_it without copying the old value: into
+ * the slack at the end of the chunk holding the last part of the value,
+ * or into a new data chunk linked to a chunked item. The readers use the
+ * value of the items without holding any locks, so we may only modify the
+ * item if we hold the only reference to it (like do_add_delta). The
+ * caller must hold the item lock.
+ *
+ * Items growing past APPEND_MAX_SEGMENTS (or being read or appended to
+ * concurrently) are compacted by replacing them with a copy.
+ */
+static enum append_result do_item_append_inplace(struct default_engine *engine,
+                                                 hash_item *old_it,
+                                                 const hash_item *it,
+                                                 hash_item **chunk) {
+    hash_item *tail = old_it;
+    size_t nsegments = 1;
+    size_t used, room;
+
+    if (ITEM_REFCOUNT(old_it) != 1 ||
+        (old_it->iflag & (ITEM_COUNTER | ITEM_COMPRESSED)) != 0 ||
+        (it->iflag & ITEM_CHUNKED) != 0) {
+        return APPEND_COPY;
+    }
+
+    if ((old_it->iflag & ITEM_CHUNKED) != 0) {
+        hash_item *next;
+        if ((size_t)old_it->nbytes + it->nbytes > engine->config.large_item_max) {
+            return APPEND_COPY;
+        }
+        for (next = item_get_chunks(old_it); next != NULL; next = next->next) {
+            tail = next;
+            ++nsegments;
+        }
+        used = sizeof(hash_item) + tail->nbytes;
+    } else {
+        used = ITEM_ntotal(engine, old_it);
+    }
+
+    room = slabs_chunk_size(engine, tail->slabs_clsid);
+    room = room > used ? room - used : 0;
+    if (room >= it->nbytes) {
+        memcpy((char*)tail + used, item_get_data(it), it->nbytes);
+        slabs_adjust_mem_requested(engine, tail->slabs_clsid, used,
+                                   used + it->nbytes);
+        if (tail != old_it) {
+            tail->nbytes += it->nbytes;
+        }
+        cb_mutex_enter(&engine->items.lru_locks[old_it->slabs_clsid]);
+        item_counts_update(engine, old_it, 0, it->nbytes);
+        cb_mutex_exit(&engine->items.lru_locks[old_it->slabs_clsid]);
+        vbucket_stats_update(engine, old_it, 0, it->nbytes, true);
+    } else if (tail == old_it || nsegments >= APPEND_MAX_SEGMENTS) {
+        return APPEND_COPY;
+    } else if (*chunk == NULL || (*chunk)->nbytes != it->nbytes) {
+        return APPEND_NEED_CHUNK;
+    } else {
+        memcpy(*chunk + 1, item_get_data(it), it->nbytes);
+        (*chunk)->h_next = old_it;
+        tail->next = *chunk;
+        *chunk = NULL;
+        cb_mutex_enter(&engine->items.lru_locks[old_it->slabs_clsid]);
+        item_counts_update(engine, old_it, 0, sizeof(hash_item) + it->nbytes);
+        cb_mutex_exit(&engine->items.lru_locks[old_it->slabs_clsid]);
+        vbucket_stats_update(engine, old_it, 0,
+                             sizeof(hash_item) + it->nbytes, true);
+    }
+
+    old_it->nbytes += it->nbytes;
+    old_it->time = engine->server.core->get_current_time();
+    item_set_cas(NULL, NULL, old_it, get_cas_id());
+    return APPEND_DONE;
+}
+
+/*
+ * Append - combine new and old record into single one. We can't allocate
+ * the new item while holding the item lock, so we grab a reference to the
+ * old item, build the new one without holding the lock and verify that
+ * the old item wasn't replaced in the meantime before we link the new
+ * one (and retry if it was). Appends are done in place when possible
+ * (see do_item_append_inplace).
+ */
+static ENGINE_ERROR_CODE store_item_concat(struct default_engine *engine,
+                                           hash_item *it, uint64_t *cas,
+                                           ENGINE_STORE_OPERATION operation,
+                                           const void *cookie,
+                                           uint32_t hv) {
+    const char *key = item_get_key(it);
+    ENGINE_ERROR_CODE stored;
+    hash_item *chunk = NULL;
+    bool retry;
+
+    do {
+        hash_item *old_it;
+        hash_item *new_it;
+        hash_item *src;
+
+        item_lock(engine, hv);
+        old_it = do_item_get(engine, key, it->nkey, hv);
+        if (old_it == NULL) {
+            /* append only appends to an existing value; don't store */
+            item_unlock(engine, hv);
+            stored = ENGINE_NOT_STORED;
+            break;
+        }
+
         /*
-         * Append - combine new and old record into single one. Here it's
-         * atomic and thread-safe.
+         * Validate CAS
          */
-        if (operation == OPERATION_APPEND || operation == OPERATION_PREPEND) {
-            /*
-             * Validate CAS
-             */
-            if (item_get_cas(it) != 0) {
-                /* CAS much be equal */
-                if (item_get_cas(it) != item_get_cas(old_it)) {
-                    stored = ENGINE_KEY_EEXISTS;
-                }
+        if (item_get_cas(it) != 0) {
+            /* CAS much be equal */
+            if (item_get_cas(it) != item_get_cas(old_it)) {
+                do_item_release(engine, old_it);
+                item_unlock(engine, hv);
+                stored = ENGINE_KEY_EEXISTS;
+                break;
             }
+        }
 
-            if (stored == ENGINE_NOT_STORED) {
-                /* we have it and old_it here - alloc memory to hold both */
-                new_it = do_item_alloc(engine, key, it->nkey,
-                                       old_it->flags,
-                                       old_it->exptime,
-                                       it->nbytes + old_it->nbytes,
-                                       cookie);
+        if (operation == OPERATION_APPEND) {
+            enum append_result res;
+            res = do_item_append_inplace(engine, old_it, it, &chunk);
+            if (res == APPEND_DONE) {
+                *cas = item_get_cas(old_it);
+                do_item_release(engine, old_it);
+                item_unlock(engine, hv);
+                stored = ENGINE_SUCCESS;
+                break;
+            } else if (res == APPEND_NEED_CHUNK) {
+                size_t reserve = old_it->nbytes / 8;
+                do_item_release(engine, old_it);
+                item_unlock(engine, hv);
 
-                if (new_it == NULL) {
+                if (chunk != NULL) {
+                    item_free_chunk(engine, chunk);
+                }
+                chunk = item_alloc_chunk(engine, it->nbytes, reserve, cookie);
+                if (chunk == NULL) {
                     /* SERVER_ERROR out of memory */
-                    if (old_it != NULL) {
-                        do_item_release(engine, old_it);
-                    }
-
-                    return ENGINE_NOT_STORED;
+                    stored = ENGINE_NOT_STORED;
+                    break;
                 }
+                retry = true;
+                continue;
+            }
+        }
+        item_unlock(engine, hv);
 
-                /* copy data from it and old_it to new_it */
+        src = old_it;
+        if ((old_it->iflag & ITEM_COMPRESSED) != 0 &&
+            (src = item_decompress(engine, old_it)) == NULL) {
+            item_release(engine, old_it);
+            stored = ENGINE_NOT_STORED;
+            break;
+        }
 
-                if (operation == OPERATION_APPEND) {
-                    memcpy(item_get_data(new_it), item_get_data(old_it), old_it->nbytes);
-                    memcpy(item_get_data(new_it) + old_it->nbytes, item_get_data(it), it->nbytes);
-                } else {
-                    /* OPERATION_PREPEND */
-                    memcpy(item_get_data(new_it), item_get_data(it), it->nbytes);
-                    memcpy(item_get_data(new_it) + it->nbytes, item_get_data(old_it), old_it->nbytes);
-                }
+        /* we have it and old_it here - alloc memory to hold both */
+        new_it = do_item_alloc(engine, key, it->nkey,
+                               old_it->flags,
+                               old_it->exptime,
+                               it->nbytes + src->nbytes,
+                               cookie);
 
-                it = new_it;
+        if (new_it == NULL) {
+            /* SERVER_ERROR out of memory */
+            if (src != old_it) {
+                item_release(engine, src);
             }
+            item_release(engine, old_it);
+            stored = ENGINE_NOT_STORED;
+            break;
         }
+        new_it->vbucket = it->vbucket;
 
-        if (stored == ENGINE_NOT_STORED) {
-            if (old_it != NULL) {
-                do_item_replace(engine, old_it, it);
-            } else {
-                do_item_link(engine, it);
-            }
+        /*
+         * copy data from it and old_it to new_it. Our reference prevents
+         * anyone from modifying old_it in place.
+         */
+        if (operation == OPERATION_APPEND) {
+            item_copy_value(engine, new_it, 0, src);
+            item_copy_value(engine, new_it, src->nbytes, it);
+        } else {
+            /* OPERATION_PREPEND */
+            item_copy_value(engine, new_it, 0, it);
+            item_copy_value(engine, new_it, it->nbytes, src);
+        }
+        if (src != old_it) {
+            item_release(engine, src);
+        }
 
-            *cas = item_get_cas(it);
+        item_lock(engine, hv);
+        if ((old_it->iflag & ITEM_LINKED) != 0) {
+            do_item_replace(engine, old_it, new_it, hv);
+            *cas = item_get_cas(new_it);
             stored = ENGINE_SUCCESS;
+            retry = false;
+        } else {
+            /* Someone replaced (or deleted) the item; try again */
+            stored = ENGINE_NOT_STORED;
+            retry = true;
         }
-    }
-
-    if (old_it != NULL) {
-        do_item_release(engine, old_it);         /* release our reference */
-    }
-
-    if (new_it != NULL) {
+        do_item_release(engine, old_it);
         do_item_release(engine, new_it);
-    }
+        item_unlock(engine, hv);
+    } while (retry);
 
-    if (stored == ENGINE_SUCCESS) {
-        *cas = item_get_cas(it);
+    if (chunk != NULL) {
+        item_free_chunk(engine, chunk);
     }
 
     return stored;
@@ -680,33 +2249,84 @@ static ENGINE_ERROR_CODE do_store_item(struct default_engine *engine,
 /*
  * adds a delta value to a numeric item.
  *
- * c     connection requesting the operation
  * it    item to adjust
  * incr  true to increment value, false to decrement
  * delta amount to adjust value by
- * buf   buffer for response string
+ * buf   buffer for the new value
+ * nbuf  the length of the new value (OUT)
  *
- * returns a response string to send back to the client.
+ * The value is updated in place if possible. Otherwise replace is set
+ * and the caller must create a new item with the value in buf (without
+ * holding the item lock).
  */
+static uint64_t item_counter_get(const hash_item *it) {
+    uint64_t value;
+    memcpy(&value, item_get_data(it) + COUNTER_DIGITS, sizeof(value));
+    return value;
+}
+
+static void item_counter_set(hash_item *it, uint64_t value) {
+    char digits[COUNTER_DIGITS];
+    int pos = COUNTER_DIGITS;
+    uint64_t v = value;
+
+    do {
+        digits[--pos] = (char)('0' + (v % 10));
+        v /= 10;
+    } while (v != 0);
+
+    memcpy(item_get_data(it), digits + pos, COUNTER_DIGITS - pos);
+    memcpy(item_get_data(it) + COUNTER_DIGITS, &value, sizeof(value));
+    it->nbytes = COUNTER_DIGITS - pos;
+}
+
+static hash_item *do_item_alloc_counter(struct default_engine *engine,
+                                        const void *key, const size_t nkey,
+                                        const int flags,
+                                        const rel_time_t exptime,
+                                        uint64_t value,
+                                        const void *cookie) {
+    hash_item *it = do_item_alloc(engine, key, nkey, flags, exptime,
+                                  (int)COUNTER_NBYTES, cookie);
+    if (it != NULL) {
+        it->iflag |= ITEM_COUNTER;
+        item_counter_set(it, value);
+    }
+    return it;
+}
+
 static ENGINE_ERROR_CODE do_add_delta(struct default_engine *engine,
                                       hash_item *it, const bool incr,
                                       const int64_t delta, uint64_t *rcas,
-                                      uint64_t *result, const void *cookie) {
-    const char *ptr;
+                                      uint64_t *result, bool *replace) {
     uint64_t value;
-    char buf[80];
-    int res;
 
-    if (it->nbytes >= (sizeof(buf) - 1)) {
-        return ENGINE_EINVAL;
-    }
+    if ((it->iflag & ITEM_COUNTER) != 0) {
+        value = item_counter_get(it);
+    } else {
+        char buf[128];
+
+        if ((it->iflag & ITEM_COMPRESSED) != 0) {
+            uint32_t nraw;
+            memcpy(&nraw, item_get_data(it), sizeof(nraw));
+            if (nraw >= (sizeof(buf) - 1) ||
+                !lz_decompress(item_get_data(it) + sizeof(nraw),
+                               it->nbytes - sizeof(nraw), buf, nraw)) {
+                return ENGINE_EINVAL;
+            }
+            buf[nraw] = '\0';
+        } else {
+            if (it->nbytes >= (sizeof(buf) - 1)) {
+                return ENGINE_EINVAL;
+            }
 
-    ptr = item_get_data(it);
-    memcpy(buf, ptr, it->nbytes);
-    buf[it->nbytes] = '\0';
+            memcpy(buf, item_get_data(it), it->nbytes);
+            buf[it->nbytes] = '\0';
+        }
 
-    if (!safe_strtoull(buf, &value)) {
-        return ENGINE_EINVAL;
+        if (!safe_strtoull(buf, &value)) {
+            return ENGINE_EINVAL;
+        }
     }
 
     if (incr) {
@@ -720,29 +2340,18 @@ static ENGINE_ERROR_CODE do_add_delta(struct default_engine *engine,
     }
 
     *result = value;
-    if ((res = snprintf(buf, sizeof(buf), "%" PRIu64, value)) == -1) {
-        return ENGINE_EINVAL;
-    }
 
-    if (it->refcount == 1 && res <= it->nbytes) {
+    /* our reference is the only one */
+    if ((it->iflag & ITEM_COUNTER) != 0 && ITEM_REFCOUNT(it) == 1) {
         /* we can do inline replacement */
-        memcpy(item_get_data(it), buf, res);
-        memset(item_get_data(it) + res, ' ', it->nbytes - res);
+        item_counter_set(it, value);
         item_set_cas(NULL, NULL, it, get_cas_id());
         *rcas = item_get_cas(it);
-    } else {
-        hash_item *new_it = do_item_alloc(engine, item_get_key(it),
-                                          it->nkey, it->flags,
-                                          it->exptime, res,
-                                          cookie);
-        if (new_it == NULL) {
-            do_item_unlink(engine, it);
-            return ENGINE_ENOMEM;
-        }
-        memcpy(item_get_data(new_it), buf, res);
-        do_item_replace(engine, it, new_it);
-        *rcas = item_get_cas(new_it);
-        do_item_release(engine, new_it);       /* release our reference */
+        *replace = false;
+        vbucket_stats_update(engine, it, 0, 0, true);
+    } else {
+        /* Replace it with a counter (once), or leave it to the readers */
+        *replace = true;
     }
 
     return ENGINE_SUCCESS;
@@ -756,11 +2365,7 @@ static ENGINE_ERROR_CODE do_add_delta(struct default_engine *engine,
 hash_item *item_alloc(struct default_engine *engine,
                       const void *key, size_t nkey, int flags,
                       rel_time_t exptime, int nbytes, const void *cookie) {
-    hash_item *it;
-    cb_mutex_enter(&engine->cache_lock);
-    it = do_item_alloc(engine, key, nkey, flags, exptime, nbytes, cookie);
-    cb_mutex_exit(&engine->cache_lock);
-    return it;
+    return do_item_alloc(engine, key, nkey, flags, exptime, nbytes, cookie);
 }
 
 /*
@@ -770,9 +2375,13 @@ hash_item *item_alloc(struct default_engine *engine,
 hash_item *item_get(struct default_engine *engine,
                     const void *key, const size_t nkey) {
     hash_item *it;
-    cb_mutex_enter(&engine->cache_lock);
-    it = do_item_get(engine, key, nkey);
-    cb_mutex_exit(&engine->cache_lock);
+    uint32_t hv = engine->server.core->hash(key, nkey, 0);
+    if (engine->items.policy->access != NULL) {
+        engine->items.policy->access(engine, hv);
+    }
+    item_lock(engine, hv);
+    it = do_item_get(engine, key, nkey, hv);
+    item_unlock(engine, hv);
     return it;
 }
 
@@ -781,61 +2390,63 @@ hash_item *item_get(struct default_engine *engine,
  * needed.
  */
 void item_release(struct default_engine *engine, hash_item *item) {
-    cb_mutex_enter(&engine->cache_lock);
     do_item_release(engine, item);
-    cb_mutex_exit(&engine->cache_lock);
 }
 
 /*
  * Unlinks an item from the LRU and hashtable.
  */
 void item_unlink(struct default_engine *engine, hash_item *item) {
-    cb_mutex_enter(&engine->cache_lock);
-    do_item_unlink(engine, item);
-    cb_mutex_exit(&engine->cache_lock);
-}
-
-static ENGINE_ERROR_CODE do_arithmetic(struct default_engine *engine,
-                                       const void* cookie,
-                                       const void* key,
-                                       const int nkey,
-                                       const bool increment,
-                                       const bool create,
-                                       const uint64_t delta,
-                                       const uint64_t initial,
-                                       const rel_time_t exptime,
-                                       uint64_t *cas,
-                                       uint64_t *result)
-{
-   hash_item *item = do_item_get(engine, key, nkey);
-   ENGINE_ERROR_CODE ret;
-
-   if (item == NULL) {
-      if (!create) {
-         return ENGINE_KEY_ENOENT;
-      } else {
-         char buffer[128];
-         int len = snprintf(buffer, sizeof(buffer), "%"PRIu64,
-                            (uint64_t)initial);
-
-         item = do_item_alloc(engine, key, nkey, 0, exptime, len, cookie);
-         if (item == NULL) {
-            return ENGINE_ENOMEM;
-         }
-         memcpy((void*)item_get_data(item), buffer, len);
-         if ((ret = do_store_item(engine, item, cas,
-                                  OPERATION_ADD, cookie)) == ENGINE_SUCCESS) {
-             *result = initial;
-             *cas = item_get_cas(item);
-         }
-         do_item_release(engine, item);
-      }
-   } else {
-      ret = do_add_delta(engine, item, increment, delta, cas, result, cookie);
-      do_item_release(engine, item);
-   }
+    uint32_t hv = item_hash(engine, item);
+    item_lock(engine, hv);
+    do_item_unlink(engine, item, hv);
+    item_unlock(engine, hv);
+}
+
+/*
+ * Unlinks the item stored in a chunk of a slab page being moved to another
+ * slab class. The chunk may be free or in the middle of being allocated, so
+ * we only trust what we read once we've found the item in the hash table.
+ */
+bool item_evict_chunk(struct default_engine *engine, hash_item *it,
+                      size_t chunk_size) {
+    const char *key;
+    uint8_t nkey;
+    uint32_t hv;
+    bool ret = false;
+
+    if ((it->iflag & (ITEM_SLABBED | ITEM_CHUNK)) == ITEM_CHUNK) {
+        /* A data chunk goes away with the chunked item owning it */
+        it = it->h_next;
+        if (it == NULL || (it->iflag & ITEM_CHUNKED) == 0) {
+            return false;
+        }
+        chunk_size = engine->config.item_size_max;
+    }
 
-   return ret;
+    nkey = it->nkey;
+    if ((it->iflag & (ITEM_SLABBED | ITEM_CHUNK)) || nkey == 0) {
+        return false;
+    }
+
+    key = item_get_key(it);
+    if (key + nkey > (const char*)it + chunk_size) {
+        return false;
+    }
+
+    /*
+     * The key may be garbage if the item isn't linked yet, but then we
+     * won't find this item in the hash table
+     */
+    hv = engine->server.core->hash(key, nkey, 0);
+    item_lock(engine, hv);
+    if (assoc_find(engine, hv, key, nkey) == it) {
+        do_item_unlink(engine, it, hv);
+        ret = true;
+    }
+    item_unlock(engine, hv);
+
+    return ret;
 }
 
 ENGINE_ERROR_CODE arithmetic(struct default_engine *engine,
@@ -848,16 +2459,89 @@ ENGINE_ERROR_CODE arithmetic(struct default_engine *engine,
                              const uint64_t initial,
                              const rel_time_t exptime,
                              uint64_t *cas,
-                             uint64_t *result)
+                             uint64_t *result,
+                             uint16_t vbucket)
 {
+    uint32_t hv = engine->server.core->hash(key, nkey, 0);
     ENGINE_ERROR_CODE ret;
 
-    cb_mutex_enter(&engine->cache_lock);
-    ret = do_arithmetic(engine, cookie, key, nkey, increment,
-                        create, delta, initial, exptime, cas,
-                        result);
-    cb_mutex_exit(&engine->cache_lock);
-    return ret;
+    /*
+     * We can't allocate new items while holding the item lock, so we
+     * might have to retry if someone else modified the item while we
+     * created the new one.
+     */
+    for (;;) {
+        hash_item *item;
+        hash_item *new_it;
+        bool replace;
+
+        item_lock(engine, hv);
+        item = do_item_get(engine, key, nkey, hv);
+        if (item == NULL) {
+            item_unlock(engine, hv);
+            if (!create) {
+                return ENGINE_KEY_ENOENT;
+            }
+
+            item = do_item_alloc_counter(engine, key, nkey, 0, exptime,
+                                         initial, cookie);
+            if (item == NULL) {
+                return ENGINE_ENOMEM;
+            }
+            item->vbucket = vbucket;
+
+            item_lock(engine, hv);
+            if ((ret = do_store_item(engine, item, cas,
+                                     OPERATION_ADD, cookie, hv)) == ENGINE_SUCCESS) {
+                *result = initial;
+                *cas = item_get_cas(item);
+            }
+            do_item_release(engine, item);
+            item_unlock(engine, hv);
+
+            if (ret != ENGINE_NOT_STORED) {
+                return ret;
+            }
+            /* Someone else created the item in the meantime */
+            continue;
+        }
+
+        ret = do_add_delta(engine, item, increment, delta, cas, result,
+                           &replace);
+        if (ret != ENGINE_SUCCESS || !replace) {
+            do_item_release(engine, item);
+            item_unlock(engine, hv);
+            return ret;
+        }
+        item_unlock(engine, hv);
+
+        new_it = do_item_alloc_counter(engine, key, nkey, item->flags,
+                                       item->exptime, *result, cookie);
+
+        item_lock(engine, hv);
+        if (new_it == NULL) {
+            do_item_unlink(engine, item, hv);
+            do_item_release(engine, item);
+            item_unlock(engine, hv);
+            return ENGINE_ENOMEM;
+        }
+
+        new_it->vbucket = vbucket;
+        if ((item->iflag & ITEM_LINKED) != 0) {
+            do_item_replace(engine, item, new_it, hv);
+            *cas = item_get_cas(new_it);
+        } else {
+            ret = ENGINE_KEY_EEXISTS;
+        }
+        do_item_release(engine, new_it);       /* release our reference */
+        do_item_release(engine, item);
+        item_unlock(engine, hv);
+
+        if (ret == ENGINE_SUCCESS) {
+            return ret;
+        }
+        /* The item was replaced (or deleted) in the meantime */
+    }
 }
 
 /*
@@ -868,21 +2552,43 @@ ENGINE_ERROR_CODE store_item(struct default_engine *engine,
                              ENGINE_STORE_OPERATION operation,
                              const void *cookie) {
     ENGINE_ERROR_CODE ret;
+    uint32_t hv = item_hash(engine, item);
+    hash_item *compressed;
+
+    if (operation == OPERATION_APPEND || operation == OPERATION_PREPEND) {
+        return store_item_concat(engine, item, cas, operation, cookie, hv);
+    }
+
+    /* Compress before we grab the lock */
+    compressed = item_compress(engine, item, cookie);
 
-    cb_mutex_enter(&engine->cache_lock);
-    ret = do_store_item(engine, item, cas, operation, cookie);
-    cb_mutex_exit(&engine->cache_lock);
+    item_lock(engine, hv);
+    if (compressed != NULL) {
+        ret = do_store_item(engine, compressed, cas, operation, cookie, hv);
+        do_item_release(engine, compressed);
+    } else {
+        ret = do_store_item(engine, item, cas, operation, cookie, hv);
+    }
+    item_unlock(engine, hv);
     return ret;
 }
 
 static hash_item *do_touch_item(struct default_engine *engine,
                                      const void *key,
                                      uint16_t nkey,
-                                     uint32_t exptime)
+                                     uint32_t exptime,
+                                     uint32_t hv)
 {
-   hash_item *item = do_item_get(engine, key, nkey);
+   hash_item *item = do_item_get(engine, key, nkey, hv);
    if (item != NULL) {
+       rel_time_t indexed = item->exptime;
        item->exptime = exptime;
+       /* The entry we already have in the wheel puts the item back once
+        * it's due if the expiry time was pushed out, so only an earlier
+        * expiry time needs a new one */
+       if (indexed == 0 || exptime < indexed) {
+           item_expiry_add(engine, item);
+       }
    }
    return item;
 }
@@ -893,51 +2599,162 @@ hash_item *touch_item(struct default_engine *engine,
                            uint32_t exptime)
 {
     hash_item *ret;
+    uint32_t hv = engine->server.core->hash(key, nkey, 0);
 
-    cb_mutex_enter(&engine->cache_lock);
-    ret = do_touch_item(engine, key, nkey, exptime);
-    cb_mutex_exit(&engine->cache_lock);
+    item_lock(engine, hv);
+    ret = do_touch_item(engine, key, nkey, exptime, hv);
+    item_unlock(engine, hv);
     return ret;
 }
 
 /*
- * Flushes expired items after a flush_all call
+ * Unlink the items linked after oldest_live. This is only needed when we
+ * can't use the CAS values to tell the flushed items apart from the ones
+ * stored after the flush_all.
  */
-void item_flush_expired(struct default_engine *engine, time_t when) {
+static void item_flush_hot(struct default_engine *engine,
+                           rel_time_t oldest_live) {
     int i;
-    hash_item *iter, *next;
 
-    cb_mutex_enter(&engine->cache_lock);
+    for (i = 0; i < POWER_LARGEST * LRU_SEGMENTS; i++) {
+        int clsid = i / LRU_SEGMENTS;
+        int segment = i % LRU_SEGMENTS;
+        hash_item *batch[50];
+        const int batch_size = sizeof(batch) / sizeof(batch[0]);
+        int nbatch;
 
-    if (when == 0) {
-        engine->config.oldest_live = engine->server.core->get_current_time() - 1;
-    } else {
-        engine->config.oldest_live = engine->server.core->realtime(when) - 1;
-    }
+        /*
+         * Items are linked at the head of the hot segment, so it is
+         * sorted in decreasing time order (and an item's timestamp
+         * is never changed while it is linked). We only need to walk
+         * back until we hit an item older than the oldest_live time.
+         * Items don't leave the hot segment until they're older than
+         * the oldest_live granularity, so the other segments should
+         * not contain any new items (but we check their heads anyway).
+         * The oldest_live checking will auto-expire the remaining items.
+         * We can't unlink the items while holding the LRU lock, so
+         * pin a batch of them and unlink them afterwards.
+         */
+        do {
+            hash_item *iter;
+            int ii;
 
-    if (engine->config.oldest_live != 0) {
-        for (i = 0; i < POWER_LARGEST; i++) {
-            /*
-             * The LRU is sorted in decreasing time order, and an item's
-             * timestamp is never newer than its last access time, so we
-             * only need to walk back until we hit an item older than the
-             * oldest_live time.
-             * The oldest_live checking will auto-expire the remaining items.
-             */
-            for (iter = engine->items.heads[i]; iter != NULL; iter = next) {
-                if (iter->time >= engine->config.oldest_live) {
-                    next = iter->next;
-                    if ((iter->iflag & ITEM_SLABBED) == 0) {
-                        do_item_unlink(engine, iter);
-                    }
-                } else {
-                    /* We've hit the first old item. Continue to the next queue. */
+            nbatch = 0;
+            cb_mutex_enter(&engine->items.lru_locks[clsid]);
+            for (iter = engine->items.heads[clsid][segment];
+                 iter != NULL && nbatch < batch_size;
+                 iter = item_get_next(engine, iter)) {
+                if (item_is_cursor(iter)) {
+                    /* Ignore cursors */
+                    continue;
+                }
+                if (iter->time < oldest_live) {
+                    /* We've hit the first old item. */
                     break;
                 }
+                if (item_get_ref(iter)) {
+                    batch[nbatch++] = iter;
+                }
+            }
+            cb_mutex_exit(&engine->items.lru_locks[clsid]);
+
+            for (ii = 0; ii < nbatch; ++ii) {
+                item_unlink_pinned(engine, batch[ii], false);
             }
+        } while (nbatch == batch_size);
+    }
+}
+
+/*
+ * Flushes expired items after a flush_all call. The flush itself is a
+ * logical operation (the items are checked against oldest_live and
+ * oldest_cas when they're accessed), and the memory is reclaimed in the
+ * background by the scrubber.
+ */
+void item_flush_expired(struct default_engine *engine, time_t when) {
+    rel_time_t oldest_live;
+
+    if (when == 0) {
+        oldest_live = engine->server.core->get_current_time() - 1;
+        if (engine->config.use_cas) {
+            engine->config.oldest_cas = get_current_cas_id();
+        }
+    } else {
+        oldest_live = engine->server.core->realtime(when) - 1;
+    }
+    engine->config.oldest_live = oldest_live;
+
+    if (when == 0) {
+        if (!engine->config.use_cas && oldest_live != 0) {
+            item_flush_hot(engine, oldest_live);
+        }
+        item_scrub_flushed(engine);
+    }
+}
+
+size_t item_restore(struct default_engine *engine, hash_item *it,
+                    unsigned int clsid, size_t chunk_size, int64_t delta) {
+    rel_time_t current_time = engine->server.core->get_current_time();
+    size_t ntotal;
+    uint32_t hv;
+    int64_t t;
+
+    /*
+     * Chunked items refer to their data chunks with pointers into the
+     * previous mapping of the memory, so we don't restore them
+     */
+    if ((it->iflag & (ITEM_LINKED | ITEM_SLABBED | ITEM_CHUNKED)) != ITEM_LINKED ||
+        it->slabs_clsid != clsid || it->nkey == 0 ||
+        (ntotal = ITEM_ntotal(engine, it)) > chunk_size) {
+        return 0;
+    }
+
+    if (it->exptime != 0) {
+        t = (int64_t)it->exptime + delta;
+        if (t <= (int64_t)current_time) {
+            return 0;
+        }
+        it->exptime = (rel_time_t)t;
+    }
+    t = (int64_t)it->time + delta;
+    it->time = t > 0 ? (rel_time_t)t : 0;
+
+    if ((it->iflag & ITEM_WITH_CAS) != 0) {
+        /* New CAS values must be larger than the ones we restore */
+        uint64_t cas = item_get_cas(it);
+        uint64_t current;
+        while ((current = get_current_cas_id()) < cas &&
+               !ATOMIC_CAS_64(&cas_id, current, cas)) {
+            /* try again */
         }
     }
-    cb_mutex_exit(&engine->cache_lock);
+
+    /* The old list pointers refers to the previous mapping */
+    item_set_next(engine, it, NULL);
+    item_set_prev(engine, it, NULL);
+    item_set_h_next(engine, it, NULL);
+    it->refcount = ITEM_REF_LINKED;
+    it->lru = LRU_COLD;
+
+    hv = engine->server.core->hash(item_get_key(it), it->nkey, 0);
+    item_lock(engine, hv);
+    if (assoc_find(engine, hv, item_get_key(it), it->nkey) != NULL) {
+        ntotal = 0;
+    } else {
+        assoc_insert(engine, hv, it);
+
+        vbucket_stats_update(engine, it, 1, ntotal, true);
+
+        cb_mutex_enter(&engine->items.lru_locks[clsid]);
+        item_counts_update(engine, it, 1, ntotal);
+        item_link_q(engine, it);
+        cb_mutex_exit(&engine->items.lru_locks[clsid]);
+
+        item_expiry_add(engine, it);
+    }
+    item_unlock(engine, hv);
+
+    return ntotal;
 }
 
 /*
@@ -947,45 +2764,124 @@ char *item_cachedump(struct default_engine *engine,
                      unsigned int slabs_clsid,
                      unsigned int limit,
                      unsigned int *bytes) {
-    char *ret;
-
-    cb_mutex_enter(&engine->cache_lock);
-    ret = do_item_cachedump(slabs_clsid, limit, bytes);
-    cb_mutex_exit(&engine->cache_lock);
-    return ret;
+    return do_item_cachedump(slabs_clsid, limit, bytes);
 }
 
 void item_stats(struct default_engine *engine,
                    ADD_STAT add_stat, const void *cookie)
 {
-    cb_mutex_enter(&engine->cache_lock);
     do_item_stats(engine, add_stat, cookie);
-    cb_mutex_exit(&engine->cache_lock);
 }
 
 
 void item_stats_sizes(struct default_engine *engine,
                       ADD_STAT add_stat, const void *cookie)
 {
-    cb_mutex_enter(&engine->cache_lock);
     do_item_stats_sizes(engine, add_stat, cookie);
-    cb_mutex_exit(&engine->cache_lock);
 }
 
+/*
+ * The cursors walks the LRUs of the slab classes (and each of their
+ * segments) in order. The position is identified by
+ * clsid * LRU_SEGMENTS + segment. Items moved between the segments while
+ * the walk is in progress may be missed or seen twice.
+ */
+static int item_cursor_lru(const hash_item *cursor)
+{
+    return cursor->slabs_clsid * LRU_SEGMENTS +
+        (cursor->lru & ITEM_LRU_SEGMENT_MASK);
+}
+
+/* The caller must hold the LRU lock for the slab class */
 static void do_item_link_cursor(struct default_engine *engine,
-                                hash_item *cursor, int ii)
+                                hash_item *cursor, int clsid, int segment)
+{
+    cursor->slabs_clsid = (uint8_t)clsid;
+    cursor->lru = (uint8_t)segment;
+    item_set_next(engine, cursor, NULL);
+    item_set_prev(engine, cursor, engine->items.tails[clsid][segment]);
+    item_set_next(engine, engine->items.tails[clsid][segment], cursor);
+    engine->items.tails[clsid][segment] = cursor;
+    engine->items.sizes[clsid][segment]++;
+}
+
+/*
+ * Compact items may only reference the cursors registered in the cursor
+ * table. The slot (+ 1) is kept in the flags of the cursor, and it is
+ * released once the cursor is no longer linked.
+ */
+static bool item_register_cursor(struct default_engine *engine,
+                                 hash_item *cursor)
+{
+    int ii;
+
+    if (!engine->config.compact_items || cursor->flags != 0) {
+        return true;
+    }
+
+    cb_mutex_enter(&engine->items.cursor_lock);
+    for (ii = 0; ii < ITEM_MAX_CURSORS; ++ii) {
+        if (engine->items.cursors[ii] == NULL) {
+            engine->items.cursors[ii] = cursor;
+            cursor->flags = ii + 1;
+            break;
+        }
+    }
+    cb_mutex_exit(&engine->items.cursor_lock);
+
+    return cursor->flags != 0;
+}
+
+static void item_release_cursor(struct default_engine *engine,
+                                hash_item *cursor)
+{
+    if (cursor->flags != 0) {
+        cb_mutex_enter(&engine->items.cursor_lock);
+        engine->items.cursors[cursor->flags - 1] = NULL;
+        cb_mutex_exit(&engine->items.cursor_lock);
+        cursor->flags = 0;
+    }
+}
+
+/*
+ * Link the cursor at the tail of the first non-empty LRU starting with
+ * position ii. Returns false if there are no more LRUs to walk.
+ */
+static bool item_link_cursor(struct default_engine *engine,
+                             hash_item *cursor, int ii)
 {
-    cursor->slabs_clsid = (uint8_t)ii;
-    cursor->next = NULL;
-    cursor->prev = engine->items.tails[ii];
-    engine->items.tails[ii]->next = cursor;
-    engine->items.tails[ii] = cursor;
-    engine->items.sizes[ii]++;
+    if (!item_register_cursor(engine, cursor)) {
+        return false;
+    }
+
+    for (; ii < POWER_LARGEST * LRU_SEGMENTS; ++ii) {
+        int clsid = ii / LRU_SEGMENTS;
+        int segment = ii % LRU_SEGMENTS;
+        bool linked = false;
+        cb_mutex_enter(&engine->items.lru_locks[clsid]);
+        if (engine->items.heads[clsid][segment] != NULL) {
+            /* add the item at the tail */
+            do_item_link_cursor(engine, cursor, clsid, segment);
+            linked = true;
+        }
+        cb_mutex_exit(&engine->items.lru_locks[clsid]);
+        if (linked) {
+            return true;
+        }
+    }
+
+    item_release_cursor(engine, cursor);
+    return false;
 }
 
+/*
+ * The iterator function is called while holding the LRU lock, so it
+ * must not try to grab the item lock (but it may pin the item).
+ */
 typedef ENGINE_ERROR_CODE (*ITERFUNC)(struct default_engine *engine,
                                       hash_item *item, void *cookie);
 
+/* The caller must hold the LRU lock for the cursors slab class */
 static bool do_item_walk_cursor(struct default_engine *engine,
                                 hash_item *cursor,
                                 int steplength,
@@ -993,29 +2889,31 @@ static bool do_item_walk_cursor(struct default_engine *engine,
                                 void* itemdata,
                                 ENGINE_ERROR_CODE *error)
 {
+    int segment = cursor->lru & ITEM_LRU_SEGMENT_MASK;
     int ii = 0;
     *error = ENGINE_SUCCESS;
 
-    while (cursor->prev != NULL && ii < steplength) {
+    while (item_get_prev(engine, cursor) != NULL && ii < steplength) {
         /* Move cursor */
-        hash_item *ptr = cursor->prev;
+        hash_item *ptr = item_get_prev(engine, cursor);
         bool done = false;
 
         ++ii;
         item_unlink_q(engine, cursor);
 
-        if (ptr == engine->items.heads[cursor->slabs_clsid]) {
+        if (ptr == engine->items.heads[cursor->slabs_clsid][segment]) {
             done = true;
-            cursor->prev = NULL;
+            item_set_prev(engine, cursor, NULL);
         } else {
-            cursor->next = ptr;
-            cursor->prev = ptr->prev;
-            cursor->prev->next = cursor;
-            ptr->prev = cursor;
+            item_set_next(engine, cursor, ptr);
+            item_set_prev(engine, cursor, item_get_prev(engine, ptr));
+            item_set_next(engine, item_get_prev(engine, cursor), cursor);
+            item_set_prev(engine, ptr, cursor);
+            engine->items.sizes[cursor->slabs_clsid][segment]++;
         }
 
         /* Ignore cursors */
-        if (ptr->nkey == 0 && ptr->nbytes == 0) {
+        if (item_is_cursor(ptr)) {
             --ii;
         } else {
             *error = itemfunc(engine, ptr, itemdata);
@@ -1029,19 +2927,25 @@ static bool do_item_walk_cursor(struct default_engine *engine,
         }
     }
 
-    return (cursor->prev != NULL);
+    return (item_get_prev(engine, cursor) != NULL);
 }
 
+/* The expired items found by a single step of the scrubber */
+struct scrub_batch {
+    hash_item *items[200];
+    int nitems;
+};
+
 static ENGINE_ERROR_CODE item_scrub(struct default_engine *engine,
                                     hash_item *item,
                                     void *cookie) {
     rel_time_t current_time = engine->server.core->get_current_time();
-    (void)cookie;
+    struct scrub_batch *batch = cookie;
     engine->scrubber.visited++;
-    if (item->refcount == 0 &&
-        (item->exptime != 0 && item->exptime < current_time)) {
-        do_item_unlink(engine, item);
-        engine->scrubber.cleaned++;
+    if (item->refcount == ITEM_REF_LINKED &&
+        item_is_dead(engine, item, current_time) &&
+        ATOMIC_CAS_16(&item->refcount, ITEM_REF_LINKED, ITEM_REF_LINKED | 1)) {
+        batch->items[batch->nitems++] = item;
     }
     return ENGINE_SUCCESS;
 }
@@ -1052,43 +2956,99 @@ static void item_scrub_class(struct default_engine *engine,
     ENGINE_ERROR_CODE ret;
     bool more;
     do {
-        cb_mutex_enter(&engine->cache_lock);
-        more = do_item_walk_cursor(engine, cursor, 200, item_scrub, NULL, &ret);
-        cb_mutex_exit(&engine->cache_lock);
+        struct scrub_batch batch;
+        int clsid = cursor->slabs_clsid;
+        int ii;
+
+        batch.nitems = 0;
+        cb_mutex_enter(&engine->items.lru_locks[clsid]);
+        more = do_item_walk_cursor(engine, cursor, 200, item_scrub,
+                                   &batch, &ret);
+        cb_mutex_exit(&engine->items.lru_locks[clsid]);
+
+        for (ii = 0; ii < batch.nitems; ++ii) {
+            if (item_unlink_pinned(engine, batch.items[ii], true)) {
+                engine->scrubber.cleaned++;
+            }
+        }
+
         if (ret != ENGINE_SUCCESS) {
             break;
         }
-    } while (more);
+    } while (more && !engine->scrubber.stop);
+
+    if (more) {
+        cb_mutex_enter(&engine->items.lru_locks[cursor->slabs_clsid]);
+        item_unlink_q(engine, cursor);
+        cb_mutex_exit(&engine->items.lru_locks[cursor->slabs_clsid]);
+    }
 }
 
 static void item_scubber_main(void *arg)
 {
     struct default_engine *engine = arg;
     hash_item cursor;
-    int ii;
+    bool restart;
 
-    memset(&cursor, 0, sizeof(cursor));
-    cursor.refcount = 1;
-    for (ii = 0; ii < POWER_LARGEST; ++ii) {
-        bool skip = false;
-        cb_mutex_enter(&engine->cache_lock);
-        if (engine->items.heads[ii] == NULL) {
-            skip = true;
-        } else {
-            /* add the item at the tail */
-            do_item_link_cursor(engine, &cursor, ii);
-        }
-        cb_mutex_exit(&engine->cache_lock);
+    do {
+        int ii = 0;
 
-        if (!skip) {
+        memset(&cursor, 0, sizeof(cursor));
+        cursor.refcount = 1;
+        while (!engine->scrubber.stop &&
+               item_link_cursor(engine, &cursor, ii)) {
             item_scrub_class(engine, &cursor);
+            ii = item_cursor_lru(&cursor) + 1;
         }
-    }
+        item_release_cursor(engine, &cursor);
 
-    cb_mutex_enter(&engine->scrubber.lock);
-    engine->scrubber.stopped = time(NULL);
-    engine->scrubber.running = false;
-    cb_mutex_exit(&engine->scrubber.lock);
+        cb_mutex_enter(&engine->scrubber.lock);
+        restart = engine->scrubber.restart && !engine->scrubber.stop;
+        engine->scrubber.restart = false;
+        if (!restart) {
+            engine->scrubber.stopped = time(NULL);
+            engine->scrubber.running = false;
+        }
+        cb_mutex_exit(&engine->scrubber.lock);
+    } while (restart);
+}
+
+void item_stop_scrub(struct default_engine *engine)
+{
+    bool running;
+
+    engine->scrubber.stop = true;
+    do {
+        cb_mutex_enter(&engine->scrubber.lock);
+        running = engine->scrubber.running;
+        cb_mutex_exit(&engine->scrubber.lock);
+        if (running) {
+#ifdef WIN32
+            Sleep(1);
+#else
+            usleep(250);
+#endif
+        }
+    } while (running);
+}
+
+/* The caller must hold the scrubber lock */
+static bool do_item_start_scrub(struct default_engine *engine)
+{
+    cb_thread_t t;
+
+    engine->scrubber.started = time(NULL);
+    engine->scrubber.stopped = 0;
+    engine->scrubber.visited = 0;
+    engine->scrubber.cleaned = 0;
+    engine->scrubber.running = true;
+
+    if (cb_create_thread(&t, item_scubber_main, engine, 1) != 0)
+    {
+        engine->scrubber.running = false;
+        return false;
+    }
+    return true;
 }
 
 bool item_start_scrub(struct default_engine *engine)
@@ -1096,24 +3056,52 @@ bool item_start_scrub(struct default_engine *engine)
     bool ret = false;
     cb_mutex_enter(&engine->scrubber.lock);
     if (!engine->scrubber.running) {
-        cb_thread_t t;
+        ret = do_item_start_scrub(engine);
+    }
+    cb_mutex_exit(&engine->scrubber.lock);
 
-        engine->scrubber.started = time(NULL);
-        engine->scrubber.stopped = 0;
-        engine->scrubber.visited = 0;
-        engine->scrubber.cleaned = 0;
-        engine->scrubber.running = true;
+    return ret;
+}
 
-        if (cb_create_thread(&t, item_scubber_main, engine, 1) != 0)
-        {
-            engine->scrubber.running = false;
-        } else {
-            ret = true;
-        }
+/*
+ * Reclaim the items invalidated by flush_all. A running scrubber may
+ * already have passed some of them, so let it walk the LRUs again.
+ */
+static void item_scrub_flushed(struct default_engine *engine)
+{
+    cb_mutex_enter(&engine->scrubber.lock);
+    if (engine->scrubber.running) {
+        engine->scrubber.restart = true;
+    } else {
+        do_item_start_scrub(engine);
     }
     cb_mutex_exit(&engine->scrubber.lock);
+}
 
-    return ret;
+/*
+ * Move the cursor one step, and continue with the next LRU when we've
+ * reached the head of the current one. Returns false when there
+ * are no more items to walk.
+ */
+static bool item_step_cursor(struct default_engine *engine,
+                             hash_item *cursor,
+                             ITERFUNC itemfunc,
+                             void *itemdata,
+                             ENGINE_ERROR_CODE *error)
+{
+    int clsid = cursor->slabs_clsid;
+    bool more;
+
+    cb_mutex_enter(&engine->items.lru_locks[clsid]);
+    more = do_item_walk_cursor(engine, cursor, 1, itemfunc, itemdata, error);
+    cb_mutex_exit(&engine->items.lru_locks[clsid]);
+
+    if (!more) {
+        /* find next LRU to look at.. */
+        return item_link_cursor(engine, cursor, item_cursor_lru(cursor) + 1);
+    }
+
+    return true;
 }
 
 struct tap_client {
@@ -1125,18 +3113,21 @@ static ENGINE_ERROR_CODE item_tap_iterfunc(struct default_engine *engine,
                                     hash_item *item,
                                     void *cookie) {
     struct tap_client *client = cookie;
-    client->it = item;
-    ++client->it->refcount;
+    if (item_get_ref(item)) {
+        client->it = item;
+    }
     return ENGINE_SUCCESS;
 }
 
-static tap_event_t do_item_tap_walker(struct default_engine *engine,
-                                         const void *cookie, item **itm,
-                                         void **es, uint16_t *nes, uint8_t *ttl,
-                                         uint16_t *flags, uint32_t *seqno,
-                                         uint16_t *vbucket)
+tap_event_t item_tap_walker(ENGINE_HANDLE* handle,
+                            const void *cookie, item **itm,
+                            void **es, uint16_t *nes, uint8_t *ttl,
+                            uint16_t *flags, uint32_t *seqno,
+                            uint16_t *vbucket)
 {
+    struct default_engine *engine = (struct default_engine*)handle;
     ENGINE_ERROR_CODE r;
+    bool more;
     struct tap_client *client = engine->server.cookie->get_engine_specific(cookie);
     if (client == NULL) {
         return TAP_DISCONNECT;
@@ -1151,47 +3142,27 @@ static tap_event_t do_item_tap_walker(struct default_engine *engine,
     client->it = NULL;
 
     do {
-        if (!do_item_walk_cursor(engine, &client->cursor, 1, item_tap_iterfunc, client, &r)) {
-            /* find next slab class to look at.. */
-            bool linked = false;
-            int ii;
-            for (ii = client->cursor.slabs_clsid + 1; ii < POWER_LARGEST && !linked;  ++ii) {
-                if (engine->items.heads[ii] != NULL) {
-                    /* add the item at the tail */
-                    do_item_link_cursor(engine, &client->cursor, ii);
-                    linked = true;
-                }
-            }
-            if (!linked) {
-                break;
-            }
+        /* The cursor may hand out the last item of the LRUs on the step
+         * which tells us that there are no more */
+        more = item_step_cursor(engine, &client->cursor,
+                                item_tap_iterfunc, client, &r);
+        if (client->it != NULL &&
+            (client->it->iflag & ITEM_COMPRESSED) != 0) {
+            /* The consumers can't handle compressed values (the item is
+             * skipped if we can't allocate the copy) */
+            hash_item *raw = item_decompress(engine, client->it);
+            item_release(engine, client->it);
+            client->it = raw;
         }
-    } while (client->it == NULL);
+    } while (more && client->it == NULL);
     *itm = client->it;
 
     return (*itm == NULL) ? TAP_DISCONNECT : TAP_MUTATION;
 }
 
-tap_event_t item_tap_walker(ENGINE_HANDLE* handle,
-                            const void *cookie, item **itm,
-                            void **es, uint16_t *nes, uint8_t *ttl,
-                            uint16_t *flags, uint32_t *seqno,
-                            uint16_t *vbucket)
-{
-    tap_event_t ret;
-    struct default_engine *engine = (struct default_engine*)handle;
-    cb_mutex_enter(&engine->cache_lock);
-    ret = do_item_tap_walker(engine, cookie, itm, es, nes, ttl, flags, seqno, vbucket);
-    cb_mutex_exit(&engine->cache_lock);
-
-    return ret;
-}
-
 bool initialize_item_tap_walker(struct default_engine *engine,
                                 const void* cookie)
 {
-    bool linked = false;
-    int ii;
     struct tap_client *client = calloc(1, sizeof(*client));
     if (client == NULL) {
         return false;
@@ -1199,15 +3170,7 @@ bool initialize_item_tap_walker(struct default_engine *engine,
     client->cursor.refcount = 1;
 
     /* Link the cursor! */
-    for (ii = 0; ii < POWER_LARGEST && !linked; ++ii) {
-        cb_mutex_enter(&engine->cache_lock);
-        if (engine->items.heads[ii] != NULL) {
-            /* add the item at the tail */
-            do_item_link_cursor(engine, &client->cursor, ii);
-            linked = true;
-        }
-        cb_mutex_exit(&engine->cache_lock);
-    }
+    item_link_cursor(engine, &client->cursor, 0);
 
     engine->server.cookie->store_engine_specific(cookie, client);
     return true;
@@ -1216,54 +3179,33 @@ bool initialize_item_tap_walker(struct default_engine *engine,
 void link_upr_walker(struct default_engine *engine,
                      struct upr_connection *connection)
 {
-    bool linked = false;
-    int ii;
     connection->cursor.refcount = 1;
 
     /* Link the cursor! */
-    for (ii = 0; ii < POWER_LARGEST && !linked; ++ii) {
-        cb_mutex_enter(&engine->cache_lock);
-        if (engine->items.heads[ii] != NULL) {
-            /* add the item at the tail */
-            do_item_link_cursor(engine, &connection->cursor, ii);
-            linked = true;
-        }
-        cb_mutex_exit(&engine->cache_lock);
-    }
+    item_link_cursor(engine, &connection->cursor, 0);
 }
 
 static ENGINE_ERROR_CODE item_upr_iterfunc(struct default_engine *engine,
                                            hash_item *item,
                                            void *cookie) {
     struct upr_connection *connection = cookie;
-    connection->it = item;
-    ++connection->it->refcount;
+    if (item_get_ref(item)) {
+        connection->it = item;
+    }
     return ENGINE_SUCCESS;
 }
 
-static ENGINE_ERROR_CODE do_item_upr_step(struct default_engine *engine,
-                                          struct upr_connection *connection,
-                                          const void *cookie,
-                                          struct upr_message_producers *producers)
+ENGINE_ERROR_CODE item_upr_step(struct default_engine *engine,
+                                struct upr_connection *connection,
+                                const void *cookie,
+                                struct upr_message_producers *producers)
 {
     ENGINE_ERROR_CODE ret = ENGINE_DISCONNECT;
 
     while (connection->it == NULL) {
-        if (!do_item_walk_cursor(engine, &connection->cursor, 1,
-                                 item_upr_iterfunc, connection, &ret)) {
-            /* find next slab class to look at.. */
-            bool linked = false;
-            int ii;
-            for (ii = connection->cursor.slabs_clsid + 1; ii < POWER_LARGEST && !linked;  ++ii) {
-                if (engine->items.heads[ii] != NULL) {
-                    /* add the item at the tail */
-                    do_item_link_cursor(engine, &connection->cursor, ii);
-                    linked = true;
-                }
-            }
-            if (!linked) {
-                break;
-            }
+        if (!item_step_cursor(engine, &connection->cursor,
+                              item_upr_iterfunc, connection, &ret)) {
+            break;
         }
     }
 
@@ -1278,10 +3220,22 @@ static ENGINE_ERROR_CODE do_item_upr_step(struct default_engine *engine,
                                         item_get_cas(connection->it),
                                         0, 0, 0);
             if (ret == ENGINE_SUCCESS) {
-                do_item_unlink(engine, connection->it);
+                uint32_t hv = item_hash(engine, connection->it);
+                item_lock(engine, hv);
+                do_item_unlink(engine, connection->it, hv);
                 do_item_release(engine, connection->it);
+                item_unlock(engine, hv);
             }
         } else {
+            if ((connection->it->iflag & ITEM_COMPRESSED) != 0) {
+                /* The consumers can't handle compressed values */
+                hash_item *raw = item_decompress(engine, connection->it);
+                if (raw == NULL) {
+                    return ENGINE_ENOMEM;
+                }
+                item_release(engine, connection->it);
+                connection->it = raw;
+            }
             ret = producers->mutation(cookie, connection->opaque,
                                       connection->it, 0, 0, 0, 0);
         }
@@ -1295,15 +3249,3 @@ static ENGINE_ERROR_CODE do_item_upr_step(struct default_engine *engine,
 
     return ret;
 }
-
-ENGINE_ERROR_CODE item_upr_step(struct default_engine *engine,
-                                struct upr_connection *connection,
-                                const void *cookie,
-                                struct upr_message_producers *producers)
-{
-    ENGINE_ERROR_CODE ret;
-    cb_mutex_enter(&engine->cache_lock);
-    ret = do_item_upr_step(engine, connection, cookie, producers);
-    cb_mutex_exit(&engine->cache_lock);
-    return ret;
-}
@@ -6,22 +6,85 @@
  * functions.
  */
 typedef struct _hash_item {
-    struct _hash_item *next;
-    struct _hash_item *prev;
-    struct _hash_item *h_next; /* hash chain next */
     rel_time_t time;  /* least recent access */
     rel_time_t exptime; /**< When the item will expire (relative to process
                          * startup) */
     uint32_t nbytes; /**< The total size of the data (in bytes) */
     uint32_t flags; /**< Flags associated with the item (in network byte order)*/
-    uint16_t nkey; /**< The total length of the key (in bytes) */
-    uint16_t iflag; /**< Intermal flags. lower 8 bit is reserved for the core
-                     * server, the upper 8 bits is reserved for engine
-                     * implementation. */
+    uint8_t nkey; /**< The total length of the key (in bytes, at most
+                   * ITEM_KEY_MAX_LENGTH) */
+    uint8_t iflag; /**< Internal flags (ITEM_WITH_CAS, ITEM_LINKED, ...).
+                    * All eight bits are in use; see default_engine.h */
     unsigned short refcount;
     uint8_t slabs_clsid;/* which slab class we're in */
+    uint8_t lru; /**< The LRU segment the item lives in (lower bits) and
+                  * the active bit. Bits 0x04-0x40 are free */
+    uint16_t vbucket; /**< The vbucket the item is stored in */
+    /**
+     * The links of the LRU and the hash chain. Items allocated by an
+     * engine created with "compact_items" use 32 bit references into the
+     * slab memory instead of the pointers, and their CAS and key starts
+     * right after the references (see ITEM_COMPACT). Use the
+     * item_get_next() family of functions to follow the links of items
+     * which may be compact.
+     */
+    union {
+        struct {
+            struct _hash_item *next;
+            struct _hash_item *prev;
+            struct _hash_item *h_next; /* hash chain next */
+        };
+        struct {
+            uint32_t next;
+            uint32_t prev;
+            uint32_t h_next;
+        } ref;
+    };
 } hash_item;
 
+/*
+ * The top bit of the refcount is set while the item is linked. The thread
+ * whose atomic update leaves the refcount at 0 (dropping the last
+ * reference to an unlinked item, or unlinking an item nobody references)
+ * frees the item, so references may be released without any locks.
+ */
+#define ITEM_REF_LINKED 0x8000
+#define ITEM_REFCOUNT(it) ((it)->refcount & ~ITEM_REF_LINKED)
+/* The most references an item may have (the bits below ITEM_REF_LINKED) */
+#define ITEM_REF_MAX (ITEM_REF_LINKED - 1)
+
+/* The length of the key is stored in a single byte */
+#define ITEM_KEY_MAX_LENGTH 255
+
+/* The size of the header of a compact item */
+#define ITEM_COMPACT_HEADER_SIZE \
+    (offsetof(hash_item, ref) + sizeof(((hash_item*)0)->ref))
+
+/*
+ * A reference is the offset of the item in the slab memory in units of
+ * CHUNK_ALIGN_BYTES plus one (0 is NULL). The cursors walking the LRUs
+ * don't live in the slab memory, so they are registered in a table and
+ * use the references from ITEM_REF_CURSOR and up.
+ */
+#define ITEM_MAX_CURSORS 1024
+#define ITEM_REF_CURSOR ((uint32_t)(0 - ITEM_MAX_CURSORS))
+/* The largest cache the references may address */
+#define ITEM_COMPACT_MAX_BYTES ((uint64_t)(ITEM_REF_CURSOR - 1) * CHUNK_ALIGN_BYTES)
+
+/* The segments of the LRU in each slab class */
+#define LRU_HOT 0
+#define LRU_WARM 1
+#define LRU_COLD 2
+#define LRU_SEGMENTS 3
+
+#define ITEM_LRU_SEGMENT_MASK 0x03
+/**
+ * Set when the item is accessed. Reading an item only sets this bit (with
+ * an atomic or), and the LRU maintainer use it to decide if an item should
+ * be moved to the warm segment instead of cold (or evicted).
+ */
+#define ITEM_LRU_ACTIVE 0x80
+
 typedef struct {
     unsigned int evicted;
     unsigned int evicted_nonzero;
@@ -29,15 +92,195 @@ typedef struct {
     unsigned int outofmemory;
     unsigned int tailrepairs;
     unsigned int reclaimed;
+    unsigned int moves_to_cold;
+    unsigned int moves_to_warm;
+    unsigned int moves_within_lru;
 } itemstats_t;
 
+/**
+ * The items linked in a slab class. These are kept per slab class (and
+ * protected by its LRU lock, which is held anyway when linking and
+ * unlinking items) instead of in the engine wide stats, and are summed up
+ * when the stats are requested.
+ */
+typedef struct {
+    uint64_t curr_items;
+    uint64_t curr_bytes;
+    uint64_t total_items;
+} itemcounts_t;
+
+/**
+ * The LRU maintainer thread moves the items between the segments of the
+ * LRU and reclaims expired items in the background.
+ */
+struct lru_maintainer {
+   cb_mutex_t lock;
+   cb_cond_t cond;
+   cb_thread_t tid;
+   bool running;
+   uint64_t juggles;
+};
+
+/**
+ * The expiry wheel is a hierarchical timing wheel indexing the items with
+ * an expiry time, so the expired items may be reclaimed without walking
+ * the LRU. Level 0 has a slot for each of the next EXPIRY_SLOTS seconds,
+ * and each slot in level n covers EXPIRY_SLOTS slots of level n - 1. The
+ * slots in the upper levels are spread over the lower levels as the time
+ * reaches them, and the entries in the level 0 slots are moved to the
+ * due list once their second has passed.
+ *
+ * The entries are just item pointers, and they are not removed when the
+ * item is unlinked (or given a new expiry time). An item which is touched
+ * keeps its entry unless the new expiry time is earlier, and it is put
+ * back in the wheel when the entry is due. The wheel is only a hint,
+ * so an entry is checked against the hash table before the item is
+ * unlinked. The entries in a slab page are purged before the page is
+ * given to another slab class, since a stale pointer could then point
+ * into the middle of a chunk of a different size.
+ */
+#define EXPIRY_LEVELS 4
+#define EXPIRY_SLOT_BITS 6
+#define EXPIRY_SLOTS (1 << EXPIRY_SLOT_BITS)
+
+struct expiry_slot {
+   hash_item **items;
+   uint32_t count;
+   uint32_t size;
+};
+
+struct expiry_wheel {
+   cb_mutex_t lock;
+   /** Signalled when a batch of due entries has been checked */
+   cb_cond_t cond;
+   /** The number of batches taken off the wheel and being checked */
+   uint32_t expiring;
+   /** All entries expiring at or before this time are in the due list */
+   rel_time_t time;
+   struct expiry_slot slots[EXPIRY_LEVELS][EXPIRY_SLOTS];
+   struct expiry_slot due;
+   /** The number of entries in the wheel (and the limit) */
+   uint64_t entries;
+   uint64_t max_entries;
+   /** The number of entries not added because the wheel was full */
+   uint64_t dropped;
+   /** The number of expired items unlinked through the wheel */
+   uint64_t reclaimed;
+};
+
+/**
+ * The eviction policy decides which item to evict when a slab class is
+ * out of memory. It may also keep track of the keys being looked up to
+ * help it decide. The policies are defined in items.c.
+ */
+struct eviction_policy {
+   const char *name;
+   /** Record a lookup of a key (hit or miss), may be NULL */
+   void (*access)(struct default_engine *engine, uint32_t hv);
+   /** Evict an item from the slab class, returns true if one was */
+   bool (*evict)(struct default_engine *engine, unsigned int id,
+                 const void *cookie);
+};
+
 struct items {
-   hash_item *heads[POWER_LARGEST];
-   hash_item *tails[POWER_LARGEST];
+   hash_item *heads[POWER_LARGEST][LRU_SEGMENTS];
+   hash_item *tails[POWER_LARGEST][LRU_SEGMENTS];
    itemstats_t itemstats[POWER_LARGEST];
-   unsigned int sizes[POWER_LARGEST];
+   itemcounts_t counts[POWER_LARGEST];
+   unsigned int sizes[POWER_LARGEST][LRU_SEGMENTS];
+
+   /**
+    * The LRU segments (and the itemstats and counts) for each slab class is
+    * protected by its own lock.
+    */
+   cb_mutex_t lru_locks[POWER_LARGEST];
+
+   /**
+    * The items (and the hash chains they live in) are protected by a
+    * power-of-two array of locks selected by the hash value of the key.
+    * The lock order is: item lock -> lru lock -> slabs/stats lock, and
+    * you should never try to grab more than one item lock at a time.
+    */
+   cb_mutex_t *item_locks;
+   unsigned int item_lock_hashpower;
+
+   /**
+    * The eviction policy picks the items to evict when a slab class is
+    * out of memory (see "eviction_policy"). The sketch is only used by
+    * the TinyLFU policy.
+    */
+   const struct eviction_policy *policy;
+   struct frequency_sketch sketch;
+
+   struct lru_maintainer maintainer;
+
+   /**
+    * The cursors linked in the LRUs of compact items (the slot of a
+    * cursor is stored in its flags, see item_ref()).
+    */
+   cb_mutex_t cursor_lock;
+   hash_item *cursors[ITEM_MAX_CURSORS];
+
+   /**
+    * The expiry wheel has its own lock, which may be grabbed while
+    * holding an item lock (but not the other way around).
+    */
+   struct expiry_wheel expiry;
 };
 
+/**
+ * Initialize the locks protecting the items
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE item_init(struct default_engine *engine);
+
+/**
+ * Release the resources allocated by item_init
+ * @param engine handle to the storage engine
+ */
+void item_destroy(struct default_engine *engine);
+
+/**
+ * Lock the item lock protecting the given hash value
+ * @param engine handle to the storage engine
+ * @param hv the hash value of the key
+ */
+void item_lock(struct default_engine *engine, uint32_t hv);
+
+/**
+ * Release the item lock protecting the given hash value
+ * @param engine handle to the storage engine
+ * @param hv the hash value of the key
+ */
+void item_unlock(struct default_engine *engine, uint32_t hv);
+
+/**
+ * Grab all of the item locks (in order). This is used by the hash table
+ * when it needs to swap the tables during expansion.
+ * @param engine handle to the storage engine
+ */
+void item_lock_all(struct default_engine *engine);
+
+/**
+ * Release all of the item locks
+ * @param engine handle to the storage engine
+ */
+void item_unlock_all(struct default_engine *engine);
+
+/**
+ * Start the LRU maintainer thread
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE item_start_lru_maintainer(struct default_engine *engine);
+
+/**
+ * Stop the LRU maintainer thread (and wait for it to terminate)
+ * @param engine handle to the storage engine
+ */
+void item_stop_lru_maintainer(struct default_engine *engine);
+
 
 /**
  * Allocate and initialize a new item structure
@@ -53,6 +296,60 @@ hash_item *item_alloc(struct default_engine *engine,
                       const void *key, size_t nkey, int flags,
                       rel_time_t exptime, int nbytes, const void *cookie);
 
+/**
+ * Get a copy of a compressed item holding the raw value. The copy isn't
+ * linked, and it's allocated with malloc (not from the slabs, so reading
+ * an item doesn't evict others) and freed when the caller releases it.
+ * It's told apart from the items in the slabs by a slabs_clsid of 0.
+ * @param engine handle to the storage engine
+ * @param it the compressed item
+ * @return the copy, or NULL if we failed to allocate it
+ */
+hash_item *item_decompress(struct default_engine *engine, hash_item *it);
+
+/**
+ * Check if we can store an item of the given size (as a single chunk,
+ * or as a chunked item if large_item_max allows it)
+ * @param engine handle to the storage engine
+ * @param nkey the number of bytes in the key
+ * @param nbytes the number of bytes in the body for the item
+ * @return true if the item may be allocated
+ */
+bool item_size_ok(struct default_engine *engine, size_t nkey,
+                  size_t nbytes);
+
+/**
+ * Get the segments holding the value of an item (more than one if the
+ * item is chunked)
+ * @param engine handle to the storage engine
+ * @param it the item
+ * @param iov where to store the segments
+ * @param niov the number of entries in iov
+ * @return the number of segments, or -1 if they don't fit in iov
+ */
+int item_get_iov(struct default_engine *engine, const hash_item *it,
+                 struct iovec *iov, int niov);
+
+/**
+ * Write data into the value of an item (across its segments)
+ * @param engine handle to the storage engine
+ * @param it the item
+ * @param offset where in the value to start writing
+ * @param src the data to write
+ * @param nsrc the number of bytes to write
+ */
+void item_write_data(struct default_engine *engine, hash_item *it,
+                     size_t offset, const void *src, size_t nsrc);
+
+/**
+ * Copy the value of an item into a single buffer
+ * @param engine handle to the storage engine
+ * @param it the item
+ * @param dst where to store the value (at least it->nbytes)
+ */
+void item_read_data(struct default_engine *engine, const hash_item *it,
+                    void *dst);
+
 /**
  * Get an item from the cache
  *
@@ -70,6 +367,16 @@ hash_item *item_get(struct default_engine *engine,
  */
 void item_stats_reset(struct default_engine *engine);
 
+/**
+ * Get the number of items (and bytes) linked in the cache
+ * @param engine handle to the storage engine
+ * @param counts where to store the counts of each slab class (indexed by
+ *               the slab class, POWER_LARGEST entries), may be NULL
+ * @param total where to store the sum of all of the slab classes
+ */
+void item_counts(struct default_engine *engine, itemcounts_t *counts,
+                 itemcounts_t *total);
+
 /**
  * Get item statitistics
  * @param engine handle to the storage engine
@@ -127,6 +434,27 @@ void item_release(struct default_engine *engine, hash_item *it);
  */
 void item_unlink(struct default_engine *engine, hash_item *it);
 
+/**
+ * Unlink the item stored in a chunk of a slab page being reassigned
+ * @param engine handle to the storage engine
+ * @param it the chunk in the slab page
+ * @param chunk_size the size of the chunk
+ * @return true if the chunk contained a linked item
+ */
+bool item_evict_chunk(struct default_engine *engine, hash_item *it,
+                      size_t chunk_size);
+
+/**
+ * Remove the entries in the expiry wheel referring to memory in a slab
+ * page about to be given to another slab class, and wait for the due
+ * entries being checked to be done
+ * @param engine handle to the storage engine
+ * @param start the start of the page
+ * @param end the end of the page
+ */
+void item_expiry_purge(struct default_engine *engine,
+                       const void *start, const void *end);
+
 /**
  * Set the expiration time for an object
  * @param engine handle to the storage engine
@@ -167,8 +495,24 @@ ENGINE_ERROR_CODE arithmetic(struct default_engine *engine,
                              const uint64_t initial,
                              const rel_time_t exptime,
                              uint64_t *cas,
-                             uint64_t *result);
+                             uint64_t *result,
+                             uint16_t vbucket);
+
 
+/**
+ * Relink an item found in the slab memory left by a previous instance
+ * (see "memory_file"). Called while the slabs are initialized, before
+ * anyone else may use the cache.
+ * @param engine handle to the storage engine
+ * @param it the chunk which may hold a linked item
+ * @param clsid the slab class of the page holding the chunk
+ * @param chunk_size the size of the chunks in the slab class
+ * @param delta the number of seconds to add to the item's relative times
+ * @return the size of the item if it was relinked, or 0 if the chunk
+ *         should be treated as free
+ */
+size_t item_restore(struct default_engine *engine, hash_item *it,
+                    unsigned int clsid, size_t chunk_size, int64_t delta);
 
 /**
  * Start the item scrubber
@@ -176,6 +520,12 @@ ENGINE_ERROR_CODE arithmetic(struct default_engine *engine,
  */
 bool item_start_scrub(struct default_engine *engine);
 
+/**
+ * Stop the item scrubber (and wait for it to terminate)
+ * @param engine handle to the storage engine
+ */
+void item_stop_scrub(struct default_engine *engine);
+
 /**
  * The tap walker to walk the hashtables
  */
@@ -0,0 +1,111 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Frequency sketch
+ *
+ * The counters are packed 16 to a 64 bit word. Each key maps to one
+ * counter in each of SKETCH_DEPTH "rows" (using a different hash function
+ * for each row, but the rows share the same table), and the estimate is
+ * the smallest of them.
+ */
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "default_engine.h"
+
+#define SKETCH_DEPTH 4
+#define SKETCH_MAX_COUNT 15
+/* The number of increments per counter before they are halved */
+#define SKETCH_SAMPLE_FACTOR 10
+
+static const uint64_t sketch_seeds[SKETCH_DEPTH] = {
+    0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL,
+    0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL
+};
+
+bool sketch_init(struct frequency_sketch *sketch, size_t counters) {
+    uint64_t size = 1024;
+
+    while (size < counters) {
+        size <<= 1;
+    }
+
+    sketch->table = calloc(size / 16, sizeof(uint64_t));
+    if (sketch->table == NULL) {
+        return false;
+    }
+    sketch->mask = size - 1;
+    sketch->additions = 0;
+    sketch->sample_size = size * SKETCH_SAMPLE_FACTOR;
+    return true;
+}
+
+void sketch_destroy(struct frequency_sketch *sketch) {
+    free(sketch->table);
+    sketch->table = NULL;
+}
+
+static uint64_t sketch_index(const struct frequency_sketch *sketch,
+                             uint32_t hash, int row) {
+    uint64_t h = ((uint64_t)hash + sketch_seeds[row]) * sketch_seeds[row];
+    h += h >> 32;
+    return h & sketch->mask;
+}
+
+static unsigned int sketch_count(uint64_t word, unsigned int shift) {
+    return (unsigned int)(word >> shift) & SKETCH_MAX_COUNT;
+}
+
+/* Halve all of the counters */
+static void sketch_reset(struct frequency_sketch *sketch) {
+    uint64_t ii;
+
+    for (ii = 0; ii <= sketch->mask / 16; ++ii) {
+        uint64_t word;
+        do {
+            word = sketch->table[ii];
+        } while (!ATOMIC_CAS_64(&sketch->table[ii], word,
+                                (word >> 1) & 0x7777777777777777ULL));
+    }
+}
+
+void sketch_increment(struct frequency_sketch *sketch, uint32_t hash) {
+    int row;
+
+    for (row = 0; row < SKETCH_DEPTH; ++row) {
+        uint64_t idx = sketch_index(sketch, hash, row);
+        uint64_t *word = &sketch->table[idx / 16];
+        unsigned int shift = (unsigned int)(idx % 16) * 4;
+        uint64_t old;
+
+        do {
+            old = *word;
+            if (sketch_count(old, shift) == SKETCH_MAX_COUNT) {
+                break;
+            }
+        } while (!ATOMIC_CAS_64(word, old, old + ((uint64_t)1 << shift)));
+    }
+
+    /* Only the thread reaching the sample size does the reset */
+    if (ATOMIC_INCR_64(&sketch->additions) == sketch->sample_size) {
+        sketch_reset(sketch);
+        ATOMIC_ADD_64(&sketch->additions, -(int64_t)(sketch->sample_size / 2));
+    }
+}
+
+unsigned int sketch_frequency(const struct frequency_sketch *sketch,
+                              uint32_t hash) {
+    unsigned int frequency = SKETCH_MAX_COUNT;
+    int row;
+
+    for (row = 0; row < SKETCH_DEPTH; ++row) {
+        uint64_t idx = sketch_index(sketch, hash, row);
+        unsigned int count = sketch_count(sketch->table[idx / 16],
+                                          (unsigned int)(idx % 16) * 4);
+        if (count < frequency) {
+            frequency = count;
+        }
+    }
+
+    return frequency;
+}
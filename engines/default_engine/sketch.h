@@ -0,0 +1,54 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* frequency sketch used by the TinyLFU eviction policy */
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A count-min sketch of 4 bit counters estimating how often a key has been
+ * accessed recently. All of the counters are halved once the number of
+ * increments reaches the sample size, so old popularity fades away.
+ * The counters are updated with atomic operations (no lock).
+ */
+struct frequency_sketch {
+    uint64_t *table;
+    /** The number of counters - 1 (a power of two) */
+    uint64_t mask;
+    uint64_t additions;
+    uint64_t sample_size;
+};
+
+/**
+ * Allocate the counters of a sketch
+ * @param sketch the sketch to initialize
+ * @param counters the minimum number of counters (rounded up to a power
+ *                 of two), which should be about the number of items
+ * @return false if we failed to allocate the memory
+ */
+bool sketch_init(struct frequency_sketch *sketch, size_t counters);
+
+/**
+ * Release the memory used by a sketch
+ * @param sketch the sketch to destroy
+ */
+void sketch_destroy(struct frequency_sketch *sketch);
+
+/**
+ * Record an access to a key
+ * @param sketch the sketch
+ * @param hash the hash value of the key
+ */
+void sketch_increment(struct frequency_sketch *sketch, uint32_t hash);
+
+/**
+ * Estimate how many times a key has been accessed (0 - 15)
+ * @param sketch the sketch
+ * @param hash the hash value of the key
+ */
+unsigned int sketch_frequency(const struct frequency_sketch *sketch,
+                              uint32_t hash);
+
+#endif
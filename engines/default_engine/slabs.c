@@ -17,14 +17,25 @@
 #include <assert.h>
 #include <inttypes.h>
 #include <stdarg.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "default_engine.h"
+#include "utilities/numa.h"
 
 /*
  * Forward Declarations
  */
-static int do_slabs_newslab(struct default_engine *engine, const unsigned int id);
-static void *memory_allocate(struct default_engine *engine, size_t size);
+static int do_slabs_newslab(struct default_engine *engine, const unsigned int id,
+                            int node);
+static void *memory_allocate(struct default_engine *engine, size_t size,
+                             const slabclass_t *p, int *node);
+static ENGINE_ERROR_CODE slabs_map_file(struct default_engine *engine);
+static void slabs_restore(struct default_engine *engine);
+static void slabs_save(struct default_engine *engine);
 
 #ifndef DONT_PREALLOC_SLABS
 /* Preallocate as many slab pages as possible (called from slabs_init)
@@ -55,6 +66,17 @@ unsigned int slabs_clsid(struct default_engine *engine, const size_t size) {
     return res;
 }
 
+size_t slabs_chunk_size(struct default_engine *engine, unsigned int id) {
+#ifdef USE_SYSTEM_MALLOC
+    return 0;
+#else
+    if (id < POWER_SMALLEST || id > (unsigned int)engine->slabs.power_largest) {
+        return 0;
+    }
+    return engine->slabs.slabclass[id].size;
+#endif
+}
+
 static void *my_allocate(struct default_engine *e, size_t size) {
     void *ptr;
     /* Is threre room? */
@@ -76,28 +98,256 @@ static void *my_allocate(struct default_engine *e, size_t size) {
     return ptr;
 }
 
+/*
+ * Split the preallocated memory in a range for each NUMA node. The pages
+ * aren't touched yet, so the kernel may place them on the right node.
+ */
+static void slabs_split_arena(struct default_engine *engine, size_t size) {
+    size_t node_size = size / engine->slabs.num_nodes;
+    char *ptr = engine->slabs.mem_base;
+    int ii;
+
+    node_size -= node_size % CHUNK_ALIGN_BYTES;
+    engine->slabs.node_size = node_size;
+    for (ii = 0; ii < engine->slabs.num_nodes; ++ii) {
+        struct slabs_node *node = &engine->slabs.nodes[ii];
+        node->current = ptr + ii * node_size;
+        node->avail = node_size;
+        if (ii == engine->slabs.num_nodes - 1) {
+            node->avail = size - ii * node_size;
+        }
+        numa_bind_memory(node->current, node->avail, ii);
+    }
+}
+
+/* The node whose range of the preallocated memory holds ptr */
+static int slabs_node_of(struct default_engine *engine, const void *ptr) {
+    size_t node;
+
+    if (engine->slabs.num_nodes == 1) {
+        return 0;
+    }
+    node = ((const char*)ptr - (const char*)engine->slabs.mem_base) /
+        engine->slabs.node_size;
+    if (node >= (size_t)engine->slabs.num_nodes) {
+        node = engine->slabs.num_nodes - 1;
+    }
+    return (int)node;
+}
+
+/* The node of the calling thread */
+static int slabs_current_node(struct default_engine *engine) {
+    if (engine->slabs.num_nodes == 1) {
+        return 0;
+    }
+    return numa_current_node() % engine->slabs.num_nodes;
+}
+
 /**
  * Determines the chunk sizes and initializes the slab class descriptors
  * accordingly.
  */
+#ifndef WIN32
+/* The size of the huge pages (from /proc/meminfo on Linux) */
+static size_t slabs_huge_page_size(void) {
+    size_t size = 2 * 1024 * 1024;
+    FILE *fp = fopen("/proc/meminfo", "r");
+    if (fp != NULL) {
+        char line[128];
+        unsigned long kb;
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+                size = (size_t)kb * 1024;
+                break;
+            }
+        }
+        fclose(fp);
+    }
+    return size;
+}
+
+/*
+ * madvise(MADV_HUGEPAGE) succeeds even if transparent huge pages are
+ * disabled, so check the mode the kernel runs in ("[never]" is selected
+ * when they're disabled)
+ */
+static bool slabs_transparent_huge_pages(void) {
+    bool ret = false;
+    FILE *fp = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (fp != NULL) {
+        char line[128];
+        if (fgets(line, sizeof(line), fp) != NULL) {
+            ret = strstr(line, "[never]") == NULL;
+        }
+        fclose(fp);
+    }
+    return ret;
+}
+
+/*
+ * Map the arena with huge pages. Try a hugetlb mapping first (which needs
+ * reserved huge pages), and fall back to an anonymous mapping aligned to
+ * the huge page size where we ask for transparent huge pages.
+ */
+static void *slabs_map_arena(struct default_engine *engine, size_t size) {
+    EXTENSION_LOGGER_DESCRIPTOR *logger;
+    size_t huge = slabs_huge_page_size();
+    size_t len = (size + huge - 1) / huge * huge;
+    char *ptr;
+
+    logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+
+#ifdef MAP_HUGETLB
+    ptr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED) {
+        engine->slabs.arena_size = len;
+        engine->slabs.arena_page_size = huge;
+        engine->slabs.arena_backing = "hugetlb";
+        return ptr;
+    }
+    logger->log(EXTENSION_LOG_INFO, NULL,
+                "Failed to map %zu bytes of hugetlb pages: %s\n",
+                len, strerror(errno));
+#endif
+
+    /* Map an extra page so we may trim the mapping to an aligned start */
+    ptr = mmap(NULL, len + huge, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Failed to map %zu bytes: %s\n", len, strerror(errno));
+        return NULL;
+    } else {
+        size_t head = (huge - (uintptr_t)ptr % huge) % huge;
+        if (head != 0) {
+            munmap(ptr, head);
+        }
+        munmap(ptr + head + len, huge - head);
+        ptr += head;
+    }
+
+    engine->slabs.arena_size = len;
+    engine->slabs.arena_page_size = (size_t)sysconf(_SC_PAGESIZE);
+    engine->slabs.arena_backing = "mmap";
+#ifdef MADV_HUGEPAGE
+    /* The kernel only backs the mapping with huge pages when it finds
+     * them, so we keep reporting the base page size */
+    if (!slabs_transparent_huge_pages()) {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Transparent huge pages are disabled\n");
+    } else if (madvise(ptr, len, MADV_HUGEPAGE) == 0) {
+        engine->slabs.arena_backing = "transparent";
+    } else {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Failed to enable transparent huge pages: %s\n",
+                    strerror(errno));
+    }
+#endif
+    return ptr;
+}
+#endif
+
+/* Allocate the preallocated memory (the "arena") */
+static void *slabs_allocate_arena(struct default_engine *engine, size_t size) {
+    void *ptr;
+
+#ifndef WIN32
+    if (engine->config.large_pages) {
+        ptr = slabs_map_arena(engine, size);
+        engine->slabs.arena_mmap = ptr != NULL;
+    } else
+#endif
+    {
+        ptr = my_allocate(engine, size);
+        engine->slabs.arena_size = size;
+#ifndef WIN32
+        engine->slabs.arena_page_size = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+        engine->slabs.arena_backing = "malloc";
+    }
+
+    if (ptr != NULL && engine->config.lock_memory) {
+#ifndef WIN32
+        if (mlock(ptr, engine->slabs.arena_size) == 0) {
+            engine->slabs.arena_locked = true;
+        } else
+#endif
+        {
+            EXTENSION_LOGGER_DESCRIPTOR *logger;
+            logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+            logger->log(EXTENSION_LOG_WARNING, NULL,
+                        "Failed to lock %zu bytes in memory: %s\n",
+                        engine->slabs.arena_size, strerror(errno));
+        }
+    }
+
+    return ptr;
+}
+
 ENGINE_ERROR_CODE slabs_init(struct default_engine *engine,
                              const size_t limit,
                              const double factor,
                              const bool prealloc) {
     int i = POWER_SMALLEST - 1;
-    unsigned int size = sizeof(hash_item) + engine->config.chunk_size;
+    unsigned int size = ITEM_HEADER_SIZE(engine) + engine->config.chunk_size;
+    bool arena = prealloc;
 
     engine->slabs.mem_limit = limit;
+    engine->slabs.num_nodes = 1;
 
-    if (prealloc) {
-        /* Allocate everything in a big chunk with malloc */
-        engine->slabs.mem_base = my_allocate(engine, engine->slabs.mem_limit);
-        if (engine->slabs.mem_base != NULL) {
-            engine->slabs.mem_current = engine->slabs.mem_base;
-            engine->slabs.mem_avail = engine->slabs.mem_limit;
+    if (engine->config.large_pages || engine->config.lock_memory) {
+        /* Only the preallocated memory may be backed by huge pages */
+#ifdef USE_SYSTEM_MALLOC
+        return ENGINE_ENOTSUP;
+#endif
+        if (engine->config.memory_file != NULL) {
+            return ENGINE_EINVAL;
+        }
+        arena = true;
+    }
+
+    if (engine->config.numa) {
+        /* Every node gets a range of the preallocated memory */
+#ifdef USE_SYSTEM_MALLOC
+        return ENGINE_ENOTSUP;
+#endif
+        if (engine->config.memory_file != NULL) {
+            return ENGINE_EINVAL;
+        }
+        engine->slabs.num_nodes = (int)engine->config.numa_nodes;
+        if (engine->slabs.num_nodes == 0) {
+            engine->slabs.num_nodes = numa_node_count();
         } else {
-            return ENGINE_ENOMEM;
+            /* Read the topology used by numa_current_node() */
+            numa_node_count();
+        }
+        if (engine->slabs.num_nodes > SLABS_MAX_NODES) {
+            engine->slabs.num_nodes = SLABS_MAX_NODES;
+        }
+        arena = true;
+    }
+
+    if (engine->config.compact_items) {
+        /*
+         * Compact items reference each other by their offset in the
+         * slab memory, so it must be a single allocation.
+         */
+#ifdef USE_SYSTEM_MALLOC
+        return ENGINE_ENOTSUP;
+#endif
+        if (limit > ITEM_COMPACT_MAX_BYTES) {
+            return ENGINE_EINVAL;
+        }
+        arena = true;
+    }
+
+    if (engine->config.memory_file != NULL) {
+        ENGINE_ERROR_CODE ret = slabs_map_file(engine);
+        if (ret != ENGINE_SUCCESS) {
+            return ret;
         }
+        arena = false;
     }
 
     memset(engine->slabs.slabclass, 0, sizeof(engine->slabs.slabclass));
@@ -132,6 +382,35 @@ ENGINE_ERROR_CODE slabs_init(struct default_engine *engine,
                     engine->slabs.slabclass[i].perslab);
     }
 
+    if (arena) {
+        size_t arena_size = engine->slabs.mem_limit;
+        if (engine->config.compact_items || engine->config.numa) {
+            /*
+             * Every slab class may get its first page even if we've
+             * reached the limit (see do_slabs_newslab)
+             */
+            arena_size += (size_t)engine->slabs.power_largest *
+                engine->config.item_size_max;
+            if (engine->config.compact_items &&
+                arena_size > ITEM_COMPACT_MAX_BYTES) {
+                return ENGINE_EINVAL;
+            }
+        }
+
+        /* Allocate everything in a big chunk */
+        engine->slabs.mem_base = slabs_allocate_arena(engine, arena_size);
+        if (engine->slabs.mem_base != NULL) {
+            engine->slabs.mem_current = engine->slabs.mem_base;
+            engine->slabs.mem_avail = arena_size;
+        } else {
+            return ENGINE_ENOMEM;
+        }
+
+        if (engine->config.numa) {
+            slabs_split_arena(engine, arena_size);
+        }
+    }
+
     /* for the test suite:  faking of how much we've already malloc'd */
     {
         char *t_initial_malloc = getenv("T_MEMD_INITIAL_MALLOC");
@@ -151,6 +430,10 @@ ENGINE_ERROR_CODE slabs_init(struct default_engine *engine,
     }
 #endif
 
+    if (engine->slabs.mapped) {
+        slabs_restore(engine);
+    }
+
     return ENGINE_SUCCESS;
 }
 
@@ -186,22 +469,82 @@ static int grow_slab_list (struct default_engine *engine, const unsigned int id)
     return 1;
 }
 
-static int do_slabs_newslab(struct default_engine *engine, const unsigned int id) {
+/*
+ * Take a page released by the rebalancer for the slab class, preferring
+ * one on the given node. Pages on nodes where the class is still handing
+ * out the chunks of its end page are skipped. Returns NULL if there are
+ * none. The caller must hold the slabs lock.
+ */
+static void *slabs_take_free_page(struct default_engine *engine,
+                                  const slabclass_t *p, int node) {
+    unsigned int count = engine->slabs.free_pages.count;
+    unsigned int ii = count;
+    void **ptrs = engine->slabs.free_pages.ptrs;
+    void *ret;
+    unsigned int jj;
+
+    for (jj = count; jj > 0; --jj) {
+        int nn = slabs_node_of(engine, ptrs[jj - 1]);
+        if (nn == node) {
+            ii = jj - 1;
+            break;
+        }
+        if (ii == count && p->pools[nn].end_page_ptr == NULL) {
+            ii = jj - 1;
+        }
+    }
+
+    if (ii == count) {
+        return NULL;
+    }
+
+    ret = ptrs[ii];
+    ptrs[ii] = ptrs[--engine->slabs.free_pages.count];
+    return ret;
+}
+
+static int do_slabs_newslab(struct default_engine *engine, const unsigned int id,
+                            int node) {
     slabclass_t *p = &engine->slabs.slabclass[id];
     int len = p->size * p->perslab;
     char *ptr;
+    slabpool_t *pool;
+
+    if (p->pools[node].end_page_ptr != NULL) {
+        /* The chunks of the end page not handed out yet would be lost
+         * (and the page could never be moved). A page released by the
+         * rebalancer stays in the pool of free pages until it's needed */
+        return 0;
+    }
+
+    if (engine->config.slab_reassign) {
+        /* All pages must be of the same size so they may be moved */
+        len = (int)engine->config.item_size_max;
+        if (engine->slabs.free_pages.count > 0 && grow_slab_list(engine, id) &&
+            (ptr = slabs_take_free_page(engine, p, node)) != NULL) {
+            /* Reuse a page released by the rebalancer */
+            memset(ptr, 0, (size_t)len);
+            pool = &p->pools[slabs_node_of(engine, ptr)];
+            pool->end_page_ptr = ptr;
+            pool->end_page_free = p->perslab;
+            p->slab_list[p->slabs++] = ptr;
+            MEMCACHED_SLABS_SLABCLASS_ALLOCATE(id);
+            return 1;
+        }
+    }
 
     if ((engine->slabs.mem_limit && engine->slabs.mem_malloced + len > engine->slabs.mem_limit && p->slabs > 0) ||
         (grow_slab_list(engine, id) == 0) ||
-        ((ptr = memory_allocate(engine, (size_t)len)) == 0)) {
+        ((ptr = memory_allocate(engine, (size_t)len, p, &node)) == 0)) {
 
         MEMCACHED_SLABS_SLABCLASS_ALLOCATE_FAILED(id);
         return 0;
     }
 
     memset(ptr, 0, (size_t)len);
-    p->end_page_ptr = ptr;
-    p->end_page_free = p->perslab;
+    pool = &p->pools[node];
+    pool->end_page_ptr = ptr;
+    pool->end_page_free = p->perslab;
 
     p->slab_list[p->slabs++] = ptr;
     engine->slabs.mem_malloced += len;
@@ -210,9 +553,29 @@ static int do_slabs_newslab(struct default_engine *engine, const unsigned int id
     return 1;
 }
 
+/*
+ * Find a pool with free chunks, starting with the one of the given node.
+ * Returns its node or -1 if none of them have any free chunks.
+ */
+static int slabs_find_pool(struct default_engine *engine, slabclass_t *p,
+                           int node) {
+    int ii;
+
+    for (ii = 0; ii < engine->slabs.num_nodes; ++ii) {
+        int nn = (node + ii) % engine->slabs.num_nodes;
+        if (p->pools[nn].end_page_ptr != 0 || p->pools[nn].sl_curr != 0) {
+            return nn;
+        }
+    }
+    return -1;
+}
+
 /*@null@*/
-static void *do_slabs_alloc(struct default_engine *engine, const size_t size, unsigned int id) {
+static void *do_slabs_alloc(struct default_engine *engine, const size_t size,
+                            unsigned int id, int node) {
     slabclass_t *p;
+    slabpool_t *pool;
+    int found;
     void *ret = NULL;
 
     if (id < POWER_SMALLEST || id > engine->slabs.power_largest) {
@@ -234,22 +597,38 @@ static void *do_slabs_alloc(struct default_engine *engine, const size_t size, un
 #endif
 
     /* fail unless we have space at the end of a recently allocated page,
-       we have something on our freelist, or we could allocate a new page */
-    if (! (p->end_page_ptr != 0 || p->sl_curr != 0 ||
-           do_slabs_newslab(engine, id) != 0)) {
+       we have something on our freelist, or we could allocate a new page.
+       The chunks on other nodes are only used if we can't get a new page */
+    pool = &p->pools[node];
+    if (pool->end_page_ptr != 0 || pool->sl_curr != 0) {
+        found = node;
+    } else {
+        do_slabs_newslab(engine, id, node);
+        found = slabs_find_pool(engine, p, node);
+    }
+
+    if (found == -1) {
         /* We don't have more memory available */
         ret = NULL;
-    } else if (p->sl_curr != 0) {
+    } else if ((pool = &p->pools[found])->sl_curr != 0) {
         /* return off our freelist */
-        ret = p->slots[--p->sl_curr];
+        ret = pool->slots[--pool->sl_curr];
     } else {
         /* if we recently allocated a whole page, return from that */
-        assert(p->end_page_ptr != NULL);
-        ret = p->end_page_ptr;
-        if (--p->end_page_free != 0) {
-            p->end_page_ptr = ((unsigned char *)p->end_page_ptr) + p->size;
+        assert(pool->end_page_ptr != NULL);
+        ret = pool->end_page_ptr;
+        if (--pool->end_page_free != 0) {
+            pool->end_page_ptr = ((unsigned char *)pool->end_page_ptr) + p->size;
         } else {
-            p->end_page_ptr = 0;
+            pool->end_page_ptr = 0;
+        }
+    }
+
+    if (ret && engine->slabs.num_nodes > 1) {
+        if (found == node) {
+            engine->slabs.nodes[node].local_allocs++;
+        } else {
+            engine->slabs.nodes[node].remote_allocs++;
         }
     }
 
@@ -263,8 +642,16 @@ static void *do_slabs_alloc(struct default_engine *engine, const size_t size, un
     return ret;
 }
 
+/* The caller must hold the slabs lock */
+static bool slabs_in_moving_page(struct default_engine *engine, const void *ptr) {
+    const char *start = engine->slabs.rebalance.slab_start;
+    const char *end = engine->slabs.rebalance.slab_end;
+    return (const char*)ptr >= start && (const char*)ptr < end;
+}
+
 static void do_slabs_free(struct default_engine *engine, void *ptr, const size_t size, unsigned int id) {
     slabclass_t *p;
+    slabpool_t *pool;
 
     if (id < POWER_SMALLEST || id > engine->slabs.power_largest)
         return;
@@ -278,15 +665,23 @@ static void do_slabs_free(struct default_engine *engine, void *ptr, const size_t
     return;
 #endif
 
-    if (p->sl_curr == p->sl_total) { /* need more space on the free list */
-        int new_size = (p->sl_total != 0) ? p->sl_total * 2 : 16;  /* 16 is arbitrary */
-        void **new_slots = realloc(p->slots, new_size * sizeof(void *));
+    if (p->killing != 0 && slabs_in_moving_page(engine, ptr)) {
+        /* Don't hand out chunks from the page the rebalancer is emptying */
+        engine->slabs.rebalance.freed++;
+        p->requested -= size;
+        return;
+    }
+
+    pool = &p->pools[slabs_node_of(engine, ptr)];
+    if (pool->sl_curr == pool->sl_total) { /* need more space on the free list */
+        int new_size = (pool->sl_total != 0) ? pool->sl_total * 2 : 16;  /* 16 is arbitrary */
+        void **new_slots = realloc(pool->slots, new_size * sizeof(void *));
         if (new_slots == 0)
             return;
-        p->slots = new_slots;
-        p->sl_total = new_size;
+        pool->slots = new_slots;
+        pool->sl_total = new_size;
     }
-    p->slots[p->sl_curr++] = ptr;
+    pool->slots[pool->sl_curr++] = ptr;
     p->requested -= size;
     return;
 }
@@ -320,7 +715,9 @@ void add_statistics(const void *cookie, ADD_STAT add_stats,
 }
 
 /*@null@*/
-static void do_slabs_stats(struct default_engine *engine, ADD_STAT add_stats, const void *cookie) {
+static void do_slabs_stats(struct default_engine *engine,
+                           const itemcounts_t *counts,
+                           ADD_STAT add_stats, const void *cookie) {
     int i, total;
     /* Get the per-thread stats which contain some interesting aggregates */
 #ifdef FUTURE
@@ -334,8 +731,15 @@ static void do_slabs_stats(struct default_engine *engine, ADD_STAT add_stats, co
         slabclass_t *p = &engine->slabs.slabclass[i];
         if (p->slabs != 0) {
             uint32_t perslab, slabs;
+            uint32_t free_chunks = 0;
+            uint32_t free_chunks_end = 0;
+            int node;
             slabs = p->slabs;
             perslab = p->perslab;
+            for (node = 0; node < engine->slabs.num_nodes; ++node) {
+                free_chunks += p->pools[node].sl_curr;
+                free_chunks_end += p->pools[node].end_page_free;
+            }
 
             add_statistics(cookie, add_stats, NULL, i, "chunk_size", "%u",
                            p->size);
@@ -346,13 +750,19 @@ static void do_slabs_stats(struct default_engine *engine, ADD_STAT add_stats, co
             add_statistics(cookie, add_stats, NULL, i, "total_chunks", "%u",
                            slabs * perslab);
             add_statistics(cookie, add_stats, NULL, i, "used_chunks", "%u",
-                           slabs*perslab - p->sl_curr - p->end_page_free);
+                           slabs*perslab - free_chunks - free_chunks_end);
             add_statistics(cookie, add_stats, NULL, i, "free_chunks", "%u",
-                           p->sl_curr);
+                           free_chunks);
             add_statistics(cookie, add_stats, NULL, i, "free_chunks_end", "%u",
-                           p->end_page_free);
+                           free_chunks_end);
             add_statistics(cookie, add_stats, NULL, i, "mem_requested", "%zu",
                            p->requested);
+            add_statistics(cookie, add_stats, NULL, i, "curr_items", "%"PRIu64,
+                           counts[i].curr_items);
+            add_statistics(cookie, add_stats, NULL, i, "total_items", "%"PRIu64,
+                           counts[i].total_items);
+            add_statistics(cookie, add_stats, NULL, i, "bytes", "%"PRIu64,
+                           counts[i].curr_bytes);
 #ifdef FUTURE
             add_statistics(cookie, add_stats, NULL, i, "get_hits", "%"PRIu64,
                            thread_stats.slab_stats[i].get_hits);
@@ -374,11 +784,78 @@ static void do_slabs_stats(struct default_engine *engine, ADD_STAT add_stats, co
     add_statistics(cookie, add_stats, NULL, -1, "active_slabs", "%d", total);
     add_statistics(cookie, add_stats, NULL, -1, "total_malloced", "%zu",
                    engine->slabs.mem_malloced);
+    add_statistics(cookie, add_stats, NULL, -1, "free_pages", "%u",
+                   engine->slabs.free_pages.count);
+
+    if (engine->slabs.arena_backing != NULL) {
+        add_statistics(cookie, add_stats, NULL, -1, "arena_backing", "%s",
+                       engine->slabs.arena_backing);
+        add_statistics(cookie, add_stats, NULL, -1, "arena_page_size", "%zu",
+                       engine->slabs.arena_page_size);
+        add_statistics(cookie, add_stats, NULL, -1, "arena_locked", "%s",
+                       engine->slabs.arena_locked ? "true" : "false");
+    }
+
+    if (engine->config.numa) {
+        add_statistics(cookie, add_stats, NULL, -1, "numa_nodes", "%d",
+                       engine->slabs.num_nodes);
+        for (i = 0; i < engine->slabs.num_nodes; ++i) {
+            struct slabs_node *node = &engine->slabs.nodes[i];
+            add_statistics(cookie, add_stats, "node", i, "total_malloced",
+                           "%zu", node->malloced);
+            add_statistics(cookie, add_stats, "node", i, "mem_avail",
+                           "%zu", node->avail);
+            add_statistics(cookie, add_stats, "node", i, "local_allocs",
+                           "%"PRIu64, node->local_allocs);
+            add_statistics(cookie, add_stats, "node", i, "remote_allocs",
+                           "%"PRIu64, node->remote_allocs);
+        }
+    }
 }
 
-static void *memory_allocate(struct default_engine *engine, size_t size) {
+/*
+ * Carve a page from the range of the node (or the next node with room
+ * left where the slab class isn't handing out the chunks of an end page),
+ * and update node to the node it came from.
+ */
+static void *node_memory_allocate(struct default_engine *engine, size_t size,
+                                  const slabclass_t *p, int *node) {
+    int ii;
+
+    /* the pages _must_ be aligned!!! */
+    if (size % CHUNK_ALIGN_BYTES) {
+        size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES);
+    }
+
+    for (ii = 0; ii < engine->slabs.num_nodes; ++ii) {
+        int nn = (*node + ii) % engine->slabs.num_nodes;
+        struct slabs_node *n = &engine->slabs.nodes[nn];
+        if (ii != 0 && p->pools[nn].end_page_ptr != NULL) {
+            /* The class is still handing out the chunks of its end page
+             * on that node */
+            continue;
+        }
+        if (size <= n->avail) {
+            void *ret = n->current;
+            n->current += size;
+            n->avail -= size;
+            n->malloced += size;
+            *node = nn;
+            return ret;
+        }
+    }
+
+    return NULL;
+}
+
+static void *memory_allocate(struct default_engine *engine, size_t size,
+                             const slabclass_t *p, int *node) {
     void *ret;
 
+    if (engine->config.numa) {
+        return node_memory_allocate(engine, size, p, node);
+    }
+
     if (engine->slabs.mem_base == NULL) {
         /* We are not using a preallocated large memory chunk */
         ret = my_allocate(engine, size);
@@ -409,7 +886,7 @@ void *slabs_alloc(struct default_engine *engine, size_t size, unsigned int id) {
     void *ret;
 
     cb_mutex_enter(&engine->slabs.lock);
-    ret = do_slabs_alloc(engine, size, id);
+    ret = do_slabs_alloc(engine, size, id, slabs_current_node(engine));
     cb_mutex_exit(&engine->slabs.lock);
     return ret;
 }
@@ -421,9 +898,30 @@ void slabs_free(struct default_engine *engine, void *ptr, size_t size, unsigned
 }
 
 void slabs_stats(struct default_engine *engine, ADD_STAT add_stats, const void *c) {
+    struct slab_rebalance *r = &engine->slabs.rebalance;
+    itemcounts_t counts[MAX_NUMBER_OF_SLAB_CLASSES];
+    itemcounts_t total;
+
+    /* The LRU locks must be acquired before the slabs lock */
+    memset(counts, 0, sizeof(counts));
+    item_counts(engine, counts, &total);
+
     cb_mutex_enter(&engine->slabs.lock);
-    do_slabs_stats(engine, add_stats, c);
+    do_slabs_stats(engine, counts, add_stats, c);
     cb_mutex_exit(&engine->slabs.lock);
+
+    cb_mutex_enter(&r->lock);
+    add_statistics(c, add_stats, NULL, -1, "slab_reassign_running", "%s",
+                   r->requested ? "true" : "false");
+    add_statistics(c, add_stats, NULL, -1, "slabs_moved", "%"PRIu64,
+                   r->slabs_moved);
+    add_statistics(c, add_stats, NULL, -1, "slab_reassign_evictions",
+                   "%"PRIu64, r->evictions);
+    add_statistics(c, add_stats, NULL, -1, "slab_reassign_busy_loops",
+                   "%"PRIu64, r->busy_loops);
+    add_statistics(c, add_stats, NULL, -1, "slab_reassign_time", "%"PRIu64,
+                   (uint64_t)(r->time_spent / 1000));
+    cb_mutex_exit(&r->lock);
 }
 
 void slabs_adjust_mem_requested(struct default_engine *engine, unsigned int id, size_t old, size_t ntotal)
@@ -449,6 +947,19 @@ void slabs_destroy(struct default_engine *e)
     size_t ii;
     int jj;
 
+    if (e->slabs.mapped) {
+        slabs_save(e);
+#ifndef WIN32
+        munmap(e->slabs.mem_base, e->slabs.mem_limit);
+#endif
+    }
+
+#ifndef WIN32
+    if (e->slabs.arena_mmap) {
+        munmap(e->slabs.mem_base, e->slabs.arena_size);
+    }
+#endif
+
     for (ii = 0; ii < e->slabs.allocs.next; ++ii) {
         free(e->slabs.allocs.ptrs[ii]);
     }
@@ -457,7 +968,708 @@ void slabs_destroy(struct default_engine *e)
     /* Release the freelists */
     for (jj = POWER_SMALLEST; jj <= e->slabs.power_largest; jj++) {
         slabclass_t *p = &e->slabs.slabclass[jj];
-        free(p->slots);
+        int node;
+        for (node = 0; node < SLABS_MAX_NODES; ++node) {
+            free(p->pools[node].slots);
+        }
         free(p->slab_list);
     }
+    free(e->slabs.free_pages.ptrs);
+}
+
+/*
+ * Warm restart: with "memory_file" set the slab memory is a shared mapping
+ * of that file. On shutdown we write a description of the slab pages to
+ * <memory_file>.meta, and the next instance using the same settings
+ * relinks the items found in the pages instead of starting empty. The
+ * meta file is removed as soon as it is read, so the cache is only
+ * reused after a clean shutdown.
+ */
+#define SLABS_META_MAGIC 0x4d435752
+#define SLABS_META_VERSION 4
+
+struct slabs_meta_header {
+    uint32_t magic;
+    uint32_t version;
+    /* The settings must match for the pages to be reused */
+    uint64_t item_header;
+    uint64_t mem_limit;
+    uint64_t item_size_max;
+    uint64_t chunk_size;
+    double factor;
+    uint32_t use_cas;
+    uint32_t slab_reassign;
+    uint32_t power_largest;
+    uint32_t npages;
+    /* The state of the arena */
+    uint64_t mem_used;
+    uint64_t mem_malloced;
+    /* abstime(0) of the instance writing the file */
+    int64_t started;
+};
+
+struct slabs_meta_page {
+    uint64_t offset;
+    /* 0 for pages in the pool of free pages */
+    uint32_t clsid;
+    uint32_t unused;
+};
+
+static char *slabs_meta_name(struct default_engine *engine,
+                             const char *suffix) {
+    size_t len = strlen(engine->config.memory_file) + strlen(suffix) + 1;
+    char *ret = malloc(len);
+    if (ret != NULL) {
+        snprintf(ret, len, "%s%s", engine->config.memory_file, suffix);
+    }
+    return ret;
+}
+
+static void slabs_meta_init(struct default_engine *engine,
+                            struct slabs_meta_header *header) {
+    memset(header, 0, sizeof(*header));
+    header->magic = SLABS_META_MAGIC;
+    header->version = SLABS_META_VERSION;
+    header->item_header = ITEM_HEADER_SIZE(engine);
+    header->mem_limit = engine->slabs.mem_limit;
+    header->item_size_max = engine->config.item_size_max;
+    header->chunk_size = engine->config.chunk_size;
+    header->factor = engine->config.factor;
+    header->use_cas = engine->config.use_cas;
+    header->slab_reassign = engine->config.slab_reassign;
+    header->power_largest = engine->slabs.power_largest;
+}
+
+static ENGINE_ERROR_CODE slabs_map_file(struct default_engine *engine) {
+    EXTENSION_LOGGER_DESCRIPTOR *logger;
+    logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+#ifdef WIN32
+    logger->log(EXTENSION_LOG_WARNING, NULL,
+                "memory_file is not supported on this platform\n");
+    return ENGINE_ENOTSUP;
+#else
+    void *ptr;
+    int fd;
+
+    if (engine->slabs.mem_limit == 0) {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "memory_file requires a cache_size\n");
+        return ENGINE_EINVAL;
+    }
+
+    /* The engine is initialized after memcached daemonized (and changed
+     * its working directory to /), so a relative path wouldn't refer to
+     * the file the user meant */
+    if (engine->config.memory_file[0] != '/') {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "memory_file must be an absolute path: %s\n",
+                    engine->config.memory_file);
+        return ENGINE_EINVAL;
+    }
+
+    fd = open(engine->config.memory_file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Failed to open %s: %s\n", engine->config.memory_file,
+                    strerror(errno));
+        return ENGINE_FAILED;
+    }
+
+    if (ftruncate(fd, (off_t)engine->slabs.mem_limit) != 0) {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Failed to resize %s: %s\n", engine->config.memory_file,
+                    strerror(errno));
+        close(fd);
+        return ENGINE_FAILED;
+    }
+
+    ptr = mmap(NULL, engine->slabs.mem_limit, PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        logger->log(EXTENSION_LOG_WARNING, NULL,
+                    "Failed to map %s: %s\n", engine->config.memory_file,
+                    strerror(errno));
+        return ENGINE_ENOMEM;
+    }
+
+    engine->slabs.mem_base = ptr;
+    engine->slabs.mem_current = ptr;
+    engine->slabs.mem_avail = engine->slabs.mem_limit;
+    engine->slabs.mapped = true;
+    return ENGINE_SUCCESS;
+#endif
+}
+
+/* The size of the pages in the slab class */
+static size_t slabs_page_size(struct default_engine *engine, unsigned int id) {
+    if (engine->config.slab_reassign) {
+        return engine->config.item_size_max;
+    }
+    return (size_t)engine->slabs.slabclass[id].size *
+        engine->slabs.slabclass[id].perslab;
+}
+
+static bool slabs_write_page(FILE *fp, struct default_engine *engine,
+                             void *page, unsigned int clsid) {
+    struct slabs_meta_page entry;
+    entry.offset = (uint64_t)((char*)page - (char*)engine->slabs.mem_base);
+    entry.clsid = clsid;
+    entry.unused = 0;
+    return fwrite(&entry, sizeof(entry), 1, fp) == 1;
+}
+
+/* Called from slabs_destroy, all of the other threads are stopped */
+static void slabs_save(struct default_engine *engine) {
+    char *name = slabs_meta_name(engine, ".meta");
+    char *tmpname = slabs_meta_name(engine, ".meta.tmp");
+    struct slabs_meta_header header;
+    bool ok;
+    FILE *fp;
+    unsigned int ii;
+    int id;
+
+    if (name == NULL || tmpname == NULL ||
+        (fp = fopen(tmpname, "wb")) == NULL) {
+        free(name);
+        free(tmpname);
+        return;
+    }
+
+    slabs_meta_init(engine, &header);
+    header.mem_used = (uint64_t)((char*)engine->slabs.mem_current -
+                                 (char*)engine->slabs.mem_base);
+    header.mem_malloced = engine->slabs.mem_malloced;
+    header.started = (int64_t)engine->server.core->abstime(0);
+    header.npages = engine->slabs.free_pages.count;
+    for (id = POWER_SMALLEST; id <= engine->slabs.power_largest; id++) {
+        header.npages += engine->slabs.slabclass[id].slabs;
+    }
+
+    ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    for (id = POWER_SMALLEST; ok && id <= engine->slabs.power_largest; id++) {
+        slabclass_t *p = &engine->slabs.slabclass[id];
+        for (ii = 0; ok && ii < p->slabs; ++ii) {
+            ok = slabs_write_page(fp, engine, p->slab_list[ii], id);
+        }
+    }
+    for (ii = 0; ok && ii < engine->slabs.free_pages.count; ++ii) {
+        ok = slabs_write_page(fp, engine, engine->slabs.free_pages.ptrs[ii], 0);
+    }
+
+#ifndef WIN32
+    /* The pages must hit the file before it is marked as valid */
+    if (ok && msync(engine->slabs.mem_base, (size_t)header.mem_used, MS_SYNC) != 0) {
+        ok = false;
+    }
+#endif
+
+    if (fclose(fp) != 0) {
+        ok = false;
+    }
+
+    if (!ok || rename(tmpname, name) != 0) {
+        remove(tmpname);
+    }
+    free(name);
+    free(tmpname);
+}
+
+/* Read and validate the page table written by slabs_save */
+static struct slabs_meta_page *slabs_read_meta(struct default_engine *engine,
+                                               struct slabs_meta_header *header) {
+    char *name = slabs_meta_name(engine, ".meta");
+    struct slabs_meta_header expected;
+    struct slabs_meta_page *pages = NULL;
+    FILE *fp;
+    uint32_t ii;
+
+    if (name == NULL) {
+        return NULL;
+    }
+
+    fp = fopen(name, "rb");
+    /* The arena is modified from now on, so never use the file again */
+    remove(name);
+    free(name);
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    slabs_meta_init(engine, &expected);
+    if (fread(header, sizeof(*header), 1, fp) != 1 ||
+        header->magic != expected.magic ||
+        header->version != expected.version ||
+        header->item_header != expected.item_header ||
+        header->mem_limit != expected.mem_limit ||
+        header->item_size_max != expected.item_size_max ||
+        header->chunk_size != expected.chunk_size ||
+        header->factor != expected.factor ||
+        header->use_cas != expected.use_cas ||
+        header->slab_reassign != expected.slab_reassign ||
+        header->power_largest != expected.power_largest ||
+        header->mem_used > header->mem_limit ||
+        header->npages == 0) {
+        fclose(fp);
+        return NULL;
+    }
+
+    pages = calloc(header->npages, sizeof(*pages));
+    if (pages == NULL ||
+        fread(pages, sizeof(*pages), header->npages, fp) != header->npages) {
+        free(pages);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+
+    for (ii = 0; ii < header->npages; ++ii) {
+        uint32_t id = pages[ii].clsid;
+        size_t size = slabs_page_size(engine, id == 0 ? POWER_SMALLEST : id);
+        if ((id != 0 && (id < POWER_SMALLEST || id > (uint32_t)engine->slabs.power_largest)) ||
+            (id == 0 && !engine->config.slab_reassign) ||
+            pages[ii].offset % CHUNK_ALIGN_BYTES != 0 ||
+            pages[ii].offset + size > header->mem_used) {
+            free(pages);
+            return NULL;
+        }
+    }
+
+    return pages;
+}
+
+/*
+ * Called from slabs_init (before any of the threads using the cache are
+ * started) to relink the items left in the arena by the previous instance.
+ */
+static void slabs_restore(struct default_engine *engine) {
+    struct slabs_meta_header header;
+    struct slabs_meta_page *pages = slabs_read_meta(engine, &header);
+    int64_t delta;
+    uint64_t restored = 0;
+    uint32_t ii;
+
+    if (pages == NULL) {
+        return;
+    }
+
+    engine->slabs.mem_current = (char*)engine->slabs.mem_base + header.mem_used;
+    engine->slabs.mem_avail = engine->slabs.mem_limit - header.mem_used;
+    engine->slabs.mem_malloced = header.mem_malloced;
+
+    /* The item times are relative to the start of the previous instance */
+    delta = header.started - (int64_t)engine->server.core->abstime(0);
+
+    for (ii = 0; ii < header.npages; ++ii) {
+        char *page = (char*)engine->slabs.mem_base + pages[ii].offset;
+        unsigned int id = pages[ii].clsid;
+        slabclass_t *p;
+        unsigned int jj;
+
+        if (id == 0) {
+            if (engine->slabs.free_pages.count == engine->slabs.free_pages.size) {
+                unsigned int n = engine->slabs.free_pages.size + 16;
+                void *ptrs = realloc(engine->slabs.free_pages.ptrs, n * sizeof(void*));
+                if (ptrs == NULL) {
+                    continue;
+                }
+                engine->slabs.free_pages.ptrs = ptrs;
+                engine->slabs.free_pages.size = n;
+            }
+            engine->slabs.free_pages.ptrs[engine->slabs.free_pages.count++] = page;
+            continue;
+        }
+
+        p = &engine->slabs.slabclass[id];
+        if (grow_slab_list(engine, id) == 0) {
+            continue;
+        }
+        p->slab_list[p->slabs++] = page;
+
+        for (jj = 0; jj < p->perslab; ++jj, page += p->size) {
+            hash_item *it = (hash_item*)page;
+            size_t ntotal = item_restore(engine, it, id, p->size, delta);
+            if (ntotal != 0) {
+                p->requested += ntotal;
+                ++restored;
+            } else {
+                it->slabs_clsid = 0;
+                it->iflag = ITEM_SLABBED;
+                do_slabs_free(engine, it, 0, id);
+            }
+        }
+    }
+    free(pages);
+
+    if (engine->config.verbose > 0) {
+        EXTENSION_LOGGER_DESCRIPTOR *logger;
+        logger = (void*)engine->server.extension->get_extension(EXTENSION_LOGGER);
+        logger->log(EXTENSION_LOG_INFO, NULL,
+                    "Restored %"PRIu64" items from %s\n", restored,
+                    engine->config.memory_file);
+    }
+}
+
+/*
+ * Moving a slab page to another slab class happens in three steps:
+ *
+ * 1. Pick the first page of the source class and mark the class as
+ *    "killing" it. All of the free chunks in the page are removed from the
+ *    freelist so they won't be handed out again.
+ * 2. Unlink all of the items stored in the page. Items still in use are
+ *    freed when the last reference is released. do_slabs_free counts the
+ *    chunks released in the page instead of putting them on the freelist.
+ * 3. When all of the chunks in the page are free, the page is removed from
+ *    the source class and put in the pool of free pages (or given to the
+ *    destination class).
+ */
+static const rel_time_t slab_automove_window = 10;
+
+static enum slabs_reassign_result do_slabs_reassign_check(struct default_engine *engine,
+                                                          unsigned int src,
+                                                          unsigned int dst) {
+    unsigned int largest = (unsigned int)engine->slabs.power_largest;
+
+    if (src < POWER_SMALLEST || src > largest ||
+        (dst != 0 && (dst < POWER_SMALLEST || dst > largest))) {
+        return REASSIGN_BADCLASS;
+    }
+
+    if (src == dst) {
+        return REASSIGN_SRC_DST_SAME;
+    }
+
+    if (engine->slabs.slabclass[src].slabs < 2) {
+        return REASSIGN_NOSPARE;
+    }
+
+    return REASSIGN_OK;
+}
+
+/* The caller must hold the slabs lock */
+static bool do_slabs_rebalance_start(struct default_engine *engine,
+                                     unsigned int src) {
+    struct slab_rebalance *r = &engine->slabs.rebalance;
+    slabclass_t *p = &engine->slabs.slabclass[src];
+    slabpool_t *pool;
+    unsigned int ii;
+
+    if (p->slabs < 2) {
+        return false;
+    }
+
+    /* Make sure we've got room for the page when it's released */
+    if (engine->slabs.free_pages.count == engine->slabs.free_pages.size) {
+        unsigned int n = engine->slabs.free_pages.size + 16;
+        void *ptrs = realloc(engine->slabs.free_pages.ptrs, n * sizeof(void*));
+        if (ptrs == NULL) {
+            return false;
+        }
+        engine->slabs.free_pages.ptrs = ptrs;
+        engine->slabs.free_pages.size = n;
+    }
+
+    p->killing = 1;
+    r->slab_start = p->slab_list[p->killing - 1];
+    r->slab_end = (char*)r->slab_start + (size_t)p->size * p->perslab;
+    r->freed = 0;
+
+    /* All of the chunks of the page are in the pool of its node */
+    pool = &p->pools[slabs_node_of(engine, r->slab_start)];
+    ii = 0;
+    while (ii < pool->sl_curr) {
+        if (slabs_in_moving_page(engine, pool->slots[ii])) {
+            pool->slots[ii] = pool->slots[--pool->sl_curr];
+            r->freed++;
+        } else {
+            ++ii;
+        }
+    }
+
+    if (pool->end_page_ptr != NULL && slabs_in_moving_page(engine, pool->end_page_ptr)) {
+        /* Mark the chunks never used as free so the eviction skips them */
+        char *ptr = pool->end_page_ptr;
+        for (ii = 0; ii < pool->end_page_free; ++ii, ptr += p->size) {
+            ((hash_item*)ptr)->iflag = ITEM_SLABBED;
+        }
+        r->freed += pool->end_page_free;
+        pool->end_page_ptr = 0;
+        pool->end_page_free = 0;
+    }
+
+    return true;
+}
+
+/* The caller must hold the slabs lock */
+static void do_slabs_rebalance_finish(struct default_engine *engine,
+                                      unsigned int src,
+                                      unsigned int dst) {
+    struct slab_rebalance *r = &engine->slabs.rebalance;
+    slabclass_t *p = &engine->slabs.slabclass[src];
+
+    p->slab_list[p->killing - 1] = p->slab_list[--p->slabs];
+    p->killing = 0;
+
+    engine->slabs.free_pages.ptrs[engine->slabs.free_pages.count++] = r->slab_start;
+
+    if (dst != 0) {
+        do_slabs_newslab(engine, dst, slabs_node_of(engine, r->slab_start));
+    }
+    r->slab_start = NULL;
+    r->slab_end = NULL;
+}
+
+/*
+ * Unlink all of the items stored in the page being moved. This is done
+ * without holding the slabs lock; the page and the chunk layout can't
+ * change while the class is killing the page.
+ */
+static void slabs_rebalance_evict(struct default_engine *engine,
+                                  unsigned int src) {
+    struct slab_rebalance *r = &engine->slabs.rebalance;
+    slabclass_t *p = &engine->slabs.slabclass[src];
+    char *ptr = r->slab_start;
+    uint64_t evicted = 0;
+    unsigned int ii;
+
+    for (ii = 0; ii < p->perslab; ++ii, ptr += p->size) {
+        if (item_evict_chunk(engine, (hash_item*)ptr, p->size)) {
+            ++evicted;
+        }
+    }
+
+    cb_mutex_enter(&r->lock);
+    r->evictions += evicted;
+    cb_mutex_exit(&r->lock);
+}
+
+static void slabs_rebalance(struct default_engine *engine,
+                            unsigned int src, unsigned int dst) {
+    struct slab_rebalance *r = &engine->slabs.rebalance;
+    hrtime_t start = gethrtime();
+    bool started;
+    bool done = false;
+
+    cb_mutex_enter(&engine->slabs.lock);
+    started = do_slabs_rebalance_start(engine, src);
+    cb_mutex_exit(&engine->slabs.lock);
+    if (!started) {
+        return;
+    }
+
+    cb_mutex_enter(&r->lock);
+    while (r->running) {
+        cb_mutex_exit(&r->lock);
+        slabs_rebalance_evict(engine, src);
+
+        cb_mutex_enter(&engine->slabs.lock);
+        done = r->freed == engine->slabs.slabclass[src].perslab;
+        cb_mutex_exit(&engine->slabs.lock);
+
+        if (done) {
+            /* Nothing may be stored in the page until we finish, but the
+             * expiry wheel may still refer to the items which were in it */
+            item_expiry_purge(engine, r->slab_start, r->slab_end);
+            cb_mutex_enter(&engine->slabs.lock);
+            do_slabs_rebalance_finish(engine, src, dst);
+            cb_mutex_exit(&engine->slabs.lock);
+        }
+
+        cb_mutex_enter(&r->lock);
+        if (done) {
+            r->slabs_moved++;
+            r->time_spent += gethrtime() - start;
+            break;
+        }
+
+        /* Some of the items are still in use.. wait for them to go away */
+        r->busy_loops++;
+        if (r->running) {
+            cb_cond_timedwait(&r->cond, &r->lock, 1);
+        }
+    }
+    cb_mutex_exit(&r->lock);
+}
+
+/*
+ * Look at the evictions in each slab class over the last window. If the
+ * same class had the most evictions for three windows in a row, take a
+ * page from a class which hasn't evicted anything for three windows
+ * (preferring the one with most free chunks).
+ */
+static bool slabs_automove_decision(struct default_engine *engine,
+                                    unsigned int *src,
+                                    unsigned int *dst) {
+    struct slab_rebalance *r = &engine->slabs.rebalance;
+    rel_time_t now = engine->server.core->get_current_time();
+    uint64_t evicted[POWER_LARGEST];
+    unsigned int pages[POWER_LARGEST];
+    unsigned int free_chunks[POWER_LARGEST];
+    uint64_t highest_evicted = 0;
+    unsigned int highest = 0;
+    unsigned int source = 0;
+    unsigned int ii;
+    unsigned int largest = (unsigned int)engine->slabs.power_largest;
+
+    if (now - r->last_window < slab_automove_window) {
+        return false;
+    }
+    r->last_window = now;
+
+    for (ii = POWER_SMALLEST; ii <= largest; ++ii) {
+        cb_mutex_enter(&engine->items.lru_locks[ii]);
+        evicted[ii] = engine->items.itemstats[ii].evicted;
+        cb_mutex_exit(&engine->items.lru_locks[ii]);
+    }
+
+    cb_mutex_enter(&engine->slabs.lock);
+    for (ii = POWER_SMALLEST; ii <= largest; ++ii) {
+        slabclass_t *p = &engine->slabs.slabclass[ii];
+        int node;
+        pages[ii] = p->slabs;
+        free_chunks[ii] = 0;
+        for (node = 0; node < engine->slabs.num_nodes; ++node) {
+            free_chunks[ii] += p->pools[node].sl_curr +
+                p->pools[node].end_page_free;
+        }
+    }
+    cb_mutex_exit(&engine->slabs.lock);
+
+    for (ii = POWER_SMALLEST; ii <= largest; ++ii) {
+        /* The counters go backwards if someone resets the stats */
+        uint64_t diff = evicted[ii];
+        if (evicted[ii] >= r->evicted_old[ii]) {
+            diff -= r->evicted_old[ii];
+        }
+        r->evicted_old[ii] = evicted[ii];
+
+        if (diff == 0 && pages[ii] > 2) {
+            r->evicted_zero[ii]++;
+            if (r->evicted_zero[ii] >= 3 &&
+                (source == 0 || free_chunks[ii] > free_chunks[source])) {
+                source = ii;
+            }
+        } else {
+            r->evicted_zero[ii] = 0;
+        }
+
+        if (diff > highest_evicted) {
+            highest_evicted = diff;
+            highest = ii;
+        }
+    }
+
+    if (highest != 0 && highest == r->highest_last) {
+        r->highest_windows++;
+    } else {
+        r->highest_windows = (highest != 0) ? 1 : 0;
+    }
+    r->highest_last = highest;
+
+    if (source != 0 && highest != 0 && r->highest_windows >= 3) {
+        *src = source;
+        *dst = highest;
+        return true;
+    }
+
+    return false;
+}
+
+static void slab_rebalancer_main(void *arg) {
+    struct default_engine *engine = arg;
+    struct slab_rebalance *r = &engine->slabs.rebalance;
+
+    cb_mutex_enter(&r->lock);
+    while (r->running) {
+        unsigned int src, dst;
+
+        if (!r->requested && engine->config.slab_automove) {
+            bool move;
+            cb_mutex_exit(&r->lock);
+            move = slabs_automove_decision(engine, &src, &dst);
+            cb_mutex_enter(&r->lock);
+            if (move && !r->requested) {
+                r->requested = true;
+                r->src = src;
+                r->dst = dst;
+            }
+        }
+
+        if (r->requested) {
+            src = r->src;
+            dst = r->dst;
+            cb_mutex_exit(&r->lock);
+            slabs_rebalance(engine, src, dst);
+            cb_mutex_enter(&r->lock);
+            r->requested = false;
+        } else if (r->running) {
+            cb_cond_timedwait(&r->cond, &r->lock, 1000);
+        }
+    }
+    cb_mutex_exit(&r->lock);
+}
+
+ENGINE_ERROR_CODE slabs_start_rebalancer(struct default_engine *engine) {
+    struct slab_rebalance *r = &engine->slabs.rebalance;
+    ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
+
+    cb_mutex_enter(&r->lock);
+    if (!r->running) {
+        r->running = true;
+        r->last_window = engine->server.core->get_current_time();
+        if (cb_create_thread(&r->tid, slab_rebalancer_main, engine, 0) != 0) {
+            r->running = false;
+            ret = ENGINE_FAILED;
+        }
+    }
+    cb_mutex_exit(&r->lock);
+
+    return ret;
+}
+
+void slabs_stop_rebalancer(struct default_engine *engine) {
+    struct slab_rebalance *r = &engine->slabs.rebalance;
+    bool running;
+
+    cb_mutex_enter(&r->lock);
+    running = r->running;
+    r->running = false;
+    cb_cond_signal(&r->cond);
+    cb_mutex_exit(&r->lock);
+
+    if (running) {
+        cb_join_thread(r->tid);
+    }
+}
+
+enum slabs_reassign_result slabs_reassign(struct default_engine *engine,
+                                          unsigned int src,
+                                          unsigned int dst) {
+    struct slab_rebalance *r = &engine->slabs.rebalance;
+    enum slabs_reassign_result ret;
+
+    if (!engine->config.slab_reassign) {
+        return REASSIGN_DISABLED;
+    }
+
+    cb_mutex_enter(&r->lock);
+    if (!r->running) {
+        ret = REASSIGN_DISABLED;
+    } else if (r->requested) {
+        ret = REASSIGN_RUNNING;
+    } else {
+        cb_mutex_enter(&engine->slabs.lock);
+        ret = do_slabs_reassign_check(engine, src, dst);
+        cb_mutex_exit(&engine->slabs.lock);
+
+        if (ret == REASSIGN_OK) {
+            r->requested = true;
+            r->src = src;
+            r->dst = dst;
+            cb_cond_signal(&r->cond);
+        }
+    }
+    cb_mutex_exit(&r->lock);
+
+    return ret;
 }
@@ -6,16 +6,27 @@
 
 /* powers-of-N allocation structures */
 
-typedef struct {
-    unsigned int size;      /* sizes of items */
-    unsigned int perslab;   /* how many items per slab */
+/* The most NUMA nodes the slab allocator keeps separate pools for */
+#define SLABS_MAX_NODES 8
 
+/**
+ * The free chunks of a slab class in the pages on one NUMA node (all of
+ * the chunks are in the pool of node 0 unless "numa" is enabled)
+ */
+typedef struct {
     void **slots;           /* list of item ptrs */
     unsigned int sl_total;  /* size of previous array */
     unsigned int sl_curr;   /* first free slot */
 
     void *end_page_ptr;         /* pointer to next free item at end of page, or 0 */
     unsigned int end_page_free; /* number of items remaining at end of last alloced page */
+} slabpool_t;
+
+typedef struct {
+    unsigned int size;      /* sizes of items */
+    unsigned int perslab;   /* how many items per slab */
+
+    slabpool_t pools[SLABS_MAX_NODES];
 
     unsigned int slabs;     /* how many slabs were allocated for this class */
 
@@ -26,6 +37,43 @@ typedef struct {
     size_t requested; /* The number of requested bytes */
 } slabclass_t;
 
+/**
+ * State for the thread moving slab pages between the slab classes
+ */
+struct slab_rebalance {
+   /**
+    * Protects the thread state, the pending request and the statistics.
+    * The page being moved is protected by the slabs lock.
+    */
+   cb_mutex_t lock;
+   cb_cond_t cond;
+   cb_thread_t tid;
+   bool running;
+
+   /* Set while a reassign request is pending or being processed */
+   bool requested;
+   unsigned int src;
+   unsigned int dst;
+
+   /* The page being emptied and the number of its chunks which are free */
+   void *slab_start;
+   void *slab_end;
+   unsigned int freed;
+
+   /* Automover state, only used by the rebalancer thread */
+   rel_time_t last_window;
+   uint64_t evicted_old[POWER_LARGEST];
+   unsigned int evicted_zero[POWER_LARGEST];
+   unsigned int highest_last;
+   unsigned int highest_windows;
+
+   /* Statistics */
+   uint64_t slabs_moved;
+   uint64_t evictions;
+   uint64_t busy_loops;
+   hrtime_t time_spent;
+};
+
 struct slabs {
    slabclass_t slabclass[MAX_NUMBER_OF_SLAB_CLASSES];
    size_t mem_limit;
@@ -35,6 +83,40 @@ struct slabs {
    void *mem_base;
    void *mem_current;
    size_t mem_avail;
+   /* Set when mem_base is a mapping of the "memory_file" */
+   bool mapped;
+
+   /**
+    * The backing of the preallocated memory: with "large_pages" it is an
+    * anonymous mapping of arena_size bytes (hugetlb pages if available,
+    * otherwise transparent huge pages are requested with madvise).
+    */
+   bool arena_mmap;
+   size_t arena_size;
+   /* The page size we got, and the name of the backing ("hugetlb", ...) */
+   size_t arena_page_size;
+   const char *arena_backing;
+   /* Set when the arena is locked in memory ("lock_memory") */
+   bool arena_locked;
+
+   /**
+    * With "numa" enabled the preallocated memory is split in a range for
+    * each node (node_size bytes each, the last one gets the rest), and
+    * the pages are carved from the range of the node the allocating
+    * thread runs on.
+    */
+   int num_nodes;
+   size_t node_size;
+   struct slabs_node {
+      char *current;
+      size_t avail;
+      /* The bytes handed out as slab pages */
+      size_t malloced;
+      /* Chunks allocated by threads on the node from its own pages */
+      uint64_t local_allocs;
+      /* ... and from the pages of other nodes */
+      uint64_t remote_allocs;
+   } nodes[SLABS_MAX_NODES];
 
    struct {
       void **ptrs;
@@ -42,10 +124,34 @@ struct slabs {
       size_t size;
    } allocs;
 
+   /**
+    * Pages released by the rebalancer, ready to be handed to any
+    * slab class (only used with slab_reassign)
+    */
+   struct {
+      void **ptrs;
+      unsigned int count;
+      unsigned int size;
+   } free_pages;
+
    /**
     * Access to the slab allocator is protected by this lock
     */
    cb_mutex_t lock;
+
+   struct slab_rebalance rebalance;
+};
+
+/**
+ * The result of asking for a slab page to be moved
+ */
+enum slabs_reassign_result {
+    REASSIGN_OK = 0,
+    REASSIGN_DISABLED,
+    REASSIGN_RUNNING,
+    REASSIGN_BADCLASS,
+    REASSIGN_NOSPARE,
+    REASSIGN_SRC_DST_SAME
 };
 
 
@@ -64,6 +170,31 @@ ENGINE_ERROR_CODE slabs_init(struct default_engine *engine,
 
 void slabs_destroy(struct default_engine *engine);
 
+/**
+ * Start the thread moving slab pages between the slab classes
+ */
+ENGINE_ERROR_CODE slabs_start_rebalancer(struct default_engine *engine);
+
+/**
+ * Stop the slab rebalancer thread (and wait for it to terminate)
+ */
+void slabs_stop_rebalancer(struct default_engine *engine);
+
+/**
+ * Request that a page is moved from one slab class to another. The items
+ * stored in the page are evicted by the rebalancer thread before the page
+ * is handed over to the destination class.
+ *
+ * @param engine the engine
+ * @param src the slab class to take the page from
+ * @param dst the slab class to give the page to, or 0 to put it in the
+ *            pool of free pages
+ * @return REASSIGN_OK if the request was accepted
+ */
+enum slabs_reassign_result slabs_reassign(struct default_engine *engine,
+                                          unsigned int src,
+                                          unsigned int dst);
+
 /**
  * Given object size, return id to use when allocating/freeing memory for object
  * 0 means error: can't store such a large object
@@ -71,6 +202,12 @@ void slabs_destroy(struct default_engine *engine);
 
 unsigned int slabs_clsid(struct default_engine *engine, const size_t size);
 
+/**
+ * The size of the chunks in a slab class (the room for an item allocated
+ * from the class). 0 if the items are allocated with malloc.
+ */
+size_t slabs_chunk_size(struct default_engine *engine, unsigned int id);
+
 /** Allocate object of given length. 0 on error */ /*@null@*/
 void *slabs_alloc(struct default_engine *engine, const size_t size, unsigned int id);
 
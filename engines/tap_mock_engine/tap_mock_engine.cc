@@ -798,8 +798,10 @@ public:
 protected:
     ENGINE_ERROR_CODE dispatchNotification(const void *cookie) {
         NotificationData *nd = new NotificationData(cookie, sapi);
-        if (cb_create_thread(NULL, dispatch_notification,
+        cb_thread_t tid;
+        if (cb_create_thread(&tid, dispatch_notification,
                            reinterpret_cast<void*>(nd), 1) != 0) {
+            delete nd;
             return ENGINE_DISCONNECT;
         }
 
@@ -819,6 +821,8 @@ private:
 
 struct EngineGlue {
     EngineGlue(SERVER_HANDLE_V1 *api): me(api) {
+        // The methods we don't implement must be NULL
+        memset(&interface, 0, sizeof(interface));
         interface.interface.interface = 1;
         interface.get_info = get_info;
         interface.initialize = initialize;
@@ -190,7 +190,9 @@ extern "C"
         /* Scrub the data */
         PROTOCOL_BINARY_CMD_SCRUB = 0xf0,
         /* Refresh the ISASL data */
-        PROTOCOL_BINARY_CMD_ISASL_REFRESH = 0xf1
+        PROTOCOL_BINARY_CMD_ISASL_REFRESH = 0xf1,
+        /* Move a slab page between slab classes */
+        PROTOCOL_BINARY_CMD_SLABS_REASSIGN = 0xf2
     } protocol_binary_command;
 
     /**
@@ -707,6 +709,26 @@ extern "C"
      */
     typedef protocol_binary_response_no_extras protocol_binary_response_scrub;
 
+    /**
+     * Definition of the packet used by slabs reassign. The destination
+     * class 0 means that the page is put in the pool of free pages.
+     */
+    typedef union {
+        struct {
+            protocol_binary_request_header header;
+            struct {
+                uint32_t src;
+                uint32_t dst;
+            } body;
+        } message;
+        uint8_t bytes[sizeof(protocol_binary_request_header) + 8];
+    } protocol_binary_request_slabs_reassign;
+
+    /**
+     * Definition of the packet returned from slabs reassign.
+     */
+    typedef protocol_binary_response_no_extras protocol_binary_response_slabs_reassign;
+
 
     /**
      * Definition of the packet used by set vbucket
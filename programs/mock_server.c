@@ -73,8 +73,20 @@ static const char *mock_get_server_version(void) {
 }
 
 static uint32_t mock_hash( const void *key, size_t length, const uint32_t initval) {
-    /*this is a very stupid hash indeed */
-    return 1;
+    /*
+     * FNV-1a. The engines use the hash to pick the buckets in their hash
+     * tables, so it has to spread the keys for the tests (and benchmarks)
+     * to exercise something resembling a real server.
+     */
+    const uint8_t *ptr = key;
+    uint32_t hv = 2166136261U ^ initval;
+    size_t ii;
+
+    for (ii = 0; ii < length; ++ii) {
+        hv ^= ptr[ii];
+        hv *= 16777619U;
+    }
+    return hv;
 }
 
 /* time-sensitive callers can call it by hand with this, outside the
@@ -0,0 +1,222 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Micro benchmark of handing work over to a worker thread from many
+ * producer threads (like new connections and I/O completions are handed
+ * to the worker threads in the daemon):
+ *
+ *    mpsc_benchmark [producers] [handoffs per producer]
+ *
+ * "mutex" is the old scheme: a mutex protected queue, and a byte written
+ * to a socketpair for every handoff. "mpsc" is the lock-free queue, with
+ * the wakeups coalesced until the consumer runs (through an eventfd where
+ * available). The consumer blocks in poll() when it runs out of work.
+ */
+#include "config.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <platform/platform.h>
+
+#include "daemon/mpsc_queue.h"
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#define HAVE_EVENTFD 1
+#endif
+
+struct handoff {
+    struct mpsc_node node;              /* must be first */
+    struct handoff *next;
+    hrtime_t pushed;
+};
+
+struct bench {
+    bool mpsc;
+    int fd[2];
+    /* "mutex" */
+    cb_mutex_t lock;
+    struct handoff *head;
+    struct handoff *tail;
+    /* "mpsc" */
+    mpsc_queue_t queue;
+    volatile uint32_t pending;
+};
+
+struct producer {
+    struct bench *bench;
+    struct handoff *handoffs;
+    int count;
+};
+
+static void bench_wakeup(struct bench *b) {
+#ifdef HAVE_EVENTFD
+    if (b->mpsc) {
+        uint64_t count = 1;
+        assert(write(b->fd[1], &count, sizeof(count)) == sizeof(count));
+        return;
+    }
+#endif
+    while (send(b->fd[1], "", 1, 0) != 1) {
+        /* The socket buffer is full, let the consumer catch up */
+        assert(errno == EAGAIN || errno == EWOULDBLOCK);
+        usleep(10);
+    }
+}
+
+static void bench_push(struct bench *b, struct handoff *h) {
+    h->pushed = gethrtime();
+    if (b->mpsc) {
+        mpsc_queue_push(&b->queue, &h->node);
+        __sync_synchronize();
+        if (__sync_lock_test_and_set(&b->pending, 1) == 0) {
+            bench_wakeup(b);
+        }
+    } else {
+        h->next = NULL;
+        cb_mutex_enter(&b->lock);
+        if (b->tail == NULL) {
+            b->head = h;
+        } else {
+            b->tail->next = h;
+        }
+        b->tail = h;
+        cb_mutex_exit(&b->lock);
+        bench_wakeup(b);
+    }
+}
+
+static struct handoff *bench_pop(struct bench *b) {
+    struct handoff *h;
+    if (b->mpsc) {
+        return (struct handoff*)mpsc_queue_pop(&b->queue);
+    }
+    cb_mutex_enter(&b->lock);
+    h = b->head;
+    if (h != NULL) {
+        b->head = h->next;
+        if (b->head == NULL) {
+            b->tail = NULL;
+        }
+    }
+    cb_mutex_exit(&b->lock);
+    return h;
+}
+
+static void producer_main(void *arg) {
+    struct producer *p = arg;
+    int ii;
+    for (ii = 0; ii < p->count; ++ii) {
+        bench_push(p->bench, &p->handoffs[ii]);
+    }
+}
+
+static void run(bool mpsc, int nproducers, int count) {
+    struct bench b;
+    struct producer *producers = calloc(nproducers, sizeof(*producers));
+    cb_thread_t *tids = calloc(nproducers, sizeof(*tids));
+    uint64_t total = (uint64_t)nproducers * count;
+    uint64_t received = 0;
+    uint64_t wakeups = 0;
+    hrtime_t latency = 0;
+    hrtime_t max_latency = 0;
+    hrtime_t start, stop;
+    char buffer[8192];
+    int ii;
+
+    assert(producers != NULL && tids != NULL);
+    memset(&b, 0, sizeof(b));
+    b.mpsc = mpsc;
+    cb_mutex_initialize(&b.lock);
+    mpsc_queue_init(&b.queue);
+#ifdef HAVE_EVENTFD
+    if (mpsc) {
+        b.fd[0] = b.fd[1] = eventfd(0, EFD_NONBLOCK);
+        assert(b.fd[0] != -1);
+    } else
+#endif
+    {
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, b.fd) == 0);
+        assert(fcntl(b.fd[0], F_SETFL, O_NONBLOCK) == 0);
+        assert(fcntl(b.fd[1], F_SETFL, O_NONBLOCK) == 0);
+    }
+
+    for (ii = 0; ii < nproducers; ++ii) {
+        producers[ii].bench = &b;
+        producers[ii].count = count;
+        producers[ii].handoffs = calloc(count, sizeof(struct handoff));
+        assert(producers[ii].handoffs != NULL);
+    }
+
+    start = gethrtime();
+    for (ii = 0; ii < nproducers; ++ii) {
+        assert(cb_create_thread(&tids[ii], producer_main, &producers[ii], 0) == 0);
+    }
+
+    while (received < total) {
+        struct pollfd pfd;
+        struct handoff *h;
+
+        pfd.fd = b.fd[0];
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 1000) <= 0) {
+            continue;
+        }
+        ++wakeups;
+        while (read(b.fd[0], buffer, sizeof(buffer)) > 0) {
+            /* drain */
+        }
+        if (mpsc) {
+            __sync_synchronize();
+            __sync_lock_test_and_set(&b.pending, 0);
+        }
+
+        while ((h = bench_pop(&b)) != NULL) {
+            hrtime_t delta = gethrtime() - h->pushed;
+            latency += delta;
+            if (delta > max_latency) {
+                max_latency = delta;
+            }
+            ++received;
+        }
+    }
+    stop = gethrtime();
+
+    for (ii = 0; ii < nproducers; ++ii) {
+        assert(cb_join_thread(tids[ii]) == 0);
+        free(producers[ii].handoffs);
+    }
+
+    fprintf(stdout, "%-6s %3d producers: %10.0f handoffs/s, latency avg %8.0f ns "
+            "max %10" PRIu64 " ns, %" PRIu64 " wakeups\n",
+            mpsc ? "mpsc" : "mutex", nproducers,
+            (double)total * 1000000000.0 / (double)(stop - start),
+            (double)latency / (double)total, (uint64_t)max_latency, wakeups);
+
+    close(b.fd[0]);
+    if (b.fd[1] != b.fd[0]) {
+        close(b.fd[1]);
+    }
+    cb_mutex_destroy(&b.lock);
+    free(producers);
+    free(tids);
+}
+
+int main(int argc, char **argv) {
+    int nproducers = argc > 1 ? atoi(argv[1]) : 8;
+    int count = argc > 2 ? atoi(argv[2]) : 200000;
+
+    if (nproducers <= 0 || count <= 0) {
+        fprintf(stderr, "Usage: %s [producers] [handoffs per producer]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    run(false, nproducers, count);
+    run(true, nproducers, count);
+    return EXIT_SUCCESS;
+}
@@ -2,6 +2,7 @@
 #include <stdio.h>
 
 #include "daemon/memcached.h"
+#include "engines/default_engine/default_engine.h"
 
 static void display(const char *name, size_t size) {
     printf("%s\t%d\n", name, (int)size);
@@ -38,5 +39,14 @@ int main(int argc, char **argv) {
     display("libevent thread cumulative", sizeof(LIBEVENT_THREAD));
     display("Thread stats cumulative\t", sizeof(struct thread_stats));
 
+    printf("----------------------------------------\n");
+
+    /* The per item overhead of the default engine (excluding the key) */
+    display("Item header", sizeof(hash_item));
+    display("Item header with CAS", sizeof(hash_item) + sizeof(uint64_t));
+    display("Compact item header", ITEM_COMPACT_HEADER_SIZE);
+    display("Compact item header with CAS",
+            ITEM_COMPACT_HEADER_SIZE + sizeof(uint64_t));
+
     return 0;
 }
@@ -12,6 +12,7 @@
 #include <evutil.h>
 
 #include "daemon/cache.h"
+#include "daemon/mpsc_queue.h"
 #include <memcached/util.h>
 #include <memcached/protocol_binary.h>
 #include <memcached/config_parser.h>
@@ -193,6 +194,76 @@ static enum test_return cache_redzone_test(void)
 #endif
 }
 
+struct mpsc_test_node {
+    struct mpsc_node node;
+    int producer;
+    int seqno;
+};
+
+struct mpsc_test_producer {
+    mpsc_queue_t *queue;
+    struct mpsc_test_node *nodes;
+    int id;
+};
+
+#define MPSC_TEST_PRODUCERS 4
+#define MPSC_TEST_NODES 100000
+
+static void mpsc_test_producer_main(void *arg) {
+    struct mpsc_test_producer *p = arg;
+    int ii;
+    for (ii = 0; ii < MPSC_TEST_NODES; ++ii) {
+        p->nodes[ii].producer = p->id;
+        p->nodes[ii].seqno = ii;
+        mpsc_queue_push(p->queue, &p->nodes[ii].node);
+    }
+}
+
+static enum test_return mpsc_queue_test(void)
+{
+    mpsc_queue_t queue;
+    struct mpsc_test_producer producers[MPSC_TEST_PRODUCERS];
+    cb_thread_t tids[MPSC_TEST_PRODUCERS];
+    int next[MPSC_TEST_PRODUCERS];
+    int received = 0;
+    int ii;
+
+    mpsc_queue_init(&queue);
+    assert(mpsc_queue_pop(&queue) == NULL);
+
+    for (ii = 0; ii < MPSC_TEST_PRODUCERS; ++ii) {
+        producers[ii].queue = &queue;
+        producers[ii].id = ii;
+        producers[ii].nodes = calloc(MPSC_TEST_NODES,
+                                     sizeof(struct mpsc_test_node));
+        assert(producers[ii].nodes != NULL);
+        next[ii] = 0;
+        assert(cb_create_thread(&tids[ii], mpsc_test_producer_main,
+                                &producers[ii], 0) == 0);
+    }
+
+    /* Every node must be popped exactly once, and in the order each
+     * producer pushed them */
+    while (received < MPSC_TEST_PRODUCERS * MPSC_TEST_NODES) {
+        struct mpsc_test_node *n;
+        n = (struct mpsc_test_node*)mpsc_queue_pop(&queue);
+        if (n != NULL) {
+            assert(n->seqno == next[n->producer]);
+            ++next[n->producer];
+            ++received;
+        }
+    }
+    assert(mpsc_queue_pop(&queue) == NULL);
+
+    for (ii = 0; ii < MPSC_TEST_PRODUCERS; ++ii) {
+        assert(cb_join_thread(tids[ii]) == 0);
+        assert(next[ii] == MPSC_TEST_NODES);
+        free(producers[ii].nodes);
+    }
+
+    return TEST_PASS;
+}
+
 static enum test_return test_safe_strtoul(void) {
     uint32_t val;
     assert(safe_strtoul("123", &val));
@@ -342,10 +413,12 @@ static void log_network_error(const char* prefix) {
 #endif
 
 #ifdef WIN32
-static HANDLE start_server(in_port_t *port_out, bool daemon, int timeout) {
+static HANDLE start_server(in_port_t *port_out, bool daemon, int timeout,
+                           const char **extra_args) {
     STARTUPINFO sinfo;
     PROCESS_INFORMATION pinfo;
 	char *commandline = malloc(1024);
+    char extra[256] = "";
     char env[80];
     sprintf_s(env, sizeof(env), "MEMCACHED_PARENT_MONITOR=%u", GetCurrentProcessId());
     putenv(env);
@@ -354,8 +427,13 @@ static HANDLE start_server(in_port_t *port_out, bool daemon, int timeout) {
     memset(&pinfo, 0, sizeof(pinfo));
     sinfo.cb = sizeof(sinfo);
 
-	sprintf(commandline, "memcached.exe -E default_engine.dll -X blackhole_logger.dll -X fragment_rw_ops.dll,r=%u;w=%u -p 11211",
-		read_command, write_command);
+    while (extra_args != NULL && *extra_args != NULL) {
+        strcat(extra, " ");
+        strcat(extra, *extra_args++);
+    }
+
+	sprintf(commandline, "memcached.exe -E default_engine.dll -X blackhole_logger.dll -X fragment_rw_ops.dll,r=%u;w=%u -p 11211%s",
+		read_command, write_command, extra);
 
     if (!CreateProcess("memcached.exe",
                        commandline,
@@ -390,9 +468,12 @@ static HANDLE start_server(in_port_t *port_out, bool daemon, int timeout) {
  *                 listening on
  * @param daemon set to true if you want to run the memcached server
  *               as a daemon process
+ * @param extra_args additional command line options (a NULL terminated
+ *                   array, or NULL)
  * @return the pid of the memcached server
  */
-static pid_t start_server(in_port_t *port_out, bool daemon, int timeout) {
+static pid_t start_server(in_port_t *port_out, bool daemon, int timeout,
+                          const char **extra_args) {
     char environment[80];
     char *filename= environment + strlen("MEMCACHED_PORT_FILENAME=");
     char pid_file[80];
@@ -426,7 +507,7 @@ static pid_t start_server(in_port_t *port_out, bool daemon, int timeout) {
 
     if (pid == 0) {
         /* Child */
-        char *argv[20];
+        char *argv[40];
         int arg = 0;
         char tmo[24];
 
@@ -456,6 +537,9 @@ static pid_t start_server(in_port_t *port_out, bool daemon, int timeout) {
             argv[arg++] = "-P";
             argv[arg++] = pid_file;
         }
+        while (extra_args != NULL && *extra_args != NULL) {
+            argv[arg++] = (char*)*extra_args++;
+        }
         argv[arg++] = NULL;
         assert(execv(argv[0], argv) != -1);
     }
@@ -485,22 +569,28 @@ static pid_t start_server(in_port_t *port_out, bool daemon, int timeout) {
 
     if (daemon) {
         int32_t val;
-        /* loop and wait for the pid file.. There is a potential race
-         * condition that the server just created the file but isn't
-         * finished writing the content, but I'll take the chance....
+        /* loop and wait for the pid file.. The server may just have
+         * created the file without writing the content yet, so wait
+         * for the complete line
          */
-        while (access(pid_file, F_OK) == -1) {
+        buffer[0] = '\0';
+        while (strchr(buffer, '\n') == NULL) {
             usleep(10);
-        }
+            if (access(pid_file, F_OK) == -1) {
+                continue;
+            }
 
-        fp = fopen(pid_file, "r");
-        if (fp == NULL) {
-            fprintf(stderr, "Failed to open pid file: %s\n",
-                    strerror(errno));
-            assert(false);
+            fp = fopen(pid_file, "r");
+            if (fp == NULL) {
+                fprintf(stderr, "Failed to open pid file: %s\n",
+                        strerror(errno));
+                assert(false);
+            }
+            if (fgets(buffer, sizeof(buffer), fp) == NULL) {
+                buffer[0] = '\0';
+            }
+            fclose(fp);
         }
-        assert(fgets(buffer, sizeof(buffer), fp) != NULL);
-        fclose(fp);
 
         assert(safe_strtol(buffer, &val));
         pid = (pid_t)val;
@@ -515,7 +605,7 @@ static enum test_return test_issue_44(void) {
     return TEST_SKIP;
 #else
     in_port_t port;
-    pid_t pid = start_server(&port, true, 15);
+    pid_t pid = start_server(&port, true, 15, NULL);
     assert(kill(pid, SIGHUP) == 0);
     sleep(1);
     assert(kill(pid, SIGTERM) == 0);
@@ -855,7 +945,7 @@ static enum test_return test_config_parser(void) {
 }
 
 static enum test_return start_memcached_server(void) {
-    server_pid = start_server(&port, false, 600);
+    server_pid = start_server(&port, false, 600, NULL);
     sock = connect_server("127.0.0.1", port, false);
 
     return TEST_PASS;
@@ -2275,6 +2365,375 @@ static enum test_return test_binary_write(void) {
     return TEST_PASS;
 }
 
+/*
+ * With -W every worker thread accepts connections on its own listening
+ * socket. Open a bunch of connections (spread over the workers by the
+ * kernel) and verify that all of them are served.
+ */
+static enum test_return test_reuseport(void) {
+#ifdef WIN32
+    return TEST_SKIP;
+#else
+    const char *args[] = { "-W", NULL };
+    SOCKET socks[64];
+    SOCKET saved = sock;
+    in_port_t saved_port = port;
+    pid_t pid;
+    int ii;
+
+    pid = start_server(&port, false, 60, args);
+    for (ii = 0; ii < 64; ++ii) {
+        socks[ii] = connect_server("127.0.0.1", port, false);
+        assert(socks[ii] != INVALID_SOCKET);
+    }
+    for (ii = 0; ii < 64; ++ii) {
+        sock = socks[ii];
+        assert(test_binary_noop() == TEST_PASS);
+    }
+    for (ii = 0; ii < 64; ++ii) {
+        closesocket(socks[ii]);
+    }
+    assert(kill(pid, SIGTERM) == 0);
+
+    sock = saved;
+    port = saved_port;
+    return TEST_PASS;
+#endif
+}
+
+/*
+ * Get the number of connections on each of the worker threads from the
+ * server stats. Returns the total.
+ */
+static int get_thread_connections(int *conns, int nthreads) {
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+    int total = 0;
+    size_t len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                             PROTOCOL_BINARY_CMD_STAT,
+                             NULL, 0, NULL, 0);
+
+    safe_send(buffer.bytes, len, false);
+    do {
+        char key[80];
+        char value[80];
+        uint16_t keylen;
+        uint32_t vallen;
+        int tid;
+        int end;
+
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_STAT,
+                                 PROTOCOL_BINARY_RESPONSE_SUCCESS);
+        keylen = buffer.response.message.header.response.keylen;
+        vallen = buffer.response.message.header.response.bodylen - keylen;
+        if (keylen >= sizeof(key) || vallen >= sizeof(value)) {
+            continue;
+        }
+        memcpy(key, buffer.bytes + sizeof(buffer.response), keylen);
+        key[keylen] = '\0';
+        memcpy(value, buffer.bytes + sizeof(buffer.response) + keylen, vallen);
+        value[vallen] = '\0';
+        end = 0;
+        if (sscanf(key, "thread_%d_curr_connections%n", &tid, &end) == 1 &&
+            end == keylen) {
+            assert(tid >= 0 && tid < nthreads);
+            conns[tid] = atoi(value);
+            total += conns[tid];
+        }
+    } while (buffer.response.message.header.response.keylen != 0);
+
+    return total;
+}
+
+/*
+ * With the least_conns dispatch policy the connections opened after
+ * some were closed should go to the workers that lost them, so the
+ * workers end up with the same number of connections.
+ */
+#define DISPATCH_THREADS 4
+#define DISPATCH_CONNECTIONS 16
+
+static enum test_return test_dispatch_least_conns(void) {
+#ifdef WIN32
+    return TEST_SKIP;
+#else
+    const char *args[] = { "-t", "4", "-j", "least_conns", NULL };
+    SOCKET socks[DISPATCH_CONNECTIONS];
+    int conns[DISPATCH_THREADS];
+    SOCKET saved = sock;
+    SOCKET stats_sock;
+    in_port_t saved_port = port;
+    pid_t pid;
+    int ii;
+
+    pid = start_server(&port, false, 60, args);
+    stats_sock = connect_server("127.0.0.1", port, false);
+    assert(stats_sock != INVALID_SOCKET);
+    for (ii = 0; ii < DISPATCH_CONNECTIONS; ++ii) {
+        socks[ii] = connect_server("127.0.0.1", port, false);
+        assert(socks[ii] != INVALID_SOCKET);
+        sock = socks[ii];
+        assert(test_binary_noop() == TEST_PASS);
+    }
+
+    /* Close every other connection among the first half (they're most
+     * likely not spread evenly over the workers), and wait for the
+     * server to notice */
+    for (ii = 0; ii < DISPATCH_CONNECTIONS / 2; ii += 2) {
+        closesocket(socks[ii]);
+    }
+    sock = stats_sock;
+    while (get_thread_connections(conns, DISPATCH_THREADS) !=
+           DISPATCH_CONNECTIONS + 1 - DISPATCH_CONNECTIONS / 4) {
+        usleep(1000);
+    }
+
+    for (ii = 0; ii < DISPATCH_CONNECTIONS / 2; ii += 2) {
+        socks[ii] = connect_server("127.0.0.1", port, false);
+        assert(socks[ii] != INVALID_SOCKET);
+        sock = socks[ii];
+        assert(test_binary_noop() == TEST_PASS);
+    }
+
+    sock = stats_sock;
+    assert(get_thread_connections(conns, DISPATCH_THREADS) ==
+           DISPATCH_CONNECTIONS + 1);
+    for (ii = 0; ii < DISPATCH_THREADS; ++ii) {
+        /* the stats connection is on one of them */
+        assert(conns[ii] == DISPATCH_CONNECTIONS / DISPATCH_THREADS ||
+               conns[ii] == DISPATCH_CONNECTIONS / DISPATCH_THREADS + 1);
+    }
+
+    for (ii = 0; ii < DISPATCH_CONNECTIONS; ++ii) {
+        closesocket(socks[ii]);
+    }
+    closesocket(stats_sock);
+    assert(kill(pid, SIGTERM) == 0);
+
+    sock = saved;
+    port = saved_port;
+    return TEST_PASS;
+#endif
+}
+
+/*
+ * Park a lot of connections in the engine at the same time (the mock
+ * engine blocks some of the gets and completes them from another thread)
+ * to verify that the pending io bookkeeping copes with it.
+ */
+#define PENDING_IO_CONNECTIONS 10000
+
+static enum test_return test_pending_io(void) {
+#ifdef WIN32
+    return TEST_SKIP;
+#else
+    const char *args[] = { "-E", "tap_mock_engine.so", "-c", "11000", NULL };
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+    SOCKET *socks;
+    SOCKET saved = sock;
+    in_port_t saved_port = port;
+    struct rlimit rlim;
+    size_t len;
+    pid_t pid;
+    int ii;
+
+    /* We need a file descriptor for each of the connections */
+    if (getrlimit(RLIMIT_NOFILE, &rlim) != 0) {
+        return TEST_SKIP;
+    }
+    if (rlim.rlim_cur < PENDING_IO_CONNECTIONS + 1024) {
+        rlim.rlim_cur = PENDING_IO_CONNECTIONS + 1024;
+        if (rlim.rlim_max < rlim.rlim_cur ||
+            setrlimit(RLIMIT_NOFILE, &rlim) != 0) {
+            return TEST_SKIP;
+        }
+    }
+
+    socks = calloc(PENDING_IO_CONNECTIONS, sizeof(SOCKET));
+    assert(socks != NULL);
+    pid = start_server(&port, false, 120, args);
+    for (ii = 0; ii < PENDING_IO_CONNECTIONS; ++ii) {
+        socks[ii] = connect_server("127.0.0.1", port, false);
+        assert(socks[ii] != INVALID_SOCKET);
+    }
+
+    /* Send all of the requests before reading any of the responses */
+    len = raw_command(buffer.bytes, sizeof(buffer.bytes),
+                      PROTOCOL_BINARY_CMD_GET, "pending_io", 10, NULL, 0);
+    for (ii = 0; ii < PENDING_IO_CONNECTIONS; ++ii) {
+        sock = socks[ii];
+        safe_send(buffer.bytes, len, false);
+    }
+    for (ii = 0; ii < PENDING_IO_CONNECTIONS; ++ii) {
+        sock = socks[ii];
+        safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+        validate_response_header(&buffer.response, PROTOCOL_BINARY_CMD_GET,
+                                 PROTOCOL_BINARY_RESPONSE_KEY_ENOENT);
+        closesocket(socks[ii]);
+    }
+    free(socks);
+    assert(kill(pid, SIGTERM) == 0);
+
+    sock = saved;
+    port = saved_port;
+    return TEST_PASS;
+#endif
+}
+
+/*
+ * Store and read back a value larger than the item size (so the engine
+ * splits it over a chain of chunks) through the binary protocol.
+ */
+#define LARGE_ITEM_SIZE (2 * 1024 * 1024)
+
+static enum test_return test_binary_large_item(void) {
+#ifdef WIN32
+    return TEST_SKIP;
+#else
+    const char *args[] = { "-e", "cache_size=67108864;large_item_max=8388608",
+                           NULL };
+    const char *key = "test_binary_large_item";
+    size_t bufsize = LARGE_ITEM_SIZE + 1024;
+    char *value = malloc(LARGE_ITEM_SIZE);
+    char *buffer = malloc(bufsize);
+    protocol_binary_response_no_extras *response = (void*)buffer;
+    SOCKET saved = sock;
+    in_port_t saved_port = port;
+    size_t len;
+    pid_t pid;
+    int ii;
+
+    assert(value != NULL && buffer != NULL);
+    for (ii = 0; ii < LARGE_ITEM_SIZE; ++ii) {
+        value[ii] = 'a' + (ii % 26);
+    }
+
+    pid = start_server(&port, false, 60, args);
+    sock = connect_server("127.0.0.1", port, false);
+    assert(sock != INVALID_SOCKET);
+
+    len = storage_command(buffer, bufsize, PROTOCOL_BINARY_CMD_SET,
+                          key, strlen(key), value, LARGE_ITEM_SIZE, 0, 0);
+    safe_send(buffer, len, false);
+    safe_recv_packet(buffer, bufsize);
+    validate_response_header(response, PROTOCOL_BINARY_CMD_SET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+
+    len = raw_command(buffer, bufsize, PROTOCOL_BINARY_CMD_GET,
+                      key, strlen(key), NULL, 0);
+    safe_send(buffer, len, false);
+    safe_recv_packet(buffer, bufsize);
+    validate_response_header(response, PROTOCOL_BINARY_CMD_GET,
+                             PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    assert(response->message.header.response.bodylen == 4 + LARGE_ITEM_SIZE);
+    assert(memcmp(buffer + sizeof(*response) + 4, value,
+                  LARGE_ITEM_SIZE) == 0);
+
+    closesocket(sock);
+    assert(kill(pid, SIGTERM) == 0);
+    free(buffer);
+    free(value);
+
+    sock = saved;
+    port = saved_port;
+    return TEST_PASS;
+#endif
+}
+
+/*
+ * Pipeline sets and gets over a bunch of connections to the mock engine,
+ * which blocks some of them and completes them from other threads. The
+ * completions arrive while the workers run the other connections, and
+ * every get must still return the value set right before it (the sets
+ * are quiet as the mock engine doesn't hand out a cas).
+ */
+#define IO_STRESS_CONNECTIONS 64
+#define IO_STRESS_ROUNDS 20
+#define IO_STRESS_PIPELINE 8
+
+static enum test_return test_io_complete_stress(void) {
+#ifdef WIN32
+    return TEST_SKIP;
+#else
+    const char *args[] = { "-E", "tap_mock_engine.so", "-t", "4", NULL };
+    union {
+        protocol_binary_request_no_extras request;
+        protocol_binary_response_no_extras response;
+        char bytes[1024];
+    } buffer;
+    char pipeline[IO_STRESS_PIPELINE * 2 * 128];
+    SOCKET socks[IO_STRESS_CONNECTIONS];
+    SOCKET saved = sock;
+    in_port_t saved_port = port;
+    pid_t pid;
+    int round, ii, jj;
+
+    pid = start_server(&port, false, 120, args);
+    for (ii = 0; ii < IO_STRESS_CONNECTIONS; ++ii) {
+        socks[ii] = connect_server("127.0.0.1", port, false);
+        assert(socks[ii] != INVALID_SOCKET);
+    }
+
+    for (round = 0; round < IO_STRESS_ROUNDS; ++round) {
+        /* Send the requests on all of the connections before reading
+         * any of the responses */
+        for (ii = 0; ii < IO_STRESS_CONNECTIONS; ++ii) {
+            size_t len = 0;
+            for (jj = 0; jj < IO_STRESS_PIPELINE; ++jj) {
+                char key[32];
+                char value[32];
+                snprintf(key, sizeof(key), "stress_%d_%d", ii, jj);
+                snprintf(value, sizeof(value), "%d:%d:%d", round, ii, jj);
+                len += storage_command(pipeline + len, sizeof(pipeline) - len,
+                                       PROTOCOL_BINARY_CMD_SETQ,
+                                       key, strlen(key),
+                                       value, strlen(value), 0, 0);
+                len += raw_command(pipeline + len, sizeof(pipeline) - len,
+                                   PROTOCOL_BINARY_CMD_GET,
+                                   key, strlen(key), NULL, 0);
+            }
+            sock = socks[ii];
+            safe_send(pipeline, len, false);
+        }
+
+        for (ii = 0; ii < IO_STRESS_CONNECTIONS; ++ii) {
+            sock = socks[ii];
+            for (jj = 0; jj < IO_STRESS_PIPELINE; ++jj) {
+                char value[32];
+                size_t vlen;
+                snprintf(value, sizeof(value), "%d:%d:%d", round, ii, jj);
+                vlen = strlen(value);
+
+                safe_recv_packet(buffer.bytes, sizeof(buffer.bytes));
+                validate_response_header(&buffer.response,
+                                         PROTOCOL_BINARY_CMD_GET,
+                                         PROTOCOL_BINARY_RESPONSE_SUCCESS);
+                assert(buffer.response.message.header.response.bodylen == 4 + vlen);
+                assert(memcmp(buffer.bytes + sizeof(buffer.response) + 4,
+                              value, vlen) == 0);
+            }
+        }
+    }
+
+    for (ii = 0; ii < IO_STRESS_CONNECTIONS; ++ii) {
+        closesocket(socks[ii]);
+    }
+    assert(kill(pid, SIGTERM) == 0);
+
+    sock = saved;
+    port = saved_port;
+    return TEST_PASS;
+#endif
+}
+
 static enum test_return test_binary_bad_tap_ttl(void) {
     union {
         protocol_binary_request_tap_flush request;
@@ -2317,6 +2776,7 @@ struct testcase testcases[] = {
     { "cache_destructor", cache_destructor_test },
     { "cache_reuse", cache_reuse_test },
     { "cache_redzone", cache_redzone_test },
+    { "mpsc_queue", mpsc_queue_test },
     { "issue_161", test_issue_161 },
     { "strtof", test_safe_strtof },
     { "strtol", test_safe_strtol },
@@ -2369,6 +2829,11 @@ struct testcase testcases[] = {
     { "binary_bad_tap_ttl", test_binary_bad_tap_ttl },
     { "binary_pipeline_hickup", test_binary_pipeline_hickup },
 	{ "stop_server", stop_memcached_server },
+    { "reuseport", test_reuseport },
+    { "pending_io", test_pending_io },
+    { "dispatch_least_conns", test_dispatch_least_conns },
+    { "io_complete_stress", test_io_complete_stress },
+    { "binary_large_item", test_binary_large_item },
     { NULL, NULL }
 };
 
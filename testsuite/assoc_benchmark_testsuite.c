@@ -0,0 +1,165 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Micro benchmark comparing the lookup latency of the chained and the
+ * grouped hash table in the default engine:
+ *
+ *    engine_testapp -E default_engine.so -T assoc_benchmark_testsuite.so
+ *
+ * The tests with more than one million items need a lot of memory (about
+ * 16GB for the 100M tests) and are skipped unless ASSOC_BENCHMARK_ITEMS is
+ * set to the maximum number of items to test with.
+ */
+#undef NDEBUG
+#include "config.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <platform/platform.h>
+#include "assoc_benchmark_testsuite.h"
+
+struct test_harness test_harness;
+
+static char hash_is_expanding;
+static char hash_power_level[32];
+
+static void hash_stats_handler(const char *key, const uint16_t klen,
+                               const char *val, const uint32_t vlen,
+                               const void *cookie) {
+    if (klen == 17 && memcmp(key, "hash_is_expanding", klen) == 0) {
+        hash_is_expanding = val[0];
+    } else if (klen == 16 && memcmp(key, "hash_power_level", klen) == 0 &&
+               vlen < sizeof(hash_power_level)) {
+        memcpy(hash_power_level, val, vlen);
+        hash_power_level[vlen] = '\0';
+    }
+}
+
+static size_t bench_key(char *key, size_t size, uint32_t id) {
+    return snprintf(key, size, "assoc_bench_%010u", id);
+}
+
+/* Pick the keys to look up in a pseudo random order */
+static uint32_t bench_next(uint32_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static enum test_result run_benchmark(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                      uint32_t nitems) {
+    const char *type = test_harness.get_current_testcase()->cfg;
+    uint32_t state = 0xdeadbeef;
+    hrtime_t start, stop;
+    uint32_t ii;
+    char key[64];
+    size_t nkey;
+    item *it;
+
+    start = gethrtime();
+    for (ii = 0; ii < nitems; ++ii) {
+        uint64_t cas = 0;
+        nkey = bench_key(key, sizeof(key), ii);
+        assert(h1->allocate(h, NULL, &it, key, nkey, 1, 0, 0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+    stop = gethrtime();
+
+    /* Don't measure the lookups while the table is being expanded */
+    do {
+        hash_is_expanding = '0';
+        assert(h1->get_stats(h, NULL, NULL, 0,
+                             hash_stats_handler) == ENGINE_SUCCESS);
+        if (hash_is_expanding != '0') {
+            usleep(10000);
+        }
+    } while (hash_is_expanding != '0');
+
+    fprintf(stdout, "\n    %s: %u items, hash_power_level %s, "
+            "%.1f ns/insert\n", strstr(type, "hash_groups=true") ?
+            "grouped" : "chained", nitems, hash_power_level,
+            (double)(stop - start) / nitems);
+
+    start = gethrtime();
+    for (ii = 0; ii < nitems; ++ii) {
+        nkey = bench_key(key, sizeof(key), bench_next(&state) % nitems);
+        assert(h1->get(h, NULL, &it, key, nkey, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+    stop = gethrtime();
+    fprintf(stdout, "    hits: %.1f ns/lookup\n",
+            (double)(stop - start) / nitems);
+
+    start = gethrtime();
+    for (ii = 0; ii < nitems; ++ii) {
+        nkey = bench_key(key, sizeof(key), nitems + bench_next(&state) % nitems);
+        assert(h1->get(h, NULL, &it, key, nkey, 0) == ENGINE_KEY_ENOENT);
+    }
+    stop = gethrtime();
+    fprintf(stdout, "    misses: %.1f ns/lookup\n",
+            (double)(stop - start) / nitems);
+
+    return SUCCESS;
+}
+
+static enum test_result bench_1m(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    return run_benchmark(h, h1, 1000000);
+}
+
+static enum test_result bench_10m(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    return run_benchmark(h, h1, 10000000);
+}
+
+static enum test_result bench_100m(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    return run_benchmark(h, h1, 100000000);
+}
+
+static enum test_result prepare_items(uint64_t nitems) {
+    const char *max = getenv("ASSOC_BENCHMARK_ITEMS");
+    if (max == NULL || strtoull(max, NULL, 10) < nitems) {
+        return SKIPPED;
+    }
+    return SUCCESS;
+}
+
+static enum test_result prepare_10m(engine_test_t *test) {
+    return prepare_items(10000000);
+}
+
+static enum test_result prepare_100m(engine_test_t *test) {
+    return prepare_items(100000000);
+}
+
+#define CFG_1M "cache_size=268435456;lru_maintainer=false"
+#define CFG_10M "cache_size=2147483648;lru_maintainer=false"
+#define CFG_100M "cache_size=17179869184;lru_maintainer=false"
+
+MEMCACHED_PUBLIC_API
+engine_test_t* get_tests(void) {
+    static engine_test_t tests[]  = {
+        {"chained 1M", bench_1m, NULL, NULL,
+         CFG_1M ";hash_groups=false"},
+        {"grouped 1M", bench_1m, NULL, NULL,
+         CFG_1M ";hash_groups=true"},
+        {"chained 10M", bench_10m, NULL, NULL,
+         CFG_10M ";hash_groups=false", prepare_10m},
+        {"grouped 10M", bench_10m, NULL, NULL,
+         CFG_10M ";hash_groups=true", prepare_10m},
+        {"chained 100M", bench_100m, NULL, NULL,
+         CFG_100M ";hash_groups=false", prepare_100m},
+        {"grouped 100M", bench_100m, NULL, NULL,
+         CFG_100M ";hash_groups=true", prepare_100m},
+        {NULL, NULL, NULL, NULL, NULL}
+    };
+    return tests;
+}
+
+MEMCACHED_PUBLIC_API
+bool setup_suite(struct test_harness *th) {
+    test_harness = *th;
+    return true;
+}
@@ -306,6 +306,510 @@ static enum test_result incr_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+/*
+ * Counters are updated in place (unless someone else is reading them)
+ * and the value is always returned as ASCII
+ */
+static enum test_result counter_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    item *held_item = NULL;
+    item *check_item = NULL;
+    void *key = "counter_test_key";
+    uint64_t cas = 0;
+    uint64_t prev_cas;
+    uint64_t res = 0;
+    item_info info;
+
+    assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 2, 0, 0) == ENGINE_SUCCESS);
+    info.nvalue = 1;
+    assert(h1->get_item_info(h, NULL, test_item, &info) == true);
+    memcpy(info.value[0].iov_base, "99", 2);
+    assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+
+    /* The first update converts the item to a counter */
+    assert(h1->arithmetic(h, NULL, key, strlen(key), true, false, 1, 0,
+                          0, &cas, &res, 0) == ENGINE_SUCCESS);
+    assert(res == 100);
+    assert(h1->get(h, NULL, &test_item, key, strlen(key), 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+
+    /* Following updates are done in place, even when the length changes */
+    prev_cas = cas;
+    assert(h1->arithmetic(h, NULL, key, strlen(key), false, false, 91, 0,
+                          0, &cas, &res, 0) == ENGINE_SUCCESS);
+    assert(res == 9);
+    assert(cas != prev_cas);
+    assert(h1->get(h, NULL, &check_item, key, strlen(key), 0) == ENGINE_SUCCESS);
+    assert(check_item == test_item);
+    info.nvalue = 1;
+    assert(h1->get_item_info(h, NULL, check_item, &info) == true);
+    assert(info.cas == cas);
+    assert(info.value[0].iov_len == 1);
+    assert(memcmp(info.value[0].iov_base, "9", 1) == 0);
+    h1->release(h, NULL, check_item);
+
+    assert(h1->arithmetic(h, NULL, key, strlen(key), true, false,
+                          UINT64_MAX - 9, 0, 0, &cas, &res, 0) == ENGINE_SUCCESS);
+    assert(res == UINT64_MAX);
+    assert(h1->get(h, NULL, &check_item, key, strlen(key), 0) == ENGINE_SUCCESS);
+    assert(check_item == test_item);
+    info.nvalue = 1;
+    assert(h1->get_item_info(h, NULL, check_item, &info) == true);
+    assert(info.value[0].iov_len == 20);
+    assert(memcmp(info.value[0].iov_base, "18446744073709551615", 20) == 0);
+
+    /* The item we're holding must not change */
+    held_item = check_item;
+    assert(h1->arithmetic(h, NULL, key, strlen(key), true, false, 1, 0,
+                          0, &cas, &res, 0) == ENGINE_SUCCESS);
+    assert(res == 0);
+    assert(h1->get_item_info(h, NULL, held_item, &info) == true);
+    assert(info.value[0].iov_len == 20);
+    assert(memcmp(info.value[0].iov_base, "18446744073709551615", 20) == 0);
+    assert(h1->get(h, NULL, &check_item, key, strlen(key), 0) == ENGINE_SUCCESS);
+    assert(check_item != held_item);
+    info.nvalue = 1;
+    assert(h1->get_item_info(h, NULL, check_item, &info) == true);
+    assert(info.value[0].iov_len == 1);
+    assert(memcmp(info.value[0].iov_base, "0", 1) == 0);
+    h1->release(h, NULL, check_item);
+    h1->release(h, NULL, held_item);
+
+    return SUCCESS;
+}
+
+typedef union {
+    item_info info;
+    char bytes[sizeof(item_info) + ((IOV_MAX - 1) * sizeof(struct iovec))];
+} large_item_info;
+
+/* Compare the value of an item (in all of its segments) with a pattern */
+static bool large_item_check(const item_info *info, size_t offset,
+                             size_t nbytes) {
+    size_t pos = 0;
+    int ii;
+
+    for (ii = 0; ii < info->nvalue; ++ii) {
+        const char *ptr = info->value[ii].iov_base;
+        size_t jj;
+        for (jj = 0; jj < info->value[ii].iov_len; ++jj, ++pos) {
+            if (pos >= offset && pos < offset + nbytes &&
+                ptr[jj] != (char)((pos - offset) % 251)) {
+                return false;
+            }
+        }
+    }
+
+    return pos >= offset + nbytes;
+}
+
+/*
+ * Values larger than the biggest slab class are stored in multiple
+ * chunks, and handed out as multiple segments
+ */
+static enum test_result large_item_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    void *key = "large_item_key";
+    const size_t nbytes = 3 * 1024 * 1024 + 100;
+    large_item_info info;
+    uint64_t cas = 0;
+    size_t pos = 0;
+    int ii;
+
+    assert(h1->allocate(h, NULL, &test_item, key, strlen(key),
+                        5 * 1024 * 1024, 0, 0) == ENGINE_E2BIG);
+
+    assert(h1->allocate(h, NULL, &test_item, key, strlen(key), nbytes,
+                        0, 0) == ENGINE_SUCCESS);
+    info.info.nvalue = 1;
+    assert(h1->get_item_info(h, NULL, test_item, &info.info) == false);
+    info.info.nvalue = IOV_MAX;
+    assert(h1->get_item_info(h, NULL, test_item, &info.info) == true);
+    assert(info.info.nvalue > 3);
+    assert(info.info.nbytes == nbytes);
+    for (ii = 0; ii < info.info.nvalue; ++ii) {
+        char *ptr = info.info.value[ii].iov_base;
+        size_t jj;
+        for (jj = 0; jj < info.info.value[ii].iov_len; ++jj, ++pos) {
+            ptr[jj] = (char)(pos % 251);
+        }
+    }
+    assert(pos == nbytes);
+    assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+
+    assert(h1->get(h, NULL, &test_item, key, strlen(key), 0) == ENGINE_SUCCESS);
+    info.info.nvalue = IOV_MAX;
+    assert(h1->get_item_info(h, NULL, test_item, &info.info) == true);
+    assert(info.info.cas == cas);
+    assert(large_item_check(&info.info, 0, nbytes));
+    h1->release(h, NULL, test_item);
+
+    /* Prepend a small value to it */
+    assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 3,
+                        0, 0) == ENGINE_SUCCESS);
+    info.info.nvalue = 1;
+    assert(h1->get_item_info(h, NULL, test_item, &info.info) == true);
+    memcpy(info.info.value[0].iov_base, "abc", 3);
+    assert(h1->store(h, NULL, test_item, &cas, OPERATION_PREPEND, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+
+    assert(h1->get(h, NULL, &test_item, key, strlen(key), 0) == ENGINE_SUCCESS);
+    info.info.nvalue = IOV_MAX;
+    assert(h1->get_item_info(h, NULL, test_item, &info.info) == true);
+    assert(info.info.nbytes == nbytes + 3);
+    assert(memcmp(info.info.value[0].iov_base, "abc", 3) == 0);
+    assert(large_item_check(&info.info, 3, nbytes));
+    h1->release(h, NULL, test_item);
+
+    assert(h1->remove(h, NULL, key, strlen(key), &cas, 0) == ENGINE_SUCCESS);
+    assert(h1->get(h, NULL, &test_item, key, strlen(key), 0) == ENGINE_KEY_ENOENT);
+
+    return SUCCESS;
+}
+
+static void append_value(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                         const char *key, const char *value, size_t nvalue,
+                         uint64_t *cas) {
+    item *it;
+    item_info info;
+
+    assert(h1->allocate(h, NULL, &it, key, strlen(key), nvalue,
+                        0, 0) == ENGINE_SUCCESS);
+    info.nvalue = 1;
+    assert(h1->get_item_info(h, NULL, it, &info) == true);
+    memcpy(info.value[0].iov_base, value, nvalue);
+    assert(h1->store(h, NULL, it, cas, OPERATION_APPEND, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+}
+
+/*
+ * Small appends are done in place (in the slack of the slab chunk or in
+ * new data chunks of a chunked item), unless someone is using the item.
+ */
+static enum test_result append_inplace_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item;
+    item *check_item;
+    void *key = "append_inplace_key";
+    const size_t nbytes = 2 * 1024 * 1024;
+    large_item_info info;
+    uint64_t cas = 0;
+    uint64_t prev_cas;
+    char buf[1000];
+    size_t pos = 0;
+    int ii;
+
+    assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 1,
+                        0, 0) == ENGINE_SUCCESS);
+    info.info.nvalue = 1;
+    assert(h1->get_item_info(h, NULL, test_item, &info.info) == true);
+    memcpy(info.info.value[0].iov_base, "a", 1);
+    assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+
+    prev_cas = cas;
+    append_value(h, h1, key, "b", 1, &cas);
+    assert(cas != prev_cas);
+    assert(h1->get(h, NULL, &check_item, key, strlen(key), 0) == ENGINE_SUCCESS);
+    assert(check_item == test_item);
+    info.info.nvalue = 1;
+    assert(h1->get_item_info(h, NULL, check_item, &info.info) == true);
+    assert(info.info.cas == cas);
+    assert(info.info.value[0].iov_len == 2);
+    assert(memcmp(info.info.value[0].iov_base, "ab", 2) == 0);
+
+    /* The item we're holding must not change */
+    append_value(h, h1, key, "c", 1, &cas);
+    assert(info.info.value[0].iov_len == 2);
+    assert(memcmp(info.info.value[0].iov_base, "ab", 2) == 0);
+    assert(h1->get(h, NULL, &test_item, key, strlen(key), 0) == ENGINE_SUCCESS);
+    assert(test_item != check_item);
+    h1->release(h, NULL, check_item);
+    info.info.nvalue = 1;
+    assert(h1->get_item_info(h, NULL, test_item, &info.info) == true);
+    assert(memcmp(info.info.value[0].iov_base, "abc", 3) == 0);
+    h1->release(h, NULL, test_item);
+
+    /* Chunked items grow by adding segments */
+    assert(h1->allocate(h, NULL, &test_item, key, strlen(key), nbytes,
+                        0, 0) == ENGINE_SUCCESS);
+    info.info.nvalue = IOV_MAX;
+    assert(h1->get_item_info(h, NULL, test_item, &info.info) == true);
+    for (ii = 0; ii < info.info.nvalue; ++ii) {
+        char *ptr = info.info.value[ii].iov_base;
+        size_t jj;
+        for (jj = 0; jj < info.info.value[ii].iov_len; ++jj, ++pos) {
+            ptr[jj] = (char)(pos % 251);
+        }
+    }
+    assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+
+    for (ii = 0; ii < 100; ++ii) {
+        size_t jj;
+        for (jj = 0; jj < sizeof(buf); ++jj, ++pos) {
+            buf[jj] = (char)(pos % 251);
+        }
+        append_value(h, h1, key, buf, sizeof(buf), &cas);
+    }
+
+    assert(h1->get(h, NULL, &check_item, key, strlen(key), 0) == ENGINE_SUCCESS);
+    assert(check_item == test_item);
+    info.info.nvalue = IOV_MAX;
+    assert(h1->get_item_info(h, NULL, check_item, &info.info) == true);
+    assert(info.info.nbytes == pos);
+    assert(info.info.cas == cas);
+    assert(large_item_check(&info.info, 0, pos));
+    h1->release(h, NULL, check_item);
+
+    return SUCCESS;
+}
+
+uint64_t compressed_items;
+
+static void compressed_items_stats_handler(const char *key, const uint16_t klen,
+                                           const char *val, const uint32_t vlen,
+                                           const void *cookie) {
+    if (klen == 16 && memcmp(key, "compressed_items", klen) == 0) {
+        char buffer[32];
+        memcpy(buffer, val, vlen);
+        buffer[vlen] = '\0';
+        compressed_items = strtoull(buffer, NULL, 10);
+    }
+}
+
+static void store_value(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                        const char *key, const char *value, size_t nvalue,
+                        uint64_t *cas) {
+    item *it;
+    item_info info;
+
+    assert(h1->allocate(h, NULL, &it, key, strlen(key), nvalue,
+                        0, 0) == ENGINE_SUCCESS);
+    info.nvalue = 1;
+    assert(h1->get_item_info(h, NULL, it, &info) == true);
+    memcpy(info.value[0].iov_base, value, nvalue);
+    assert(h1->store(h, NULL, it, cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+}
+
+uint64_t used_chunks;
+static void used_chunks_handler(const char *key, const uint16_t klen,
+                                const char *val, const uint32_t vlen,
+                                const void *cookie) {
+    char buffer[64];
+    if (klen > 12 && memcmp(key + klen - 12, ":used_chunks", 12) == 0) {
+        assert(vlen < sizeof(buffer));
+        memcpy(buffer, val, vlen);
+        buffer[vlen] = '\0';
+        used_chunks += strtoull(buffer, NULL, 10);
+    }
+}
+
+/*
+ * Values above compression_threshold are stored compressed (if it saves
+ * memory), and decompressed when they are read. The decompressed copy
+ * doesn't take any memory from the slabs.
+ */
+static enum test_result compression_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    char *value = malloc(20000);
+    item *test_item;
+    item_info info;
+    uint64_t cas = 0;
+    size_t nvalue = 0;
+    size_t ii;
+
+    assert(value != NULL);
+    while (nvalue < 10000) {
+        nvalue += sprintf(value + nvalue, "{\"id\":%d,\"name\":\"user%d\"},",
+                          (int)nvalue, (int)nvalue * 7);
+    }
+    store_value(h, h1, "json", value, nvalue, &cas);
+    assert(h1->get_stats(h, NULL, NULL, 0,
+                         compressed_items_stats_handler) == ENGINE_SUCCESS);
+    assert(compressed_items == 1);
+
+    used_chunks = 0;
+    assert(h1->get_stats(h, NULL, "slabs", 5,
+                         used_chunks_handler) == ENGINE_SUCCESS);
+    assert(used_chunks == 1);
+
+    assert(h1->get(h, NULL, &test_item, "json", 4, 0) == ENGINE_SUCCESS);
+    info.nvalue = 1;
+    assert(h1->get_item_info(h, NULL, test_item, &info) == true);
+    assert(info.cas == cas);
+    assert(info.value[0].iov_len == nvalue);
+    assert(memcmp(info.value[0].iov_base, value, nvalue) == 0);
+    used_chunks = 0;
+    assert(h1->get_stats(h, NULL, "slabs", 5,
+                         used_chunks_handler) == ENGINE_SUCCESS);
+    assert(used_chunks == 1);
+    h1->release(h, NULL, test_item);
+
+    /* Appending to it gives us the raw values of both */
+    append_value(h, h1, "json", "]", 1, &cas);
+    assert(h1->get(h, NULL, &test_item, "json", 4, 0) == ENGINE_SUCCESS);
+    info.nvalue = 1;
+    assert(h1->get_item_info(h, NULL, test_item, &info) == true);
+    assert(info.value[0].iov_len == nvalue + 1);
+    assert(memcmp(info.value[0].iov_base, value, nvalue) == 0);
+    assert(memcmp((char*)info.value[0].iov_base + nvalue, "]", 1) == 0);
+    h1->release(h, NULL, test_item);
+
+    /* Values which don't compress are stored as is */
+    srand(1);
+    for (ii = 0; ii < nvalue; ++ii) {
+        value[ii] = (char)rand();
+    }
+    store_value(h, h1, "random", value, nvalue, &cas);
+    assert(h1->get_stats(h, NULL, NULL, 0,
+                         compressed_items_stats_handler) == ENGINE_SUCCESS);
+    assert(compressed_items == 1);
+    assert(h1->get(h, NULL, &test_item, "random", 6, 0) == ENGINE_SUCCESS);
+    info.nvalue = 1;
+    assert(h1->get_item_info(h, NULL, test_item, &info) == true);
+    assert(info.value[0].iov_len == nvalue);
+    assert(memcmp(info.value[0].iov_base, value, nvalue) == 0);
+    h1->release(h, NULL, test_item);
+
+    free(value);
+    return SUCCESS;
+}
+
+/*
+ * The items streamed to a TAP client hold the raw values of compressed
+ * items
+ */
+static enum test_result tap_compression_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const void *cookie = test_harness.create_cookie();
+    char *value = malloc(20000);
+    TAP_ITERATOR iter;
+    tap_event_t event;
+    item *test_item;
+    item_info info;
+    uint64_t cas = 0;
+    size_t nvalue = 0;
+    bool found = false;
+    void *es;
+    uint16_t nes;
+    uint8_t ttl;
+    uint16_t flags;
+    uint32_t seqno;
+    uint16_t vbucket;
+
+    assert(value != NULL);
+    while (nvalue < 10000) {
+        nvalue += sprintf(value + nvalue, "{\"id\":%d,\"name\":\"user%d\"},",
+                          (int)nvalue, (int)nvalue * 7);
+    }
+    store_value(h, h1, "json", value, nvalue, &cas);
+    assert(h1->get_stats(h, NULL, NULL, 0,
+                         compressed_items_stats_handler) == ENGINE_SUCCESS);
+    assert(compressed_items == 1);
+
+    iter = h1->get_tap_iterator(h, cookie, NULL, 0, 0, NULL, 0);
+    assert(iter != NULL);
+    while ((event = iter(h, cookie, &test_item, &es, &nes, &ttl, &flags,
+                         &seqno, &vbucket)) == TAP_MUTATION) {
+        info.nvalue = 1;
+        assert(h1->get_item_info(h, cookie, test_item, &info) == true);
+        assert(info.nkey == 4 && memcmp(info.key, "json", 4) == 0);
+        assert(info.value[0].iov_len == nvalue);
+        assert(memcmp(info.value[0].iov_base, value, nvalue) == 0);
+        h1->release(h, cookie, test_item);
+        found = true;
+    }
+    assert(event == TAP_DISCONNECT);
+    assert(found);
+
+    test_harness.destroy_cookie(cookie);
+    free(value);
+    return SUCCESS;
+}
+
+uint64_t expiry_curr_items;
+uint64_t expiry_wheel_entries;
+uint64_t expiry_wheel_dropped;
+uint64_t expiry_wheel_reclaimed;
+
+static void expiry_wheel_stats_handler(const char *key, const uint16_t klen,
+                                       const char *val, const uint32_t vlen,
+                                       const void *cookie) {
+    char buffer[32];
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+
+    if (klen == 10 && memcmp(key, "curr_items", klen) == 0) {
+        expiry_curr_items = strtoull(buffer, NULL, 10);
+    } else if (klen == 20 && memcmp(key, "expiry_wheel_entries", klen) == 0) {
+        expiry_wheel_entries = strtoull(buffer, NULL, 10);
+    } else if (klen == 20 && memcmp(key, "expiry_wheel_dropped", klen) == 0) {
+        expiry_wheel_dropped = strtoull(buffer, NULL, 10);
+    } else if (klen == 22 && memcmp(key, "expiry_wheel_reclaimed", klen) == 0) {
+        expiry_wheel_reclaimed = strtoull(buffer, NULL, 10);
+    }
+}
+
+/*
+ * Items with an expiry time should be reclaimed in the background once
+ * they expire, without anyone trying to access them
+ */
+static enum test_result expiry_wheel_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const int nitems = 500;
+    uint64_t cas = 0;
+    int wait;
+    int ii;
+
+    for (ii = 0; ii < nitems; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "expiry_wheel_%d", ii);
+        item *test_item = NULL;
+        /* Spread them over a few seconds (and levels of the wheel) */
+        rel_time_t exptime = ii < nitems / 2 ? 5 + ii % 3 : 100 + ii;
+        assert(h1->allocate(h, NULL, &test_item, key, keylen, 1, 0,
+                            exptime) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, test_item, &cas,
+                         OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    /* Items without an expiry time shouldn't be in the wheel */
+    store_value(h, h1, "expiry_wheel_forever", "x", 1, &cas);
+
+    assert(h1->get_stats(h, NULL, NULL, 0,
+                         expiry_wheel_stats_handler) == ENGINE_SUCCESS);
+    assert(expiry_curr_items == (uint64_t)nitems + 1);
+    assert(expiry_wheel_entries == (uint64_t)nitems);
+    assert(expiry_wheel_reclaimed == 0);
+
+    test_harness.time_travel(10);
+    for (wait = 0; wait < 5000; ++wait) {
+        assert(h1->get_stats(h, NULL, NULL, 0,
+                             expiry_wheel_stats_handler) == ENGINE_SUCCESS);
+        if (expiry_curr_items == (uint64_t)nitems / 2 + 1) {
+            break;
+        }
+        usleep(1000);
+    }
+    assert(expiry_curr_items == (uint64_t)nitems / 2 + 1);
+    assert(expiry_wheel_reclaimed > 0);
+
+    test_harness.time_travel(nitems + 100);
+    for (wait = 0; wait < 5000; ++wait) {
+        assert(h1->get_stats(h, NULL, NULL, 0,
+                             expiry_wheel_stats_handler) == ENGINE_SUCCESS);
+        if (expiry_curr_items == 1 && expiry_wheel_entries == 0) {
+            break;
+        }
+        usleep(1000);
+    }
+    assert(expiry_curr_items == 1);
+    assert(expiry_wheel_entries == 0);
+
+    return SUCCESS;
+}
+
 static void incr_test_main(void *arg) {
     ENGINE_HANDLE *h = arg;
     ENGINE_HANDLE_V1 *h1 = arg;
@@ -356,6 +860,245 @@ static enum test_result mt_incr_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+struct mt_store_ctx {
+    ENGINE_HANDLE *h;
+    int id;
+};
+
+#define mt_store_iterations 2000
+
+static void mt_store_test_main(void *arg) {
+    struct mt_store_ctx *ctx = arg;
+    ENGINE_HANDLE *h = ctx->h;
+    ENGINE_HANDLE_V1 *h1 = (ENGINE_HANDLE_V1*)ctx->h;
+    const char *counter = "mt_store_counter";
+    item_info info;
+    int ii;
+
+    info.nvalue = 1;
+    for (ii = 0; ii < mt_store_iterations; ++ii) {
+        char key[64];
+        size_t nkey = snprintf(key, sizeof(key), "mt_store_%d_%d",
+                               ctx->id, ii % 100);
+        item *it = NULL;
+        uint64_t cas = 0;
+        uint64_t res = 0;
+
+        assert(h1->allocate(h, NULL, &it, key, nkey, 1, 0, 0) == ENGINE_SUCCESS);
+        assert(h1->get_item_info(h, NULL, it, &info));
+        memcpy(info.value[0].iov_base, "a", 1);
+        assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+
+        assert(h1->allocate(h, NULL, &it, key, nkey, 1, 0, 0) == ENGINE_SUCCESS);
+        assert(h1->get_item_info(h, NULL, it, &info));
+        memcpy(info.value[0].iov_base, "b", 1);
+        assert(h1->store(h, NULL, it, &cas, OPERATION_APPEND, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+
+        assert(h1->get(h, NULL, &it, key, nkey, 0) == ENGINE_SUCCESS);
+        assert(h1->get_item_info(h, NULL, it, &info));
+        assert(info.value[0].iov_len == 2);
+        assert(memcmp(info.value[0].iov_base, "ab", 2) == 0);
+        h1->release(h, NULL, it);
+
+        cas = 0;
+        assert(h1->remove(h, NULL, key, nkey, &cas, 0) == ENGINE_SUCCESS);
+
+        assert(h1->arithmetic(h, NULL, counter, strlen(counter), true, true,
+                              1, 1, 0, &cas, &res, 0) == ENGINE_SUCCESS);
+    }
+}
+
+/*
+ * Hammer the engine from multiple threads with a mix of operations on
+ * private keys and increments of a shared counter, and verify that no
+ * updates were lost.
+ */
+static enum test_result mt_store_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    cb_thread_t tid[max_threads];
+    struct mt_store_ctx ctx[max_threads];
+    const char *counter = "mt_store_counter";
+    uint64_t cas = 0;
+    uint64_t res = 0;
+    int ii;
+
+    for (ii = 0; ii < max_threads; ++ii) {
+        ctx[ii].h = h;
+        ctx[ii].id = ii;
+        assert(cb_create_thread(&tid[ii], mt_store_test_main, &ctx[ii], 0) == 0);
+    }
+
+    for (ii = 0; ii < max_threads; ++ii) {
+        assert(cb_join_thread(tid[ii]) == 0);
+    }
+
+    /* The counter was created with 1 by the first incr */
+    assert(h1->arithmetic(h, NULL, counter, strlen(counter), true, false,
+                          0, 0, 0, &cas, &res, 0) == ENGINE_SUCCESS);
+    assert(res == (uint64_t)max_threads * mt_store_iterations);
+
+    return SUCCESS;
+}
+
+#define mt_release_keys 64
+#define mt_release_iterations 20000
+
+static void mt_release_test_main(void *arg) {
+    struct mt_store_ctx *ctx = arg;
+    ENGINE_HANDLE *h = ctx->h;
+    ENGINE_HANDLE_V1 *h1 = (ENGINE_HANDLE_V1*)ctx->h;
+    int ii;
+
+    for (ii = 0; ii < mt_release_iterations; ++ii) {
+        char key[64];
+        size_t nkey = snprintf(key, sizeof(key), "mt_release_%d",
+                               (ii * 7 + ctx->id) % mt_release_keys);
+        item *it = NULL;
+        uint64_t cas = 0;
+
+        if (ctx->id % 2 == 0) {
+            /* Readers hold on to the items while the writers unlink them */
+            if (h1->get(h, NULL, &it, key, nkey, 0) == ENGINE_SUCCESS) {
+                h1->release(h, NULL, it);
+            }
+        } else if (ii % 3 == 0) {
+            h1->remove(h, NULL, key, nkey, &cas, 0);
+        } else {
+            assert(h1->allocate(h, NULL, &it, key, nkey, 100, 0, 0) == ENGINE_SUCCESS);
+            assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+            h1->release(h, NULL, it);
+        }
+    }
+}
+
+/*
+ * References are released without any locks. Release items from some
+ * threads while others replace and delete them, and verify that every
+ * item was freed exactly once (all of the chunks are free once we've
+ * deleted the keys).
+ */
+static enum test_result mt_release_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    cb_thread_t tid[max_threads];
+    struct mt_store_ctx ctx[max_threads];
+    int ii;
+
+    for (ii = 0; ii < max_threads; ++ii) {
+        ctx[ii].h = h;
+        ctx[ii].id = ii;
+        assert(cb_create_thread(&tid[ii], mt_release_test_main, &ctx[ii], 0) == 0);
+    }
+
+    for (ii = 0; ii < max_threads; ++ii) {
+        assert(cb_join_thread(tid[ii]) == 0);
+    }
+
+    for (ii = 0; ii < mt_release_keys; ++ii) {
+        char key[64];
+        size_t nkey = snprintf(key, sizeof(key), "mt_release_%d", ii);
+        uint64_t cas = 0;
+        h1->remove(h, NULL, key, nkey, &cas, 0);
+    }
+
+    used_chunks = 0;
+    assert(h1->get_stats(h, NULL, "slabs", 5,
+                         used_chunks_handler) == ENGINE_SUCCESS);
+    assert(used_chunks == 0);
+
+    return SUCCESS;
+}
+
+/*
+ * The refcount of an item has 15 bits (the top bit tells if the item is
+ * linked). Hold as many references as it may count, and verify that the
+ * next get misses instead of overflowing the refcount.
+ */
+static enum test_result refcount_limit_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const int max_refs = 0x7fff;
+    item **items = calloc(max_refs, sizeof(item*));
+    uint64_t cas = 0;
+    item *it;
+    int ii;
+
+    assert(items != NULL);
+    assert(h1->allocate(h, NULL, &it, "refcount", 8, 1, 0, 0) == ENGINE_SUCCESS);
+    assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+
+    for (ii = 0; ii < max_refs; ++ii) {
+        assert(h1->get(h, NULL, &items[ii], "refcount", 8, 0) == ENGINE_SUCCESS);
+    }
+    assert(h1->get(h, NULL, &it, "refcount", 8, 0) == ENGINE_KEY_ENOENT);
+
+    h1->release(h, NULL, items[0]);
+    assert(h1->get(h, NULL, &items[0], "refcount", 8, 0) == ENGINE_SUCCESS);
+
+    for (ii = 0; ii < max_refs; ++ii) {
+        h1->release(h, NULL, items[ii]);
+    }
+    free(items);
+
+    cas = 0;
+    assert(h1->remove(h, NULL, "refcount", 8, &cas, 0) == ENGINE_SUCCESS);
+    used_chunks = 0;
+    assert(h1->get_stats(h, NULL, "slabs", 5,
+                         used_chunks_handler) == ENGINE_SUCCESS);
+    assert(used_chunks == 0);
+
+    return SUCCESS;
+}
+
+static void mt_cas_test_main(void *arg) {
+    struct mt_store_ctx *ctx = arg;
+    ENGINE_HANDLE *h = ctx->h;
+    ENGINE_HANDLE_V1 *h1 = (ENGINE_HANDLE_V1*)ctx->h;
+    uint64_t prev = 0;
+    char key[64];
+    size_t nkey = snprintf(key, sizeof(key), "mt_cas_%d", ctx->id);
+    int ii;
+
+    for (ii = 0; ii < mt_store_iterations; ++ii) {
+        item *it = NULL;
+        uint64_t cas = 0;
+
+        assert(h1->allocate(h, NULL, &it, key, nkey, 1, 0, 0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+        assert(cas > prev);
+        prev = cas;
+    }
+}
+
+/*
+ * Verify that the CAS values handed out to concurrent writers are unique
+ * and increasing.
+ */
+static enum test_result mt_cas_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    cb_thread_t tid[max_threads];
+    struct mt_store_ctx ctx[max_threads];
+    item *it = NULL;
+    uint64_t cas = 0;
+    int ii;
+
+    for (ii = 0; ii < max_threads; ++ii) {
+        ctx[ii].h = h;
+        ctx[ii].id = ii;
+        assert(cb_create_thread(&tid[ii], mt_cas_test_main, &ctx[ii], 0) == 0);
+    }
+
+    for (ii = 0; ii < max_threads; ++ii) {
+        assert(cb_join_thread(tid[ii]) == 0);
+    }
+
+    /* No id may be handed out twice */
+    assert(h1->allocate(h, NULL, &it, "mt_cas", 6, 1, 0, 0) == ENGINE_SUCCESS);
+    assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+    assert(cas > (uint64_t)max_threads * mt_store_iterations);
+
+    return SUCCESS;
+}
+
 /*
  * Make sure we can arithmetic operations to set the initial value of a key and
  * to then later decrement that value
@@ -397,110 +1140,935 @@ static enum test_result flush_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+uint64_t curr_items;
+static void curr_items_stats_handler(const char *key, const uint16_t klen,
+                                     const char *val, const uint32_t vlen,
+                                     const void *cookie) {
+    if (klen == 10 && memcmp(key, "curr_items", klen) == 0) {
+        char buffer[32];
+        memcpy(buffer, val, vlen);
+        buffer[vlen] = '\0';
+        curr_items = strtoull(buffer, NULL, 10);
+    }
+}
+
+/*
+ * Items stored right after a flush must survive it, and the flushed
+ * items should be reclaimed in the background
+ */
+static enum test_result flush_reclaim_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const int nitems = 1000;
+    item *test_item = NULL;
+    void *key = "flush_reclaim_test_key";
+    uint64_t cas = 0;
+    int ii;
+
+    /* oldest_live is relative to the process start (and 0 means "off") */
+    test_harness.time_travel(3);
+    for (ii = 0; ii < nitems; ++ii) {
+        char k[64];
+        size_t klen = snprintf(k, sizeof(k), "flush_reclaim_%d", ii);
+        assert(h1->allocate(h, NULL, &test_item, k, klen, 1, 0, 0) == ENGINE_SUCCESS);
+        cas = 0;
+        assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    assert(h1->flush(h, NULL, 0) == ENGINE_SUCCESS);
+    assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 1, 0, 0) == ENGINE_SUCCESS);
+    cas = 0;
+    assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    assert(h1->get(h, NULL, &test_item, key, strlen(key), 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+
+    for (ii = 0; ii < 10000; ++ii) {
+        assert(h1->get_stats(h, NULL, NULL, 0,
+                             curr_items_stats_handler) == ENGINE_SUCCESS);
+        if (curr_items == 1) {
+            break;
+        }
+        usleep(1000);
+    }
+    assert(curr_items == 1);
+
+    return SUCCESS;
+}
+
+/*
+ * Make sure we can successfully retrieve the item info struct for an item and
+ * that the contents of the item_info are as expected.
+ */
+static enum test_result get_item_info_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    char *key = "get_item_info_test_key";
+    uint64_t cas = 0;
+    const rel_time_t exp = 1;
+    item_info ii;
+    ii.nvalue = 1;
+
+    assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 1,0, exp) == ENGINE_SUCCESS);
+    assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
+    /* Had this been actual code, there'd be a connection here */
+    assert(h1->get_item_info(h, NULL, test_item, &ii) == true);
+    assert(ii.cas == cas);
+    assert(ii.flags == 0);
+    assert(strcmp(key,ii.key) == 0);
+    assert(ii.nkey == strlen(key));
+    assert(ii.nbytes == 1);
+    assert(ii.exptime == exp);
+    h1->release(h, NULL, test_item);
+    return SUCCESS;
+}
+
+static enum test_result item_set_cas_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    char *key = "item_set_cas_test_key";
+    uint64_t cas = 0;
+    const rel_time_t exp = 1;
+    uint64_t newcas;
+    item_info ii;
+
+    ii.nvalue = 1;
+    assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 1,0, exp) == ENGINE_SUCCESS);
+    assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
+    newcas = cas + 1;
+    h1->item_set_cas(h, NULL, test_item, newcas);
+    assert(h1->get_item_info(h, NULL, test_item, &ii) == true);
+    assert(ii.cas == newcas);
+    h1->release(h, NULL, test_item);
+    return SUCCESS;
+}
+
+uint32_t evictions;
+static void eviction_stats_handler(const char *key, const uint16_t klen,
+                                   const char *val, const uint32_t vlen,
+                                   const void *cookie) {
+    if (klen == 9 && memcmp(key, "evictions", klen) == 0) {
+        char buffer[1024];
+        memcpy(buffer, val, vlen);
+        buffer[vlen] = '\0';
+        evictions = atoi(buffer);
+    }
+}
+
+static enum test_result lru_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    const char *hot_key = "hot_key";
+    uint64_t cas = 0;
+    int ii;
+    int jj;
+
+    assert(h1->allocate(h, NULL, &test_item,
+                        hot_key, strlen(hot_key), 4096, 0, 0) == ENGINE_SUCCESS);
+    assert(h1->store(h, NULL, test_item,
+                     &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+
+    for (ii = 0; ii < 250; ++ii) {
+        char key[1024];
+        size_t keylen;
+
+        assert(h1->get(h, NULL, &test_item,
+                       hot_key, strlen(hot_key), 0) ==  ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+        keylen = snprintf(key, sizeof(key), "lru_test_key_%08d", ii);
+        assert(h1->allocate(h, NULL, &test_item,
+                            key, keylen, 4096, 0, 0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+        assert(h1->get_stats(h, NULL, NULL, 0,
+                             eviction_stats_handler) == ENGINE_SUCCESS);
+        if (evictions == 2) {
+            break;
+        }
+    }
+
+    assert(ii < 250);
+    for (jj = 0; jj <= ii; ++jj) {
+        char key[1024];
+        size_t keylen = snprintf(key, sizeof(key), "lru_test_key_%08d", jj);
+        if (jj == 0 || jj == 1) {
+            assert(h1->get(h, NULL, &test_item,
+                           key, keylen, 0) == ENGINE_KEY_ENOENT);
+        } else {
+            assert(h1->get(h, NULL, &test_item,
+                           key, keylen, 0) == ENGINE_SUCCESS);
+            assert(test_item != NULL);
+            h1->release(h, NULL, test_item);
+        }
+    }
+    return SUCCESS;
+}
+
+uint32_t lru_hot, lru_warm, lru_cold, lru_moves_to_warm;
+static void lru_stats_handler(const char *key, const uint16_t klen,
+                              const char *val, const uint32_t vlen,
+                              const void *cookie) {
+    char buffer[1024];
+    const char *name;
+
+    memcpy(buffer, key, klen);
+    buffer[klen] = '\0';
+    /* The stats is named items:<clsid>:<name> */
+    if ((name = strrchr(buffer, ':')) == NULL) {
+        return;
+    }
+    ++name;
+
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (strncmp(name, "number_hot", klen) == 0) {
+        lru_hot += atoi(buffer);
+    } else if (strncmp(name, "number_warm", klen) == 0) {
+        lru_warm += atoi(buffer);
+    } else if (strncmp(name, "number_cold", klen) == 0) {
+        lru_cold += atoi(buffer);
+    } else if (strncmp(name, "moves_to_warm", klen) == 0) {
+        lru_moves_to_warm += atoi(buffer);
+    }
+}
+
+static void store_lru_test_keys(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                int start, int stop) {
+    int ii;
+    for (ii = start; ii < stop; ++ii) {
+        char key[1024];
+        size_t keylen = snprintf(key, sizeof(key), "slru_test_key_%08d", ii);
+        item *test_item = NULL;
+        uint64_t cas = 0;
+        assert(h1->allocate(h, NULL, &test_item,
+                            key, keylen, 10, 0, 0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+}
+
+/*
+ * Verify that the items move from the hot to the cold segment of the
+ * LRU, and that accessed items are moved to the warm segment.
+ * The LRU maintainer is disabled so that the items is moved as part of
+ * the allocation.
+ */
+static enum test_result segmented_lru_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    item *test_item = NULL;
+    const char *hot_key = "slru_test_key_00000000";
+
+    store_lru_test_keys(h, h1, 0, 100);
+    assert(h1->get(h, NULL, &test_item,
+                   hot_key, strlen(hot_key), 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+
+    lru_hot = lru_warm = lru_cold = lru_moves_to_warm = 0;
+    assert(h1->get_stats(h, NULL, "items", 5,
+                         lru_stats_handler) == ENGINE_SUCCESS);
+    assert(lru_hot == 100);
+
+    /* New items must be older than a second to leave the hot segment */
+    test_harness.time_travel(3);
+    store_lru_test_keys(h, h1, 100, 200);
+
+    lru_hot = lru_warm = lru_cold = lru_moves_to_warm = 0;
+    assert(h1->get_stats(h, NULL, "items", 5,
+                         lru_stats_handler) == ENGINE_SUCCESS);
+    assert(lru_hot + lru_warm + lru_cold == 200);
+    assert(lru_cold > 0);
+    assert(lru_warm == 1);
+    assert(lru_moves_to_warm == 1);
+
+    /* and the accessed item should still be there */
+    assert(h1->get(h, NULL, &test_item,
+                   hot_key, strlen(hot_key), 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+    return SUCCESS;
+}
+
+uint32_t admission_rejects;
+static void admission_stats_handler(const char *key, const uint16_t klen,
+                                    const char *val, const uint32_t vlen,
+                                    const void *cookie) {
+    if (klen == 17 && memcmp(key, "admission_rejects", klen) == 0) {
+        char buffer[1024];
+        memcpy(buffer, val, vlen);
+        buffer[vlen] = '\0';
+        admission_rejects = atoi(buffer);
+    }
+}
+
+static void tinylfu_test_key(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                             int id, bool store) {
+    char key[1024];
+    size_t keylen = snprintf(key, sizeof(key), "tinylfu_test_key_%08d", id);
+    item *test_item = NULL;
+    uint64_t cas = 0;
+
+    if (store) {
+        assert(h1->allocate(h, NULL, &test_item,
+                            key, keylen, 4096, 0, 0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+    } else {
+        assert(h1->get(h, NULL, &test_item,
+                       key, keylen, 0) == ENGINE_SUCCESS);
+    }
+    h1->release(h, NULL, test_item);
+}
+
+/*
+ * With the TinyLFU eviction policy a scan through keys nobody reads
+ * shouldn't evict the items which have been read a few times (the plain
+ * LRU would evict them once they reach the tail).
+ */
+static enum test_result tinylfu_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    int ii;
+    int jj;
+
+    for (ii = 0; ii < 10; ++ii) {
+        tinylfu_test_key(h, h1, ii, true);
+        for (jj = 0; jj < 5; ++jj) {
+            tinylfu_test_key(h, h1, ii, false);
+        }
+    }
+
+    /* Let them leave the hot segment, and scan through new keys */
+    test_harness.time_travel(3);
+    for (ii = 10; ii < 1000; ++ii) {
+        tinylfu_test_key(h, h1, ii, true);
+    }
+
+    assert(h1->get_stats(h, NULL, NULL, 0,
+                         eviction_stats_handler) == ENGINE_SUCCESS);
+    assert(evictions > 0);
+    assert(h1->get_stats(h, NULL, NULL, 0,
+                         admission_stats_handler) == ENGINE_SUCCESS);
+    assert(admission_rejects > 0);
+
+    for (ii = 0; ii < 10; ++ii) {
+        tinylfu_test_key(h, h1, ii, false);
+    }
+    return SUCCESS;
+}
+
+uint64_t curr_bytes;
+static void bytes_stats_handler(const char *key, const uint16_t klen,
+                                const char *val, const uint32_t vlen,
+                                const void *cookie) {
+    if (klen == 5 && memcmp(key, "bytes", klen) == 0) {
+        char buffer[1024];
+        memcpy(buffer, val, vlen);
+        buffer[vlen] = '\0';
+        curr_bytes = strtoull(buffer, NULL, 10);
+    }
+}
+
+/*
+ * Compact items use 32 bit references instead of the LRU and hash chain
+ * pointers. Store enough items to share the hash chains, verify that the
+ * header takes less space, and that we may delete every other item
+ * (unlinking them from the middle of the chains) and find the rest.
+ */
+static enum test_result compact_items_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const int nitems = 100000;
+    /* The size of the pointer based header with the CAS on 64 bit */
+    const uint64_t full_header = 56;
+    uint64_t cas = 0;
+    char key[32];
+    char value[32];
+    size_t nkey;
+    item *it;
+    item_info info;
+    int ii;
+
+    for (ii = 0; ii < nitems; ++ii) {
+        nkey = snprintf(key, sizeof(key), "compact_%08d", ii);
+        assert(h1->allocate(h, NULL, &it, key, nkey, 16, 0, 0) == ENGINE_SUCCESS);
+        info.nvalue = 1;
+        assert(h1->get_item_info(h, NULL, it, &info) == true);
+        snprintf(value, sizeof(value), "value_%010d", ii);
+        memcpy(info.value[0].iov_base, value, 16);
+        assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+
+    assert(h1->get_stats(h, NULL, NULL, 0,
+                         bytes_stats_handler) == ENGINE_SUCCESS);
+    assert(curr_bytes < nitems * (full_header + nkey + 16));
+
+    for (ii = 0; ii < nitems; ii += 2) {
+        nkey = snprintf(key, sizeof(key), "compact_%08d", ii);
+        cas = 0;
+        assert(h1->remove(h, NULL, key, nkey, &cas, 0) == ENGINE_SUCCESS);
+    }
+
+    for (ii = 0; ii < nitems; ++ii) {
+        nkey = snprintf(key, sizeof(key), "compact_%08d", ii);
+        if (ii % 2 == 0) {
+            assert(h1->get(h, NULL, &it, key, nkey, 0) == ENGINE_KEY_ENOENT);
+            continue;
+        }
+        assert(h1->get(h, NULL, &it, key, nkey, 0) == ENGINE_SUCCESS);
+        info.nvalue = 1;
+        assert(h1->get_item_info(h, NULL, it, &info) == true);
+        assert(info.nkey == nkey && memcmp(info.key, key, nkey) == 0);
+        assert(info.cas != 0);
+        snprintf(value, sizeof(value), "value_%010d", ii);
+        assert(memcmp(info.value[0].iov_base, value, 16) == 0);
+        h1->release(h, NULL, it);
+    }
+
+    return SUCCESS;
+}
+
+/* The item counts from "stats", and summed up from "stats slabs" */
+struct item_counts {
+    uint64_t curr_items;
+    uint64_t total_items;
+    uint64_t bytes;
+} engine_counts, slab_counts;
+
+static void item_counts_handler(const char *key, const uint16_t klen,
+                                const char *val, const uint32_t vlen,
+                                const void *cookie) {
+    const char *colon = memchr(key, ':', klen);
+    struct item_counts *counts = colon ? &slab_counts : &engine_counts;
+    const char *name = colon ? colon + 1 : key;
+    size_t nname = klen - (name - key);
+    char buffer[64];
+    uint64_t value;
+
+    if (vlen >= sizeof(buffer)) {
+        return;
+    }
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    value = strtoull(buffer, NULL, 10);
+
+    if (nname == 10 && memcmp(name, "curr_items", nname) == 0) {
+        counts->curr_items += value;
+    } else if (nname == 11 && memcmp(name, "total_items", nname) == 0) {
+        counts->total_items += value;
+    } else if (nname == 5 && memcmp(name, "bytes", nname) == 0) {
+        counts->bytes += value;
+    }
+}
+
+static void verify_item_counts(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                               uint64_t curr_items, uint64_t total_items) {
+    memset(&engine_counts, 0, sizeof(engine_counts));
+    memset(&slab_counts, 0, sizeof(slab_counts));
+    assert(h1->get_stats(h, NULL, NULL, 0,
+                         item_counts_handler) == ENGINE_SUCCESS);
+    assert(h1->get_stats(h, NULL, "slabs", 5,
+                         item_counts_handler) == ENGINE_SUCCESS);
+    assert(engine_counts.curr_items == curr_items);
+    assert(engine_counts.total_items == total_items);
+    assert(memcmp(&engine_counts, &slab_counts, sizeof(slab_counts)) == 0);
+}
+
+/*
+ * The item counts are kept per slab class. Store items of different sizes
+ * (in different slab classes) and verify that the totals in "stats" match
+ * the sum of the slab classes in "stats slabs".
+ */
+static enum test_result item_counts_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const int nitems = 1000;
+    uint64_t cas = 0;
+    char key[32];
+    size_t nkey;
+    item *it;
+    int ii;
+
+    for (ii = 0; ii < nitems; ++ii) {
+        nkey = snprintf(key, sizeof(key), "counts_%d", ii);
+        assert(h1->allocate(h, NULL, &it, key, nkey, (ii % 10) * 100,
+                            0, 0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+    verify_item_counts(h, h1, nitems, nitems);
+
+    for (ii = 0; ii < nitems; ii += 2) {
+        nkey = snprintf(key, sizeof(key), "counts_%d", ii);
+        cas = 0;
+        assert(h1->remove(h, NULL, key, nkey, &cas, 0) == ENGINE_SUCCESS);
+    }
+    verify_item_counts(h, h1, nitems / 2, nitems);
+
+    h1->reset_stats(h, NULL);
+    verify_item_counts(h, h1, nitems / 2, 0);
+
+    for (ii = 1; ii < nitems; ii += 2) {
+        nkey = snprintf(key, sizeof(key), "counts_%d", ii);
+        cas = 0;
+        assert(h1->remove(h, NULL, key, nkey, &cas, 0) == ENGINE_SUCCESS);
+    }
+    verify_item_counts(h, h1, 0, 0);
+    assert(engine_counts.bytes == 0);
+
+    return SUCCESS;
+}
+
+uint64_t numa_malloced[2];
+uint64_t numa_local_allocs[2];
+uint64_t numa_remote_allocs[2];
+static void numa_stats_handler(const char *key, const uint16_t klen,
+                               const char *val, const uint32_t vlen,
+                               const void *cookie) {
+    char buffer[1024];
+    char number[1024];
+    char *name;
+    uint64_t value;
+    int node;
+
+    /* The per node stats are named node:<node>:<name> */
+    if (klen < 5 || memcmp(key, "node:", 5) != 0) {
+        return;
+    }
+    memcpy(buffer, key + 5, klen - 5);
+    buffer[klen - 5] = '\0';
+    node = atoi(buffer);
+    name = strchr(buffer, ':');
+    assert(node >= 0 && node < 2 && name != NULL);
+
+    memcpy(number, val, vlen);
+    number[vlen] = '\0';
+    value = strtoull(number, NULL, 10);
+    if (strcmp(name, ":total_malloced") == 0) {
+        numa_malloced[node] = value;
+    } else if (strcmp(name, ":local_allocs") == 0) {
+        numa_local_allocs[node] = value;
+    } else if (strcmp(name, ":remote_allocs") == 0) {
+        numa_remote_allocs[node] = value;
+    }
+}
+
+uint64_t slab_used_chunks, slab_curr_items;
+static void slab_chunks_handler(const char *key, const uint16_t klen,
+                                const char *val, const uint32_t vlen,
+                                const void *cookie) {
+    char buffer[1024];
+    char number[1024];
+    char *name;
+
+    /* The per class stats are named <clsid>:<name> */
+    memcpy(buffer, key, klen);
+    buffer[klen] = '\0';
+    if ((name = strchr(buffer, ':')) == NULL || atoi(buffer) == 0) {
+        return;
+    }
+    memcpy(number, val, vlen);
+    number[vlen] = '\0';
+    if (strcmp(name, ":used_chunks") == 0) {
+        slab_used_chunks += strtoull(number, NULL, 10);
+    } else if (strcmp(name, ":curr_items") == 0) {
+        slab_curr_items += strtoull(number, NULL, 10);
+    }
+}
+
+/*
+ * Store more items than fit in the range of memory of our node, and
+ * verify that the pages were taken from our node first and then from the
+ * other node. Every chunk must be either free or hold an item (a new page
+ * must not replace a page still being handed out on the other node).
+ */
+static enum test_result numa_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const int nitems = 8000;
+    uint64_t cas = 0;
+    char key[32];
+    size_t nkey;
+    item *it;
+    int home;
+    int ii;
+
+    for (ii = 0; ii < nitems; ++ii) {
+        nkey = snprintf(key, sizeof(key), "numa_%08d", ii);
+        assert(h1->allocate(h, NULL, &it, key, nkey, 10000, 0, 0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
+
+    memset(numa_malloced, 0, sizeof(numa_malloced));
+    memset(numa_local_allocs, 0, sizeof(numa_local_allocs));
+    memset(numa_remote_allocs, 0, sizeof(numa_remote_allocs));
+    assert(h1->get_stats(h, NULL, "slabs", 5,
+                         numa_stats_handler) == ENGINE_SUCCESS);
+
+    home = numa_local_allocs[0] > 0 ? 0 : 1;
+    assert(numa_local_allocs[home] > 0);
+    assert(numa_remote_allocs[home] > 0);
+    assert(numa_local_allocs[1 - home] == 0);
+    assert(numa_malloced[home] > numa_malloced[1 - home]);
+    assert(numa_malloced[1 - home] > 0);
+
+    slab_used_chunks = slab_curr_items = 0;
+    assert(h1->get_stats(h, NULL, "slabs", 5,
+                         slab_chunks_handler) == ENGINE_SUCCESS);
+    assert(slab_used_chunks == slab_curr_items);
+
+    /* The last item stored should still be there */
+    assert(h1->get(h, NULL, &it, key, nkey, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+
+    return SUCCESS;
+}
+
+struct vbucket_details {
+    uint64_t curr_items;
+    uint64_t bytes;
+    uint64_t high_seqno;
+    int reported;
+} vbucket_details[4];
+static void vbucket_details_handler(const char *key, const uint16_t klen,
+                                    const char *val, const uint32_t vlen,
+                                    const void *cookie) {
+    char buffer[1024];
+    char number[1024];
+    char *name;
+    uint64_t value;
+    int vb;
+
+    /* The stats are named vb_<vbid>:<name> */
+    memcpy(buffer, key, klen);
+    buffer[klen] = '\0';
+    assert(strncmp(buffer, "vb_", 3) == 0);
+    vb = atoi(buffer + 3);
+    name = strchr(buffer, ':');
+    assert(vb >= 0 && vb < 4 && name != NULL);
+
+    memcpy(number, val, vlen);
+    number[vlen] = '\0';
+    value = strtoull(number, NULL, 10);
+    if (strcmp(name, ":curr_items") == 0) {
+        vbucket_details[vb].curr_items = value;
+    } else if (strcmp(name, ":bytes") == 0) {
+        vbucket_details[vb].bytes = value;
+    } else if (strcmp(name, ":high_seqno") == 0) {
+        vbucket_details[vb].high_seqno = value;
+    }
+    vbucket_details[vb].reported++;
+}
+
+static void get_vbucket_details(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                const char *stat_key) {
+    memset(vbucket_details, 0, sizeof(vbucket_details));
+    assert(h1->get_stats(h, NULL, stat_key, strlen(stat_key),
+                         vbucket_details_handler) == ENGINE_SUCCESS);
+}
+
 /*
- * Make sure we can successfully retrieve the item info struct for an item and
- * that the contents of the item_info are as expected.
+ * Store, update and delete items in a few vbuckets and verify that the
+ * items and bytes are accounted to the right vbucket.
  */
-static enum test_result get_item_info_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    item *test_item = NULL;
-    char *key = "get_item_info_test_key";
+static enum test_result vbucket_details_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     uint64_t cas = 0;
-    const rel_time_t exp = 1;
-    item_info ii;
-    ii.nvalue = 1;
+    uint64_t result;
+    char key[32];
+    size_t nkey;
+    item *it;
+    int ii;
 
-    assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 1,0, exp) == ENGINE_SUCCESS);
-    assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
-    /* Had this been actual code, there'd be a connection here */
-    assert(h1->get_item_info(h, NULL, test_item, &ii) == true);
-    assert(ii.cas == cas);
-    assert(ii.flags == 0);
-    assert(strcmp(key,ii.key) == 0);
-    assert(ii.nkey == strlen(key));
-    assert(ii.nbytes == 1);
-    assert(ii.exptime == exp);
-    h1->release(h, NULL, test_item);
-    return SUCCESS;
-}
+    for (ii = 0; ii < 150; ++ii) {
+        uint16_t vb = ii < 100 ? 1 : 2;
+        nkey = snprintf(key, sizeof(key), "vb_key_%08d", ii);
+        assert(h1->allocate(h, NULL, &it, key, nkey, 100, 0, 0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, it, &cas, OPERATION_SET, vb) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
 
-static enum test_result item_set_cas_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    item *test_item = NULL;
-    char *key = "item_set_cas_test_key";
-    uint64_t cas = 0;
-    const rel_time_t exp = 1;
-    uint64_t newcas;
-    item_info ii;
+    for (ii = 0; ii < 10; ++ii) {
+        nkey = snprintf(key, sizeof(key), "vb_key_%08d", ii);
+        cas = 0;
+        assert(h1->remove(h, NULL, key, nkey, &cas, 1) == ENGINE_SUCCESS);
+    }
+
+    nkey = snprintf(key, sizeof(key), "vb_key_%08d", 50);
+    assert(h1->allocate(h, NULL, &it, key, nkey, 10, 0, 0) == ENGINE_SUCCESS);
+    cas = 0;
+    assert(h1->store(h, NULL, it, &cas, OPERATION_APPEND, 1) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+
+    assert(h1->arithmetic(h, NULL, "vb_counter", 10, true, true, 0, 1,
+                          0, &cas, &result, 3) == ENGINE_SUCCESS);
+    assert(h1->arithmetic(h, NULL, "vb_counter", 10, true, false, 1, 0,
+                          0, &cas, &result, 3) == ENGINE_SUCCESS);
+    assert(result == 2);
+
+    get_vbucket_details(h, h1, "vbucket-details");
+    assert(vbucket_details[0].curr_items == 0);
+    assert(vbucket_details[1].curr_items == 90);
+    assert(vbucket_details[1].high_seqno == 101);
+    assert(vbucket_details[2].curr_items == 50);
+    assert(vbucket_details[2].high_seqno == 50);
+    assert(vbucket_details[3].curr_items == 1);
+    assert(vbucket_details[3].high_seqno == 2);
+    assert(vbucket_details[2].bytes >= 50 * 100);
+    assert(vbucket_details[1].bytes > vbucket_details[2].bytes);
+
+    assert(h1->get_stats(h, NULL, NULL, 0,
+                         bytes_stats_handler) == ENGINE_SUCCESS);
+    assert(curr_bytes == vbucket_details[0].bytes + vbucket_details[1].bytes +
+           vbucket_details[2].bytes + vbucket_details[3].bytes);
+
+    /* Ask for a single vbucket */
+    get_vbucket_details(h, h1, "vbucket-details 2");
+    assert(vbucket_details[2].curr_items == 50);
+    assert(vbucket_details[1].reported == 0);
+    assert(h1->get_stats(h, NULL, "vbucket-details 65536", 21,
+                         vbucket_details_handler) == ENGINE_EINVAL);
 
-    ii.nvalue = 1;
-    assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 1,0, exp) == ENGINE_SUCCESS);
-    assert(h1->store(h, NULL, test_item, &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
-    newcas = cas + 1;
-    h1->item_set_cas(h, NULL, test_item, newcas);
-    assert(h1->get_item_info(h, NULL, test_item, &ii) == true);
-    assert(ii.cas == newcas);
-    h1->release(h, NULL, test_item);
     return SUCCESS;
 }
 
-uint32_t evictions;
-static void eviction_stats_handler(const char *key, const uint16_t klen,
-                                   const char *val, const uint32_t vlen,
-                                   const void *cookie) {
-    if (memcmp(key, "evictions", klen) == 0) {
-        char buffer[1024];
+char arena_backing[32];
+uint64_t arena_page_size;
+static void arena_stats_handler(const char *key, const uint16_t klen,
+                                const char *val, const uint32_t vlen,
+                                const void *cookie) {
+    if (klen == 13 && memcmp(key, "arena_backing", klen) == 0) {
+        assert(vlen < sizeof(arena_backing));
+        memcpy(arena_backing, val, vlen);
+        arena_backing[vlen] = '\0';
+    } else if (klen == 15 && memcmp(key, "arena_page_size", klen) == 0) {
+        char buffer[32];
+        assert(vlen < sizeof(buffer));
         memcpy(buffer, val, vlen);
         buffer[vlen] = '\0';
-        evictions = atoi(buffer);
+        arena_page_size = strtoull(buffer, NULL, 10);
     }
 }
 
-static enum test_result lru_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
-    item *test_item = NULL;
-    const char *hot_key = "hot_key";
+/*
+ * The arena is mapped with huge pages if the system has them (and a
+ * plain anonymous mapping if it doesn't); verify that we report what we
+ * got and that the memory works. The kernel decides if a mapping with
+ * transparent huge pages gets any, so the base page size is reported.
+ */
+static enum test_result large_pages_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     uint64_t cas = 0;
+    char key[32];
+    size_t nkey;
+    item *it;
     int ii;
-    int jj;
 
-    assert(h1->allocate(h, NULL, &test_item,
-                        hot_key, strlen(hot_key), 4096, 0, 0) == ENGINE_SUCCESS);
-    assert(h1->store(h, NULL, test_item,
-                     &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
-    h1->release(h, NULL, test_item);
+    for (ii = 0; ii < 10000; ++ii) {
+        nkey = snprintf(key, sizeof(key), "large_pages_%08d", ii);
+        assert(h1->allocate(h, NULL, &it, key, nkey, 1000, 0, 0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, it, &cas, OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+    }
 
-    for (ii = 0; ii < 250; ++ii) {
-        char key[1024];
-        size_t keylen;
+    arena_backing[0] = '\0';
+    arena_page_size = 0;
+    assert(h1->get_stats(h, NULL, "slabs", 5,
+                         arena_stats_handler) == ENGINE_SUCCESS);
+    assert(arena_page_size > 0);
+    if (strcmp(arena_backing, "hugetlb") == 0) {
+        assert(arena_page_size > 4096);
+    } else {
+        /* Transparent huge pages may be regular pages */
+        assert(strcmp(arena_backing, "transparent") == 0 ||
+               strcmp(arena_backing, "mmap") == 0);
+        assert(arena_page_size == (uint64_t)sysconf(_SC_PAGESIZE));
+    }
 
-        assert(h1->get(h, NULL, &test_item,
-                       hot_key, strlen(hot_key), 0) ==  ENGINE_SUCCESS);
-        h1->release(h, NULL, test_item);
-        keylen = snprintf(key, sizeof(key), "lru_test_key_%08d", ii);
+    assert(h1->get(h, NULL, &it, key, nkey, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+
+    return SUCCESS;
+}
+
+char hash_is_expanding;
+int hash_power_level;
+static void hash_stats_handler(const char *key, const uint16_t klen,
+                               const char *val, const uint32_t vlen,
+                               const void *cookie) {
+    char buffer[1024];
+
+    memcpy(buffer, val, vlen);
+    buffer[vlen] = '\0';
+    if (klen == 17 && memcmp(key, "hash_is_expanding", klen) == 0) {
+        hash_is_expanding = buffer[0];
+    } else if (klen == 16 && memcmp(key, "hash_power_level", klen) == 0) {
+        hash_power_level = atoi(buffer);
+    }
+}
+
+/*
+ * Store enough items in the grouped hash table to make it grow, and
+ * verify that we find (and may delete) all of them after the expansion.
+ */
+static enum test_result hash_expansion_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const int nitems = 300000;
+    int ii;
+
+    for (ii = 0; ii < nitems; ++ii) {
+        char key[1024];
+        size_t keylen = snprintf(key, sizeof(key), "hash_expansion_%08d", ii);
+        item *test_item = NULL;
+        uint64_t cas = 0;
         assert(h1->allocate(h, NULL, &test_item,
-                            key, keylen, 4096, 0, 0) == ENGINE_SUCCESS);
+                            key, keylen, 1, 0, 0) == ENGINE_SUCCESS);
         assert(h1->store(h, NULL, test_item,
                          &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
         h1->release(h, NULL, test_item);
+    }
+
+    do {
         assert(h1->get_stats(h, NULL, NULL, 0,
-                             eviction_stats_handler) == ENGINE_SUCCESS);
-        if (evictions == 2) {
-            break;
+                             hash_stats_handler) == ENGINE_SUCCESS);
+        if (hash_is_expanding != '0') {
+            usleep(1000);
+        }
+    } while (hash_is_expanding != '0');
+    assert(hash_power_level > 16);
+
+    for (ii = 0; ii < nitems; ++ii) {
+        char key[1024];
+        size_t keylen = snprintf(key, sizeof(key), "hash_expansion_%08d", ii);
+        item *test_item = NULL;
+        assert(h1->get(h, NULL, &test_item,
+                       key, keylen, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+        if (ii % 2 == 0) {
+            uint64_t cas = 0;
+            assert(h1->remove(h, NULL, key, keylen, &cas, 0) == ENGINE_SUCCESS);
         }
     }
 
-    assert(ii < 250);
-    for (jj = 0; jj <= ii; ++jj) {
+    for (ii = 0; ii < nitems; ++ii) {
         char key[1024];
-        size_t keylen = snprintf(key, sizeof(key), "lru_test_key_%08d", jj);
-        if (jj == 0 || jj == 1) {
+        size_t keylen = snprintf(key, sizeof(key), "hash_expansion_%08d", ii);
+        item *test_item = NULL;
+        if (ii % 2 == 0) {
             assert(h1->get(h, NULL, &test_item,
                            key, keylen, 0) == ENGINE_KEY_ENOENT);
         } else {
             assert(h1->get(h, NULL, &test_item,
                            key, keylen, 0) == ENGINE_SUCCESS);
-            assert(test_item != NULL);
             h1->release(h, NULL, test_item);
         }
     }
+
+    return SUCCESS;
+}
+
+/*
+ * Pre-size the hash table for 1M items (hash_items=1000000), and verify
+ * that it doesn't grow when we store them
+ */
+static enum test_result hash_presize_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const int nitems = 100000;
+    int ii;
+
+    assert(h1->get_stats(h, NULL, NULL, 0,
+                         hash_stats_handler) == ENGINE_SUCCESS);
+    assert(hash_power_level == 20);
+
+    for (ii = 0; ii < nitems; ++ii) {
+        char key[1024];
+        size_t keylen = snprintf(key, sizeof(key), "hash_presize_%08d", ii);
+        item *test_item = NULL;
+        uint64_t cas = 0;
+        assert(h1->allocate(h, NULL, &test_item,
+                            key, keylen, 1, 0, 0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    assert(h1->get_stats(h, NULL, NULL, 0,
+                         hash_stats_handler) == ENGINE_SUCCESS);
+    assert(hash_power_level == 20);
+    assert(hash_is_expanding == '0');
+
+    return SUCCESS;
+}
+
+#define WARM_RESTART_FILE "/tmp/basic_engine_testsuite.warm"
+
+static void warm_restart_remove_files(void) {
+    remove(WARM_RESTART_FILE);
+    remove(WARM_RESTART_FILE ".meta");
+    remove(WARM_RESTART_FILE ".meta.tmp");
+}
+
+static enum test_result warm_restart_prepare(engine_test_t *test) {
+#ifdef WIN32
+    return SKIPPED;
+#else
+    warm_restart_remove_files();
+    return SUCCESS;
+#endif
+}
+
+static void warm_restart_cleanup(engine_test_t *test, enum test_result result) {
+    warm_restart_remove_files();
+}
+
+/*
+ * Store items in a file backed cache, restart the engine and verify that
+ * the items (and only those) are still there
+ */
+static enum test_result warm_restart_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const int nitems = 1000;
+    uint64_t cas[1000];
+    item_info info;
+    item *it;
+    int ii;
+
+    for (ii = 0; ii < nitems; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "warm_restart_%d", ii);
+        assert(h1->allocate(h, NULL, &it, key, keylen,
+                            sizeof(int), 0, 0) == ENGINE_SUCCESS);
+        info.nvalue = 1;
+        assert(h1->get_item_info(h, NULL, it, &info) == true);
+        memcpy(info.value[0].iov_base, &ii, sizeof(int));
+        cas[ii] = 0;
+        assert(h1->store(h, NULL, it, &cas[ii], OPERATION_SET, 0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, it);
+        if (ii % 10 == 0) {
+            uint64_t rcas = 0;
+            assert(h1->remove(h, NULL, key, keylen, &rcas, 0) == ENGINE_SUCCESS);
+        }
+    }
+
+    test_harness.reload_engine(&h, &h1, test_harness.engine_path,
+                               test_harness.get_current_testcase()->cfg,
+                               true, false);
+
+    for (ii = 0; ii < nitems; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "warm_restart_%d", ii);
+        if (ii % 10 == 0) {
+            assert(h1->get(h, NULL, &it, key, keylen, 0) == ENGINE_KEY_ENOENT);
+            continue;
+        }
+        assert(h1->get(h, NULL, &it, key, keylen, 0) == ENGINE_SUCCESS);
+        info.nvalue = 1;
+        assert(h1->get_item_info(h, NULL, it, &info) == true);
+        assert(info.cas == cas[ii]);
+        assert(info.value[0].iov_len == sizeof(int));
+        assert(memcmp(info.value[0].iov_base, &ii, sizeof(int)) == 0);
+        h1->release(h, NULL, it);
+    }
+
+    /* New items must get a CAS value above the restored ones */
+    assert(h1->allocate(h, NULL, &it, "warm_restart_new", 16,
+                        1, 0, 0) == ENGINE_SUCCESS);
+    info.nvalue = 1;
+    assert(h1->store(h, NULL, it, &cas[0], OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, it);
+    assert(cas[0] > cas[nitems - 1]);
+
+    /* The cache can't be reused with other settings */
+    test_harness.reload_engine(&h, &h1, test_harness.engine_path,
+                               "memory_file=" WARM_RESTART_FILE
+                               ";cache_size=33554432", true, false);
+    assert(h1->get(h, NULL, &it, "warm_restart_1", 14, 0) == ENGINE_KEY_ENOENT);
+
     return SUCCESS;
 }
 
@@ -636,6 +2204,84 @@ static enum test_result touch_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+static void send_touch(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                       const char *key, uint32_t exptime) {
+    union request {
+        protocol_binary_request_touch touch;
+        char buffer[512];
+    };
+    size_t keylen = strlen(key);
+    union request r;
+
+    memset(r.buffer, 0, sizeof(r));
+    r.touch.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    r.touch.message.header.request.opcode = PROTOCOL_BINARY_CMD_TOUCH;
+    r.touch.message.header.request.keylen = htons((uint16_t)keylen);
+    r.touch.message.header.request.extlen = 4;
+    r.touch.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    r.touch.message.header.request.bodylen = htonl(keylen + 4);
+    r.touch.message.body.expiration = htonl(exptime);
+    memcpy(r.buffer + sizeof(r.touch.bytes), key, keylen);
+
+    assert(h1->unknown_command(h, NULL, &r.touch.message.header,
+                               response_handler) == ENGINE_SUCCESS);
+    assert(last_response != NULL);
+    assert(ntohs(last_response->response.status) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    release_last_response();
+}
+
+/*
+ * Touching an item shouldn't pile up entries in the expiry wheel, and
+ * the item should still be reclaimed through the wheel once it expires
+ */
+static enum test_result touch_expiry_wheel_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const char *key = "touch_expiry_wheel";
+    item *test_item = NULL;
+    uint64_t cas = 0;
+    uint32_t exptime;
+    int wait;
+
+    assert(h1->allocate(h, NULL, &test_item, key, strlen(key), 1, 0,
+                        5) == ENGINE_SUCCESS);
+    assert(h1->store(h, NULL, test_item, &cas,
+                     OPERATION_SET, 0) == ENGINE_SUCCESS);
+    h1->release(h, NULL, test_item);
+
+    for (exptime = 10; exptime < 110; ++exptime) {
+        send_touch(h, h1, key, exptime);
+    }
+
+    assert(h1->get_stats(h, NULL, NULL, 0,
+                         expiry_wheel_stats_handler) == ENGINE_SUCCESS);
+    assert(expiry_curr_items == 1);
+    assert(expiry_wheel_entries == 1);
+    assert(expiry_wheel_dropped == 0);
+
+    /* The entry is due, but the item has moved on */
+    test_harness.time_travel(20);
+    usleep(200000);
+    assert(h1->get_stats(h, NULL, NULL, 0,
+                         expiry_wheel_stats_handler) == ENGINE_SUCCESS);
+    assert(expiry_curr_items == 1);
+    assert(expiry_wheel_entries == 1);
+    assert(expiry_wheel_reclaimed == 0);
+
+    test_harness.time_travel(100);
+    for (wait = 0; wait < 5000; ++wait) {
+        assert(h1->get_stats(h, NULL, NULL, 0,
+                             expiry_wheel_stats_handler) == ENGINE_SUCCESS);
+        if (expiry_curr_items == 0) {
+            break;
+        }
+        usleep(1000);
+    }
+    assert(expiry_curr_items == 0);
+    assert(expiry_wheel_entries == 0);
+    assert(expiry_wheel_reclaimed == 1);
+
+    return SUCCESS;
+}
+
 static enum test_result gat_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     union request {
         protocol_binary_request_gat gat;
@@ -781,6 +2427,231 @@ static enum test_result gatq_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
     return SUCCESS;
 }
 
+uint32_t reassign_pages[256];
+uint32_t reassign_moved, reassign_free_pages;
+static void slabs_reassign_stats_handler(const char *key, const uint16_t klen,
+                                         const char *val, const uint32_t vlen,
+                                         const void *cookie) {
+    char buffer[1024];
+    char value[1024];
+
+    memcpy(buffer, key, klen);
+    buffer[klen] = '\0';
+    memcpy(value, val, vlen);
+    value[vlen] = '\0';
+
+    if (strcmp(buffer, "slabs_moved") == 0) {
+        reassign_moved = atoi(value);
+    } else if (strcmp(buffer, "free_pages") == 0) {
+        reassign_free_pages = atoi(value);
+    } else {
+        /* The per class stats are named <clsid>:<name> */
+        char *name = strchr(buffer, ':');
+        if (name != NULL && strcmp(name, ":total_pages") == 0) {
+            int id = atoi(buffer);
+            assert(id > 0 && id < 256);
+            reassign_pages[id] = atoi(value);
+        }
+    }
+}
+
+static uint16_t send_slabs_reassign(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                                    uint32_t src, uint32_t dst) {
+    protocol_binary_request_slabs_reassign r;
+    uint16_t status;
+
+    memset(r.bytes, 0, sizeof(r));
+    r.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    r.message.header.request.opcode = PROTOCOL_BINARY_CMD_SLABS_REASSIGN;
+    r.message.header.request.extlen = 8;
+    r.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    r.message.header.request.bodylen = htonl(8);
+    r.message.body.src = htonl(src);
+    r.message.body.dst = htonl(dst);
+
+    assert(h1->unknown_command(h, NULL, &r.message.header,
+                               response_handler) == ENGINE_SUCCESS);
+    assert(last_response != NULL);
+    status = ntohs(last_response->response.status);
+    release_last_response();
+    return status;
+}
+
+static void get_reassign_stats(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    memset(reassign_pages, 0, sizeof(reassign_pages));
+    reassign_moved = reassign_free_pages = 0;
+    assert(h1->get_stats(h, NULL, "slabs", 5,
+                         slabs_reassign_stats_handler) == ENGINE_SUCCESS);
+}
+
+/*
+ * Fill a few pages in one slab class, move one of them to the pool of
+ * free pages and verify that it is reused by another slab class. The
+ * items have an expiry time, and the entries in the expiry wheel for the
+ * items in the moved page must be gone with it.
+ */
+static enum test_result slabs_reassign_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    uint32_t clsid = 0;
+    uint32_t pages;
+    uint32_t ii;
+    int wait;
+
+    for (ii = 0; ii < 3000; ++ii) {
+        char key[1024];
+        size_t keylen = snprintf(key, sizeof(key), "reassign_key_%08d", ii);
+        item *test_item = NULL;
+        uint64_t cas = 0;
+        assert(h1->allocate(h, NULL, &test_item,
+                            key, keylen, 1000, 0, 1000) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+
+    get_reassign_stats(h, h1);
+    for (ii = 1; ii < 256; ++ii) {
+        if (reassign_pages[ii] > reassign_pages[clsid]) {
+            clsid = ii;
+        }
+    }
+    pages = reassign_pages[clsid];
+    assert(pages > 2);
+    assert(reassign_moved == 0);
+
+    /* Verify that we reject bogus requests */
+    assert(send_slabs_reassign(h, h1, 0, 0) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    assert(send_slabs_reassign(h, h1, clsid, clsid) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+    assert(send_slabs_reassign(h, h1, clsid, 1000) == PROTOCOL_BINARY_RESPONSE_EINVAL);
+
+    assert(send_slabs_reassign(h, h1, clsid, 0) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    for (wait = 0; wait < 5000; ++wait) {
+        get_reassign_stats(h, h1);
+        if (reassign_moved == 1) {
+            break;
+        }
+        usleep(1000);
+    }
+    assert(reassign_moved == 1);
+    assert(reassign_pages[clsid] == pages - 1);
+    assert(reassign_free_pages == 1);
+
+    assert(h1->get_stats(h, NULL, NULL, 0,
+                         expiry_wheel_stats_handler) == ENGINE_SUCCESS);
+    assert(expiry_curr_items < 3000);
+    assert(expiry_wheel_entries == expiry_curr_items);
+
+    /* The next class to need a new page should get the free one */
+    {
+        item *test_item = NULL;
+        uint64_t cas = 0;
+        assert(h1->allocate(h, NULL, &test_item,
+                            "reassign_big", 12, 100000, 0, 0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+    get_reassign_stats(h, h1);
+    assert(reassign_free_pages == 0);
+
+    return SUCCESS;
+}
+
+/*
+ * Store a value of the given size under each of the keys prefix_<n> for
+ * n in [first, last)
+ */
+static void reassign_store(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                           const char *prefix, int first, int last,
+                           size_t nbytes) {
+    int ii;
+
+    for (ii = first; ii < last; ++ii) {
+        char key[64];
+        size_t keylen = snprintf(key, sizeof(key), "%s_%08d", prefix, ii);
+        item *test_item = NULL;
+        uint64_t cas = 0;
+        assert(h1->allocate(h, NULL, &test_item,
+                            key, keylen, nbytes, 0, 0) == ENGINE_SUCCESS);
+        assert(h1->store(h, NULL, test_item,
+                         &cas, OPERATION_SET,0) == ENGINE_SUCCESS);
+        h1->release(h, NULL, test_item);
+    }
+}
+
+/* The first slab class with pages which didn't have any before */
+static uint32_t reassign_new_class(const uint32_t *before) {
+    uint32_t ii;
+
+    for (ii = 1; ii < 256; ++ii) {
+        if (before[ii] == 0 && reassign_pages[ii] != 0) {
+            return ii;
+        }
+    }
+    assert(false);
+    return 0;
+}
+
+static void reassign_wait(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1,
+                          uint32_t moved) {
+    int wait;
+
+    for (wait = 0; wait < 5000; ++wait) {
+        get_reassign_stats(h, h1);
+        if (reassign_moved == moved) {
+            break;
+        }
+        usleep(1000);
+    }
+    assert(reassign_moved == moved);
+}
+
+/*
+ * Move a page to a class which is still handing out the chunks of its
+ * last page. The chunks not handed out yet must not be lost, so the page
+ * stays in the pool of free pages until the class needs it, and the
+ * partly used page may later be moved away.
+ */
+static enum test_result slabs_reassign_carving_test(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    uint32_t before[256];
+    uint32_t src, dst;
+    int nsmall = 10;
+
+    get_reassign_stats(h, h1);
+    memcpy(before, reassign_pages, sizeof(before));
+    reassign_store(h, h1, "big", 0, 3000, 1000);
+    get_reassign_stats(h, h1);
+    src = reassign_new_class(before);
+
+    memcpy(before, reassign_pages, sizeof(before));
+    reassign_store(h, h1, "small", 0, nsmall, 100);
+    get_reassign_stats(h, h1);
+    dst = reassign_new_class(before);
+
+    assert(reassign_pages[src] > 2);
+    assert(reassign_pages[dst] == 1);
+
+    assert(send_slabs_reassign(h, h1, src, dst) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    reassign_wait(h, h1, 1);
+    assert(reassign_pages[dst] == 1);
+    assert(reassign_free_pages == 1);
+
+    /* Use up the first page, so the class takes the free one */
+    while (reassign_pages[dst] == 1) {
+        reassign_store(h, h1, "small", nsmall, nsmall + 100, 100);
+        nsmall += 100;
+        get_reassign_stats(h, h1);
+    }
+    assert(reassign_pages[dst] == 2);
+    assert(reassign_free_pages == 0);
+
+    assert(send_slabs_reassign(h, h1, dst, 0) == PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    reassign_wait(h, h1, 2);
+    assert(reassign_pages[dst] == 1);
+    assert(reassign_free_pages == 1);
+
+    return SUCCESS;
+}
+
 MEMCACHED_PUBLIC_API
 engine_test_t* get_tests(void) {
     static engine_test_t tests[]  = {
@@ -799,19 +2670,69 @@ engine_test_t* get_tests(void) {
         {"remove test", remove_test, NULL, NULL, NULL},
         {"release test", release_test, NULL, NULL, NULL},
         {"incr test", incr_test, NULL, NULL, NULL},
+        {"counter test", counter_test, NULL, NULL, NULL},
+        {"large item test", large_item_test, NULL, NULL,
+         "large_item_max=4194304"},
+        {"append in place test", append_inplace_test, NULL, NULL,
+         "large_item_max=4194304"},
+        {"compression test", compression_test, NULL, NULL,
+         "compression_threshold=256"},
+        {"tap compression test", tap_compression_test, NULL, NULL,
+         "compression_threshold=256"},
+        {"expiry wheel test", expiry_wheel_test, NULL, NULL, NULL},
         {"mt incr test", mt_incr_test, NULL, NULL, NULL},
+        {"mt store test", mt_store_test, NULL, NULL, "item_locks=16"},
+        {"mt store test (grouped hash)", mt_store_test, NULL, NULL,
+         "item_locks=16;hash_groups=true"},
+        {"mt cas test", mt_cas_test, NULL, NULL, NULL},
+        {"mt release test", mt_release_test, NULL, NULL, "lru_maintainer=false"},
+        {"refcount limit test", refcount_limit_test, NULL, NULL,
+         "lru_maintainer=false"},
+        {"item counts", item_counts_test, NULL, NULL, NULL},
         {"decr test", decr_test, NULL, NULL, NULL},
         {"flush test", flush_test, NULL, NULL, NULL},
+        {"flush reclaim test", flush_reclaim_test, NULL, NULL, NULL},
+        {"flush reclaim test (no cas)", flush_reclaim_test, NULL, NULL,
+         "use_cas=false"},
         {"get item info test", get_item_info_test, NULL, NULL, NULL},
         {"set cas test", item_set_cas_test, NULL, NULL, NULL},
         {"LRU test", lru_test, NULL, NULL, "cache_size=48"},
+        {"segmented LRU test", segmented_lru_test, NULL, NULL,
+         "lru_maintainer=false"},
+        {"TinyLFU test", tinylfu_test, NULL, NULL,
+         "cache_size=48;eviction_policy=tinylfu;lru_maintainer=false"},
+        {"compact items test", compact_items_test, NULL, NULL,
+         "compact_items=true"},
+        {"LRU test (compact items)", lru_test, NULL, NULL,
+         "cache_size=48;compact_items=true"},
         {"get stats test", get_stats_test, NULL, NULL, NULL},
         {"reset stats test", reset_stats_test, NULL, NULL, NULL},
         {"get stats struct test", get_stats_struct_test, NULL, NULL, NULL},
         {"aggregate stats test", aggregate_stats_test, NULL, NULL, NULL},
         {"touch", touch_test, NULL, NULL, NULL},
+        {"touch expiry wheel", touch_expiry_wheel_test, NULL, NULL, NULL},
         {"Get And Touch", gat_test, NULL, NULL, NULL},
         {"Get And Touch Quiet", gatq_test, NULL, NULL, NULL},
+        {"slabs reassign", slabs_reassign_test, NULL, NULL,
+         "slab_reassign=true"},
+        {"slabs reassign to a carving class", slabs_reassign_carving_test,
+         NULL, NULL, "slab_reassign=true"},
+        {"hash table expansion", hash_expansion_test, NULL, NULL, NULL},
+        {"hash table presize", hash_presize_test, NULL, NULL,
+         "hash_items=1000000"},
+        {"warm restart", warm_restart_test, NULL, NULL,
+         "memory_file=" WARM_RESTART_FILE, warm_restart_prepare,
+         warm_restart_cleanup},
+        {"grouped hash table", hash_expansion_test, NULL, NULL,
+         "hash_groups=true"},
+        {"grouped hash table (compact items)", hash_expansion_test, NULL, NULL,
+         "hash_groups=true;compact_items=true"},
+        {"numa", numa_test, NULL, NULL,
+         "cache_size=67108864;numa=true;numa_nodes=2"},
+        {"vbucket details", vbucket_details_test, NULL, NULL,
+         "ignore_vbucket=true"},
+        {"large pages", large_pages_test, NULL, NULL,
+         "cache_size=67108864;large_pages=true;lock_memory=true"},
         {NULL, NULL, NULL, NULL, NULL}
     };
     return tests;
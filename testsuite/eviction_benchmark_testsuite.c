@@ -0,0 +1,203 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Trace replay benchmark comparing the hit rate of the eviction policies
+ * in the default engine:
+ *
+ *    engine_testapp -E default_engine.so -T eviction_benchmark_testsuite.so
+ *
+ * Every key in the trace is looked up, and stored if it wasn't found (like
+ * a client using the cache in front of a database would do). The default
+ * trace is a zipf distributed set of popular keys interrupted by scans
+ * through keys which are never requested again. Set EVICTION_BENCHMARK_TRACE
+ * to the name of a file with one key per line to replay another trace.
+ */
+#undef NDEBUG
+#include "config.h"
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <platform/platform.h>
+#include "eviction_benchmark_testsuite.h"
+
+struct test_harness test_harness;
+
+#define BENCH_POPULAR_KEYS 20000
+#define BENCH_ZIPF_SKEW 0.9
+#define BENCH_REQUESTS 1000000
+/* Every phase ends with a scan through keys used only once */
+#define BENCH_PHASE 100000
+#define BENCH_SCAN 30000
+#define BENCH_VALUE_SIZE 512
+/* Items may only leave the hot segment of the LRU as the clock moves */
+#define BENCH_REQUESTS_PER_SECOND 1000
+
+static char stat_hit_rate[32];
+static char stat_admission_rejects[32];
+static char stat_evictions[32];
+
+static void copy_stat(char *dst, size_t size, const char *val, uint32_t vlen) {
+    if (vlen < size) {
+        memcpy(dst, val, vlen);
+        dst[vlen] = '\0';
+    }
+}
+
+static void policy_stats_handler(const char *key, const uint16_t klen,
+                                 const char *val, const uint32_t vlen,
+                                 const void *cookie) {
+    if (klen == 8 && memcmp(key, "hit_rate", klen) == 0) {
+        copy_stat(stat_hit_rate, sizeof(stat_hit_rate), val, vlen);
+    } else if (klen == 17 && memcmp(key, "admission_rejects", klen) == 0) {
+        copy_stat(stat_admission_rejects, sizeof(stat_admission_rejects),
+                  val, vlen);
+    } else if (klen == 9 && memcmp(key, "evictions", klen) == 0) {
+        copy_stat(stat_evictions, sizeof(stat_evictions), val, vlen);
+    }
+}
+
+static uint32_t bench_next(uint32_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/* The cumulative distribution of the popular keys */
+static double *zipf_cdf;
+
+static void zipf_init(void) {
+    double sum = 0;
+    int ii;
+
+    if (zipf_cdf != NULL) {
+        return;
+    }
+    zipf_cdf = malloc(BENCH_POPULAR_KEYS * sizeof(double));
+    assert(zipf_cdf != NULL);
+    for (ii = 0; ii < BENCH_POPULAR_KEYS; ++ii) {
+        sum += 1.0 / pow(ii + 1, BENCH_ZIPF_SKEW);
+        zipf_cdf[ii] = sum;
+    }
+    for (ii = 0; ii < BENCH_POPULAR_KEYS; ++ii) {
+        zipf_cdf[ii] /= sum;
+    }
+}
+
+static int zipf_next(uint32_t *state) {
+    double u = (double)bench_next(state) / 4294967296.0;
+    int lo = 0;
+    int hi = BENCH_POPULAR_KEYS - 1;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Get the next key in the trace, returns 0 at the end of the trace */
+static size_t trace_next(FILE *fp, uint32_t *state, uint32_t request,
+                         char *key, size_t size) {
+    if (fp != NULL) {
+        size_t nkey;
+        if (fgets(key, (int)size, fp) == NULL) {
+            return 0;
+        }
+        nkey = strcspn(key, "\r\n");
+        key[nkey] = '\0';
+        return nkey == 0 ? trace_next(fp, state, request, key, size) : nkey;
+    }
+
+    if (request == BENCH_REQUESTS) {
+        return 0;
+    }
+    if (request % BENCH_PHASE >= BENCH_PHASE - BENCH_SCAN) {
+        return snprintf(key, size, "scan_%010u", request);
+    }
+    return snprintf(key, size, "popular_%06d", zipf_next(state));
+}
+
+static enum test_result replay_trace(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
+    const char *cfg = test_harness.get_current_testcase()->cfg;
+    const char *fname = getenv("EVICTION_BENCHMARK_TRACE");
+    FILE *fp = NULL;
+    uint32_t state = 0xdeadbeef;
+    uint64_t hits = 0;
+    uint32_t requests = 0;
+    uint32_t failed = 0;
+    hrtime_t start, stop;
+    char key[251];
+    size_t nkey;
+
+    if (fname != NULL) {
+        fp = fopen(fname, "r");
+        if (fp == NULL) {
+            fprintf(stderr, "Failed to open %s\n", fname);
+            return FAIL;
+        }
+    } else {
+        zipf_init();
+    }
+
+    start = gethrtime();
+    while ((nkey = trace_next(fp, &state, requests, key, sizeof(key))) != 0) {
+        item *it = NULL;
+        if (++requests % BENCH_REQUESTS_PER_SECOND == 0) {
+            test_harness.time_travel(1);
+        }
+        if (h1->get(h, NULL, &it, key, nkey, 0) == ENGINE_SUCCESS) {
+            h1->release(h, NULL, it);
+            ++hits;
+        } else if (h1->allocate(h, NULL, &it, key, nkey, BENCH_VALUE_SIZE,
+                                0, 0) == ENGINE_SUCCESS) {
+            uint64_t cas = 0;
+            assert(h1->store(h, NULL, it, &cas,
+                             OPERATION_SET, 0) == ENGINE_SUCCESS);
+            h1->release(h, NULL, it);
+        } else {
+            ++failed;
+        }
+    }
+    stop = gethrtime();
+
+    if (fp != NULL) {
+        fclose(fp);
+    }
+
+    assert(h1->get_stats(h, NULL, NULL, 0,
+                         policy_stats_handler) == ENGINE_SUCCESS);
+    fprintf(stdout, "\n    %s: %u requests, hit rate %.4f (engine %s), "
+            "%s evictions, %s admission rejects, %u failed stores, "
+            "%.1f ns/request\n",
+            strstr(cfg, "eviction_policy=tinylfu") ? "tinylfu" : "lru",
+            requests, requests == 0 ? 0.0 : (double)hits / requests,
+            stat_hit_rate, stat_evictions, stat_admission_rejects, failed,
+            requests == 0 ? 0.0 : (double)(stop - start) / requests);
+
+    return SUCCESS;
+}
+
+#define CFG "cache_size=4194304;lru_maintainer=false"
+
+MEMCACHED_PUBLIC_API
+engine_test_t* get_tests(void) {
+    static engine_test_t tests[]  = {
+        {"lru", replay_trace, NULL, NULL, CFG ";eviction_policy=lru"},
+        {"tinylfu", replay_trace, NULL, NULL, CFG ";eviction_policy=tinylfu"},
+        {NULL, NULL, NULL, NULL, NULL}
+    };
+    return tests;
+}
+
+MEMCACHED_PUBLIC_API
+bool setup_suite(struct test_harness *th) {
+    test_harness = *th;
+    return true;
+}
@@ -0,0 +1,175 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifdef __linux__
+/* for sched_getcpu() and the CPU_SET macros */
+#define _GNU_SOURCE
+#endif
+#include "config.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+#include "utilities/numa.h"
+
+#ifdef __linux__
+
+#define NUMA_MAX_NODES 64
+#define NUMA_MAX_CPUS 1024
+#define LONG_BITS (8 * sizeof(unsigned long))
+
+/* mbind() policy from linux/mempolicy.h */
+#define NUMA_MPOL_PREFERRED 1
+
+/* The node of each CPU, read by numa_node_count() */
+static unsigned char cpu_nodes[NUMA_MAX_CPUS];
+
+/* Parse a sysfs list of CPUs or nodes ("0-3,8-11") into a bitmap */
+static bool numa_read_list(const char *fname, unsigned long *bits,
+                           size_t nbits) {
+    char buffer[4096];
+    char *ptr = buffer;
+    FILE *fp = fopen(fname, "r");
+
+    if (fp == NULL) {
+        return false;
+    }
+    if (fgets(buffer, sizeof(buffer), fp) == NULL) {
+        fclose(fp);
+        return false;
+    }
+    fclose(fp);
+
+    memset(bits, 0, nbits / 8);
+    while (*ptr >= '0' && *ptr <= '9') {
+        unsigned long first = strtoul(ptr, &ptr, 10);
+        unsigned long last = first;
+        if (*ptr == '-') {
+            last = strtoul(ptr + 1, &ptr, 10);
+        }
+        for (; first <= last && first < nbits; ++first) {
+            bits[first / LONG_BITS] |= 1UL << (first % LONG_BITS);
+        }
+        if (*ptr == ',') {
+            ++ptr;
+        }
+    }
+    return true;
+}
+
+static bool numa_node_cpus(int node, unsigned long *cpus) {
+    char fname[80];
+    snprintf(fname, sizeof(fname),
+             "/sys/devices/system/node/node%d/cpulist", node);
+    return numa_read_list(fname, cpus, NUMA_MAX_CPUS);
+}
+
+int numa_node_count(void) {
+    unsigned long nodes[NUMA_MAX_NODES / LONG_BITS];
+    unsigned long cpus[NUMA_MAX_CPUS / LONG_BITS];
+    int count = 1;
+    int node;
+
+    if (!numa_read_list("/sys/devices/system/node/online", nodes,
+                        NUMA_MAX_NODES)) {
+        return 1;
+    }
+
+    for (node = 0; node < NUMA_MAX_NODES; ++node) {
+        int cpu;
+        if ((nodes[node / LONG_BITS] & (1UL << (node % LONG_BITS))) == 0 ||
+            !numa_node_cpus(node, cpus)) {
+            continue;
+        }
+        count = node + 1;
+        for (cpu = 0; cpu < NUMA_MAX_CPUS; ++cpu) {
+            if (cpus[cpu / LONG_BITS] & (1UL << (cpu % LONG_BITS))) {
+                cpu_nodes[cpu] = (unsigned char)node;
+            }
+        }
+    }
+
+    return count;
+}
+
+int numa_current_node(void) {
+    int cpu = sched_getcpu();
+    if (cpu < 0 || cpu >= NUMA_MAX_CPUS) {
+        return 0;
+    }
+    return cpu_nodes[cpu];
+}
+
+bool numa_pin_thread(int node) {
+    unsigned long cpus[NUMA_MAX_CPUS / LONG_BITS];
+    cpu_set_t set;
+    int cpu;
+    int count = 0;
+
+    if (!numa_node_cpus(node, cpus)) {
+        return false;
+    }
+
+    CPU_ZERO(&set);
+    for (cpu = 0; cpu < NUMA_MAX_CPUS && cpu < CPU_SETSIZE; ++cpu) {
+        if (cpus[cpu / LONG_BITS] & (1UL << (cpu % LONG_BITS))) {
+            CPU_SET(cpu, &set);
+            ++count;
+        }
+    }
+
+    return count > 0 && sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+bool numa_bind_memory(void *ptr, size_t size, int node) {
+#ifdef SYS_mbind
+    unsigned long mask[NUMA_MAX_NODES / LONG_BITS];
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)ptr + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)ptr + size) & ~(page - 1);
+
+    if (node < 0 || node >= NUMA_MAX_NODES || end <= start) {
+        return false;
+    }
+
+    memset(mask, 0, sizeof(mask));
+    mask[node / LONG_BITS] = 1UL << (node % LONG_BITS);
+    return syscall(SYS_mbind, (void*)start, (unsigned long)(end - start),
+                   NUMA_MPOL_PREFERRED, mask,
+                   (unsigned long)NUMA_MAX_NODES + 1, 0) == 0;
+#else
+    (void)ptr;
+    (void)size;
+    (void)node;
+    return false;
+#endif
+}
+
+#else
+
+int numa_node_count(void) {
+    return 1;
+}
+
+int numa_current_node(void) {
+    return 0;
+}
+
+bool numa_pin_thread(int node) {
+    (void)node;
+    return false;
+}
+
+bool numa_bind_memory(void *ptr, size_t size, int node) {
+    (void)ptr;
+    (void)size;
+    (void)node;
+    return false;
+}
+
+#endif
@@ -0,0 +1,53 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Minimal NUMA support used to keep the worker threads and the memory they
+ * use on the same node. It talks directly to the kernel (and sysfs), so we
+ * don't depend on libnuma. On platforms without NUMA support the system is
+ * reported as a single node.
+ */
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <memcached/visibility.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Get the number of NUMA nodes in the system. This also reads the
+ * topology used by numa_current_node(), so call it before the others.
+ * @return the number of nodes (1 if the system isn't NUMA)
+ */
+MEMCACHED_PUBLIC_API int numa_node_count(void);
+
+/**
+ * Get the node of the CPU the calling thread is running on
+ * @return the node (0 if unknown)
+ */
+MEMCACHED_PUBLIC_API int numa_current_node(void);
+
+/**
+ * Restrict the calling thread to the CPUs of a node
+ * @param node the node to run on
+ * @return true if the thread was pinned
+ */
+MEMCACHED_PUBLIC_API bool numa_pin_thread(int node);
+
+/**
+ * Ask the kernel to allocate the pages of a memory range (which haven't
+ * been touched yet) on a node. The range is shrunk to whole pages.
+ * @param ptr the start of the range
+ * @param size the size of the range
+ * @param node the preferred node
+ * @return true if the policy was set
+ */
+MEMCACHED_PUBLIC_API bool numa_bind_memory(void *ptr, size_t size, int node);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif